@@ -7,13 +7,14 @@
 #include "utils/texture.cpp"
 #include "utils/memory.cpp"
 #include "utils/assets.cpp"
+
+#include "renderer/renderer.cpp"
+
 #include "utils/font.cpp"
 #include "utils/ui.cpp"
 
 #include "platform/sound.cpp"
 
-#include "renderer/renderer.cpp"
-
 #include <math.h>
 
 typedef struct Envelope {
@@ -448,11 +449,6 @@ void render_keyboard(State *state)
   RenderingContext *ctx = &state->rendering_context;
   UIContext *ui = &state->ui;
 
-  renderer_set_flags(ctx, RENDER_BLENDING | RENDER_SHADING);
-  renderer_set_blend_mode(ctx, BLEND_MODE_DECAL);
-
-  ui_begin(ui, 10.0f, 10.0f);
-
   ui_group_begin(ui, (char *) "Keyboard");
   ui_layout_row_begin(ui, 600.0f, 30.0f);
 
@@ -515,13 +511,9 @@ void render_keyboard(State *state)
 
 void render_ui(State *state)
 {
-  RenderingContext *ctx = &state->rendering_context;
   UIContext *ui = &state->ui;
 
-  renderer_set_flags(ctx, RENDER_BLENDING | RENDER_SHADING);
-  renderer_set_blend_mode(ctx, BLEND_MODE_DECAL);
-
-  ui_begin(ui, 10.0f, 60.0f);
+  ui_layout_spacer(ui, 0.0f, 10.0f);
 
   char buf[255];
   snprintf(buf, 255, "Key pressed: %d, key octave: %d", state->keys[0].pressed, state->keys[0].octave);
@@ -658,7 +650,14 @@ C_LINKAGE EXPORT void draw_frame(GlobalState *global_state, DrawingBuffer *drawi
   SoundMixerMixResult mix_result = sound_mixer_mix(state->sound_mixer, dt);
   render_sound_buffer_state(state, mix_result);
 
+  // Widgets only record commands, ui_draw renders them once the frame's UI is complete
+  ui_begin(&state->ui, 10.0f, 10.0f);
   render_keyboard(state);
   render_mixer_buffer(state, state->sound_mixer, {0.0f, 300.0f, 0.0f}, state->screen_width, 300.0f);
   //render_ui(state);
+  ui_end(&state->ui);
+
+  renderer_set_flags(ctx, RENDER_BLENDING | RENDER_SHADING);
+  renderer_set_blend_mode(ctx, BLEND_MODE_DECAL);
+  ui_draw(&state->ui);
 }
@@ -8,10 +8,11 @@
 #include "utils/texture.cpp"
 #include "utils/memory.cpp"
 #include "utils/assets.cpp"
-#include "utils/font.cpp"
 
 #include "renderer/renderer.cpp"
 
+#include "utils/font.cpp"
+
 #ifndef CUBES_GRID_SIZE
 #define CUBES_GRID_SIZE 6
 #endif
@@ -377,15 +378,23 @@ static void update_camera(State *state, float dt)
 
 #ifdef __ARCH_X86__
 
+// Rows may be padded past width and aren't guaranteed to be 16-byte aligned
 static inline void clear_buffer(DrawingBuffer *buffer, Vec4f color)
 {
-  uint32_t iterCount = (buffer->width * buffer->height) / 4;
+  uint32_t rgba = rgba_color(color);
+  __m128i value = _mm_set1_epi32(rgba);
 
-  __m128i value = _mm_set1_epi32(rgba_color(color));
-  __m128i *p = (__m128i *) buffer->pixels;
+  for (uint32_t y = 0; y < buffer->height; y++) {
+    uint32_t *p = (uint32_t *) buffer->pixels + y * buffer->pitch;
+    uint32_t x = 0;
 
-  while (iterCount--) {
-    *p++ = value;
+    for (; x + 4 <= buffer->width; x += 4) {
+      _mm_storeu_si128((__m128i *) &p[x], value);
+    }
+
+    for (; x < buffer->width; x++) {
+      p[x] = rgba;
+    }
   }
 }
 
@@ -1,8 +1,13 @@
 #include <cstdio>
 #include <cstdint>
+#include <cfloat>
 
 #include "m2.h"
 
+#ifdef MODEL_SKIN_AVX2
+#include <immintrin.h>
+#endif
+
 typedef void (ModelLoadAnimValueFunc)(void *, void *);
 typedef void (ModelDumpAnimValueFunc)(uint32_t, void *);
 
@@ -264,426 +269,1912 @@ void m2_load_animation_data(void *bytes, M2Header *header, MemoryAllocator *allo
     }
 }
 
-void m2_fix_normals(M2Model *model)
+// Keyframes of every animation share one timeline, a range only counts when one of its keyframes
+// falls inside the animation. Others would just hold a keyframe of a neighbouring animation.
+static bool m2_range_has_keyframes(ModelAnimationData *data, ModelAnimationRange range, ModelAnimation *anim)
+{
+  for (uint32_t ki = range.start; ki <= range.end && ki < data->keyframesCount; ki++) {
+    if (data->timestamps[ki] >= anim->startFrame && data->timestamps[ki] <= anim->endFrame) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+// Float attributes of the bind pose, they only live while the model is loaded
+typedef struct M2LoadVertices {
+  Vec3f *positions;
+  Vec3f *normals;
+  Vec3f *tangents;
+  Vec3f *bitangents;
+  Vec3f *textureCoords;
+  M2Vertex *sources; // Bone indices and weights
+} M2LoadVertices;
+
+void m2_fix_normals(M2Model *model, M2LoadVertices *vertices)
 {
-  for (size_t fi = 0; fi < model->facesCount; fi++) {
-    M2Face face = model->faces[fi];
+  ModelView *view = &model->views[0];
+  for (size_t fi = 0; fi < view->facesCount; fi++) {
+    M2Face face = view->faces[fi];
 
-    Vec3f vertices[3] = {};
+    Vec3f positions[3] = {};
     for (size_t vi = 0; vi < 3; vi++) {
-      vertices[vi] = model->positions[face.indices[vi]];
+      positions[vi] = vertices->positions[face.indices[vi]];
     }
 
-    Vec3f face_normal = (vertices[2] - vertices[1]).cross(vertices[2] - vertices[0]).normalized();
+    Vec3f face_normal = (positions[2] - positions[1]).cross(positions[2] - positions[0]).normalized();
     for (size_t ni = 0; ni < 3; ni++) {
-      Vec3f normal = model->normals[face.indices[ni]];
+      Vec3f normal = vertices->normals[face.indices[ni]];
       if ((fabs(normal.x) < 0.000001f) && (fabs(normal.y) < 0.000001f) && (fabs(normal.z) < 0.000001)) {
-        model->normals[face.indices[ni]] = face_normal;
+        vertices->normals[face.indices[ni]] = face_normal;
       }
     }
   }
 }
 
-M2Model *m2_load(MemoryAllocator *allocator, void *bytes, size_t size)
+// Accumulates per-face tangent basis into vertices so fragment shaders
+// don't have to rebuild it from positions and UVs for every pixel
+void m2_calc_tangents(M2Model *model, M2LoadVertices *vertices)
 {
-  M2Header *header = (M2Header *) bytes;
-  m2_dump_header(header, bytes);
-
-  // uint16_t *texUnitLookups = (uint16_t *) ((uint8_t *) bytes + header->textureUnitLookupsOffset);
-  // for (int tui = 0; tui < header->textureUnitLookupsCount; tui++) {
-  //   printf("Texture unit lookup %d: %d\n", tui, texUnitLookups[tui]);
-  // }
+  for (size_t vi = 0; vi < model->verticesCount; vi++) {
+    vertices->tangents[vi] = {};
+    vertices->bitangents[vi] = {};
+  }
 
-  M2Model *model = ALLOCATE_ONE(allocator, M2Model);
-  model->bounding_radius = header->bounding_sphere_radius;
+  ModelView *view = &model->views[0];
+  for (size_t fi = 0; fi < view->facesCount; fi++) {
+    M2Face face = view->faces[fi];
+
+    Vec3f p0 = vertices->positions[face.indices[0]];
+    Vec3f p1 = vertices->positions[face.indices[1]];
+    Vec3f p2 = vertices->positions[face.indices[2]];
+    Vec3f uv0 = vertices->textureCoords[face.indices[0]];
+    Vec3f uv1 = vertices->textureCoords[face.indices[1]];
+    Vec3f uv2 = vertices->textureCoords[face.indices[2]];
+
+    Vec3f dp1 = p1 - p0;
+    Vec3f dp2 = p2 - p1;
+    Vec3f duv1 = uv1 - uv0;
+    Vec3f duv2 = uv2 - uv1;
+
+    float det = duv1.x * duv2.y - duv1.y * duv2.x;
+    if (fabs(det) < 0.000001f) {
+      continue; // Degenerate texture mapping
+    }
 
-  model->verticesCount = header->verticesCount;
-  model->positions = ALLOCATE_MANY(allocator, Vec3f, header->verticesCount);
-  model->animatedPositions = ALLOCATE_MANY(allocator, Vec3f, header->verticesCount);
-  model->normals = ALLOCATE_MANY(allocator, Vec3f,  header->verticesCount);
-  model->animatedNormals = ALLOCATE_MANY(allocator, Vec3f, header->verticesCount);
-  model->textureCoords = ALLOCATE_MANY(allocator, Vec3f, header->verticesCount);
+    float r = 1.0f / det;
+    Vec3f tangent = -(dp1 * duv2.y - dp2 * duv1.y) * r;
+    Vec3f bitangent = -(dp2 * duv1.x - dp1 * duv2.x) * r;
 
-  model->weightsPerVertex = 4;
-  model->weights = ALLOCATE_MANY(allocator, ModelVertexWeight, model->weightsPerVertex * header->verticesCount);
+    for (size_t i = 0; i < 3; i++) {
+      vertices->tangents[face.indices[i]] = vertices->tangents[face.indices[i]] + tangent;
+      vertices->bitangents[face.indices[i]] = vertices->bitangents[face.indices[i]] + bitangent;
+    }
+  }
 
-  static Mat44 worldMat = {
-    1.0f, 0.0f, 0.0f, 0.0f,
-    0.0f, 0.0f, -1.0f, 0.0f,
-    0.0f, 1.0f, 0.0f, 0.0f,
-    0.0f, 0.0f, 0.0f, 1.0f
-  };
+  for (size_t vi = 0; vi < model->verticesCount; vi++) {
+    Vec3f normal = vertices->normals[vi];
+    Vec3f tangent = vertices->tangents[vi];
+    Vec3f bitangent = vertices->bitangents[vi];
 
-  M2Vertex *vertices = (M2Vertex *) ((uint8_t *) bytes + header->verticesOffset);
-  for(size_t i = 0; i < header->verticesCount; i++) {
-    model->positions[i] = vertices[i].pos * worldMat;
-    model->animatedPositions[i] = model->positions[i];
-    model->normals[i] = -(vertices[i].normal * worldMat);
-    model->animatedNormals[i] = model->normals[i];
-    model->textureCoords[i] = {vertices[i].texcoords[0], vertices[i].texcoords[1], 0.0f};
+    // Gram-Schmidt orthogonalize against the normal
+    tangent = tangent - normal * normal.dot(tangent);
+    if (tangent.length() < 0.000001f) {
+      tangent = normal.cross(fabs(normal.x) < 0.9f ? Vec3f(1.0f, 0.0f, 0.0f) : Vec3f(0.0f, 1.0f, 0.0f));
+    }
+    tangent = tangent.normalized();
 
-    for (int wi = 0; wi < model->weightsPerVertex; wi++) {
-      ModelVertexWeight vw = {};
-      vw.bone = vertices[i].bones[wi];
-      vw.weight = (float) vertices[i].weights[wi] / 255.0f;
-      model->weights[i * 4 + wi] = vw;
+    if (bitangent.length() < 0.000001f) {
+      bitangent = normal.cross(tangent);
     }
+    bitangent = bitangent.normalized();
+
+    vertices->tangents[vi] = tangent;
+    vertices->bitangents[vi] = bitangent;
   }
+}
 
-  M2View *view = (M2View *) ((uint8_t *) bytes + header->viewsOffset);
-  m2_dump_view(view);
+// Evaluation order by depth in the hierarchy, bone indices stay as in the file
+// since vertex weights, attachments and keybones refer to them
+static void m2_order_bones(MemoryAllocator *allocator, M2Model *model)
+{
+  uint32_t *depths = ALLOCATE_MANY(allocator, uint32_t, model->bonesCount);
+  uint32_t maxDepth = 0;
 
-  model->renderPassesCount = view->renderPassesCount;
-  model->renderPasses = ALLOCATE_MANY(allocator, M2RenderPass, view->renderPassesCount);
+  for (uint32_t i = 0; i < model->bonesCount; i++) {
+    uint32_t depth = 0;
+    for (int32_t parent = model->bones[i].parent; parent > -1 && depth < model->bonesCount; parent = model->bones[parent].parent) {
+      depth++;
+    }
 
-  model->renderFlagsCount = header->renderFlagsCount;
-  model->renderFlags = ALLOCATE_MANY(allocator, M2RenderFlag, header->renderFlagsCount);
-  M2RenderFlag *renderFlags = (M2RenderFlag *) ((uint8_t *) bytes + header->renderFlagsOffset);
-  for (int rfi = 0; rfi < header->renderFlagsCount; rfi++) {
-    model->renderFlags[rfi] = renderFlags[rfi];
-    // printf("Render flag %d: f = %d; b = %d\n", rfi, renderFlags[rfi].flags, renderFlags[rfi].blendingMode);
-  }
+    if (depth == model->bonesCount) {
+      model->bones[i].parent = -1; // Cyclic hierarchy
+      depth = 0;
+    }
 
-  M2RenderPass *renderPasses = (M2RenderPass *) ((uint8_t *) bytes + view->renderPassesOffset);
-  for (int rpi = 0; rpi < view->renderPassesCount; rpi++) {
-    //m2_dump_render_pass(&renderPasses[rpi], bytes, header);
-    model->renderPasses[rpi] = renderPasses[rpi];
-    // printf("Render pass %d: flags: %d; submesh: %d, render flags index = %d\n", rpi, renderPasses[rpi].flags, renderPasses[rpi].submesh, renderPasses[rpi].renderFlagIndex);
+    depths[i] = depth;
+    maxDepth = MAX(maxDepth, depth);
   }
 
-  M2Texture *m2textures = (M2Texture *) ((uint8_t *) bytes + header->texturesOffset);
-  model->texturesCount = header->texturesCount;
-  model->textures = ALLOCATE_MANY(allocator, ModelTexture, header->texturesCount);
-  for (int ti = 0; ti < header->texturesCount; ti++) {
-    m2_dump_texture(&m2textures[ti], bytes);
+  model->bonesOrder = ALLOCATE_MANY(allocator, uint32_t, model->bonesCount);
+  uint32_t ordered = 0;
 
-    model->textures[ti].type = m2textures[ti].type;
-    if (m2textures[ti].type == MTT_INLINE) {
-      model->textures[ti].name = (char *) ALLOCATE_SIZE(allocator, m2textures[ti].filenameLength);
-      memcpy(model->textures[ti].name, (uint8_t *) bytes + m2textures[ti].filenameOffset, m2textures[ti].filenameLength);
-    } else {
-      model->textures[ti].name = NULL;
+  for (uint32_t depth = 0; depth <= maxDepth && ordered < model->bonesCount; depth++) {
+    for (uint32_t i = 0; i < model->bonesCount; i++) {
+      if (depths[i] == depth) {
+        model->bonesOrder[ordered++] = i;
+      }
     }
   }
+}
 
-  uint16_t *texLookups = (uint16_t *) ((uint8_t *) bytes + header->textureLookupsOffset);
-  model->textureLookupsCount = header->textureLookupsCount;
-  model->textureLookups = ALLOCATE_MANY(allocator, uint32_t, header->textureLookupsCount);
-  for (int ti = 0; ti < header->textureLookupsCount; ti++) {
-    model->textureLookups[ti] = texLookups[ti];
+#define M2_SKIN_PALETTE_STRIDE 24
+#define M2_SKIN_BLENDED 21 // Normal matrix translation is always zero
+
+// Range of the values over the 16 bit domain, flat axes get a unit scale
+static ModelQuantization m2_quantization_range(Vec3f *values, uint32_t count)
+{
+  ModelQuantization result = {};
+  if (count == 0) {
+    result.scale[0] = result.scale[1] = result.scale[2] = 1.0f;
+    return result;
   }
 
-  M2Geoset *geosets = (M2Geoset *) ((uint8_t *) bytes + view->submeshesOffset);
-  model->submeshesCount = view->submeshesCount;
-  model->submeshes = ALLOCATE_MANY(allocator, ModelSubmesh, view->submeshesCount);
-  for (int i = 0; i < view->submeshesCount; i++) {
-    m2_dump_geoset(&geosets[i]);
-    ModelSubmesh submesh;
-    submesh.id = geosets[i].id;
-    submesh.verticesStart = geosets[i].verticesStart;
-    submesh.verticesCount = geosets[i].verticesCount;
-    submesh.facesStart = geosets[i].indicesStart / 3;
-    submesh.facesCount = geosets[i].indicesCount / 3;
-    submesh.enabled = true;
+  float *flat = (float *) values;
+  for (uint32_t c = 0; c < 3; c++) {
+    float min = flat[c];
+    float max = flat[c];
+    for (uint32_t i = 1; i < count; i++) {
+      min = MIN(min, flat[i * 3 + c]);
+      max = MAX(max, flat[i * 3 + c]);
+    }
 
-    model->submeshes[i] = submesh;
+    result.min[c] = min;
+    result.scale[c] = max > min ? (max - min) / 65535.0f : 1.0f;
   }
 
-  uint16_t *indicesLookup = (uint16_t *) ((uint8_t *) bytes + view->indicesOffset);
-  uint16_t *faces = (uint16_t *) ((uint8_t *) bytes + view->facesOffset);
+  return result;
+}
 
-  uint32_t facesCount = view->facesCount / 3;
-  model->facesCount = facesCount;
-  model->faces = ALLOCATE_MANY(allocator, M2Face, facesCount);
-  for (int i = 0; i < facesCount; i++) {
-    M2Face face;
+static inline uint16_t m2_quantize(ModelQuantization *range, uint32_t c, float value)
+{
+  return (uint16_t) CLAMP(roundf((value - range->min[c]) / range->scale[c]), 0.0f, 65535.0f);
+}
 
-    face.indices[0] = indicesLookup[faces[i * 3]];
-    face.indices[1] = indicesLookup[faces[i * 3 + 1]];
-    face.indices[2] = indicesLookup[faces[i * 3 + 2]];
+static inline float m2_dequantize(ModelQuantization *range, uint32_t c, uint16_t value)
+{
+  return range->min[c] + value * range->scale[c];
+}
 
-    model->faces[i] = face;
-  }
+static inline int16_t m2_snorm16(float value)
+{
+  return (int16_t) roundf(CLAMP(value, -1.0f, 1.0f) * 32767.0f);
+}
 
-  M2Animation *animations = (M2Animation *) ((uint8_t *) bytes + header->animationsOffset);
-  model->animationsCount = header->animationsCount;
-  model->animations = ALLOCATE_MANY(allocator, ModelAnimation, header->animationsCount);
-  for (int ai = 0; ai < header->animationsCount; ai++) {
-    model->animations[ai].id = -1;
-    model->animations[ai].startFrame = animations[ai].timeStart;
-    model->animations[ai].endFrame = animations[ai].timeEnd;
-    model->animations[ai].speed = animations[ai].moveSpeed;
+// Projects the direction on the octahedron and unfolds its lower half over the upper one
+static void m2_octahedral_encode(Vec3f v, int16_t *x, int16_t *y)
+{
+  float sum = fabsf(v.x) + fabsf(v.y) + fabsf(v.z);
+  if (sum < 0.000001f) {
+    *x = *y = 0;
+    return;
   }
 
-  int16_t *animLookups = (int16_t *) ((uint8_t *) bytes + header->animationLookupsOffset);
-  model->animationLookupsCount = header->animationLookupsCount;
-  model->animationLookups = (int16_t *) ALLOCATE_MANY(allocator, int32_t, model->animationLookupsCount);
-  for (size_t ali = 0; ali < model->animationLookupsCount; ali++) {
-    int16_t anim_id = animLookups[ali];
-    model->animationLookups[ali] = anim_id;
-
-    if (anim_id >= 0 && anim_id < model->animationsCount) {
-      model->animations[anim_id].id = ali; // Reverse lookup
-    }
+  float ox = v.x / sum;
+  float oy = v.y / sum;
+  if (v.z < 0.0f) {
+    float fx = (1.0f - fabsf(oy)) * (ox >= 0.0f ? 1.0f : -1.0f);
+    float fy = (1.0f - fabsf(ox)) * (oy >= 0.0f ? 1.0f : -1.0f);
+    ox = fx;
+    oy = fy;
   }
 
-  model->bonesCount = header->bonesCount;
-  model->bones = ALLOCATE_MANY(allocator, ModelBone, header->bonesCount);
-
-  M2Bone *bones = (M2Bone *) ((uint8_t *) bytes + header->bonesOffset);
-  for (int i = 0; i < header->bonesCount; i++) {
-    ModelBone bone = {};
-    bone.pivot = bones[i].pivot * worldMat;
-    bone.parent = bones[i].parent;
-    bone.keybone = bones[i].keybone;
+  *x = m2_snorm16(ox);
+  *y = m2_snorm16(oy);
+}
 
-    m2_load_animation_data(bytes, header, allocator, &bone.translations, &bones[i].translation, sizeof(Vec3f), m2_load_translation);
-    m2_load_animation_data(bytes, header, allocator, &bone.rotations, &bones[i].rotation, sizeof(Quaternion), m2_load_rotation);
-    m2_load_animation_data(bytes, header, allocator, &bone.scalings, &bones[i].scaling, sizeof(Vec3f), m2_load_scaling);
+static inline Vec3f m2_octahedral_decode(int16_t ex, int16_t ey)
+{
+  float x = ex * (1.0f / 32767.0f);
+  float y = ey * (1.0f / 32767.0f);
+  float z = 1.0f - fabsf(x) - fabsf(y);
+  float t = MAX(-z, 0.0f);
+  x = x >= 0.0f ? x - t : x + t;
+  y = y >= 0.0f ? y - t : y + t;
+  return {x, y, z};
+}
 
-    model->bones[i] = bone;
+static void m2_build_skin(MemoryAllocator *allocator, M2Model *model, M2LoadVertices *vertices)
+{
+  M2Vertex *source = vertices->sources;
+  ModelSkin *skin = &model->skin;
+  skin->count = (model->verticesCount + MODEL_SKIN_LANES - 1) / MODEL_SKIN_LANES * MODEL_SKIN_LANES;
+
+  model->positionsRange = m2_quantization_range(vertices->positions, model->verticesCount);
+  for (size_t c = 0; c < 3; c++) {
+    skin->positions[c] = ALLOCATE_MANY(allocator, uint16_t, skin->count);
+    for (uint32_t vi = 0; vi < skin->count; vi++) {
+      skin->positions[c][vi] = vi < model->verticesCount ? m2_quantize(&model->positionsRange, c, ((float *) &vertices->positions[vi])[c]) : 0;
+    }
   }
 
-  model->keybonesCount = header->keyBoneLookupsCount;
-  model->keybones = ALLOCATE_MANY(allocator, int16_t,  header->keyBoneLookupsCount);
+  Vec3f *directions[] = {vertices->normals, vertices->tangents, vertices->bitangents};
+  int16_t **targets[] = {skin->normals, skin->tangents, skin->bitangents};
+  for (size_t di = 0; di < 3; di++) {
+    targets[di][0] = ALLOCATE_MANY(allocator, int16_t, skin->count);
+    targets[di][1] = ALLOCATE_MANY(allocator, int16_t, skin->count);
 
-  int16_t *keybones = (int16_t *) ((uint8_t *) bytes + header->keyBoneLookupsOffset);
-  for (size_t bli = 0; bli < header->keyBoneLookupsCount; bli++) {
-    model->keybones[bli] = keybones[bli];
+    for (uint32_t vi = 0; vi < skin->count; vi++) {
+      Vec3f v = vi < model->verticesCount ? directions[di][vi] : Vec3f();
+      m2_octahedral_encode(v, &targets[di][0][vi], &targets[di][1][vi]);
+    }
   }
 
-  if (model->keybonesCount > M2_KEYBONE_ROOT) {
-    printf("Head bone: %d\n", model->keybones[M2_KEYBONE_ROOT]);
-  }
+  skin->bones = ALLOCATE_MANY(allocator, uint32_t, skin->count);
+  skin->weights = ALLOCATE_MANY(allocator, uint32_t, skin->count);
+  for (uint32_t vi = 0; vi < skin->count; vi++) {
+    skin->bones[vi] = 0;
+    skin->weights[vi] = 0;
 
-  printf("att size: %zu\n", sizeof(M2Attachment));
-  model->attachmentsCount = header->attachmentsCount;
-  M2Attachment *attachments = (M2Attachment *) ((uint8_t *) bytes + header->attachmentsOffset);
-  model->attachments = ALLOCATE_MANY(allocator, M2Attachment, header->attachmentsCount);
-  for (size_t ai = 0; ai < header->attachmentsCount; ai++) {
-    M2Attachment *attachment = &attachments[ai];
-    model->attachments[ai] = attachments[ai];
-    model->attachments[ai].offset = Vec3f(attachments[ai].offset.x, attachments[ai].offset.z, -attachments[ai].offset.y);
+    for (uint32_t wi = 0; vi < model->verticesCount && wi < 4; wi++) {
+      if (source[vi].bones[wi] < model->bonesCount) {
+        skin->bones[vi] |= (uint32_t) source[vi].bones[wi] << (wi * 8);
+        skin->weights[vi] |= (uint32_t) source[vi].weights[wi] << (wi * 8);
+      }
+    }
   }
 
-  int16_t *attachmentLookups = (int16_t *) ((uint8_t *) bytes + header->attachmentLookupsOffset);
-  model->attachmentLookups = ALLOCATE_MANY(allocator, int16_t, header->attachmentLookupsCount);
-  for (size_t ali = 0; ali < header->attachmentLookupsCount; ali++) {
-    model->attachmentLookups[ali] = attachmentLookups[ali];
+  model->textureCoordsRange = m2_quantization_range(vertices->textureCoords, model->verticesCount);
+  model->textureCoords = ALLOCATE_MANY(allocator, uint16_t, model->verticesCount * 2);
+  for (uint32_t vi = 0; vi < model->verticesCount; vi++) {
+    model->textureCoords[vi * 2] = m2_quantize(&model->textureCoordsRange, 0, vertices->textureCoords[vi].x);
+    model->textureCoords[vi * 2 + 1] = m2_quantize(&model->textureCoordsRange, 1, vertices->textureCoords[vi].y);
   }
-
-  m2_fix_normals(model);
-
-  return model;
 }
 
-inline void m2_reset_bones(M2Model *model)
+// Decodes the bind pose, any of the targets may be NULL
+void m2_bind_pose(M2Model *model, Vec3f *positions, Vec3f *normals, Vec3f *tangents, Vec3f *bitangents)
 {
-  for (int i = 0; i < model->bonesCount; i++) {
-    model->bones[i].calculated = false;
+  ModelSkin *skin = &model->skin;
+  Vec3f *directions[] = {normals, tangents, bitangents};
+  int16_t **sources[] = {skin->normals, skin->tangents, skin->bitangents};
+
+  for (uint32_t vi = 0; vi < model->verticesCount; vi++) {
+    if (positions) {
+      positions[vi] = {m2_dequantize(&model->positionsRange, 0, skin->positions[0][vi]),
+                       m2_dequantize(&model->positionsRange, 1, skin->positions[1][vi]),
+                       m2_dequantize(&model->positionsRange, 2, skin->positions[2][vi])};
+    }
+
+    for (size_t di = 0; di < 3; di++) {
+      if (directions[di]) {
+        directions[di][vi] = m2_octahedral_decode(sources[di][0][vi], sources[di][1][vi]);
+      }
+    }
   }
 }
 
-inline void m2_anim_get_frame(ModelAnimationData *data, ModelAnimationRange range, uint32_t frame, uint32_t globalFrame, uint32_t *idx0, uint32_t *idx1, float *t)
+Vec3f m2_texture_coords(M2Model *model, uint32_t vertex)
 {
-  if (range.start == range.end) {
-    *idx0 = range.start;
-    *idx1 = range.start;
-    *t = 0;
-    return;
-  }
+  return {m2_dequantize(&model->textureCoordsRange, 0, model->textureCoords[vertex * 2]),
+          m2_dequantize(&model->textureCoordsRange, 1, model->textureCoords[vertex * 2 + 1]), 0.0f};
+}
 
-  if (data->isGlobal) {
-    frame = range.start + globalFrame % (range.end - range.start);
+#define M2_VCACHE_SIZE 32 // Modelled post-transform cache, for both the ordering and the ACMR
+
+// Average cache miss ratio of drawing the faces through a FIFO cache, vertices transformed per face
+static uint32_t m2_vcache_misses(M2Face *faces, uint32_t facesCount)
+{
+  int32_t fifo[M2_VCACHE_SIZE];
+  uint32_t head = 0;
+  uint32_t misses = 0;
+  for (uint32_t i = 0; i < M2_VCACHE_SIZE; i++) {
+    fifo[i] = -1;
   }
 
-  for (int i = range.start; i < range.end; i++) {
-    uint32_t ts0 = data->timestamps[i];
-    uint32_t ts1 = data->timestamps[i + 1];
+  for (uint32_t fi = 0; fi < facesCount; fi++) {
+    for (uint32_t vi = 0; vi < 3; vi++) {
+      int32_t v = faces[fi].indices[vi];
+      bool hit = false;
+      for (uint32_t ci = 0; ci < M2_VCACHE_SIZE && !hit; ci++) {
+        hit = fifo[ci] == v;
+      }
 
-    if (frame >= ts0 && frame <= ts1) {
-      *idx0 = i;
-      *idx1 = i + 1;
-      *t = (float) (frame - ts0) / (float)(ts1 - ts0);
-      return;
+      if (!hit) {
+        fifo[head] = v;
+        head = (head + 1) % M2_VCACHE_SIZE;
+        misses++;
+      }
     }
   }
 
-  *idx0 = range.start;
-  *idx1 = range.start + 1;
-  *t = 0;
+  return misses;
 }
 
-void m2_calc_bone(M2Model *model, ModelBone *bone, uint32_t animId, uint32_t frame, uint32_t globalFrame)
+// Forsyth's vertex score, recently used vertices and those with few faces left go first
+static float m2_vcache_score(int32_t cachePosition, uint32_t activeFaces)
 {
-  if (bone->calculated) {
-    return;
+  if (activeFaces == 0) {
+    return -1.0f;
   }
 
-  Mat44 mat = Mat44::identity();
-  Mat44 nmat = mat;
+  float score = 0.0f;
+  if (cachePosition >= 0 && cachePosition < 3) {
+    score = 0.75f; // Last face, which doesn't depend on the order it's visited
+  } else if (cachePosition >= 3) {
+    score = powf(1.0f - (cachePosition - 3) * (1.0f / (M2_VCACHE_SIZE - 3)), 1.5f);
+  }
 
-  ModelAnimationRange trRange = {};
-  bool translate = false;
-  ModelAnimationRange rotRange = {};
-  bool rotate = false;
-  ModelAnimationRange scaleRange = {};
-  bool scale = false;
+  return score + 2.0f * powf((float) activeFaces, -0.5f);
+}
 
-  if (bone->translations.isGlobal) {
-    trRange = bone->translations.animationRanges[0];
-    translate = true;
-  } else if (animId >= 0 && animId < bone->translations.animationsCount) {
-    trRange = bone->translations.animationRanges[animId];
-    translate = bone->translations.keyframesCount > 0;
+typedef struct M2VcacheScratch {
+  int32_t *localIds; // Per model vertex, -1 when not used by the current submesh
+  uint32_t *globalIds;
+  uint32_t *activeFaces;
+  uint32_t *adjacencyStart;
+  uint32_t *adjacency;
+  int32_t *cachePositions;
+  float *vertexScores;
+  float *faceScores;
+  bool *emitted;
+  M2Face *localFaces;
+  M2Face *ordered;
+} M2VcacheScratch;
+
+// Greedy Forsyth ordering of one submesh's faces
+static void m2_vcache_order(M2VcacheScratch *scratch, M2Face *faces, uint32_t facesCount)
+{
+  uint32_t verticesCount = 0;
+  for (uint32_t fi = 0; fi < facesCount; fi++) {
+    for (uint32_t vi = 0; vi < 3; vi++) {
+      uint32_t v = faces[fi].indices[vi];
+      if (scratch->localIds[v] < 0) {
+        scratch->localIds[v] = verticesCount;
+        scratch->globalIds[verticesCount++] = v;
+      }
+      scratch->localFaces[fi].indices[vi] = scratch->localIds[v];
+    }
   }
 
-  if (bone->rotations.isGlobal) {
-    rotRange = bone->rotations.animationRanges[0];
-    rotate = true;
-  } else if (animId >= 0 && animId < bone->rotations.animationsCount) {
-    rotRange = bone->rotations.animationRanges[animId];
-    rotate = bone->rotations.keyframesCount > 0;
+  uint32_t *active = scratch->activeFaces;
+  for (uint32_t v = 0; v < verticesCount; v++) {
+    active[v] = 0;
   }
-
-  if (bone->scalings.isGlobal) {
-    scaleRange = bone->scalings.animationRanges[0];
-    scale = true;
-  } else if (animId >= 0 && animId < bone->scalings.animationsCount) {
-    scaleRange = bone->scalings.animationRanges[animId];
-    scale = bone->scalings.keyframesCount > 0;
+  for (uint32_t fi = 0; fi < facesCount * 3; fi++) {
+    active[scratch->localFaces[fi / 3].indices[fi % 3]]++;
   }
 
-  bool animated = translate || rotate || scale;
-  uint32_t idx0;
-  uint32_t idx1;
-  float t;
+  uint32_t *start = scratch->adjacencyStart;
+  start[0] = 0;
+  for (uint32_t v = 0; v < verticesCount; v++) {
+    start[v + 1] = start[v] + active[v];
+    active[v] = 0;
+  }
+  for (uint32_t fi = 0; fi < facesCount; fi++) {
+    for (uint32_t vi = 0; vi < 3; vi++) {
+      uint32_t v = scratch->localFaces[fi].indices[vi];
+      scratch->adjacency[start[v] + active[v]++] = fi;
+    }
+  }
 
-  if (animated) {
-    mat = Mat44::translate(-bone->pivot.x, -bone->pivot.y, -bone->pivot.z);
+  for (uint32_t v = 0; v < verticesCount; v++) {
+    scratch->cachePositions[v] = -1;
+    scratch->vertexScores[v] = m2_vcache_score(-1, active[v]);
+  }
 
-    if (scale) {
-      m2_anim_get_frame(&bone->scalings, scaleRange, frame, globalFrame, &idx0, &idx1, &t);
-      Vec3f s0 = ((Vec3f *) bone->scalings.data)[idx0];
-      Vec3f s1 = ((Vec3f *) bone->scalings.data)[idx1];
-      Vec3f s = lerp(s0, s1, t);
-      mat = mat * Mat44::scale(s.x, s.y, s.z);
+  int32_t best = -1;
+  for (uint32_t fi = 0; fi < facesCount; fi++) {
+    M2Face face = scratch->localFaces[fi];
+    scratch->emitted[fi] = false;
+    scratch->faceScores[fi] = scratch->vertexScores[face.indices[0]] + scratch->vertexScores[face.indices[1]] + scratch->vertexScores[face.indices[2]];
+    if (best < 0 || scratch->faceScores[fi] > scratch->faceScores[best]) {
+      best = fi;
     }
+  }
 
-    if (rotate) {
-      m2_anim_get_frame(&bone->rotations, rotRange, frame, globalFrame, &idx0, &idx1, &t);
-      Quaternion q0 = ((Quaternion *) bone->rotations.data)[idx0];
-      Quaternion q;
-
-      switch (bone->rotations.interpolationType) {
-        case MODEL_INTERPOLATION_NONE:
-          q = q0;
-          break;
+  int32_t cache[M2_VCACHE_SIZE + 3];
+  uint32_t cacheCount = 0;
 
-        case MODEL_INTERPOLATION_LINEAR: {
-          Quaternion q1 = ((Quaternion *) bone->rotations.data)[idx1];
-          q = lerp(q0, q1, t);
-        } break;
+  for (uint32_t oi = 0; oi < facesCount; oi++) {
+    if (best < 0) {
+      // Nothing in the cache has faces left, start over from the best remaining face
+      for (uint32_t fi = 0; fi < facesCount; fi++) {
+        if (!scratch->emitted[fi] && (best < 0 || scratch->faceScores[fi] > scratch->faceScores[best])) {
+          best = fi;
+        }
+      }
+    }
 
-        default:
-          q = q0;
+    M2Face face = scratch->localFaces[best];
+    scratch->emitted[best] = true;
+    scratch->ordered[oi] = faces[best];
+
+    int32_t next[M2_VCACHE_SIZE + 3];
+    uint32_t nextCount = 0;
+    for (uint32_t vi = 0; vi < 3; vi++) {
+      uint32_t v = face.indices[vi];
+      next[nextCount++] = v;
+
+      // Drops the face from the vertex's active list
+      for (uint32_t ai = start[v]; ai < start[v] + active[v]; ai++) {
+        if (scratch->adjacency[ai] == (uint32_t) best) {
+          scratch->adjacency[ai] = scratch->adjacency[start[v] + active[v] - 1];
+          active[v]--;
           break;
+        }
       }
-
-      Mat44 rotmat = Mat44::from_quaternion(q);
-      mat = mat * rotmat;
-      nmat = rotmat;
     }
 
-    if (translate) {
-      m2_anim_get_frame(&bone->translations, trRange, frame, globalFrame, &idx0, &idx1, &t);
-      Vec3f tr0 = ((Vec3f *) bone->translations.data)[idx0];
-      Vec3f tr;
-
-      switch (bone->translations.interpolationType) {
-        case MODEL_INTERPOLATION_NONE:
-          tr = tr0;
-          break;
+    for (uint32_t ci = 0; ci < cacheCount; ci++) {
+      int32_t v = cache[ci];
+      if (v != face.indices[0] && v != face.indices[1] && v != face.indices[2]) {
+        next[nextCount++] = v;
+      }
+    }
 
-        case MODEL_INTERPOLATION_LINEAR: {
-          Vec3f tr1 = ((Vec3f *) bone->translations.data)[idx1];
-          tr = lerp(tr0, tr1, t);
-        } break;
+    for (uint32_t ci = 0; ci < nextCount; ci++) {
+      int32_t v = next[ci];
+      scratch->cachePositions[v] = ci < M2_VCACHE_SIZE ? ci : -1;
+      scratch->vertexScores[v] = m2_vcache_score(scratch->cachePositions[v], active[v]);
+    }
 
-        default:
-          tr = tr0;
-          break;
+    best = -1;
+    for (uint32_t ci = 0; ci < nextCount; ci++) {
+      int32_t v = next[ci];
+      for (uint32_t ai = start[v]; ai < start[v] + active[v]; ai++) {
+        uint32_t fi = scratch->adjacency[ai];
+        M2Face f = scratch->localFaces[fi];
+        scratch->faceScores[fi] = scratch->vertexScores[f.indices[0]] + scratch->vertexScores[f.indices[1]] + scratch->vertexScores[f.indices[2]];
+        if (best < 0 || scratch->faceScores[fi] > scratch->faceScores[best]) {
+          best = fi;
+        }
       }
-
-      mat = mat * Mat44::translate(tr.x, tr.y, tr.z);
     }
 
-    mat = mat * Mat44::translate(bone->pivot.x, bone->pivot.y, bone->pivot.z);
+    cacheCount = MIN(nextCount, (uint32_t) M2_VCACHE_SIZE);
+    memcpy(cache, next, sizeof(int32_t) * cacheCount);
   }
 
-  if (bone->parent > -1) {
-    m2_calc_bone(model, &model->bones[bone->parent], animId, frame, globalFrame);
-    mat = mat * model->bones[bone->parent].matrix;
-    nmat = nmat * model->bones[bone->parent].normal_matrix;
+  memcpy(faces, scratch->ordered, sizeof(M2Face) * facesCount);
+  for (uint32_t v = 0; v < verticesCount; v++) {
+    scratch->localIds[scratch->globalIds[v]] = -1;
   }
-
-  bone->matrix = mat;
-  bone->normal_matrix = nmat;
-  bone->calculated = true;
 }
 
-void m2_calc_bones(M2Model *model, ModelBoneSet *boneset, uint32_t animId, uint32_t frame, uint32_t globalFrame)
+static void m2_permute(MemoryAllocator *allocator, void *array, size_t elementSize, uint32_t *order, uint32_t count)
 {
-  if (boneset != NULL) {
-    for (size_t i = 0; i < sizeof(boneset->set) / sizeof(boneset->set[0]); i++) {
-      uint32_t boneIdx = 32 * i;
-      uint32_t set = boneset->set[i];
+  uint8_t *copy = (uint8_t *) ALLOCATE_SIZE(allocator, elementSize * count);
+  memcpy(copy, array, elementSize * count);
+  for (uint32_t i = 0; i < count; i++) {
+    memcpy((uint8_t *) array + i * elementSize, copy + order[i] * elementSize, elementSize);
+  }
+  memory_free(allocator, copy);
+}
 
-      while (set > 0) {
-        if (set & 0x1) {
-          m2_calc_bone(model, &model->bones[boneIdx], animId, frame, globalFrame);
-        }
+static bool m2_ranges_overlap(uint32_t start0, uint32_t count0, uint32_t start1, uint32_t count1)
+{
+  return start0 < start1 + count1 && start1 < start0 + count0;
+}
 
-        boneIdx++;
-        set = set >> 1;
-      }
-    }
-  } else {
-    for (size_t i = 0; i < model->bonesCount; i++) {
-      m2_calc_bone(model, &model->bones[i], animId, frame, globalFrame);
-    }
+static bool m2_submesh_shares_faces(ModelView *view, uint32_t si)
+{
+  ModelSubmesh *submesh = &view->submeshes[si];
+  bool shared = submesh->facesStart + submesh->facesCount > view->facesCount;
+  for (uint32_t oi = 0; oi < view->submeshesCount && !shared; oi++) {
+    ModelSubmesh *other = &view->submeshes[oi];
+    shared = oi != si && m2_ranges_overlap(submesh->facesStart, submesh->facesCount, other->facesStart, other->facesCount);
   }
+  return shared;
 }
 
-void m2_animate_vertices(M2Model *model)
+// Reorders the faces of every submesh in every view for the post-transform cache, then renumbers each full
+// detail submesh's vertices in the order its faces first use them so skinning and drawing walk memory forward.
+// Submeshes sharing faces are left alone, vertices are only renumbered inside ranges no other submesh touches.
+static void m2_optimize_faces(MemoryAllocator *allocator, M2Model *model, M2LoadVertices *vertices)
 {
-  for (int rpi = 0; rpi < model->renderPassesCount; rpi++) {
-    M2RenderPass pass = model->renderPasses[rpi];
-    ModelSubmesh submesh = model->submeshes[pass.submesh];
+  ModelView *full = &model->views[0];
+  uint32_t verticesCount = model->verticesCount;
+  uint32_t maxFacesCount = 0;
+  for (uint32_t vi = 0; vi < model->viewsCount; vi++) {
+    maxFacesCount = MAX(maxFacesCount, model->views[vi].facesCount);
+  }
 
-    if (!submesh.enabled) {
-      continue;
-    }
+  model->orderedFacesCount = 0;
+  model->cacheMissesBefore = 0;
+  model->cacheMissesAfter = 0;
+
+  if (maxFacesCount == 0 || verticesCount == 0) {
+    return;
+  }
+
+  uint32_t missesBefore = 0;
+  uint32_t missesAfter = 0;
+  uint32_t orderedCount = 0;
+
+  M2VcacheScratch scratch = {};
+  scratch.localIds = ALLOCATE_MANY(allocator, int32_t, verticesCount);
+  scratch.globalIds = ALLOCATE_MANY(allocator, uint32_t, maxFacesCount * 3);
+  scratch.activeFaces = ALLOCATE_MANY(allocator, uint32_t, maxFacesCount * 3);
+  scratch.adjacencyStart = ALLOCATE_MANY(allocator, uint32_t, (maxFacesCount * 3 + 1));
+  scratch.adjacency = ALLOCATE_MANY(allocator, uint32_t, maxFacesCount * 3);
+  scratch.cachePositions = ALLOCATE_MANY(allocator, int32_t, maxFacesCount * 3);
+  scratch.vertexScores = ALLOCATE_MANY(allocator, float, maxFacesCount * 3);
+  scratch.faceScores = ALLOCATE_MANY(allocator, float, maxFacesCount);
+  scratch.emitted = ALLOCATE_MANY(allocator, bool, maxFacesCount);
+  scratch.localFaces = ALLOCATE_MANY(allocator, M2Face, maxFacesCount);
+  scratch.ordered = ALLOCATE_MANY(allocator, M2Face, maxFacesCount);
+  for (uint32_t v = 0; v < verticesCount; v++) {
+    scratch.localIds[v] = -1;
+  }
+
+  // Full detail submesh renumbering each vertex, -1 for none yet and -2 when the vertex can't move
+  int32_t *owners = ALLOCATE_MANY(allocator, int32_t, verticesCount);
+  for (uint32_t v = 0; v < verticesCount; v++) {
+    owners[v] = -1;
+  }
+
+  for (uint32_t vwi = 0; vwi < model->viewsCount; vwi++) {
+    ModelView *view = &model->views[vwi];
+    for (uint32_t si = 0; si < view->submeshesCount; si++) {
+      if (m2_submesh_shares_faces(view, si)) {
+        continue;
+      }
+
+      ModelSubmesh *submesh = &view->submeshes[si];
+      M2Face *faces = &view->faces[submesh->facesStart];
+      missesBefore += m2_vcache_misses(faces, submesh->facesCount);
+      m2_vcache_order(&scratch, faces, submesh->facesCount);
+      missesAfter += m2_vcache_misses(faces, submesh->facesCount);
+      orderedCount += submesh->facesCount;
 
-    uint32_t vstart = submesh.verticesStart;
-    uint32_t vend = submesh.verticesStart + submesh.verticesCount;
+      if (vwi > 0) {
+        continue;
+      }
 
-    for (int vi = vstart; vi < vend; vi++) {
-      Vec3f pos = {};
-      Vec3f normal = {};
-      ModelVertexWeight *weights = &model->weights[vi * model->weightsPerVertex];
+      for (uint32_t v = submesh->verticesStart; v < submesh->verticesStart + submesh->verticesCount && v < verticesCount; v++) {
+        owners[v] = owners[v] == -1 ? (int32_t) si : -2;
+      }
+    }
+  }
 
-      for (int wi = 0; wi < model->weightsPerVertex; wi++) {
-        if (weights[wi].weight > 0) {
-          Vec3f v = model->positions[vi] * model->bones[weights[wi].bone].matrix;
-          Vec3f n = model->normals[vi] * model->bones[weights[wi].bone].normal_matrix;
-          pos = pos + v * weights[wi].weight;
-          normal = normal + n * weights[wi].weight;
+  // Faces outside the owning submesh pin the vertex
+  for (uint32_t si = 0; si < full->submeshesCount; si++) {
+    ModelSubmesh *submesh = &full->submeshes[si];
+    for (uint32_t fi = submesh->facesStart; fi < submesh->facesStart + submesh->facesCount && fi < full->facesCount; fi++) {
+      for (uint32_t vi = 0; vi < 3; vi++) {
+        uint32_t v = full->faces[fi].indices[vi];
+        if (owners[v] != (int32_t) si) {
+          owners[v] = -2;
         }
       }
+    }
+  }
+
+  // New index to old index, identity unless the whole range belongs to one submesh
+  uint32_t *order = ALLOCATE_MANY(allocator, uint32_t, verticesCount);
+  uint32_t *remap = ALLOCATE_MANY(allocator, uint32_t, verticesCount);
+  for (uint32_t v = 0; v < verticesCount; v++) {
+    order[v] = remap[v] = v;
+  }
+
+  for (uint32_t si = 0; si < full->submeshesCount; si++) {
+    ModelSubmesh *submesh = &full->submeshes[si];
+    uint32_t first = submesh->verticesStart;
+    uint32_t end = submesh->verticesStart + submesh->verticesCount;
+    bool movable = end <= verticesCount && submesh->facesStart + submesh->facesCount <= full->facesCount;
+    for (uint32_t v = first; v < end && movable; v++) {
+      movable = owners[v] == (int32_t) si;
+    }
+
+    if (!movable) {
+      continue;
+    }
+
+    uint32_t next = first;
+    for (uint32_t fi = submesh->facesStart; fi < submesh->facesStart + submesh->facesCount; fi++) {
+      for (uint32_t vi = 0; vi < 3; vi++) {
+        uint32_t v = full->faces[fi].indices[vi];
+        if (owners[v] == (int32_t) si) {
+          owners[v] = -1; // Placed
+          order[next++] = v;
+        }
+      }
+    }
+
+    for (uint32_t v = first; v < end; v++) {
+      if (owners[v] == (int32_t) si) {
+        order[next++] = v; // Unused by the faces
+      }
+    }
+  }
+
+  for (uint32_t v = 0; v < verticesCount; v++) {
+    remap[order[v]] = v;
+  }
+
+  for (uint32_t vwi = 0; vwi < model->viewsCount; vwi++) {
+    ModelView *view = &model->views[vwi];
+    for (uint32_t fi = 0; fi < view->facesCount; fi++) {
+      for (uint32_t vi = 0; vi < 3; vi++) {
+        view->faces[fi].indices[vi] = remap[view->faces[fi].indices[vi]];
+      }
+    }
+  }
+
+  m2_permute(allocator, vertices->positions, sizeof(Vec3f), order, verticesCount);
+  m2_permute(allocator, vertices->normals, sizeof(Vec3f), order, verticesCount);
+  m2_permute(allocator, vertices->textureCoords, sizeof(Vec3f), order, verticesCount);
+  m2_permute(allocator, vertices->sources, sizeof(M2Vertex), order, verticesCount);
+
+  model->orderedFacesCount = orderedCount;
+  model->cacheMissesBefore = missesBefore;
+  model->cacheMissesAfter = missesAfter;
+
+  void *scratches[] = {scratch.localIds, scratch.globalIds, scratch.activeFaces, scratch.adjacencyStart, scratch.adjacency,
+                       scratch.cachePositions, scratch.vertexScores, scratch.faceScores, scratch.emitted, scratch.localFaces,
+                       scratch.ordered, owners, order, remap};
+  for (size_t i = 0; i < sizeof(scratches) / sizeof(scratches[0]); i++) {
+    memory_free(allocator, scratches[i]);
+  }
+}
+
+// Vertex span of every submesh from the vertices its faces use, lower detail views skip most of their range
+static void m2_view_vertex_spans(ModelView *view)
+{
+  for (uint32_t si = 0; si < view->submeshesCount; si++) {
+    ModelSubmesh *submesh = &view->submeshes[si];
+    uint32_t first = UINT32_MAX;
+    uint32_t last = 0;
+    for (uint32_t fi = submesh->facesStart; fi < submesh->facesStart + submesh->facesCount && fi < view->facesCount; fi++) {
+      for (uint32_t vi = 0; vi < 3; vi++) {
+        first = MIN(first, (uint32_t) view->faces[fi].indices[vi]);
+        last = MAX(last, (uint32_t) view->faces[fi].indices[vi]);
+      }
+    }
+
+    submesh->verticesStart = first <= last ? first : 0;
+    submesh->verticesCount = first <= last ? last - first + 1 : 0;
+  }
+}
+
+// Submesh vertex spans of the file index the view's vertex lookup, they are turned into model vertex spans
+static void m2_load_view(MemoryAllocator *allocator, void *bytes, M2View *m2view, ModelView *view)
+{
+  view->renderPassesCount = m2view->renderPassesCount;
+  view->renderPasses = ALLOCATE_MANY(allocator, M2RenderPass, m2view->renderPassesCount);
+  M2RenderPass *renderPasses = (M2RenderPass *) ((uint8_t *) bytes + m2view->renderPassesOffset);
+  for (int rpi = 0; rpi < m2view->renderPassesCount; rpi++) {
+    //m2_dump_render_pass(&renderPasses[rpi], bytes, header);
+    view->renderPasses[rpi] = renderPasses[rpi];
+    // printf("Render pass %d: flags: %d; submesh: %d, render flags index = %d\n", rpi, renderPasses[rpi].flags, renderPasses[rpi].submesh, renderPasses[rpi].renderFlagIndex);
+  }
+
+  uint16_t *indicesLookup = (uint16_t *) ((uint8_t *) bytes + m2view->indicesOffset);
+  M2Geoset *geosets = (M2Geoset *) ((uint8_t *) bytes + m2view->submeshesOffset);
+  view->submeshesCount = m2view->submeshesCount;
+  view->submeshes = ALLOCATE_MANY(allocator, ModelSubmesh, m2view->submeshesCount);
+  view->geosets = ALLOCATE_MANY(allocator, uint32_t, m2view->submeshesCount);
+  for (int i = 0; i < m2view->submeshesCount; i++) {
+    ModelSubmesh submesh;
+    submesh.id = geosets[i].id;
+    submesh.facesStart = geosets[i].indicesStart / 3;
+    submesh.facesCount = geosets[i].indicesCount / 3;
+
+    uint32_t first = UINT32_MAX;
+    uint32_t last = 0;
+    for (uint32_t li = geosets[i].verticesStart; li < (uint32_t) geosets[i].verticesStart + geosets[i].verticesCount && li < m2view->indicesCount; li++) {
+      first = MIN(first, (uint32_t) indicesLookup[li]);
+      last = MAX(last, (uint32_t) indicesLookup[li]);
+    }
+    submesh.verticesStart = first <= last ? first : 0;
+    submesh.verticesCount = first <= last ? last - first + 1 : 0;
+
+    view->submeshes[i] = submesh;
+  }
+
+  uint16_t *faces = (uint16_t *) ((uint8_t *) bytes + m2view->facesOffset);
+  uint32_t facesCount = m2view->facesCount / 3;
+  view->facesCount = facesCount;
+  view->faces = ALLOCATE_MANY(allocator, M2Face, facesCount);
+  for (int i = 0; i < facesCount; i++) {
+    M2Face face;
+
+    face.indices[0] = indicesLookup[faces[i * 3]];
+    face.indices[1] = indicesLookup[faces[i * 3 + 1]];
+    face.indices[2] = indicesLookup[faces[i * 3 + 2]];
+
+    view->faces[i] = face;
+  }
+}
+
+M2Model *m2_load(MemoryAllocator *allocator, void *bytes, size_t size)
+{
+  M2Header *header = (M2Header *) bytes;
+  m2_dump_header(header, bytes);
+
+  // uint16_t *texUnitLookups = (uint16_t *) ((uint8_t *) bytes + header->textureUnitLookupsOffset);
+  // for (int tui = 0; tui < header->textureUnitLookupsCount; tui++) {
+  //   printf("Texture unit lookup %d: %d\n", tui, texUnitLookups[tui]);
+  // }
+
+  M2Model *model = ALLOCATE_ONE(allocator, M2Model);
+  model->bounding_radius = header->bounding_sphere_radius;
+
+  model->verticesCount = header->verticesCount;
+
+  M2LoadVertices loadVertices = {};
+  Vec3f **loadArrays[] = {&loadVertices.positions, &loadVertices.normals, &loadVertices.tangents, &loadVertices.bitangents, &loadVertices.textureCoords};
+  for (size_t ai = 0; ai < 5; ai++) {
+    *loadArrays[ai] = ALLOCATE_MANY(allocator, Vec3f, header->verticesCount);
+  }
+  loadVertices.sources = ALLOCATE_MANY(allocator, M2Vertex, header->verticesCount);
+
+  static Mat44 worldMat = {
+    1.0f, 0.0f, 0.0f, 0.0f,
+    0.0f, 0.0f, -1.0f, 0.0f,
+    0.0f, 1.0f, 0.0f, 0.0f,
+    0.0f, 0.0f, 0.0f, 1.0f
+  };
+
+  M2Vertex *vertices = (M2Vertex *) ((uint8_t *) bytes + header->verticesOffset);
+  for(size_t i = 0; i < header->verticesCount; i++) {
+    loadVertices.positions[i] = vertices[i].pos * worldMat;
+    loadVertices.normals[i] = -(vertices[i].normal * worldMat);
+    loadVertices.textureCoords[i] = {vertices[i].texcoords[0], vertices[i].texcoords[1], 0.0f};
+    loadVertices.sources[i] = vertices[i];
+  }
+
+  M2View *m2views = (M2View *) ((uint8_t *) bytes + header->viewsOffset);
+  m2_dump_view(&m2views[0]);
+
+  model->viewsCount = header->viewsCount;
+  model->views = ALLOCATE_MANY(allocator, ModelView, header->viewsCount);
+  for (uint32_t vi = 0; vi < header->viewsCount; vi++) {
+    m2_load_view(allocator, bytes, &m2views[vi], &model->views[vi]);
+  }
+
+  ModelView *full = &model->views[0];
+  model->submeshesCount = full->submeshesCount;
+  model->submeshes = full->submeshes;
+  for (uint32_t vi = 0; vi < model->viewsCount; vi++) {
+    ModelView *view = &model->views[vi];
+    for (uint32_t si = 0; si < view->submeshesCount; si++) {
+      view->geosets[si] = vi == 0 ? si : M2_NO_GEOSET;
+      for (uint32_t fsi = 0; fsi < full->submeshesCount && view->geosets[si] == M2_NO_GEOSET; fsi++) {
+        if (full->submeshes[fsi].id == view->submeshes[si].id) {
+          view->geosets[si] = fsi;
+        }
+      }
+    }
+  }
+
+  model->renderFlagsCount = header->renderFlagsCount;
+  model->renderFlags = ALLOCATE_MANY(allocator, M2RenderFlag, header->renderFlagsCount);
+  M2RenderFlag *renderFlags = (M2RenderFlag *) ((uint8_t *) bytes + header->renderFlagsOffset);
+  for (int rfi = 0; rfi < header->renderFlagsCount; rfi++) {
+    model->renderFlags[rfi] = renderFlags[rfi];
+    // printf("Render flag %d: f = %d; b = %d\n", rfi, renderFlags[rfi].flags, renderFlags[rfi].blendingMode);
+  }
+
+  M2Texture *m2textures = (M2Texture *) ((uint8_t *) bytes + header->texturesOffset);
+  model->texturesCount = header->texturesCount;
+  model->textures = ALLOCATE_MANY(allocator, ModelTexture, header->texturesCount);
+  for (int ti = 0; ti < header->texturesCount; ti++) {
+    m2_dump_texture(&m2textures[ti], bytes);
+
+    model->textures[ti].type = m2textures[ti].type;
+    if (m2textures[ti].type == MTT_INLINE) {
+      model->textures[ti].name = (char *) ALLOCATE_SIZE(allocator, m2textures[ti].filenameLength);
+      memcpy(model->textures[ti].name, (uint8_t *) bytes + m2textures[ti].filenameOffset, m2textures[ti].filenameLength);
+    } else {
+      model->textures[ti].name = NULL;
+    }
+  }
+
+  uint16_t *texLookups = (uint16_t *) ((uint8_t *) bytes + header->textureLookupsOffset);
+  model->textureLookupsCount = header->textureLookupsCount;
+  model->textureLookups = ALLOCATE_MANY(allocator, uint32_t, header->textureLookupsCount);
+  for (int ti = 0; ti < header->textureLookupsCount; ti++) {
+    model->textureLookups[ti] = texLookups[ti];
+  }
+
+  M2Geoset *geosets = (M2Geoset *) ((uint8_t *) bytes + m2views[0].submeshesOffset);
+  for (uint32_t si = 0; si < full->submeshesCount; si++) {
+    m2_dump_geoset(&geosets[si]);
+  }
+
+  m2_optimize_faces(allocator, model, &loadVertices);
+  for (uint32_t vi = 1; vi < model->viewsCount; vi++) {
+    m2_view_vertex_spans(&model->views[vi]);
+  }
+
+  M2Animation *animations = (M2Animation *) ((uint8_t *) bytes + header->animationsOffset);
+  model->animationsCount = header->animationsCount;
+  model->animations = ALLOCATE_MANY(allocator, ModelAnimation, header->animationsCount);
+  for (int ai = 0; ai < header->animationsCount; ai++) {
+    model->animations[ai].id = -1;
+    model->animations[ai].startFrame = animations[ai].timeStart;
+    model->animations[ai].endFrame = animations[ai].timeEnd;
+    model->animations[ai].speed = animations[ai].moveSpeed;
+  }
+
+  int16_t *animLookups = (int16_t *) ((uint8_t *) bytes + header->animationLookupsOffset);
+  model->animationLookupsCount = header->animationLookupsCount;
+  model->animationLookups = (int16_t *) ALLOCATE_MANY(allocator, int32_t, model->animationLookupsCount);
+  for (size_t ali = 0; ali < model->animationLookupsCount; ali++) {
+    int16_t anim_id = animLookups[ali];
+    model->animationLookups[ali] = anim_id;
+
+    if (anim_id >= 0 && anim_id < model->animationsCount) {
+      model->animations[anim_id].id = ali; // Reverse lookup
+    }
+  }
+
+  model->bonesCount = header->bonesCount;
+  model->bones = ALLOCATE_MANY(allocator, ModelBone, header->bonesCount);
+  uint32_t animatedWords = MAX((model->animationsCount + 31) / 32, 1u);
+
+  M2Bone *bones = (M2Bone *) ((uint8_t *) bytes + header->bonesOffset);
+  for (int i = 0; i < header->bonesCount; i++) {
+    ModelBone bone = {};
+    bone.pivot = bones[i].pivot * worldMat;
+    bone.parent = bones[i].parent;
+    bone.keybone = bones[i].keybone;
+
+    m2_load_animation_data(bytes, header, allocator, &bone.translations, &bones[i].translation, sizeof(Vec3f), m2_load_translation);
+    m2_load_animation_data(bytes, header, allocator, &bone.rotations, &bones[i].rotation, sizeof(Quaternion), m2_load_rotation);
+    m2_load_animation_data(bytes, header, allocator, &bone.scalings, &bones[i].scaling, sizeof(Vec3f), m2_load_scaling);
+
+    if (bone.parent >= (int32_t) header->bonesCount) {
+      bone.parent = -1;
+    }
+
+    bone.animated = ALLOCATE_MANY(allocator, uint32_t, animatedWords);
+    memset(bone.animated, 0, animatedWords * sizeof(uint32_t));
+
+    ModelAnimationData *tracks[] = {&bone.translations, &bone.rotations, &bone.scalings};
+    for (size_t ti = 0; ti < 3; ti++) {
+      if (tracks[ti]->isGlobal) {
+        bone.globalAnimated = true;
+        continue;
+      }
+
+      for (uint32_t ai = 0; ai < MIN(tracks[ti]->animationsCount, model->animationsCount); ai++) {
+        if (m2_range_has_keyframes(tracks[ti], tracks[ti]->animationRanges[ai], &model->animations[ai])) {
+          bone.animated[ai / 32] |= 1u << (ai % 32);
+        }
+      }
+    }
+
+    model->bones[i] = bone;
+  }
+
+  m2_order_bones(allocator, model);
+  model->keyframeSearch = M2_KEYFRAME_SEARCH_CURSOR;
+
+  model->keybonesCount = header->keyBoneLookupsCount;
+  model->keybones = ALLOCATE_MANY(allocator, int16_t,  header->keyBoneLookupsCount);
+
+  int16_t *keybones = (int16_t *) ((uint8_t *) bytes + header->keyBoneLookupsOffset);
+  for (size_t bli = 0; bli < header->keyBoneLookupsCount; bli++) {
+    model->keybones[bli] = keybones[bli];
+  }
+
+  if (model->keybonesCount > M2_KEYBONE_ROOT) {
+    printf("Head bone: %d\n", model->keybones[M2_KEYBONE_ROOT]);
+  }
+
+  printf("att size: %zu\n", sizeof(M2Attachment));
+  model->attachmentsCount = header->attachmentsCount;
+  M2Attachment *attachments = (M2Attachment *) ((uint8_t *) bytes + header->attachmentsOffset);
+  model->attachments = ALLOCATE_MANY(allocator, M2Attachment, header->attachmentsCount);
+  for (size_t ai = 0; ai < header->attachmentsCount; ai++) {
+    M2Attachment *attachment = &attachments[ai];
+    model->attachments[ai] = attachments[ai];
+    model->attachments[ai].offset = Vec3f(attachments[ai].offset.x, attachments[ai].offset.z, -attachments[ai].offset.y);
+  }
+
+  int16_t *attachmentLookups = (int16_t *) ((uint8_t *) bytes + header->attachmentLookupsOffset);
+  model->attachmentLookups = ALLOCATE_MANY(allocator, int16_t, header->attachmentLookupsCount);
+  for (size_t ali = 0; ali < header->attachmentLookupsCount; ali++) {
+    model->attachmentLookups[ali] = attachmentLookups[ali];
+  }
+
+  m2_fix_normals(model, &loadVertices);
+  m2_calc_tangents(model, &loadVertices);
+  m2_build_skin(allocator, model, &loadVertices);
+
+  for (size_t ai = 0; ai < 5; ai++) {
+    memory_free(allocator, *loadArrays[ai]);
+  }
+  memory_free(allocator, loadVertices.sources);
+
+  return model;
+}
+
+// Points the instance's bone matrices and skinned attributes at the given buffers
+static void m2_instance_use_buffers(ModelInstance *instance, ModelPoseBuffers *bones, ModelPoseBuffers *vertices)
+{
+  instance->boneMatrices = bones->boneMatrices;
+  instance->boneNormalMatrices = bones->boneNormalMatrices;
+  instance->animatedPositions = vertices->positions;
+  instance->animatedNormals = vertices->normals;
+  instance->animatedTangents = vertices->tangents;
+  instance->animatedBitangents = vertices->bitangents;
+}
+
+#define M2_INSTANCE_ALLOCATE(A, T, C) ((T *) (A)->allocate(sizeof(T) * MAX((C), 1)))
+
+// Instance in the bind pose with every submesh enabled, textures are left for the caller to assign
+ModelInstance *m2_instance_create(MemoryArena *arena, M2Model *model)
+{
+  ModelInstance *instance = M2_INSTANCE_ALLOCATE(arena, ModelInstance, 1);
+  instance->model = model;
+
+  instance->textures = M2_INSTANCE_ALLOCATE(arena, Texture *, model->texturesCount);
+  for (uint32_t i = 0; i < model->texturesCount; i++) {
+    instance->textures[i] = NULL;
+  }
+
+  ModelPoseBuffers *own = &instance->own;
+  own->boneMatrices = M2_INSTANCE_ALLOCATE(arena, Mat34, model->bonesCount);
+  own->boneNormalMatrices = M2_INSTANCE_ALLOCATE(arena, Mat34, model->bonesCount);
+  instance->boneLayers = M2_INSTANCE_ALLOCATE(arena, uint32_t, model->bonesCount);
+  instance->cursors = M2_INSTANCE_ALLOCATE(arena, uint32_t, model->bonesCount * M2_KEYFRAME_CURSORS);
+  for (uint32_t i = 0; i < model->bonesCount; i++) {
+    own->boneMatrices[i] = Mat34::identity();
+    own->boneNormalMatrices[i] = Mat34::identity();
+    instance->boneLayers[i] = M2_POSE_MAX_LAYERS;
+  }
+  memset(instance->cursors, 0, sizeof(uint32_t) * model->bonesCount * M2_KEYFRAME_CURSORS);
+
+  Vec3f **targets[] = {&own->positions, &own->normals, &own->tangents, &own->bitangents};
+  for (size_t si = 0; si < 4; si++) {
+    *targets[si] = M2_INSTANCE_ALLOCATE(arena, Vec3f, model->verticesCount);
+  }
+  m2_bind_pose(model, own->positions, own->normals, own->tangents, own->bitangents);
+  m2_instance_use_buffers(instance, own, own);
+
+  instance->palette = M2_INSTANCE_ALLOCATE(arena, float, model->bonesCount * M2_SKIN_PALETTE_STRIDE);
+  uint32_t maxRenderPassesCount = 1;
+  for (uint32_t vi = 0; vi < model->viewsCount; vi++) {
+    maxRenderPassesCount = MAX(maxRenderPassesCount, model->views[vi].renderPassesCount);
+  }
+  instance->ranges = M2_INSTANCE_ALLOCATE(arena, ModelSkinRange, maxRenderPassesCount);
+  instance->rangesCount = 0;
+  instance->view = 0;
+  instance->screenRadius = FLT_MAX;
+
+  instance->submeshesEnabled = M2_INSTANCE_ALLOCATE(arena, bool, model->submeshesCount);
+  for (uint32_t i = 0; i < model->submeshesCount; i++) {
+    instance->submeshesEnabled[i] = true;
+  }
+
+  return instance;
+}
+
+// Whether frame lies in [ts[i], ts[i + 1]] and no earlier keyframe pair of the range contains it
+static inline bool m2_anim_keyframe_matches(ModelAnimationData *data, ModelAnimationRange range, uint32_t i, uint32_t frame)
+{
+  return i >= range.start && i < range.end &&
+         data->timestamps[i] <= frame && frame <= data->timestamps[i + 1] &&
+         (i == range.start || data->timestamps[i] < frame);
+}
+
+static inline bool m2_anim_find_keyframe(ModelAnimationData *data, ModelAnimationRange range, uint32_t frame, M2KeyframeSearch search, uint32_t *cursor, uint32_t *result)
+{
+  if (search == M2_KEYFRAME_SEARCH_LINEAR) {
+    for (uint32_t i = range.start; i < range.end; i++) {
+      if (frame >= data->timestamps[i] && frame <= data->timestamps[i + 1]) {
+        *result = i;
+        return true;
+      }
+    }
+
+    return false;
+  }
+
+  if (search == M2_KEYFRAME_SEARCH_CURSOR) {
+    for (uint32_t i = *cursor; i <= *cursor + 1; i++) {
+      if (m2_anim_keyframe_matches(data, range, i, frame)) {
+        *result = i;
+        *cursor = i;
+        return true;
+      }
+    }
+  }
+
+  // First keyframe in (start, end] not earlier than the frame
+  uint32_t lo = range.start + 1;
+  uint32_t hi = range.end + 1;
+  while (lo < hi) {
+    uint32_t mid = lo + (hi - lo) / 2;
+    if (data->timestamps[mid] < frame) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+
+  if (lo > range.end || data->timestamps[lo - 1] > frame) {
+    return false;
+  }
+
+  *result = lo - 1;
+  *cursor = lo - 1;
+  return true;
+}
+
+inline void m2_anim_get_frame(ModelAnimationData *data, ModelAnimationRange range, uint32_t frame, uint32_t globalFrame, M2KeyframeSearch search, uint32_t *cursor, uint32_t *idx0, uint32_t *idx1, float *t)
+{
+  if (range.start == range.end) {
+    *idx0 = range.start;
+    *idx1 = range.start;
+    *t = 0;
+    return;
+  }
+
+  if (data->isGlobal) {
+    frame = range.start + globalFrame % (range.end - range.start);
+  }
+
+  uint32_t i;
+  if (m2_anim_find_keyframe(data, range, frame, search, cursor, &i)) {
+    uint32_t ts0 = data->timestamps[i];
+    uint32_t ts1 = data->timestamps[i + 1];
+
+    *idx0 = i;
+    *idx1 = i + 1;
+    *t = (float) (frame - ts0) / (float)(ts1 - ts0);
+    return;
+  }
+
+  *idx0 = range.start;
+  *idx1 = range.start + 1;
+  *t = 0;
+}
+
+static void m2_calc_bone(ModelInstance *instance, uint32_t boneIndex, uint32_t animId, uint32_t frame, uint32_t globalFrame)
+{
+  ModelBone *bone = &instance->model->bones[boneIndex];
+  Mat34 *matrix = &instance->boneMatrices[boneIndex];
+  Mat34 *normalMatrix = &instance->boneNormalMatrices[boneIndex];
+  Mat34 *parentMatrix = bone->parent > -1 ? &instance->boneMatrices[bone->parent] : NULL;
+  Mat34 *parentNormalMatrix = bone->parent > -1 ? &instance->boneNormalMatrices[bone->parent] : NULL;
+  uint32_t *cursors = &instance->cursors[boneIndex * M2_KEYFRAME_CURSORS];
+  M2KeyframeSearch search = instance->model->keyframeSearch;
+
+  bool animated = animId < instance->model->animationsCount && (bone->animated[animId / 32] & (1u << (animId % 32)));
+  if (!bone->globalAnimated && !animated) {
+    *matrix = parentMatrix ? *parentMatrix : Mat34::identity();
+    *normalMatrix = parentNormalMatrix ? *parentNormalMatrix : Mat34::identity();
+    return;
+  }
+
+  ModelAnimationRange trRange = {};
+  bool translate = false;
+  ModelAnimationRange rotRange = {};
+  bool rotate = false;
+  ModelAnimationRange scaleRange = {};
+  bool scale = false;
+
+  if (bone->translations.isGlobal) {
+    trRange = bone->translations.animationRanges[0];
+    translate = true;
+  } else if (animId < bone->translations.animationsCount) {
+    trRange = bone->translations.animationRanges[animId];
+    translate = bone->translations.keyframesCount > 0;
+  }
+
+  if (bone->rotations.isGlobal) {
+    rotRange = bone->rotations.animationRanges[0];
+    rotate = true;
+  } else if (animId < bone->rotations.animationsCount) {
+    rotRange = bone->rotations.animationRanges[animId];
+    rotate = bone->rotations.keyframesCount > 0;
+  }
+
+  if (bone->scalings.isGlobal) {
+    scaleRange = bone->scalings.animationRanges[0];
+    scale = true;
+  } else if (animId < bone->scalings.animationsCount) {
+    scaleRange = bone->scalings.animationRanges[animId];
+    scale = bone->scalings.keyframesCount > 0;
+  }
+
+  uint32_t idx0;
+  uint32_t idx1;
+  float t;
+
+  Vec3f s = {1.0f, 1.0f, 1.0f};
+  Vec3f tr = {};
+  Mat34 rotmat = Mat34::identity();
+
+  if (scale) {
+    m2_anim_get_frame(&bone->scalings, scaleRange, frame, globalFrame, search, &cursors[2], &idx0, &idx1, &t);
+    Vec3f s0 = ((Vec3f *) bone->scalings.data)[idx0];
+    Vec3f s1 = ((Vec3f *) bone->scalings.data)[idx1];
+    s = lerp(s0, s1, t);
+  }
+
+  if (rotate) {
+    m2_anim_get_frame(&bone->rotations, rotRange, frame, globalFrame, search, &cursors[1], &idx0, &idx1, &t);
+    Quaternion q0 = ((Quaternion *) bone->rotations.data)[idx0];
+    Quaternion q;
+
+    switch (bone->rotations.interpolationType) {
+      case MODEL_INTERPOLATION_NONE:
+        q = q0;
+        break;
+
+      case MODEL_INTERPOLATION_LINEAR: {
+        Quaternion q1 = ((Quaternion *) bone->rotations.data)[idx1];
+        q = lerp(q0, q1, t);
+      } break;
+
+      default:
+        q = q0;
+        break;
+    }
+
+    rotmat = Mat34::from_quaternion(q);
+  }
+
+  if (translate) {
+    m2_anim_get_frame(&bone->translations, trRange, frame, globalFrame, search, &cursors[0], &idx0, &idx1, &t);
+    Vec3f tr0 = ((Vec3f *) bone->translations.data)[idx0];
+
+    switch (bone->translations.interpolationType) {
+      case MODEL_INTERPOLATION_NONE:
+        tr = tr0;
+        break;
+
+      case MODEL_INTERPOLATION_LINEAR: {
+        Vec3f tr1 = ((Vec3f *) bone->translations.data)[idx1];
+        tr = lerp(tr0, tr1, t);
+      } break;
+
+      default:
+        tr = tr0;
+        break;
+    }
+  }
+
+  // Translate(-pivot) * Scale * Rotate * Translate(tr + pivot)
+  Mat34 mat;
+  float sv[3] = {s.x, s.y, s.z};
+  for (int row = 0; row < 3; row++) {
+    for (int col = 0; col < 3; col++) {
+      mat.el[row][col] = sv[row] * rotmat.el[row][col];
+    }
+  }
+
+  Vec3f origin = {-bone->pivot.x * mat.a - bone->pivot.y * mat.e - bone->pivot.z * mat.i,
+                  -bone->pivot.x * mat.b - bone->pivot.y * mat.f - bone->pivot.z * mat.j,
+                  -bone->pivot.x * mat.c - bone->pivot.y * mat.g - bone->pivot.z * mat.k};
+  mat.m = origin.x + tr.x + bone->pivot.x;
+  mat.n = origin.y + tr.y + bone->pivot.y;
+  mat.o = origin.z + tr.z + bone->pivot.z;
+
+  if (parentMatrix) {
+    *matrix = mat * *parentMatrix;
+    *normalMatrix = rotmat * *parentNormalMatrix;
+  } else {
+    *matrix = mat;
+    *normalMatrix = rotmat;
+  }
+}
+
+void m2_calc_bones(ModelInstance *instance, ModelAnimationLayer *layers, uint32_t layersCount, uint32_t globalFrame)
+{
+  ASSERT(layersCount > 0 && layersCount <= M2_POSE_MAX_LAYERS);
+
+  M2Model *model = instance->model;
+  uint32_t *boneLayers = instance->boneLayers;
+
+  for (uint32_t i = 0; i < model->bonesCount; i++) {
+    boneLayers[i] = M2_POSE_MAX_LAYERS;
+
+    for (uint32_t li = 0; li < layersCount; li++) {
+      ModelBoneSet *boneset = layers[li].boneset;
+      if (boneset == NULL || (i < 256 && MODEL_PBONESET_ISSET(boneset, i))) {
+        boneLayers[i] = li;
+        break;
+      }
+    }
+  }
+
+  // Parents are posed by the earliest layer of any of their descendants
+  for (uint32_t oi = model->bonesCount; oi > 0; oi--) {
+    uint32_t bi = model->bonesOrder[oi - 1];
+    int32_t parent = model->bones[bi].parent;
+    if (parent > -1) {
+      boneLayers[parent] = MIN(boneLayers[parent], boneLayers[bi]);
+    }
+  }
+
+  for (uint32_t oi = 0; oi < model->bonesCount; oi++) {
+    uint32_t bi = model->bonesOrder[oi];
+    if (boneLayers[bi] < layersCount) {
+      ModelAnimationLayer *layer = &layers[boneLayers[bi]];
+      m2_calc_bone(instance, bi, layer->animId, layer->frame, globalFrame);
+    }
+  }
+}
+
+bool m2_view_submesh_enabled(ModelInstance *instance, ModelView *view, uint32_t submesh)
+{
+  uint32_t geoset = view->geosets[submesh];
+  return geoset == M2_NO_GEOSET || instance->submeshesEnabled[geoset];
+}
+
+// Steps one view at a time so a radius sitting near a boundary doesn't flip between views every frame
+uint32_t m2_view_for_radius(M2Model *model, uint32_t view, float radius)
+{
+  uint32_t viewsCount = model->viewsCount;
+  view = MIN(view, viewsCount > 0 ? viewsCount - 1 : 0);
+
+  while (view + 1 < viewsCount && radius < ldexpf(M2_VIEW_LOD_RADIUS, -(int) view) * (1.0f - M2_VIEW_LOD_HYSTERESIS)) {
+    view++;
+  }
+
+  while (view > 0 && radius > ldexpf(M2_VIEW_LOD_RADIUS, 1 - (int) view) * (1.0f + M2_VIEW_LOD_HYSTERESIS)) {
+    view--;
+  }
+
+  return view;
+}
+
+void m2_select_view(ModelInstance *instance)
+{
+  instance->view = m2_view_for_radius(instance->model, instance->view, instance->screenRadius);
+}
+
+// Lanes covering the vertices of the enabled submeshes in the instance's view, or every lane when a pose is
+// shared with instances that may draw other submeshes or views
+static uint32_t m2_skin_ranges(ModelInstance *instance, bool allSubmeshes)
+{
+  M2Model *model = instance->model;
+  ModelSkinRange *ranges = instance->ranges;
+  uint32_t count = 0;
+
+  if (allSubmeshes) {
+    ranges[0] = {0, model->skin.count / MODEL_SKIN_LANES};
+    return ranges[0].end > 0 ? 1 : 0;
+  }
+
+  ModelView *view = &model->views[instance->view];
+  for (uint32_t rpi = 0; rpi < view->renderPassesCount; rpi++) {
+    uint32_t si = view->renderPasses[rpi].submesh;
+    ModelSubmesh *submesh = &view->submeshes[si];
+    if (!m2_view_submesh_enabled(instance, view, si) || submesh->verticesCount == 0) {
+      continue;
+    }
+
+    ModelSkinRange range = {submesh->verticesStart / MODEL_SKIN_LANES,
+                            (submesh->verticesStart + submesh->verticesCount + MODEL_SKIN_LANES - 1) / MODEL_SKIN_LANES};
+    range.end = MIN(range.end, model->skin.count / MODEL_SKIN_LANES);
+    if (range.start >= range.end) {
+      continue;
+    }
+
+    uint32_t i = count++;
+    while (i > 0 && ranges[i - 1].start > range.start) {
+      ranges[i] = ranges[i - 1];
+      i--;
+    }
+    ranges[i] = range;
+  }
+
+  uint32_t merged = 0;
+  for (uint32_t i = 0; i < count; i++) {
+    if (merged > 0 && ranges[i].start <= ranges[merged - 1].end) {
+      ranges[merged - 1].end = MAX(ranges[merged - 1].end, ranges[i].end);
+    } else {
+      ranges[merged++] = ranges[i];
+    }
+  }
+
+  return merged;
+}
+
+#ifdef MODEL_SKIN_AVX2
+
+static inline void m2_transpose8(__m256 *rows)
+{
+  __m256 t0 = _mm256_unpacklo_ps(rows[0], rows[1]);
+  __m256 t1 = _mm256_unpackhi_ps(rows[0], rows[1]);
+  __m256 t2 = _mm256_unpacklo_ps(rows[2], rows[3]);
+  __m256 t3 = _mm256_unpackhi_ps(rows[2], rows[3]);
+  __m256 t4 = _mm256_unpacklo_ps(rows[4], rows[5]);
+  __m256 t5 = _mm256_unpackhi_ps(rows[4], rows[5]);
+  __m256 t6 = _mm256_unpacklo_ps(rows[6], rows[7]);
+  __m256 t7 = _mm256_unpackhi_ps(rows[6], rows[7]);
+
+  __m256 s0 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(1, 0, 1, 0));
+  __m256 s1 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(3, 2, 3, 2));
+  __m256 s2 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(1, 0, 1, 0));
+  __m256 s3 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(3, 2, 3, 2));
+  __m256 s4 = _mm256_shuffle_ps(t4, t6, _MM_SHUFFLE(1, 0, 1, 0));
+  __m256 s5 = _mm256_shuffle_ps(t4, t6, _MM_SHUFFLE(3, 2, 3, 2));
+  __m256 s6 = _mm256_shuffle_ps(t5, t7, _MM_SHUFFLE(1, 0, 1, 0));
+  __m256 s7 = _mm256_shuffle_ps(t5, t7, _MM_SHUFFLE(3, 2, 3, 2));
+
+  rows[0] = _mm256_permute2f128_ps(s0, s4, 0x20);
+  rows[1] = _mm256_permute2f128_ps(s1, s5, 0x20);
+  rows[2] = _mm256_permute2f128_ps(s2, s6, 0x20);
+  rows[3] = _mm256_permute2f128_ps(s3, s7, 0x20);
+  rows[4] = _mm256_permute2f128_ps(s0, s4, 0x31);
+  rows[5] = _mm256_permute2f128_ps(s1, s5, 0x31);
+  rows[6] = _mm256_permute2f128_ps(s2, s6, 0x31);
+  rows[7] = _mm256_permute2f128_ps(s3, s7, 0x31);
+}
+
+static inline __m256 m2_load_u16x8(uint16_t *values)
+{
+  return _mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(_mm_loadu_si128((__m128i *) values)));
+}
+
+static inline __m256 m2_load_s16x8(int16_t *values)
+{
+  return _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(_mm_loadu_si128((__m128i *) values)));
+}
+
+// Same steps as m2_octahedral_decode, x - copysign(t, x) equals its branches as x is never -0
+static inline void m2_octahedral_decode8(int16_t **encoded, uint32_t base, __m256 *xyz)
+{
+  __m256 k = _mm256_set1_ps(1.0f / 32767.0f);
+  __m256 sign = _mm256_set1_ps(-0.0f);
+  __m256 x = _mm256_mul_ps(m2_load_s16x8(&encoded[0][base]), k);
+  __m256 y = _mm256_mul_ps(m2_load_s16x8(&encoded[1][base]), k);
+  __m256 z = _mm256_sub_ps(_mm256_sub_ps(_mm256_set1_ps(1.0f), _mm256_andnot_ps(sign, x)), _mm256_andnot_ps(sign, y));
+  __m256 t = _mm256_max_ps(_mm256_xor_ps(z, sign), _mm256_setzero_ps());
+  xyz[0] = _mm256_sub_ps(x, _mm256_or_ps(t, _mm256_and_ps(x, sign)));
+  xyz[1] = _mm256_sub_ps(y, _mm256_or_ps(t, _mm256_and_ps(y, sign)));
+  xyz[2] = z;
+}
+
+// Skins 8 vertices with a per vertex blend of the 4 influencing bone matrices, decoding the packed bind pose
+static void m2_skin_lanes(ModelInstance *instance, uint32_t base)
+{
+  M2Model *model = instance->model;
+  ModelSkin *skin = &model->skin;
+  float *palette = instance->palette;
+
+  // Blended palette entries per vertex, transposed so m[k] holds element k of all 8 lanes
+  __m256 m[M2_SKIN_PALETTE_STRIDE];
+  for (int l = 0; l < MODEL_SKIN_LANES; l++) {
+    uint32_t vi = base + l;
+    uint32_t bones = skin->bones[vi];
+    uint32_t weights = skin->weights[vi];
+    float *p0 = &palette[(bones & 0xFF) * M2_SKIN_PALETTE_STRIDE];
+    float *p1 = &palette[(bones >> 8 & 0xFF) * M2_SKIN_PALETTE_STRIDE];
+    float *p2 = &palette[(bones >> 16 & 0xFF) * M2_SKIN_PALETTE_STRIDE];
+    float *p3 = &palette[(bones >> 24) * M2_SKIN_PALETTE_STRIDE];
+    __m256 w0 = _mm256_set1_ps((weights & 0xFF) * (1.0f / 255.0f));
+    __m256 w1 = _mm256_set1_ps((weights >> 8 & 0xFF) * (1.0f / 255.0f));
+    __m256 w2 = _mm256_set1_ps((weights >> 16 & 0xFF) * (1.0f / 255.0f));
+    __m256 w3 = _mm256_set1_ps((weights >> 24) * (1.0f / 255.0f));
+
+    for (int g = 0; g < M2_SKIN_PALETTE_STRIDE / 8; g++) {
+      __m256 acc = _mm256_mul_ps(w0, _mm256_loadu_ps(p0 + 8 * g));
+      acc = _mm256_add_ps(acc, _mm256_mul_ps(w1, _mm256_loadu_ps(p1 + 8 * g)));
+      acc = _mm256_add_ps(acc, _mm256_mul_ps(w2, _mm256_loadu_ps(p2 + 8 * g)));
+      acc = _mm256_add_ps(acc, _mm256_mul_ps(w3, _mm256_loadu_ps(p3 + 8 * g)));
+      m[8 * g + l] = acc;
+    }
+  }
+
+  for (int g = 0; g < M2_SKIN_PALETTE_STRIDE / 8; g++) {
+    m2_transpose8(&m[8 * g]);
+  }
+
+  int16_t **directions[] = {skin->normals, skin->tangents, skin->bitangents};
+  Vec3f *targets[] = {instance->animatedPositions, instance->animatedNormals, instance->animatedTangents, instance->animatedBitangents};
+  uint32_t lanes = MIN(MODEL_SKIN_LANES, model->verticesCount - base);
+  ModelQuantization *range = &model->positionsRange;
+
+  for (int si = 0; si < 4; si++) {
+    __m256 v[3];
+    if (si == 0) {
+      for (int c = 0; c < 3; c++) {
+        v[c] = _mm256_add_ps(_mm256_mul_ps(m2_load_u16x8(&skin->positions[c][base]), _mm256_set1_ps(range->scale[c])), _mm256_set1_ps(range->min[c]));
+      }
+    } else {
+      m2_octahedral_decode8(directions[si - 1], base, v);
+    }
+
+    __m256 x = v[0];
+    __m256 y = v[1];
+    __m256 z = v[2];
+    __m256 *mat = si == 0 ? m : m + 12; // Normal matrices have no translation
+
+    float result[3][MODEL_SKIN_LANES];
+    for (int c = 0; c < 3; c++) {
+      __m256 r = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(x, mat[c]), _mm256_mul_ps(y, mat[3 + c])), _mm256_mul_ps(z, mat[6 + c]));
+      if (si == 0) {
+        r = _mm256_add_ps(r, mat[9 + c]);
+      }
+      _mm256_storeu_ps(result[c], r);
+    }
+
+    for (uint32_t l = 0; l < lanes; l++) {
+      targets[si][base + l] = {result[0][l], result[1][l], result[2][l]};
+    }
+  }
+}
+
+#else
+
+static void m2_skin_lanes(ModelInstance *instance, uint32_t base)
+{
+  M2Model *model = instance->model;
+  ModelSkin *skin = &model->skin;
+  float *palette = instance->palette;
+  uint32_t end = MIN(base + MODEL_SKIN_LANES, model->verticesCount);
+
+  int16_t **directions[] = {skin->normals, skin->tangents, skin->bitangents};
+  Vec3f *targets[] = {instance->animatedPositions, instance->animatedNormals, instance->animatedTangents, instance->animatedBitangents};
+  ModelQuantization *range = &model->positionsRange;
+
+  for (uint32_t vi = base; vi < end; vi++) {
+    float *p[4];
+    float w[4];
+    for (int wi = 0; wi < 4; wi++) {
+      p[wi] = &palette[(skin->bones[vi] >> (wi * 8) & 0xFF) * M2_SKIN_PALETTE_STRIDE];
+      w[wi] = (skin->weights[vi] >> (wi * 8) & 0xFF) * (1.0f / 255.0f);
+    }
+
+    float m[M2_SKIN_BLENDED];
+    for (int k = 0; k < M2_SKIN_BLENDED; k++) {
+      float acc = w[0] * p[0][k];
+      acc = acc + w[1] * p[1][k];
+      acc = acc + w[2] * p[2][k];
+      acc = acc + w[3] * p[3][k];
+      m[k] = acc;
+    }
+
+    for (int si = 0; si < 4; si++) {
+      Vec3f v;
+      if (si == 0) {
+        v = {m2_dequantize(range, 0, skin->positions[0][vi]), m2_dequantize(range, 1, skin->positions[1][vi]),
+             m2_dequantize(range, 2, skin->positions[2][vi])};
+      } else {
+        v = m2_octahedral_decode(directions[si - 1][0][vi], directions[si - 1][1][vi]);
+      }
+
+      float x = v.x;
+      float y = v.y;
+      float z = v.z;
+      float *mat = si == 0 ? m : m + 12; // Normal matrices have no translation
+
+      float result[3];
+      for (int c = 0; c < 3; c++) {
+        result[c] = x * mat[c] + y * mat[3 + c] + z * mat[6 + c];
+        if (si == 0) {
+          result[c] = result[c] + mat[9 + c];
+        }
+      }
+
+      targets[si][vi] = {result[0], result[1], result[2]};
+    }
+  }
+}
+
+#endif
+
+// Refreshes the bone palette and the lane ranges to skin, returns false for models without bones
+static bool m2_skin_prepare(ModelInstance *instance, bool allSubmeshes)
+{
+  M2Model *model = instance->model;
+  if (model->bonesCount == 0) {
+    instance->rangesCount = 0;
+    return false;
+  }
+
+  for (uint32_t i = 0; i < model->bonesCount; i++) {
+    memcpy(&instance->palette[i * M2_SKIN_PALETTE_STRIDE], &instance->boneMatrices[i], sizeof(Mat34));
+    memcpy(&instance->palette[i * M2_SKIN_PALETTE_STRIDE + 12], &instance->boneNormalMatrices[i], sizeof(Mat34));
+  }
+
+  instance->rangesCount = m2_skin_ranges(instance, allSubmeshes);
+  return true;
+}
+
+void m2_animate_vertices(ModelInstance *instance, bool allSubmeshes = false)
+{
+  m2_select_view(instance);
+  if (!m2_skin_prepare(instance, allSubmeshes)) {
+    return;
+  }
+
+  for (uint32_t ri = 0; ri < instance->rangesCount; ri++) {
+    for (uint32_t lane = instance->ranges[ri].start; lane < instance->ranges[ri].end; lane++) {
+      m2_skin_lanes(instance, lane * MODEL_SKIN_LANES);
+    }
+  }
+}
+
+#define M2_SKIN_JOB_LANES 64 // 512 vertices
+#define M2_POSE_MAX_JOBS 256
+
+typedef struct M2PoseJob {
+  M2Pose *pose;
+  uint32_t start; // Lanes to skin
+  uint32_t end;
+} M2PoseJob;
+
+static WORK_QUEUE_CALLBACK(m2_pose_skeleton_job)
+{
+  M2Pose *pose = ((M2PoseJob *) data)->pose;
+  m2_calc_bones(pose->instance, pose->layers, pose->layersCount, pose->globalFrame);
+  m2_skin_prepare(pose->instance, pose->skinAll);
+}
+
+static WORK_QUEUE_CALLBACK(m2_pose_skin_job)
+{
+  M2PoseJob *job = (M2PoseJob *) data;
+  for (uint32_t lane = job->start; lane < job->end; lane++) {
+    m2_skin_lanes(job->pose->instance, lane * MODEL_SKIN_LANES);
+  }
+}
+
+// Runs the job right away without a queue
+static void m2_pose_job_add(PlatformAPI *api, PlatformWorkQueue *queue, WorkQueueBatch *batch, WorkQueueCallback *callback, M2PoseJob *job)
+{
+  if (queue) {
+    api->work_queue_add(queue, batch, callback, job);
+  } else {
+    callback(job);
+  }
+}
+
+static void m2_pose_jobs_complete(PlatformAPI *api, PlatformWorkQueue *queue, WorkQueueBatch *batch)
+{
+  if (queue) {
+    api->work_queue_complete(queue, batch);
+  }
+}
+
+// Evaluates the skeletons in parallel, a single one inline, then skins their vertex ranges in chunks
+// across the queue, or serially without a queue. Every lane is computed exactly as in the serial path.
+// Instances have to be distinct, their models may be shared.
+void m2_pose_models(PlatformAPI *api, PlatformWorkQueue *queue, M2Pose *poses, uint32_t posesCount)
+{
+  M2PoseJob jobs[M2_POSE_MAX_JOBS];
+  uint32_t jobsCount = 0;
+  WorkQueueBatch batch = {}; // The queue may be busy with other work, only this is waited for
+  PlatformWorkQueue *skeletonQueue = posesCount > 1 ? queue : NULL; // A single skeleton has nothing to overlap with
+
+  // Views follow the screen radius of the last frame drawn
+  for (uint32_t pi = 0; pi < posesCount; pi++) {
+    m2_select_view(poses[pi].instance);
+  }
+
+  for (uint32_t pi = 0; pi < posesCount; pi++) {
+    if (poses[pi].skipBones) {
+      continue;
+    }
+
+    jobs[jobsCount] = {&poses[pi], 0, 0};
+    m2_pose_job_add(api, skeletonQueue, &batch, &m2_pose_skeleton_job, &jobs[jobsCount++]);
+
+    if (jobsCount == M2_POSE_MAX_JOBS) {
+      m2_pose_jobs_complete(api, skeletonQueue, &batch);
+      jobsCount = 0;
+    }
+  }
+
+  m2_pose_jobs_complete(api, skeletonQueue, &batch);
+  jobsCount = 0;
+
+  // Shared bone matrices are complete only now
+  for (uint32_t pi = 0; pi < posesCount; pi++) {
+    if (poses[pi].skipBones && !poses[pi].skipSkinning) {
+      m2_skin_prepare(poses[pi].instance, false);
+    }
+  }
+
+  for (uint32_t pi = 0; pi < posesCount; pi++) {
+    ModelInstance *instance = poses[pi].instance;
+    if (poses[pi].skipSkinning) {
+      continue;
+    }
+
+    for (uint32_t ri = 0; ri < instance->rangesCount; ri++) {
+      for (uint32_t lane = instance->ranges[ri].start; lane < instance->ranges[ri].end; lane += M2_SKIN_JOB_LANES) {
+        jobs[jobsCount] = {&poses[pi], lane, MIN(lane + M2_SKIN_JOB_LANES, instance->ranges[ri].end)};
+        m2_pose_job_add(api, queue, &batch, &m2_pose_skin_job, &jobs[jobsCount++]);
+
+        if (jobsCount == M2_POSE_MAX_JOBS) {
+          m2_pose_jobs_complete(api, queue, &batch);
+          jobsCount = 0;
+        }
+      }
+    }
+  }
+
+  m2_pose_jobs_complete(api, queue, &batch);
+}
+
+void m2_pose_cache_init(M2PoseCache *cache, MemoryAllocator *allocator, uint32_t entriesCount, uint32_t maxBones, uint32_t maxVertices)
+{
+  *cache = {};
+  cache->entriesCount = entriesCount;
+  cache->maxBones = maxBones;
+  cache->maxVertices = maxVertices;
+  cache->entries = ALLOCATE_MANY(allocator, M2PoseCacheEntry, entriesCount);
+
+  for (uint32_t i = 0; i < entriesCount; i++) {
+    M2PoseCacheEntry *entry = &cache->entries[i];
+    *entry = {};
+    entry->buffers.boneMatrices = ALLOCATE_MANY(allocator, Mat34, maxBones);
+    entry->buffers.boneNormalMatrices = ALLOCATE_MANY(allocator, Mat34, maxBones);
+    entry->buffers.positions = ALLOCATE_MANY(allocator, Vec3f, maxVertices);
+    entry->buffers.normals = ALLOCATE_MANY(allocator, Vec3f, maxVertices);
+    entry->buffers.tangents = ALLOCATE_MANY(allocator, Vec3f, maxVertices);
+    entry->buffers.bitangents = ALLOCATE_MANY(allocator, Vec3f, maxVertices);
+  }
+}
+
+// Required after changing cacheVertices, entries filled before hold bone matrices only
+void m2_pose_cache_clear(M2PoseCache *cache)
+{
+  for (uint32_t i = 0; i < cache->entriesCount; i++) {
+    cache->entries[i].valid = false;
+  }
+}
+
+static inline bool m2_pose_cache_key_equals(M2PoseCacheKey a, M2PoseCacheKey b)
+{
+  return a.model == b.model && a.animId == b.animId && a.frame == b.frame && a.globalFrame == b.globalFrame;
+}
+
+// Points the poses at cache entries before m2_pose_models. Hits skip evaluation, misses fill the least
+// recently used entry. Without a cache the instances get their own buffers back.
+// Every pose of an instance that ever used the cache has to go through here.
+void m2_pose_cache_apply(M2PoseCache *cache, M2Pose *poses, uint32_t posesCount)
+{
+  if (cache) {
+    cache->clock++;
+  }
+
+  for (uint32_t pi = 0; pi < posesCount; pi++) {
+    M2Pose *pose = &poses[pi];
+    ModelInstance *instance = pose->instance;
+    M2Model *model = instance->model;
+
+    pose->skipBones = false;
+    pose->skipSkinning = false;
+    pose->skinAll = false;
+    m2_instance_use_buffers(instance, &instance->own, &instance->own);
+
+    if (cache == NULL) {
+      continue;
+    }
+
+    if (pose->layersCount != 1 || pose->layers[0].boneset != NULL ||
+        model->bonesCount > cache->maxBones || model->verticesCount > cache->maxVertices) {
+      cache->bypasses++;
+      continue;
+    }
+
+    // Frames snap down from the animation start so they stay inside it
+    uint32_t animId = pose->layers[0].animId;
+    uint32_t start = animId < model->animationsCount ? model->animations[animId].startFrame : 0;
+    uint32_t frame = pose->layers[0].frame;
+    if (frame >= start) {
+      frame -= (frame - start) % M2_POSE_CACHE_FRAME_STEP;
+    }
+
+    M2PoseCacheKey key = {model, animId, frame, pose->globalFrame - pose->globalFrame % M2_POSE_CACHE_FRAME_STEP};
+    pose->layers[0].frame = key.frame;
+    pose->globalFrame = key.globalFrame;
+
+    M2PoseCacheEntry *found = NULL;
+    M2PoseCacheEntry *victim = NULL;
+    for (uint32_t ei = 0; ei < cache->entriesCount; ei++) {
+      M2PoseCacheEntry *entry = &cache->entries[ei];
+      if (entry->valid && m2_pose_cache_key_equals(entry->key, key)) {
+        found = entry;
+        break;
+      }
+
+      if (!entry->valid) {
+        if (victim == NULL || victim->valid) {
+          victim = entry;
+        }
+      } else if (entry->lastUse < cache->clock && (victim == NULL || (victim->valid && entry->lastUse < victim->lastUse))) {
+        victim = entry;
+      }
+    }
+
+    ModelPoseBuffers *vertices = cache->cacheVertices ? NULL : &instance->own;
+
+    if (found) {
+      cache->hits++;
+      found->lastUse = cache->clock;
+      m2_instance_use_buffers(instance, &found->buffers, vertices ? vertices : &found->buffers);
+
+      for (uint32_t i = 0; i < model->bonesCount; i++) {
+        instance->boneLayers[i] = 0;
+      }
+
+      pose->skipBones = true;
+      pose->skipSkinning = cache->cacheVertices;
+      if (pose->skipSkinning) {
+        instance->rangesCount = 0;
+      }
+      continue;
+    }
+
+    if (victim == NULL) {
+      cache->bypasses++; // Every entry is taken by this batch
+      continue;
+    }
+
+    if (victim->valid) {
+      cache->evictions++;
+    }
+
+    cache->misses++;
+    victim->key = key;
+    victim->valid = true;
+    victim->lastUse = cache->clock;
+    m2_instance_use_buffers(instance, &victim->buffers, vertices ? vertices : &victim->buffers);
+    pose->skinAll = cache->cacheVertices;
+  }
+}
+
+static inline uint32_t m2_baked_sample_frame(M2BakedAnimation *baked, uint32_t sample)
+{
+  return MIN(baked->startFrame + sample * baked->frameStep, baked->endFrame);
+}
+
+// Poses the instance at a sample, every submesh is skinned so the bake serves any geoset mask
+static void m2_bake_sample(M2BakedAnimation *baked, ModelInstance *instance, uint32_t sample)
+{
+  uint32_t frame = m2_baked_sample_frame(baked, sample);
+  ModelAnimationLayer layer = {NULL, baked->animId, frame};
+  m2_calc_bones(instance, &layer, 1, frame);
+  m2_animate_vertices(instance, true);
+}
+
+// Widens the range bounds by the values, min and max are kept in min and scale until m2_bake_range_finish
+static void m2_bake_range_add(ModelQuantization *range, float *values, uint32_t componentsCount)
+{
+  for (uint32_t i = 0; i < componentsCount; i++) {
+    range->min[i % 3] = MIN(range->min[i % 3], values[i]);
+    range->scale[i % 3] = MAX(range->scale[i % 3], values[i]);
+  }
+}
+
+static void m2_bake_range_finish(ModelQuantization *range)
+{
+  for (uint32_t c = 0; c < 3; c++) {
+    float max = range->scale[c];
+    range->scale[c] = max > range->min[c] ? (max - range->min[c]) / 65535.0f : 1.0f;
+  }
+}
+
+// Samples an animation with the instance, which is left posed at the last sample. Global sequences play
+// along with the animation. Returns NULL when the arena can't hold the samples.
+M2BakedAnimation *m2_bake_animation(MemoryArena *arena, ModelInstance *instance, uint32_t animId, uint32_t frameStep)
+{
+  M2Model *model = instance->model;
+  if (animId >= model->animationsCount || model->bonesCount == 0 || model->verticesCount == 0 || frameStep == 0) {
+    return NULL;
+  }
+
+  ModelAnimation *anim = &model->animations[animId];
+  uint32_t framesCount = (anim->endFrame - anim->startFrame + frameStep - 1) / frameStep + 1;
+  size_t bonesSize = sizeof(Mat34) * framesCount * model->bonesCount;
+  size_t streamSize = sizeof(uint16_t) * 3 * framesCount * model->verticesCount;
+  if (arena->taken + sizeof(M2BakedAnimation) + bonesSize + 2 * streamSize > arena->total_size) {
+    return NULL;
+  }
+
+  M2BakedAnimation *baked = (M2BakedAnimation *) arena->allocate(sizeof(M2BakedAnimation));
+  *baked = {};
+  baked->model = model;
+  baked->animId = animId;
+  baked->startFrame = anim->startFrame;
+  baked->endFrame = anim->endFrame;
+  baked->frameStep = frameStep;
+  baked->framesCount = framesCount;
+  baked->boneMatrices = bonesSize ? (Mat34 *) arena->allocate(bonesSize) : NULL;
+  baked->positions = (uint16_t *) arena->allocate(streamSize);
+  baked->normals = (uint16_t *) arena->allocate(streamSize);
+  baked->size = bonesSize + 2 * streamSize;
+
+  m2_instance_use_buffers(instance, &instance->own, &instance->own);
+
+  // Attributes as flat float arrays, three per vertex
+  float *animatedPositions = (float *) instance->animatedPositions;
+  float *animatedNormals = (float *) instance->animatedNormals;
+  uint32_t componentsCount = model->verticesCount * 3;
+
+  // First pass finds the ranges over the whole animation, the second one quantizes against them
+  for (uint32_t c = 0; c < 3; c++) {
+    baked->positionsRange.min[c] = baked->normalsRange.min[c] = FLT_MAX;
+    baked->positionsRange.scale[c] = baked->normalsRange.scale[c] = -FLT_MAX;
+  }
+
+  for (uint32_t fi = 0; fi < framesCount; fi++) {
+    m2_bake_sample(baked, instance, fi);
+    m2_bake_range_add(&baked->positionsRange, animatedPositions, componentsCount);
+    m2_bake_range_add(&baked->normalsRange, animatedNormals, componentsCount);
+  }
+
+  m2_bake_range_finish(&baked->positionsRange);
+  m2_bake_range_finish(&baked->normalsRange);
+
+  for (uint32_t fi = 0; fi < framesCount; fi++) {
+    m2_bake_sample(baked, instance, fi);
+    memcpy(&baked->boneMatrices[fi * model->bonesCount], instance->boneMatrices, sizeof(Mat34) * model->bonesCount);
+
+    uint16_t *positions = &baked->positions[fi * componentsCount];
+    uint16_t *normals = &baked->normals[fi * componentsCount];
+    for (uint32_t i = 0; i < componentsCount; i++) {
+      positions[i] = m2_quantize(&baked->positionsRange, i % 3, animatedPositions[i]);
+      normals[i] = m2_quantize(&baked->normalsRange, i % 3, animatedNormals[i]);
+      float error = fabsf(m2_dequantize(&baked->positionsRange, i % 3, positions[i]) - animatedPositions[i]);
+      baked->maxError = MAX(baked->maxError, error);
+    }
+  }
+
+  return baked;
+}
+
+// Decodes the two samples around the frame and interpolates them into the instance's positions, normals
+// and bone matrices. Tangents and bitangents are left as they are.
+void m2_baked_pose(M2BakedAnimation *baked, ModelInstance *instance, uint32_t frame)
+{
+  M2Model *model = baked->model;
+  ASSERT(instance->model == model);
+
+  m2_instance_use_buffers(instance, &instance->own, &instance->own);
+  m2_select_view(instance); // Every vertex is decoded, any view can be drawn
+
+  frame = CLAMP(frame, baked->startFrame, baked->endFrame);
+  uint32_t s0 = (frame - baked->startFrame) / baked->frameStep;
+  uint32_t s1 = MIN(s0 + 1, baked->framesCount - 1);
+  uint32_t f0 = m2_baked_sample_frame(baked, s0);
+  uint32_t f1 = m2_baked_sample_frame(baked, s1);
+  float t = f1 > f0 ? (float) (frame - f0) / (float) (f1 - f0) : 0.0f;
+
+  Mat34 *bones0 = &baked->boneMatrices[s0 * model->bonesCount];
+  Mat34 *bones1 = &baked->boneMatrices[s1 * model->bonesCount];
+  for (uint32_t bi = 0; bi < model->bonesCount; bi++) {
+    float *a = &bones0[bi].el[0][0];
+    float *b = &bones1[bi].el[0][0];
+    float *r = &instance->boneMatrices[bi].el[0][0];
+    for (uint32_t i = 0; i < 12; i++) {
+      r[i] = a[i] + (b[i] - a[i]) * t;
+    }
+    instance->boneLayers[bi] = 0;
+  }
 
-      model->animatedPositions[vi] = pos;
-      model->animatedNormals[vi] = normal;
+  uint32_t componentsCount = model->verticesCount * 3;
+  uint16_t *positions0 = &baked->positions[s0 * componentsCount];
+  uint16_t *positions1 = &baked->positions[s1 * componentsCount];
+  uint16_t *normals0 = &baked->normals[s0 * componentsCount];
+  uint16_t *normals1 = &baked->normals[s1 * componentsCount];
+
+  float *animatedPositions = (float *) instance->animatedPositions;
+  float *animatedNormals = (float *) instance->animatedNormals;
+  ModelQuantization *pr = &baked->positionsRange;
+  ModelQuantization *nr = &baked->normalsRange;
+
+  for (uint32_t vi = 0; vi < componentsCount; vi += 3) {
+    for (uint32_t c = 0; c < 3; c++) {
+      uint32_t i = vi + c;
+      float p = positions0[i] + ((float) positions1[i] - positions0[i]) * t;
+      float n = normals0[i] + ((float) normals1[i] - normals0[i]) * t;
+      animatedPositions[i] = pr->min[c] + p * pr->scale[c];
+      animatedNormals[i] = nr->min[c] + n * nr->scale[c];
     }
   }
 }
@@ -178,7 +178,6 @@ typedef struct ModelSubmesh {
   uint32_t facesCount;
   uint32_t verticesStart;
   uint32_t verticesCount;
-  bool enabled;
 } ModelPart;
 
 typedef struct ModelAnimationRange {
@@ -203,6 +202,13 @@ typedef struct ModelAnimationData {
   void *data;
 } ModelAnimationData;
 
+typedef enum M2KeyframeSearch {
+  M2_KEYFRAME_SEARCH_LINEAR, // Reference scan from the range start
+  M2_KEYFRAME_SEARCH_BINARY,
+  M2_KEYFRAME_SEARCH_CURSOR, // Checks the instance's cursor and its successor before a binary search
+  M2_KEYFRAME_SEARCH_COUNT
+} M2KeyframeSearch;
+
 typedef enum ModelTextureType {
   MTT_INLINE = 0,
   MTT_SKIN,
@@ -217,7 +223,6 @@ typedef enum ModelTextureType {
 typedef struct ModelTexture {
   uint32_t type;
   char *name; // for MTT_INLINE only
-  Texture *texture;
 } ModelTexture;
 
 typedef struct M2Attachment {
@@ -234,13 +239,13 @@ typedef struct ModelBone {
   ModelAnimationData translations;
   ModelAnimationData rotations;
   ModelAnimationData scalings;
-  Mat44 matrix;
-  Mat44 normal_matrix;
-  bool calculated;
+  bool globalAnimated; // Has tracks driven by global sequences
+  uint32_t *animated; // Bit per animation with keyframes on any track, bones without them only inherit the parent transform
 } ModelBone;
 
+// Vertex indices come from 16 bit lookups in the file, so they always fit
 typedef struct M2Face {
-  uint32_t indices[3];
+  uint16_t indices[3];
 } M2Face;
 
 typedef struct ModelAnimation {
@@ -250,30 +255,71 @@ typedef struct ModelAnimation {
   float speed;
 } ModelAnimation;
 
-typedef struct ModelVertexWeight {
-  uint32_t bone;
-  float weight;
-} ModelVertexWeight;
+// Components quantized to 16 bits decode as min + q * scale
+typedef struct ModelQuantization {
+  float min[3];
+  float scale[3];
+} ModelQuantization;
+
+#if defined(__ARCH_X86__) && defined(__AVX2__)
+  #define MODEL_SKIN_AVX2 1
+#endif
+
+#define MODEL_SKIN_LANES 8
+
+typedef struct ModelSkinRange {
+  uint32_t start; // In whole lanes
+  uint32_t end;
+} ModelSkinRange;
+
+// Bind pose in SoA layout for the skinning kernel, padded to whole lanes with weightless vertices.
+// Positions are quantized against the model bounds, directions are octahedral encoded and decode
+// unnormalized since every consumer normalizes them anyway.
+typedef struct ModelSkin {
+  uint32_t count;
+  uint16_t *positions[3];
+  int16_t *normals[2];
+  int16_t *tangents[2];
+  int16_t *bitangents[2];
+  uint32_t *bones; // Four 8 bit influencing bone indices, unused influences have zero weight
+  uint32_t *weights; // Four 8 bit weights out of 255
+} ModelSkin;
+
+#define M2_NO_GEOSET UINT32_MAX
+
+// One skin profile, later views draw the same vertices with fewer faces. Vertex spans of submeshes index the
+// model's vertices and geosets map each submesh to the full detail submesh with the same id.
+typedef struct ModelView {
+  uint32_t facesCount;
+  M2Face *faces;
+  uint32_t submeshesCount;
+  ModelSubmesh *submeshes;
+  uint32_t *geosets; // M2_NO_GEOSET when the full detail view has no such submesh
+  uint32_t renderPassesCount;
+  M2RenderPass *renderPasses;
+} ModelView;
+
+#define M2_VIEW_LOD_RADIUS 160.0f // Screen radius in pixels the second view takes over below, halving for every further view
+#define M2_VIEW_LOD_HYSTERESIS 0.2f // Fraction of the boundary an instance has to cross before switching views
 
 typedef struct M2Model {
   uint32_t verticesCount;
-  uint32_t weightsPerVertex;
-  Vec3f *positions;
-  Vec3f *animatedPositions;
-  Vec3f *normals;
-  Vec3f *animatedNormals;
-  Vec3f *textureCoords;
+  ModelQuantization positionsRange;
+  ModelQuantization textureCoordsRange;
+  uint16_t *textureCoords; // u and v per vertex
   uint32_t texturesCount;
   ModelTexture *textures;
   uint32_t textureLookupsCount;
   uint32_t *textureLookups;
-  ModelVertexWeight *weights;
-  uint32_t facesCount;
-  M2Face *faces;
-  uint32_t submeshesCount;
+  ModelSkin skin;
+  uint32_t viewsCount;
+  ModelView *views; // Decreasing detail
+  uint32_t submeshesCount; // Submeshes of the first view, submeshesEnabled follows them
   ModelSubmesh *submeshes;
   uint32_t bonesCount;
   ModelBone *bones;
+  uint32_t *bonesOrder; // Parents always precede their children
+  M2KeyframeSearch keyframeSearch;
   uint32_t keybonesCount;
   int16_t *keybones;
   uint32_t animationLookupsCount;
@@ -282,15 +328,49 @@ typedef struct M2Model {
   ModelAnimation *animations;
   uint32_t renderFlagsCount;
   M2RenderFlag *renderFlags;
-  uint32_t renderPassesCount;
-  M2RenderPass *renderPasses;
   uint32_t attachmentsCount;
   M2Attachment *attachments;
   uint32_t attachmentLookupsCount;
   int16_t *attachmentLookups;
   float bounding_radius;
+  uint32_t orderedFacesCount; // Faces m2_optimize_faces reordered for the post-transform cache
+  uint32_t cacheMissesBefore; // Simulated cache misses over those faces, ACMR is misses per face
+  uint32_t cacheMissesAfter;
 } M2Model;
 
+#define M2_KEYFRAME_CURSORS 3 // Translation, rotation and scaling track per bone
+
+typedef struct ModelPoseBuffers {
+  Mat34 *boneMatrices;
+  Mat34 *boneNormalMatrices;
+  Vec3f *positions;
+  Vec3f *normals;
+  Vec3f *tangents;
+  Vec3f *bitangents;
+} ModelPoseBuffers;
+
+// Pose state of one placed model, the loaded model itself is shared and stays read-only.
+// Bone matrices and skinned attributes point either to the instance's own buffers or to a pose cache entry.
+typedef struct ModelInstance {
+  M2Model *model;
+  ModelPoseBuffers own;
+  Mat34 *boneMatrices;
+  Mat34 *boneNormalMatrices;
+  uint32_t *boneLayers; // Layer that posed the bone, M2_POSE_MAX_LAYERS if none did
+  uint32_t *cursors; // Keyframes found by the last lookups, playback mostly moves forward
+  bool *submeshesEnabled;
+  Texture **textures;
+  Vec3f *animatedPositions;
+  Vec3f *animatedNormals;
+  Vec3f *animatedTangents;
+  Vec3f *animatedBitangents;
+  float *palette; // Bone matrix and normal matrix per bone, refreshed every frame
+  ModelSkinRange *ranges;
+  uint32_t rangesCount;
+  uint32_t view; // Picked by m2_select_view before posing
+  float screenRadius; // Projected bounding radius in pixels, set by the renderer
+} ModelInstance;
+
 typedef enum M2Keybone {
   M2_KEYBONE_ARM_L = 0,
   M2_KEYBONE_ARM_R,
@@ -325,6 +405,79 @@ typedef struct ModelBoneSet {
   uint32_t set[8];
 } BoneSet;
 
+// Earlier layers take precedence, a bone is posed by the first layer containing it or any of its descendants
+typedef struct ModelAnimationLayer {
+  ModelBoneSet *boneset; // NULL for all bones
+  uint32_t animId;
+  uint32_t frame;
+} ModelAnimationLayer;
+
+#define M2_POSE_MAX_LAYERS 4
+
+// Skeleton posed and skinned by m2_pose_models
+typedef struct M2Pose {
+  ModelInstance *instance;
+  ModelAnimationLayer layers[M2_POSE_MAX_LAYERS];
+  uint32_t layersCount;
+  uint32_t globalFrame;
+
+  // Set by m2_pose_cache_apply
+  bool skipBones; // Bone matrices are shared from a cache entry another pose fills
+  bool skipSkinning; // So are the skinned attributes
+  bool skinAll; // Fills an entry shared with instances that may enable other submeshes
+} M2Pose;
+
+#define M2_POSE_CACHE_FRAME_STEP 33 // Cached poses are evaluated at frames quantized to this step
+
+typedef struct M2PoseCacheKey {
+  M2Model *model;
+  uint32_t animId;
+  uint32_t frame;
+  uint32_t globalFrame;
+} M2PoseCacheKey;
+
+typedef struct M2PoseCacheEntry {
+  M2PoseCacheKey key;
+  bool valid;
+  uint64_t lastUse;
+  ModelPoseBuffers buffers;
+} M2PoseCacheEntry;
+
+// Poses shared by instances playing the same animation frame, least recently used entries are replaced.
+// Only single layer poses are cached, entries have a fixed capacity and bigger models bypass the cache.
+typedef struct M2PoseCache {
+  M2PoseCacheEntry *entries;
+  uint32_t entriesCount;
+  uint32_t maxBones;
+  uint32_t maxVertices;
+  bool cacheVertices; // Otherwise hits share bone matrices only and skin their own vertices
+  uint64_t clock; // Advanced by every m2_pose_cache_apply, entries used in the current batch are never evicted
+  uint32_t hits;
+  uint32_t misses;
+  uint32_t evictions;
+  uint32_t bypasses;
+} M2PoseCache;
+
+#define M2_BAKE_FRAME_STEP 33 // Roughly 30 samples per second
+
+// Skinned positions and normals of one animation sampled at a fixed rate, quantized to 16 bits against
+// their range over the whole animation. Bone matrices are kept as floats for attachments.
+typedef struct M2BakedAnimation {
+  M2Model *model;
+  uint32_t animId;
+  uint32_t startFrame;
+  uint32_t endFrame;
+  uint32_t frameStep;
+  uint32_t framesCount; // The last sample is at the end frame
+  ModelQuantization positionsRange;
+  ModelQuantization normalsRange;
+  Mat34 *boneMatrices; // framesCount * bonesCount
+  uint16_t *positions; // framesCount * verticesCount * 3
+  uint16_t *normals;
+  size_t size; // Bytes of the sampled data
+  float maxError; // Largest position error of the quantization
+} M2BakedAnimation;
+
 typedef enum M2AttachmentType {
   M2_AT_RSHOULDER = 5,
   M2_AT_LSHOULDER,
@@ -335,3 +488,14 @@ typedef enum M2AttachmentType {
 #define MODEL_PBONESET_ISSET(PBS, IDX) ((PBS->set[IDX / 32] & (1 << (IDX % 32))) > 0)
 
 M2Model *m2_load(MemoryAllocator *allocator, void *bytes, size_t size);
+ModelInstance *m2_instance_create(MemoryArena *arena, M2Model *model);
+void m2_bind_pose(M2Model *model, Vec3f *positions, Vec3f *normals, Vec3f *tangents, Vec3f *bitangents);
+Vec3f m2_texture_coords(M2Model *model, uint32_t vertex);
+uint32_t m2_view_for_radius(M2Model *model, uint32_t view, float radius);
+void m2_select_view(ModelInstance *instance);
+bool m2_view_submesh_enabled(ModelInstance *instance, ModelView *view, uint32_t submesh);
+void m2_pose_cache_init(M2PoseCache *cache, MemoryAllocator *allocator, uint32_t entriesCount, uint32_t maxBones, uint32_t maxVertices);
+void m2_pose_cache_clear(M2PoseCache *cache);
+void m2_pose_cache_apply(M2PoseCache *cache, M2Pose *poses, uint32_t posesCount);
+M2BakedAnimation *m2_bake_animation(MemoryArena *arena, ModelInstance *instance, uint32_t animId, uint32_t frameStep);
+void m2_baked_pose(M2BakedAnimation *baked, ModelInstance *instance, uint32_t frame);
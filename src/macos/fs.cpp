@@ -2,6 +2,7 @@
 #include <sys/stat.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <sys/mman.h>
 
 #include "fs.h"
 
@@ -63,7 +64,7 @@ int32_t macos_fs_read(char *filename, void *memory, uint32_t size)
 int32_t macos_file_open(MacosOpenFile *file, char *filename)
 {
   int fd = open(filename, O_RDONLY);
-  if (!fd) {
+  if (fd < 0) {
     // TODO: Handle fopen failure
     return -1;
   }
@@ -98,6 +99,31 @@ int32_t macos_file_read(MacosOpenFile *file, void *dst, uint32_t offset, uint32_
   return total_read;
 }
 
+void *macos_file_map(MacosOpenFile *file, size_t *size)
+{
+  struct stat stbuf;
+  if ((fstat(file->fd, &stbuf) != 0) || (!S_ISREG(stbuf.st_mode)) || stbuf.st_size == 0) {
+    return NULL;
+  }
+
+  void *result = mmap(NULL, stbuf.st_size, PROT_READ, MAP_PRIVATE, file->fd, 0);
+  if (result == MAP_FAILED) {
+    return NULL;
+  }
+
+  *size = stbuf.st_size;
+  return result;
+}
+
+void macos_file_close(MacosOpenFile *file, void *mapping, size_t size)
+{
+  if (mapping != NULL) {
+    munmap(mapping, size);
+  }
+
+  close(file->fd);
+}
+
 static MacosDirectoryListingEntry directory_listing_entry;
 
 bool macos_directory_listing_begin(MacosDirectoryListingIter *iter, char *directory)
@@ -342,9 +342,12 @@ static DrawFrameFunc draw_frame = NULL;
 static bool shouldReloadDylib = false;
 static void *dylibHandle = NULL;
 
+C_LINKAGE void macos_work_queues_complete_all();
+
 static void load_dylib(char *path)
 {
   if (dylibHandle) {
+    macos_work_queues_complete_all();
     dlclose(dylibHandle);
     draw_frame = NULL;
   }
@@ -397,6 +400,11 @@ C_LINKAGE void macos_terminate()
   gameRunning = false;
 }
 
+C_LINKAGE double macos_get_time()
+{
+  return mach_time_in_seconds(mach_absolute_time());
+}
+
 static void update_fps(float frameMs, float fps)
 {
   char buf[255];
@@ -489,7 +497,8 @@ int main(int argc, char *argv[])
 
     if (draw_frame) {
       draw_frame(&state, &drawing_buffer, lastFrameTotal);
-      glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, WIDTH, HEIGHT, GL_RGBA, GL_UNSIGNED_BYTE, framePixelData);
+      // Module may point the buffer to pixels of its own
+      glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, WIDTH, HEIGHT, GL_RGBA, GL_UNSIGNED_BYTE, drawing_buffer.pixels);
     }
 
     DEBUG_DrawScene();
@@ -2,10 +2,12 @@
 
 #include "macos/fs.cpp"
 #include "platform/mpq.cpp"
+#include "macos/threads.cpp"
 
 C_LINKAGE void *macos_allocate_memory(size_t size);
 C_LINKAGE void *macos_free_memory(void *memory);
 C_LINKAGE void macos_terminate();
+C_LINKAGE double macos_get_time();
 
 MPQFileId macos_get_asset_id(char *name);
 MPQFile macos_load_asset(char *name);
@@ -22,9 +24,15 @@ PlatformAPI PLATFORM_API = {
   (ReleaseAssetFunc) macos_release_asset,
   (FileOpenFunc) macos_file_open,
   (FileReadFunc) macos_file_read,
+  (FileMapFunc) macos_file_map,
+  (FileCloseFunc) macos_file_close,
   (DirectoryListingBeginFunc) macos_directory_listing_begin,
   (DirectoryListingNextEntryFunc) macos_directory_listing_next_entry,
-  (DirectoryListingEndFunc) macos_directory_listing_end
+  (DirectoryListingEndFunc) macos_directory_listing_end,
+  (GetTimeFunc) macos_get_time,
+  (WorkQueueCreateFunc) macos_work_queue_create,
+  (WorkQueueAddFunc) macos_work_queue_add,
+  (WorkQueueCompleteFunc) macos_work_queue_complete
 };
 
 MPQFileId macos_get_asset_id(char *name)
@@ -34,16 +42,6 @@ MPQFileId macos_get_asset_id(char *name)
 
 MPQFile macos_load_asset(char *name)
 {
-  int32_t size = macos_fs_size(name);
-  if (size >= 0) {
-    MPQFile result = {};
-    result.id = mpq_file_id(name);
-    result.data = macos_allocate_memory(size);
-    result.size = size;
-    macos_fs_read(name, result.data, size);
-    return result;
-  }
-
   return mpq_load_file(&MPQ_REGISTRY, name);
 }
 
@@ -0,0 +1,162 @@
+#include <pthread.h>
+#include <unistd.h>
+
+#define WORK_QUEUE_MAX_ENTRIES 1024
+#define WORK_QUEUE_MAX_THREADS 16
+#define MAX_WORK_QUEUES 8
+
+typedef struct WorkQueueEntry {
+  WorkQueueCallback *callback; // NULL once taken out of order by a batch's completion
+  WorkQueueBatch *batch;
+  void *data;
+} WorkQueueEntry;
+
+struct PlatformWorkQueue {
+  pthread_mutex_t mutex;
+  pthread_cond_t work_added;
+  pthread_cond_t work_done;
+
+  WorkQueueEntry entries[WORK_QUEUE_MAX_ENTRIES];
+  uint32_t read;
+  uint32_t write;
+  uint32_t pending; // Added and not finished yet
+
+  uint32_t threads_count;
+  pthread_t threads[WORK_QUEUE_MAX_THREADS];
+};
+
+static PlatformWorkQueue *macos_work_queues[MAX_WORK_QUEUES];
+static uint32_t macos_work_queues_count = 0;
+static PlatformWorkQueue *macos_shared_work_queue = NULL; // The WORK_QUEUE_THREADS_AUTO pool
+
+// Has to be called with the mutex locked, it's unlocked while the callback runs.
+// Takes the oldest entry of the batch, or the oldest one at all for a NULL batch.
+static bool macos_work_queue_run_next(PlatformWorkQueue *queue, WorkQueueBatch *batch)
+{
+  while (queue->read != queue->write && queue->entries[queue->read % WORK_QUEUE_MAX_ENTRIES].callback == NULL) {
+    queue->read++;
+  }
+
+  WorkQueueEntry *found = NULL;
+  for (uint32_t i = queue->read; i != queue->write; i++) {
+    WorkQueueEntry *entry = &queue->entries[i % WORK_QUEUE_MAX_ENTRIES];
+    if (entry->callback != NULL && (batch == NULL || entry->batch == batch)) {
+      found = entry;
+      break;
+    }
+  }
+
+  if (found == NULL) {
+    return false;
+  }
+
+  WorkQueueEntry entry = *found;
+  found->callback = NULL;
+
+  pthread_mutex_unlock(&queue->mutex);
+  entry.callback(entry.data);
+  pthread_mutex_lock(&queue->mutex);
+
+  queue->pending--;
+  if (entry.batch != NULL) {
+    entry.batch->pending--;
+  }
+
+  // Waiters check their own batch, adders whether there's room
+  pthread_cond_broadcast(&queue->work_done);
+
+  return true;
+}
+
+static void *macos_work_queue_thread(void *data)
+{
+  PlatformWorkQueue *queue = (PlatformWorkQueue *) data;
+
+  pthread_mutex_lock(&queue->mutex);
+  for (;;) {
+    if (!macos_work_queue_run_next(queue, NULL)) {
+      pthread_cond_wait(&queue->work_added, &queue->mutex);
+    }
+  }
+
+  return NULL;
+}
+
+C_LINKAGE PlatformWorkQueue *macos_work_queue_create(uint32_t threads_count)
+{
+  // Pools sized for every core are shared, separate ones would oversubscribe the cores
+  bool shared = threads_count == WORK_QUEUE_THREADS_AUTO;
+  if (shared && macos_shared_work_queue != NULL) {
+    return macos_shared_work_queue;
+  }
+
+  if (macos_work_queues_count >= MAX_WORK_QUEUES) {
+    return NULL;
+  }
+
+  if (shared) {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    threads_count = cores > 1 ? (uint32_t) cores - 1 : 1;
+  }
+
+  PlatformWorkQueue *queue = (PlatformWorkQueue *) calloc(1, sizeof(PlatformWorkQueue));
+  pthread_mutex_init(&queue->mutex, NULL);
+  pthread_cond_init(&queue->work_added, NULL);
+  pthread_cond_init(&queue->work_done, NULL);
+
+  queue->threads_count = threads_count < WORK_QUEUE_MAX_THREADS ? threads_count : WORK_QUEUE_MAX_THREADS;
+  for (uint32_t i = 0; i < queue->threads_count; i++) {
+    pthread_create(&queue->threads[i], NULL, &macos_work_queue_thread, queue);
+  }
+
+  macos_work_queues[macos_work_queues_count++] = queue;
+  if (shared) {
+    macos_shared_work_queue = queue;
+  }
+
+  return queue;
+}
+
+C_LINKAGE void macos_work_queue_add(PlatformWorkQueue *queue, WorkQueueBatch *batch, WorkQueueCallback *callback, void *data)
+{
+  pthread_mutex_lock(&queue->mutex);
+
+  // Queue is full, work on the batch here until there's room
+  while (queue->write - queue->read >= WORK_QUEUE_MAX_ENTRIES) {
+    if (!macos_work_queue_run_next(queue, batch) && queue->write - queue->read >= WORK_QUEUE_MAX_ENTRIES) {
+      pthread_cond_wait(&queue->work_done, &queue->mutex);
+    }
+  }
+
+  queue->entries[queue->write % WORK_QUEUE_MAX_ENTRIES] = {callback, batch, data};
+  queue->write++;
+  queue->pending++;
+  if (batch != NULL) {
+    batch->pending++;
+  }
+
+  pthread_cond_signal(&queue->work_added);
+  pthread_mutex_unlock(&queue->mutex);
+}
+
+C_LINKAGE void macos_work_queue_complete(PlatformWorkQueue *queue, WorkQueueBatch *batch)
+{
+  pthread_mutex_lock(&queue->mutex);
+
+  // Calling thread takes entries of the batch too instead of only waiting, work of others is left alone
+  while ((batch != NULL ? batch->pending : queue->pending) > 0) {
+    if (!macos_work_queue_run_next(queue, batch)) {
+      pthread_cond_wait(&queue->work_done, &queue->mutex);
+    }
+  }
+
+  pthread_mutex_unlock(&queue->mutex);
+}
+
+// Callbacks live in the module, they have to finish before it's unloaded
+C_LINKAGE void macos_work_queues_complete_all()
+{
+  for (uint32_t i = 0; i < macos_work_queues_count; i++) {
+    macos_work_queue_complete(macos_work_queues[i], NULL);
+  }
+}
@@ -6,6 +6,10 @@
   #define C_LINKAGE extern
 #endif
 
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+  #define __ARCH_X86__ 1
+#endif
+
 #ifdef DEBUG
   #define ASSERT(x) if (!(x)) { printf("Assertion at %s, line %d failed: %s\n", __FILE__, __LINE__, #x); *((uint32_t *)1) = 0xDEADCAFE; }
 #else
@@ -16,32 +16,71 @@
 #define MPQ_HASH_ENTRY_EMPTY 0xFFFFFFFF
 #define MPQ_HASH_ENTRY_DELETED 0xFFFFFFFE
 
-static uint32_t CRYPT_TABLE[0x500];
-MPQRegistry MPQ_REGISTRY = {0};
+// Block tables are only copied and decrypted once a file is loaded from the archive
+#ifndef MPQ_LAZY_BLOCK_TABLES
+#define MPQ_LAZY_BLOCK_TABLES 1
+#endif
+
+// Every loaded file is reported with its timings and file reads, the first one also with the time since startup
+#ifndef MPQ_LOAD_STATS
+#define MPQ_LOAD_STATS 0
+#endif
+
+// The crypt table is a walk of seed = (seed * 125 + 3) % 0x2AAAAB, two steps per entry.
+// Entries jump ahead to their step so the constexpr recursion stays shallow enough for C++11.
+#define MPQ_CRYPT_MODULUS 0x2AAAAB
+#define MPQ_CRYPT_SEED 0x00100001
+
+static constexpr uint64_t mpq_crypt_mul(uint64_t a, uint64_t b)
+{
+  return (a * b) % MPQ_CRYPT_MODULUS;
+}
 
-static void mpq_init_crypt_table()
+static constexpr uint64_t mpq_crypt_square(uint64_t a)
 {
-  uint32_t seed   = 0x00100001;
-  uint32_t index1 = 0;
-  uint32_t index2 = 0;
-  int i;
+  return mpq_crypt_mul(a, a);
+}
 
-  for (index1 = 0; index1 < 0x100; index1++) {
-    for (index2 = index1, i = 0; i < 5; i++, index2 += 0x100){
-      uint32_t temp1;
-      uint32_t temp2;
+// 125^n
+static constexpr uint64_t mpq_crypt_pow(uint32_t n)
+{
+  return n == 0 ? 1 : (n & 1) ? mpq_crypt_mul(mpq_crypt_pow(n - 1), 125) : mpq_crypt_square(mpq_crypt_pow(n / 2));
+}
 
-      seed  = (seed * 125 + 3) % 0x2AAAAB;
-      temp1 = (seed & 0xFFFF) << 0x10;
+// 1 + 125 + ... + 125^(n - 1)
+static constexpr uint64_t mpq_crypt_sum(uint32_t n)
+{
+  return n == 0 ? 0 : (n & 1) ? (1 + mpq_crypt_mul(mpq_crypt_sum(n - 1), 125)) % MPQ_CRYPT_MODULUS
+                              : mpq_crypt_mul(mpq_crypt_sum(n / 2), 1 + mpq_crypt_pow(n / 2));
+}
 
-      seed  = (seed * 125 + 3) % 0x2AAAAB;
-      temp2 = (seed & 0xFFFF);
+static constexpr uint32_t mpq_crypt_seed(uint32_t step)
+{
+  return (uint32_t) ((mpq_crypt_mul(mpq_crypt_pow(step), MPQ_CRYPT_SEED) + mpq_crypt_mul(mpq_crypt_sum(step), 3)) % MPQ_CRYPT_MODULUS);
+}
 
-      CRYPT_TABLE[index2] = (temp1 | temp2);
-    }
-  }
+// Entries were generated in runs of five spaced 0x100 apart
+static constexpr uint32_t mpq_crypt_entry_at(uint32_t pair)
+{
+  return ((mpq_crypt_seed(pair * 2 + 1) & 0xFFFF) << 0x10) | (mpq_crypt_seed(pair * 2 + 2) & 0xFFFF);
+}
+
+static constexpr uint32_t mpq_crypt_entry(uint32_t index)
+{
+  return mpq_crypt_entry_at((index & 0xFF) * 5 + (index >> 8));
 }
 
+#define MPQ_CRYPT_4(i) mpq_crypt_entry(i), mpq_crypt_entry(i + 1), mpq_crypt_entry(i + 2), mpq_crypt_entry(i + 3)
+#define MPQ_CRYPT_16(i) MPQ_CRYPT_4(i), MPQ_CRYPT_4(i + 4), MPQ_CRYPT_4(i + 8), MPQ_CRYPT_4(i + 12)
+#define MPQ_CRYPT_64(i) MPQ_CRYPT_16(i), MPQ_CRYPT_16(i + 16), MPQ_CRYPT_16(i + 32), MPQ_CRYPT_16(i + 48)
+#define MPQ_CRYPT_256(i) MPQ_CRYPT_64(i), MPQ_CRYPT_64(i + 64), MPQ_CRYPT_64(i + 128), MPQ_CRYPT_64(i + 192)
+
+static constexpr uint32_t CRYPT_TABLE[0x500] = {
+  MPQ_CRYPT_256(0x000), MPQ_CRYPT_256(0x100), MPQ_CRYPT_256(0x200), MPQ_CRYPT_256(0x300), MPQ_CRYPT_256(0x400)
+};
+
+MPQRegistry MPQ_REGISTRY = {0};
+
 static size_t string_length(char *string)
 {
   size_t result = 0;
@@ -75,7 +114,8 @@ static bool string_ends_with(char *string, char *what)
   return matched == what_len;
 }
 
-static bool mpq_archive_init(MPQArchive *archive, char *filename);
+static bool mpq_archive_init(MPQArchive *archive);
+static void mpq_index_build(MPQRegistry *registry);
 
 typedef int (* QSortCompareFunc)(const void *, const void *);
 
@@ -119,9 +159,21 @@ static int32_t string_equal_ni(char *a, char *b, size_t len)
   return 0;
 }
 
+typedef struct MPQOpenJob {
+  MPQArchive *archive;
+  bool ok;
+} MPQOpenJob;
+
+static WORK_QUEUE_CALLBACK(mpq_open_job)
+{
+  MPQOpenJob *job = (MPQOpenJob *) data;
+  job->ok = mpq_archive_init(job->archive);
+}
+
 void mpq_registry_init(MPQRegistry *registry, char *directory)
 {
-  mpq_init_crypt_table();
+  registry->start_time = PLATFORM_API.get_time();
+  registry->pool = PLATFORM_API.work_queue_create(WORK_QUEUE_THREADS_AUTO);
 
   DirectoryListingIter iter;
   DirectoryListingEntry *entry;
@@ -158,19 +210,52 @@ void mpq_registry_init(MPQRegistry *registry, char *directory)
       MPQArchive *archive = &registry->archives[registry->archives_count++];
       archive->priority = priority;
 
-      // TODO: Fix when opening file failed
-      mpq_archive_init(archive, buf);
+      uint32_t len = strlen(buf);
+      archive->filename = (char *) PLATFORM_API.allocate_memory(len + 1);
+      memcpy(archive->filename, buf, len + 1);
     }
   }
 
   PLATFORM_API.directory_listing_end(&iter);
 
+  // Archives are independent, each one reads and decrypts its own tables
+  MPQOpenJob jobs[MPQ_MAX_ARCHIVES] = {0};
+  WorkQueueBatch batch = {};
+  for (size_t i = 0; i < registry->archives_count; i++) {
+    jobs[i].archive = &registry->archives[i];
+    if (registry->pool != NULL) {
+      PLATFORM_API.work_queue_add(registry->pool, &batch, &mpq_open_job, &jobs[i]);
+    } else {
+      mpq_open_job(&jobs[i]);
+    }
+  }
+
+  if (registry->pool != NULL) {
+    PLATFORM_API.work_queue_complete(registry->pool, &batch);
+  }
+
+  size_t opened = 0;
+  for (size_t i = 0; i < registry->archives_count; i++) {
+    if (jobs[i].ok) {
+      registry->archives[opened++] = registry->archives[i];
+    } else {
+      printf("[WARN] Failed to open archive %s\n", registry->archives[i].filename);
+      PLATFORM_API.free_memory(registry->archives[i].filename);
+    }
+  }
+  registry->archives_count = opened;
+
   qsort(registry->archives, registry->archives_count, sizeof(MPQArchive), (QSortCompareFunc) _mpq_archive_compare);
 
   for (size_t i = 0; i < registry->archives_count; i++) {
     MPQArchive *archive = &registry->archives[i];
     printf("Archive %s: priority %u, size %u\n", archive->filename, archive->priority, archive->header.archive_size);
   }
+
+  mpq_index_build(registry);
+
+  printf("Registry: %u archives ready in %.2f ms\n", (uint32_t) registry->archives_count,
+         (PLATFORM_API.get_time() - registry->start_time) * 1000.0);
 }
 
 static void mpq_decrypt_data(void *data, size_t size, uint32_t key)
@@ -216,40 +301,94 @@ static uint32_t mpq_string_hash(char *string, uint32_t type)
   return seed1;
 }
 
-static bool mpq_archive_init(MPQArchive *archive, char *filename)
+// Each read is a seek and at least one read call
+static bool mpq_archive_read(MPQArchive *archive, void *dst, uint32_t offset, uint32_t bytes)
 {
-  PlatformFile file = {0};
-  if (PAPI_ERROR(PLATFORM_API.file_open(&file, filename))) {
+  archive->reads++;
+  return PLATFORM_API.file_read(&archive->file, dst, offset, bytes) == (int32_t) bytes;
+}
+
+// Tables are copied out of the mapping, they are decrypted in place
+static bool mpq_archive_copy(MPQArchive *archive, void *dst, uint32_t offset, uint32_t bytes)
+{
+  if (archive->mapping == NULL) {
+    return mpq_archive_read(archive, dst, offset, bytes);
+  }
+
+  if ((size_t) offset + bytes > archive->mapping_size) {
     return false;
   }
 
-  if (PAPI_ERROR(PLATFORM_API.file_read(&file, (void *) &archive->header, 0, sizeof(MPQHeader)))) {
+  memcpy(dst, archive->mapping + offset, bytes);
+  return true;
+}
+
+static bool mpq_archive_load_block_table(MPQArchive *archive)
+{
+  if (archive->block_table != NULL) {
+    return true;
+  }
+
+  size_t block_table_size = archive->header.block_table_size * sizeof(MPQBlockEntry);
+  MPQBlockEntry *block_table = (MPQBlockEntry *) PLATFORM_API.allocate_memory(block_table_size);
+  if (!mpq_archive_copy(archive, (void *) block_table, archive->header.block_table_offset, block_table_size)) {
+    PLATFORM_API.free_memory(block_table);
+    return false;
+  }
+
+  uint32_t btkey = mpq_string_hash((char *) "(block table)", MPQ_HASH_TYPE_FILE_KEY);
+  mpq_decrypt_data((void *) block_table, block_table_size, btkey);
+  archive->block_table = block_table;
+
+  return true;
+}
+
+// Releases everything mpq_archive_init acquired, the filename stays with the registry
+static void mpq_archive_close(MPQArchive *archive)
+{
+  PLATFORM_API.file_close(&archive->file, archive->mapping, archive->mapping_size);
+  PLATFORM_API.free_memory(archive->hash_table);
+  PLATFORM_API.free_memory(archive->block_table);
+  archive->mapping = NULL;
+  archive->hash_table = NULL;
+  archive->block_table = NULL;
+}
+
+// Safe to run on the pool, archives share nothing. Nothing is left open when it fails.
+static bool mpq_archive_init(MPQArchive *archive)
+{
+  PlatformFile file = {0};
+  if (PAPI_ERROR(PLATFORM_API.file_open(&file, archive->filename))) {
     return false;
   }
 
   archive->file = file;
+  archive->mapping = (uint8_t *) PLATFORM_API.file_map(&archive->file, &archive->mapping_size);
+  archive->reads = 0;
+  archive->hash_table = NULL;
+  archive->block_table = NULL;
 
-  uint32_t len = strlen(filename);
-  archive->filename = (char *) PLATFORM_API.allocate_memory(len + 1);
-  memcpy(archive->filename, filename, len);
+  if (!mpq_archive_copy(archive, (void *) &archive->header, 0, sizeof(MPQHeader))) {
+    mpq_archive_close(archive);
+    return false;
+  }
 
   size_t hash_table_size = archive->header.hash_table_size * sizeof(MPQHashEntry);
   archive->hash_table = (MPQHashEntry *) PLATFORM_API.allocate_memory(hash_table_size);
-  if (PAPI_ERROR(PLATFORM_API.file_read(&file, (void *) archive->hash_table, archive->header.hash_table_offset, hash_table_size))) {
+  if (!mpq_archive_copy(archive, (void *) archive->hash_table, archive->header.hash_table_offset, hash_table_size)) {
+    mpq_archive_close(archive);
     return false;
   }
 
   uint32_t htkey = mpq_string_hash((char *) "(hash table)", MPQ_HASH_TYPE_FILE_KEY);
   mpq_decrypt_data((void *) archive->hash_table, hash_table_size, htkey);
 
-  size_t block_table_size = archive->header.block_table_size * sizeof(MPQHashEntry);
-  archive->block_table = (MPQBlockEntry *) PLATFORM_API.allocate_memory(block_table_size);
-  if (PAPI_ERROR(PLATFORM_API.file_read(&file, (void *) archive->block_table, archive->header.block_table_offset, block_table_size))) {
+#if !MPQ_LAZY_BLOCK_TABLES
+  if (!mpq_archive_load_block_table(archive)) {
+    mpq_archive_close(archive);
     return false;
   }
-
-  uint32_t btkey = mpq_string_hash((char *) "(block table)", MPQ_HASH_TYPE_FILE_KEY);
-  mpq_decrypt_data((void *) archive->block_table, block_table_size, btkey);
+#endif
 
   return true;
 }
@@ -264,116 +403,336 @@ static MPQFileId mpq_file_id(char *name)
   return result;
 }
 
-static MPQHashEntry *mpq_archive_find_entry(MPQArchive *archive, MPQFileId file_id)
+static inline uint32_t mpq_index_slot(MPQIndex *index, uint32_t check1, uint32_t check2)
+{
+  return (check1 ^ (check2 * 0x9E3779B1)) & index->mask;
+}
+
+// Returns the entry for the name or the empty slot it would occupy
+static MPQIndexEntry *mpq_index_find(MPQIndex *index, uint32_t check1, uint32_t check2)
 {
-  uint32_t start_idx = file_id.hash & (archive->header.hash_table_size - 1);
+  uint32_t idx = mpq_index_slot(index, check1, check2);
 
-  MPQHashEntry *table = archive->hash_table;
-  MPQHashEntry *result = NULL;
+  while (true) {
+    MPQIndexEntry *entry = &index->entries[idx];
 
-  uint32_t locale = 0;
-  uint32_t platform = 0;
+    if (entry->source == MPQ_INDEX_EMPTY || (entry->check1 == check1 && entry->check2 == check2)) {
+      return entry;
+    }
+
+    idx = (idx + 1) & index->mask;
+  }
+}
+
+static void mpq_index_resize(MPQIndex *index, uint32_t capacity)
+{
+  MPQIndexEntry *entries = index->entries;
+  uint32_t old_capacity = entries != NULL ? index->mask + 1 : 0;
 
-  uint32_t idx = start_idx;
-  uint32_t tries = 100;
+  index->entries = (MPQIndexEntry *) PLATFORM_API.allocate_memory(capacity * sizeof(MPQIndexEntry));
+  memset(index->entries, 0xFF, capacity * sizeof(MPQIndexEntry));
+  index->mask = capacity - 1;
 
-  while (table[idx].block_index != MPQ_HASH_ENTRY_EMPTY && tries) {
-    MPQHashEntry *entry = &table[idx];
+  for (uint32_t i = 0; i < old_capacity; i++) {
+    if (entries[i].source != MPQ_INDEX_EMPTY) {
+      *mpq_index_find(index, entries[i].check1, entries[i].check2) = entries[i];
+    }
+  }
+
+  if (entries != NULL) {
+    PLATFORM_API.free_memory(entries);
+  }
+}
+
+// Fresh entries come back with source MPQ_INDEX_EMPTY for the caller to fill in
+static MPQIndexEntry *mpq_index_insert(MPQIndex *index, uint32_t check1, uint32_t check2)
+{
+  uint32_t capacity = index->entries != NULL ? index->mask + 1 : 0;
+  if ((index->count + 1) * 4 > capacity * 3) {
+    mpq_index_resize(index, capacity > 0 ? capacity * 2 : 1024);
+  }
+
+  MPQIndexEntry *entry = mpq_index_find(index, check1, check2);
+  if (entry->source == MPQ_INDEX_EMPTY) {
+    entry->check1 = check1;
+    entry->check2 = check2;
+    entry->flags = 0;
+    entry->block_index = 0;
+    index->count++;
+  }
 
-    if (entry->block_index != MPQ_HASH_ENTRY_DELETED) {
-      if (entry->check1 == file_id.check1 && entry->check2 == file_id.check2) {
-        result = entry;
-        break;
+  return entry;
+}
+
+static void mpq_index_build(MPQRegistry *registry)
+{
+  double start = PLATFORM_API.get_time();
+  MPQIndex *index = &registry->index;
+
+  uint32_t total = 0;
+  for (size_t i = 0; i < registry->archives_count; i++) {
+    total += registry->archives[i].header.hash_table_size;
+  }
+
+  uint32_t capacity = 1024;
+  while (capacity * 3 < total * 4) {
+    capacity *= 2;
+  }
+  mpq_index_resize(index, capacity);
+
+  for (size_t i = 0; i < registry->archives_count; i++) {
+    MPQArchive *archive = &registry->archives[i];
+
+    for (uint32_t j = 0; j < archive->header.hash_table_size; j++) {
+      MPQHashEntry *hash_entry = &archive->hash_table[j];
+      if (hash_entry->block_index >= archive->header.block_table_size) {
+        continue; // Empty, deleted or broken
+      }
+
+      // Archives are sorted by priority so the first one to claim a name keeps it,
+      // within an archive the neutral locale wins
+      MPQIndexEntry *entry = mpq_index_insert(index, hash_entry->check1, hash_entry->check2);
+      if (entry->source == MPQ_INDEX_EMPTY || (entry->source == i && hash_entry->locale == 0)) {
+        entry->source = (uint16_t) i;
+        entry->block_index = hash_entry->block_index;
       }
     }
 
-    idx = (idx + 1) & (archive->header.hash_table_size - 1);
-    tries--;
+    PLATFORM_API.free_memory(archive->hash_table);
+    archive->hash_table = NULL;
   }
 
-  return result;
+
+  printf("Index: %u files from %u archives in %.2f ms\n", index->count, (uint32_t) registry->archives_count,
+         (PLATFORM_API.get_time() - start) * 1000.0);
 }
 
-int32_t inflate(void *src, size_t src_size, void *dst, size_t dst_size)
+// Loose files on disk override archives, the filesystem is asked once per name
+static MPQIndexEntry *mpq_index_lookup(MPQRegistry *registry, char *name, MPQFileId file_id)
+{
+  MPQIndex *index = &registry->index;
+
+  MPQIndexEntry *entry = mpq_index_insert(index, file_id.check1, file_id.check2);
+
+  if (entry->source == MPQ_INDEX_EMPTY) {
+    entry->flags = MPQ_INDEX_OVERLAY_CHECKED;
+    entry->source = PLATFORM_API.get_file_size(name) >= 0 ? MPQ_INDEX_LOOSE : MPQ_INDEX_MISSING;
+
+    if (entry->source == MPQ_INDEX_MISSING) {
+      printf("[WARN] No archive contained %s\n", name);
+    }
+  } else if ((entry->flags & MPQ_INDEX_OVERLAY_CHECKED) == 0) {
+    entry->flags |= MPQ_INDEX_OVERLAY_CHECKED;
+
+    if (PLATFORM_API.get_file_size(name) >= 0) {
+      entry->source = MPQ_INDEX_LOOSE;
+    }
+  }
+
+  return entry;
+}
+
+// Decompressor state lives on the stack, sectors may be inflated on several threads at once.
+// Succeeds only when the stream ends exactly at dst_size bytes.
+bool inflate(void *src, size_t src_size, void *dst, size_t dst_size)
 {
   tinfl_decompressor decompressor;
   tinfl_init(&decompressor);
 
-  static mz_uint8 outbuf[TINFL_LZ_DICT_SIZE];
-
   size_t in_bytes = src_size;
   size_t out_bytes = dst_size;
-  int32_t result = tinfl_decompress(&decompressor, (const mz_uint8 *) src, &in_bytes, (mz_uint8 *) dst, (mz_uint8 *) dst, &out_bytes, TINFL_FLAG_USING_NON_WRAPPING_OUTPUT_BUF | TINFL_FLAG_PARSE_ZLIB_HEADER);
+  tinfl_status status = tinfl_decompress(&decompressor, (const mz_uint8 *) src, &in_bytes, (mz_uint8 *) dst, (mz_uint8 *) dst, &out_bytes, TINFL_FLAG_USING_NON_WRAPPING_OUTPUT_BUF | TINFL_FLAG_PARSE_ZLIB_HEADER);
 
+  return status == TINFL_STATUS_DONE && out_bytes == dst_size;
+}
+
+#define MPQ_PARALLEL_MIN_SECTORS 32 // Smaller files aren't worth handing to the pool
+#define MPQ_SECTORS_PER_JOB 8
+
+typedef struct MPQUnpackJob {
+  MPQBlockEntry *block;
+  size_t sector_size;
+  uint8_t *packed;
+  uint8_t *data;
+  uint32_t start; // Sectors to unpack
+  uint32_t end;
+  bool ok;
+} MPQUnpackJob;
+
+// Every sector goes to its own offset of the file data, so jobs never overlap
+static void mpq_unpack_sectors(MPQUnpackJob *job)
+{
+  uint32_t *sectors = (uint32_t *) job->packed;
+  job->ok = true;
+
+  for (size_t i = job->start; i < job->end; i++) {
+    uint8_t *src = job->packed + sectors[i];
+    size_t src_size = sectors[i + 1] - sectors[i];
+    uint8_t *dst = job->data + i * job->sector_size;
+    size_t dst_size = job->block->file_size - i * job->sector_size;
+    dst_size = dst_size < job->sector_size ? dst_size : job->sector_size;
+
+    if (src_size >= dst_size) {
+      memcpy(dst, src, dst_size);
+      continue;
+    }
+
+    // First byte denotes the compression method used
+    uint8_t compression = src[0];
+    ASSERT(compression == MPQ_COMPRESSION_DEFLATE);
+    if (compression != MPQ_COMPRESSION_DEFLATE) {
+      job->ok = false;
+      continue;
+    }
+
+    if (!inflate(src + 1, src_size - 1, dst, dst_size)) {
+      job->ok = false;
+    }
+  }
+}
+
+static WORK_QUEUE_CALLBACK(mpq_unpack_job)
+{
+  mpq_unpack_sectors((MPQUnpackJob *) data);
+}
+
+// Inflates sectors of the packed block straight into the file data. Sectors that didn't shrink are stored as is.
+// Large files are split into runs of sectors for the registry's pool.
+static bool mpq_unpack_block(MPQRegistry *registry, MPQArchive *archive, MPQBlockEntry *block, uint8_t *packed, uint8_t *data)
+{
+  if ((block->flags & MPQ_BLOCK_IS_COMPRESSED) != MPQ_BLOCK_IS_COMPRESSED) {
+    if (block->file_size > block->block_size) {
+      return false;
+    }
+
+    memcpy(data, packed, block->file_size);
+    return true;
+  }
+
+  size_t sector_size = 512 << archive->header.sector_size_shift;
+  uint32_t sectors_count = (uint32_t) ((block->file_size + sector_size - 1) / sector_size);
+  if (block->block_size < (sectors_count + 1) * sizeof(uint32_t)) {
+    return false;
+  }
+
+  uint32_t *sectors = (uint32_t *) packed;
+  for (size_t i = 0; i < sectors_count; i++) {
+    if (sectors[i] >= sectors[i + 1] || sectors[i + 1] > block->block_size) {
+      return false;
+    }
+  }
+
+  if (registry->pool == NULL || sectors_count < MPQ_PARALLEL_MIN_SECTORS) {
+    MPQUnpackJob job = {block, sector_size, packed, data, 0, sectors_count, false};
+    mpq_unpack_sectors(&job);
+    return job.ok;
+  }
+
+  uint32_t jobs_count = (sectors_count + MPQ_SECTORS_PER_JOB - 1) / MPQ_SECTORS_PER_JOB;
+  MPQUnpackJob *jobs = (MPQUnpackJob *) PLATFORM_API.allocate_memory(jobs_count * sizeof(MPQUnpackJob));
+  WorkQueueBatch batch = {};
+  for (uint32_t i = 0; i < jobs_count; i++) {
+    uint32_t start = i * MPQ_SECTORS_PER_JOB;
+    uint32_t end = start + MPQ_SECTORS_PER_JOB < sectors_count ? start + MPQ_SECTORS_PER_JOB : sectors_count;
+    jobs[i] = {block, sector_size, packed, data, start, end, false};
+    PLATFORM_API.work_queue_add(registry->pool, &batch, &mpq_unpack_job, &jobs[i]);
+  }
+
+  PLATFORM_API.work_queue_complete(registry->pool, &batch);
+
+  bool result = true;
+  for (uint32_t i = 0; i < jobs_count; i++) {
+    result = result && jobs[i].ok;
+  }
+
+  PLATFORM_API.free_memory(jobs);
   return result;
 }
 
+// Mapped archives hand out the block in place, others read it whole in one go
 MPQFile mpq_load_file(MPQRegistry *registry, char *name)
 {
   MPQFile result = {0};
 
-  MPQArchive *matchedArchive = NULL;
-  MPQHashEntry *matchedEntry = NULL;
+  double start = PLATFORM_API.get_time();
+  if (MPQ_LOAD_STATS && registry->start_time > 0.0) {
+    printf("Registry: first load %.2f ms after startup\n", (start - registry->start_time) * 1000.0);
+    registry->start_time = 0.0;
+  }
 
   MPQFileId file_id = mpq_file_id(name);
+  MPQIndexEntry *entry = mpq_index_lookup(registry, name, file_id);
+  double lookup_time = PLATFORM_API.get_time() - start;
 
-  for (size_t i = 0; i < registry->archives_count; i++) {
-    MPQHashEntry *entry = mpq_archive_find_entry(&registry->archives[i], file_id);
-    if (entry != NULL) {
-      matchedArchive = &registry->archives[i];
-      matchedEntry = entry;
-      break;
-    }
-  }
-
-  if (matchedArchive == NULL || matchedEntry == NULL) {
-    printf("[WARN] No archive contained %s\n", name);
+  if (entry->source == MPQ_INDEX_MISSING) {
     return result;
   }
 
-  printf("Found %s in archive %s\n", name, matchedArchive->filename);
+  if (entry->source == MPQ_INDEX_LOOSE) {
+    int32_t size = PLATFORM_API.get_file_size(name);
+    if (size < 0) {
+      printf("[WARN] Loose file %s is gone\n", name);
+      return result;
+    }
 
-  MPQBlockEntry *block = &matchedArchive->block_table[matchedEntry->block_index];
-  if ((block->flags & MPQ_BLOCK_IS_FILE) != MPQ_BLOCK_IS_FILE) {
+    result.id = file_id;
+    result.data = PLATFORM_API.allocate_memory(size);
+    result.size = size;
+    PLATFORM_API.read_file_contents(name, result.data, size);
     return result;
   }
 
-  size_t uncompressed_sector_size = 512 << matchedArchive->header.sector_size_shift;
-  void *uncompressed_data = PLATFORM_API.allocate_memory(block->file_size);
-
-  uint8_t buf[4096] = {0};
-  if (PAPI_ERROR(PLATFORM_API.file_read(&matchedArchive->file, (void *) &buf[0], block->offset, 4))) {
+  MPQArchive *matchedArchive = &registry->archives[entry->source];
+  if (!mpq_archive_load_block_table(matchedArchive)) {
+    printf("[WARN] Failed to read block table of archive %s\n", matchedArchive->filename);
     return result;
   }
 
-  int32_t data_offset = ((int32_t *) buf)[0];
-  size_t sectors_count = data_offset / sizeof(int32_t);
+  MPQBlockEntry *block = &matchedArchive->block_table[entry->block_index];
+  if ((block->flags & MPQ_BLOCK_IS_FILE) != MPQ_BLOCK_IS_FILE) {
+    return result;
+  }
 
-  int32_t *sectors = (int32_t *) PLATFORM_API.allocate_memory(sectors_count * sizeof(int32_t));
-  PLATFORM_API.file_read(&matchedArchive->file, sectors, block->offset, data_offset);
+  uint32_t reads = matchedArchive->reads;
 
-  for (size_t i = 0; i < sectors_count - 1; i++) {
-    size_t sector_size = sectors[i + 1] - sectors[i] - 1;
-    PLATFORM_API.file_read(&matchedArchive->file, (void *) &buf, block->offset + sectors[i], sector_size);
+  uint8_t *packed = NULL;
+  if (matchedArchive->mapping != NULL) {
+    if ((size_t) block->offset + block->block_size <= matchedArchive->mapping_size) {
+      packed = matchedArchive->mapping + block->offset;
+    }
+  } else {
+    packed = (uint8_t *) PLATFORM_API.allocate_memory(block->block_size);
+    if (!mpq_archive_read(matchedArchive, packed, block->offset, block->block_size)) {
+      PLATFORM_API.free_memory(packed);
+      packed = NULL;
+    }
+  }
 
-    void *sector_data = (void *) &buf[0];
+  if (packed == NULL) {
+    printf("[WARN] Block of %s lies outside archive %s\n", name, matchedArchive->filename);
+    return result;
+  }
 
-    if ((block->flags & MPQ_BLOCK_IS_COMPRESSED) == MPQ_BLOCK_IS_COMPRESSED) {
-      // First byte denotes the compression method used
-      uint8_t compression = buf[0];
-      sector_data = (void *) &buf[1];
+  void *uncompressed_data = PLATFORM_API.allocate_memory(block->file_size);
+  bool unpacked = mpq_unpack_block(registry, matchedArchive, block, packed, (uint8_t *) uncompressed_data);
 
-      ASSERT(compression == 2);
+  if (matchedArchive->mapping == NULL) {
+    PLATFORM_API.free_memory(packed);
+  }
 
-      inflate(sector_data,
-              sector_size,
-              (void *) ((uint8_t *) uncompressed_data + i * uncompressed_sector_size),
-              uncompressed_sector_size);
-    }
+  if (!unpacked) {
+    printf("[WARN] Malformed block of %s in archive %s\n", name, matchedArchive->filename);
+    PLATFORM_API.free_memory(uncompressed_data);
+    return result;
   }
 
-  PLATFORM_API.free_memory(sectors);
+  if (MPQ_LOAD_STATS) {
+    printf("Loaded %s from %s: %u bytes in %.2f ms (lookup %.2f us), %u file reads\n", name, matchedArchive->filename,
+           block->file_size, (PLATFORM_API.get_time() - start) * 1000.0, lookup_time * 1000000.0,
+           matchedArchive->reads - reads);
+  }
 
+  result.id = file_id;
   result.data = uncompressed_data;
   result.size = block->file_size;
 
@@ -35,18 +35,47 @@ PACK_END();
 
 typedef struct MPQArchive {
   PlatformFile file;
+  uint8_t *mapping; // Whole archive, NULL when it couldn't be mapped and blocks are read instead
+  size_t mapping_size;
+  uint32_t reads; // File reads issued, for load reports
   MPQHeader header;
   MPQHashEntry *hash_table;
-  MPQBlockEntry *block_table;
+  MPQBlockEntry *block_table; // NULL until first needed with MPQ_LAZY_BLOCK_TABLES
   char *filename;
   uint32_t priority;
 } MPQArchive;
 
 #define MPQ_MAX_ARCHIVES 32
 
+#define MPQ_INDEX_EMPTY 0xFFFF
+#define MPQ_INDEX_MISSING 0xFFFE // Looked up before and found nowhere
+#define MPQ_INDEX_LOOSE 0xFFFD // Overridden by a loose file on disk
+
+#define MPQ_INDEX_OVERLAY_CHECKED 0x01
+
+// Where a file resolves to: an archive and its block, a loose file or nothing
+typedef struct MPQIndexEntry {
+  uint32_t check1;
+  uint32_t check2;
+  uint16_t source; // Archive index or one of MPQ_INDEX_*
+  uint16_t flags;
+  uint32_t block_index;
+} MPQIndexEntry;
+
+typedef struct MPQIndex {
+  MPQIndexEntry *entries;
+  uint32_t mask;
+  uint32_t count;
+} MPQIndex;
+
+typedef struct PlatformWorkQueue PlatformWorkQueue;
+
 typedef struct MPQRegistry {
   size_t archives_count;
   MPQArchive archives[MPQ_MAX_ARCHIVES];
+  MPQIndex index; // Every known name resolved by archive priority
+  PlatformWorkQueue *pool; // Opens archives and inflates sectors of large files
+  double start_time; // Cleared once the first load has reported startup time
 } MPQRegistry;
 
 typedef struct MPQFileId {
@@ -37,6 +37,27 @@ typedef int32_t (* ReadFileContentsFunc)(char *, void*, uint32_t);
 typedef void *(* AllocateMemoryFunc)(size_t size);
 typedef void *(* FreeMemoryFunc)(void *memory);
 typedef void ( *TerminateFunc)();
+typedef double ( *GetTimeFunc)();
+
+// Threads consume entries in the order they were added, see work_queue_complete
+typedef struct PlatformWorkQueue PlatformWorkQueue;
+#define WORK_QUEUE_CALLBACK(name) void name(void *data)
+typedef WORK_QUEUE_CALLBACK(WorkQueueCallback);
+
+// Entries added under one batch are completed together, independently of other work on the queue.
+// Zero initialized, it must outlive its entries.
+typedef struct WorkQueueBatch {
+  uint32_t pending; // Guarded by the queue
+} WorkQueueBatch;
+
+// One thread per core besides the calling one. Every such request gets the same shared pool,
+// callers keep their work apart with batches.
+#define WORK_QUEUE_THREADS_AUTO 0
+
+// Returns NULL when no more queues can be created, callers run their work inline then
+typedef PlatformWorkQueue *(*WorkQueueCreateFunc)(uint32_t threads_count);
+typedef void (*WorkQueueAddFunc)(PlatformWorkQueue *queue, WorkQueueBatch *batch, WorkQueueCallback *callback, void *data);
+typedef void (*WorkQueueCompleteFunc)(PlatformWorkQueue *queue, WorkQueueBatch *batch); // NULL batch waits for everything
 
 typedef AssetId ( *GetAssetIdFunc)(char *name);
 typedef LoadedAsset ( *LoadAssetFunc)(char *name);
@@ -44,6 +65,8 @@ typedef void ( *ReleaseAssetFunc)(LoadedAsset *asset);
 
 typedef int32_t (* FileOpenFunc)(PlatformFile *file, char *filename);
 typedef int32_t (* FileReadFunc)(PlatformFile *file, void *dst, uint32_t offset, uint32_t bytes);
+typedef void *(* FileMapFunc)(PlatformFile *file, size_t *size); // Read-only until the file is closed, NULL on failure
+typedef void (* FileCloseFunc)(PlatformFile *file, void *mapping, size_t size); // Also unmaps the file_map result unless NULL
 
 typedef bool (*DirectoryListingBeginFunc)(DirectoryListingIter *iter, char *dir);
 typedef DirectoryListingEntry *(*DirectoryListingNextEntryFunc)(DirectoryListingIter *iter);
@@ -67,9 +90,15 @@ typedef struct PlatformAPI {
   ReleaseAssetFunc release_asset;
   FileOpenFunc file_open;
   FileReadFunc file_read;
+  FileMapFunc file_map;
+  FileCloseFunc file_close;
   DirectoryListingBeginFunc directory_listing_begin;
   DirectoryListingNextEntryFunc directory_listing_next_entry;
   DirectoryListingEndFunc directory_listing_end;
+  GetTimeFunc get_time; // Seconds from an arbitrary point, for profiling
+  WorkQueueCreateFunc work_queue_create;
+  WorkQueueAddFunc work_queue_add;
+  WorkQueueCompleteFunc work_queue_complete; // Returns once everything added to the batch so far has finished
 
   SoundBufferInitFunc sound_buffer_init;
   SoundBufferFinalizeFunc sound_buffer_finalize;
@@ -15,6 +15,10 @@
   #define DRAW_TRIANGLE_DO_BLEND(CTX, SRC, DST) DRAW_TRIANGLE_TEXEL_TO_COLOR(SRC)
 #endif
 
+#ifndef DRAW_TRIANGLE_MSAA
+  #define DRAW_TRIANGLE_MSAA 0
+#endif
+
 #if DRAW_TRIANGLE_ZTEST
   #define ZTEST(NEW, OLD) ((NEW > OLD))
   #if DRAW_TRIANGLE_BLEND
@@ -58,16 +62,18 @@ static DRAW_TRIANGLE_FUNC(DRAW_TRIANGLE_FUNC_NAME)
   int32_t target_width = target->width;
   int32_t target_height = target->height;
 
-  if (maxx < 0 || maxy < 0 ||
-      minx >= (target_width) || miny >= (target_height)) {
+  RenderRect scissor = ctx->scissor;
+
+  if (maxx < scissor.x0 || maxy < scissor.y0 ||
+      minx >= scissor.x1 || miny >= scissor.y1) {
     return;
   }
 
-  // Clip bounding rect to target rect
-  minx = MAX(0, minx);
-  miny = MAX(0, miny);
-  maxx = MIN(maxx, (target_width - 1));
-  maxy = MIN(maxy, (target_height - 1));
+  // Clip bounding rect to scissor rect, which is never larger than the target
+  minx = MAX(scissor.x0, minx);
+  miny = MAX(scissor.y0, miny);
+  maxx = MIN(maxx, (scissor.x1 - 1));
+  maxy = MIN(maxy, (scissor.y1 - 1));
 
   float rarea = 1.0f / to_float(area);
 
@@ -109,6 +115,45 @@ static DRAW_TRIANGLE_FUNC(DRAW_TRIANGLE_FUNC_NAME)
 
   Vec3q basew = c + w_xinc * to_q8(blkminx) + w_yinc * to_q8(blkminy);
 
+#if DRAW_TRIANGLE_MSAA
+  // Rotated grid sample positions inside the pixel, edge function offsets are precalculated
+  static const q8 sample_x[MSAA_SAMPLES] = {96, 224, 32, 160};
+  static const q8 sample_y[MSAA_SAMPLES] = {32, 96, 160, 224};
+
+  Vec3q sample_w[MSAA_SAMPLES];
+  for (int s = 0; s < MSAA_SAMPLES; s++) {
+    sample_w[s] = w_xinc * sample_x[s] + w_yinc * sample_y[s];
+  }
+
+  // Depth is tested per sample but the fragment is shaded once per pixel
+  #define MSAA_PIXEL(MASK) { \
+    zval_t zvalue = (zval_t) (z * ZBUFFER_MAX); \
+    uint32_t passed = 0; \
+    for (int s = 0; s < MSAA_SAMPLES; s++) { \
+      if ((((MASK) >> s) & 1) && ZTEST(zvalue, zs[s])) { \
+        passed |= 1 << s; \
+      } \
+    } \
+    if (passed) { \
+      Texel color = {}; \
+      if (fragment(ctx, shader_data, startx + i, starty + j, 1 - t1 - t2, t1, t2, &color)) { \
+        for (int s = 0; s < MSAA_SAMPLES; s++) { \
+          if ((passed >> s) & 1) { \
+            cs[s] = DRAW_TRIANGLE_DO_BLEND(ctx, color, cs[s]); \
+          } \
+        } \
+      } \
+      if (ALPHA_TEST(color.a)) { \
+        for (int s = 0; s < MSAA_SAMPLES; s++) { \
+          if ((passed >> s) & 1) { \
+            zs[s] = zvalue; \
+          } \
+        } \
+      } \
+    } \
+  }
+#endif
+
   float t1dx = to_float(w_xinc.y) * rarea;
   float t1dy = to_float(w_yinc.y) * rarea;
   float t2dx = to_float(w_xinc.z) * rarea;
@@ -171,8 +216,13 @@ static DRAW_TRIANGLE_FUNC(DRAW_TRIANGLE_FUNC_NAME)
       float zdx = (zmaxx - zrow) / BLOCK_SIZE;
       float zdy = (zmaxy - zrow) / BLOCK_SIZE;
 
+#if DRAW_TRIANGLE_MSAA
+      zval_t *zs_row = &ctx->msaa_zbuffer[(starty * target_width + startx) * MSAA_SAMPLES];
+      DRAW_TRIANGLE_TEXEL_TYPE *cs_row = &((DRAW_TRIANGLE_TEXEL_TYPE *) ctx->msaa_color)[(starty * target_width + startx) * MSAA_SAMPLES];
+#else
       zval_t *zp_row = &ctx->zbuffer[starty * target_width + startx];
       DRAW_TRIANGLE_TEXEL_TYPE *bufferp_row = DRAW_TRIANGLE_TEXELP(target, startx, starty);
+#endif
 
       if (allInside) {
         // Block is fully inside the triangle
@@ -182,6 +232,23 @@ static DRAW_TRIANGLE_FUNC(DRAW_TRIANGLE_FUNC_NAME)
           float t2 = t2row;
           float z = zrow;
 
+#if DRAW_TRIANGLE_MSAA
+          zval_t *zs = zs_row;
+          DRAW_TRIANGLE_TEXEL_TYPE *cs = cs_row;
+
+          for (int i = 0; i < BLOCK_SIZE; i++) {
+            MSAA_PIXEL(0xF);
+
+            t1 += t1dx;
+            t2 += t2dx;
+            z += zdx;
+            zs += MSAA_SAMPLES;
+            cs += MSAA_SAMPLES;
+          }
+
+          zs_row += target_width * MSAA_SAMPLES;
+          cs_row += target_width * MSAA_SAMPLES;
+#else
           zval_t *zp = zp_row;
           DRAW_TRIANGLE_TEXEL_TYPE *bufferp = bufferp_row;
 
@@ -209,11 +276,13 @@ static DRAW_TRIANGLE_FUNC(DRAW_TRIANGLE_FUNC_NAME)
             bufferp++;
           }
 
+          zp_row += target_width;
+          bufferp_row += target_width;
+#endif
+
           t1row += t1dy;
           t2row += t2dy;
           zrow += zdy;
-          zp_row += target_width;
-          bufferp_row += target_width;
         }
       } else {
         // Block is partially inside the triangle
@@ -226,15 +295,41 @@ static DRAW_TRIANGLE_FUNC(DRAW_TRIANGLE_FUNC_NAME)
           float t2 = t2row;
           float z = zrow;
 
-          zval_t *zp = zp_row;
-          DRAW_TRIANGLE_TEXEL_TYPE *bufferp = bufferp_row;
-
 #if DRAW_TRIANGLE_CULL
   #define INSIDE_TRIANGLE(w) ((w.x | w.y | w.z) >= 0)
 #else
   #define INSIDE_TRIANGLE(w) (((w.x | w.y | w.z) >= 0) || ((w.x < 0.0f) && (w.y < 0.0f) && (w.z < 0.0f)))
 #endif
 
+#if DRAW_TRIANGLE_MSAA
+          zval_t *zs = zs_row;
+          DRAW_TRIANGLE_TEXEL_TYPE *cs = cs_row;
+
+          for (int i = 0; i < BLOCK_SIZE; i++) {
+            uint32_t mask = 0;
+            for (int s = 0; s < MSAA_SAMPLES; s++) {
+              Vec3q ws = w + sample_w[s];
+              mask |= INSIDE_TRIANGLE(ws) << s;
+            }
+
+            if (mask) {
+              MSAA_PIXEL(mask);
+            }
+
+            t1 += t1dx;
+            t2 += t2dx;
+            z += zdx;
+            w = w + w_xinc;
+            zs += MSAA_SAMPLES;
+            cs += MSAA_SAMPLES;
+          }
+
+          zs_row += target_width * MSAA_SAMPLES;
+          cs_row += target_width * MSAA_SAMPLES;
+#else
+          zval_t *zp = zp_row;
+          DRAW_TRIANGLE_TEXEL_TYPE *bufferp = bufferp_row;
+
           for (int i = 0; i < BLOCK_SIZE; i++) {
             if (INSIDE_TRIANGLE(w)) {
               zval_t zvalue = (zval_t) (z * ZBUFFER_MAX);
@@ -262,17 +357,20 @@ static DRAW_TRIANGLE_FUNC(DRAW_TRIANGLE_FUNC_NAME)
             bufferp++;
           }
 
+          zp_row += target_width;
+          bufferp_row += target_width;
+#endif
+
           t1row += t1dy;
           t2row += t2dy;
           zrow += zdy;
           wrow = wrow + w_yinc;
-          zp_row += target_width;
-          bufferp_row += target_width;
         }
       }
     }
   }
 
+#undef MSAA_PIXEL
 #undef INSIDE_TRIANGLE
 #undef INOUT
 #undef IROUND
@@ -296,3 +394,4 @@ static DRAW_TRIANGLE_FUNC(DRAW_TRIANGLE_FUNC_NAME)
 #undef DRAW_TRIANGLE_CULL
 #undef DRAW_TRIANGLE_FRAG
 #undef DRAW_TRIANGLE_ZTEST
+#undef DRAW_TRIANGLE_MSAA
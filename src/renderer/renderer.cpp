@@ -134,6 +134,69 @@ inline static q8 edge_funcq(q8 x0, q8 y0, q8 x1, q8 y1)
 #define DRAW_TRIANGLE_FRAG 0
 #include "draw_triangle.cpp"
 
+#define DRAW_TRIANGLE_TARGET_TYPE Texture
+#define DRAW_TRIANGLE_TEXEL_TYPE Texel
+#define DRAW_TRIANGLE_FUNC_NAME draw_triangle_rgba4f_noblend_cull_nofrag
+#define DRAW_TRIANGLE_BLEND 0
+#define DRAW_TRIANGLE_CULL 1
+#define DRAW_TRIANGLE_ZTEST 1
+#define DRAW_TRIANGLE_FRAG 0
+#include "draw_triangle.cpp"
+
+#define DRAW_TRIANGLE_TARGET_TYPE Texture
+#define DRAW_TRIANGLE_TEXEL_TYPE Texel
+#define DRAW_TRIANGLE_FUNC_NAME draw_triangle_rgba4f_blend_cull_frag_z
+#define DRAW_TRIANGLE_BLEND 1
+#define DRAW_TRIANGLE_CULL 1
+#define DRAW_TRIANGLE_ZTEST 1
+#define DRAW_TRIANGLE_FRAG 1
+#include "draw_triangle.cpp"
+
+#define DRAW_TRIANGLE_TARGET_TYPE Texture
+#define DRAW_TRIANGLE_TEXEL_TYPE Texel
+#define DRAW_TRIANGLE_FUNC_NAME draw_triangle_rgba4f_blend_nocull_frag_z
+#define DRAW_TRIANGLE_BLEND 1
+#define DRAW_TRIANGLE_CULL 0
+#define DRAW_TRIANGLE_ZTEST 1
+#define DRAW_TRIANGLE_FRAG 1
+#include "draw_triangle.cpp"
+
+#define DRAW_TRIANGLE_TARGET_TYPE Texture
+#define DRAW_TRIANGLE_TEXEL_TYPE Texel
+#define DRAW_TRIANGLE_FUNC_NAME draw_triangle_rgba4f_blend_nocull_frag_noz
+#define DRAW_TRIANGLE_BLEND 1
+#define DRAW_TRIANGLE_CULL 0
+#define DRAW_TRIANGLE_ZTEST 0
+#define DRAW_TRIANGLE_FRAG 1
+#include "draw_triangle.cpp"
+
+#define DRAW_TRIANGLE_TARGET_TYPE Texture
+#define DRAW_TRIANGLE_TEXEL_TYPE Texel
+#define DRAW_TRIANGLE_FUNC_NAME draw_triangle_rgba4f_noblend_nocull_frag_z
+#define DRAW_TRIANGLE_BLEND 0
+#define DRAW_TRIANGLE_CULL 0
+#define DRAW_TRIANGLE_ZTEST 1
+#define DRAW_TRIANGLE_FRAG 1
+#include "draw_triangle.cpp"
+
+#define DRAW_TRIANGLE_TARGET_TYPE Texture
+#define DRAW_TRIANGLE_TEXEL_TYPE Texel
+#define DRAW_TRIANGLE_FUNC_NAME draw_triangle_rgba4f_noblend_cull_frag_z
+#define DRAW_TRIANGLE_BLEND 0
+#define DRAW_TRIANGLE_CULL 1
+#define DRAW_TRIANGLE_ZTEST 1
+#define DRAW_TRIANGLE_FRAG 1
+#include "draw_triangle.cpp"
+
+#define DRAW_TRIANGLE_TARGET_TYPE Texture
+#define DRAW_TRIANGLE_TEXEL_TYPE Texel
+#define DRAW_TRIANGLE_FUNC_NAME draw_triangle_rgba4f_noblend_nocull_frag_noz
+#define DRAW_TRIANGLE_BLEND 0
+#define DRAW_TRIANGLE_CULL 0
+#define DRAW_TRIANGLE_ZTEST 0
+#define DRAW_TRIANGLE_FRAG 1
+#include "draw_triangle.cpp"
+
 /* DrawingBuffer target */
 
 #define DRAW_TRIANGLE_FUNC_NAME draw_triangle_rgba32_blend_cull_frag_z
@@ -202,12 +265,435 @@ inline static q8 edge_funcq(q8 x0, q8 y0, q8 x1, q8 y1)
 #define DRAW_TRIANGLE_FRAG 1
 #include "draw_triangle.cpp"
 
+/* DrawingBuffer target, 4x coverage sampled */
+
+#define DRAW_TRIANGLE_FUNC_NAME draw_triangle_rgba32_blend_cull_frag_z_msaa
+#define DRAW_TRIANGLE_TARGET_TYPE DrawingBuffer
+#define DRAW_TRIANGLE_TEXEL_TYPE uint32_t
+#define DRAW_TRIANGLE_COLOR_TO_TEXEL(V) (color_rgba(V))
+#define DRAW_TRIANGLE_TEXEL_TO_COLOR(V) (rgba_color(V))
+#define DRAW_TRIANGLE_BLEND 1
+#define DRAW_TRIANGLE_CULL 1
+#define DRAW_TRIANGLE_ZTEST 1
+#define DRAW_TRIANGLE_FRAG 1
+#define DRAW_TRIANGLE_MSAA 1
+#include "draw_triangle.cpp"
+
+#define DRAW_TRIANGLE_FUNC_NAME draw_triangle_rgba32_blend_nocull_frag_z_msaa
+#define DRAW_TRIANGLE_TARGET_TYPE DrawingBuffer
+#define DRAW_TRIANGLE_TEXEL_TYPE uint32_t
+#define DRAW_TRIANGLE_COLOR_TO_TEXEL(V) (color_rgba(V))
+#define DRAW_TRIANGLE_TEXEL_TO_COLOR(V) (rgba_color(V))
+#define DRAW_TRIANGLE_BLEND 1
+#define DRAW_TRIANGLE_CULL 0
+#define DRAW_TRIANGLE_ZTEST 1
+#define DRAW_TRIANGLE_FRAG 1
+#define DRAW_TRIANGLE_MSAA 1
+#include "draw_triangle.cpp"
+
+#define DRAW_TRIANGLE_FUNC_NAME draw_triangle_rgba32_noblend_nocull_frag_z_msaa
+#define DRAW_TRIANGLE_TARGET_TYPE DrawingBuffer
+#define DRAW_TRIANGLE_TEXEL_TYPE uint32_t
+#define DRAW_TRIANGLE_COLOR_TO_TEXEL(V) (color_rgba(V))
+#define DRAW_TRIANGLE_TEXEL_TO_COLOR(V) (rgba_color(V))
+#define DRAW_TRIANGLE_BLEND 0
+#define DRAW_TRIANGLE_CULL 0
+#define DRAW_TRIANGLE_ZTEST 1
+#define DRAW_TRIANGLE_FRAG 1
+#define DRAW_TRIANGLE_MSAA 1
+#include "draw_triangle.cpp"
+
+#define DRAW_TRIANGLE_FUNC_NAME draw_triangle_rgba32_noblend_cull_frag_z_msaa
+#define DRAW_TRIANGLE_TARGET_TYPE DrawingBuffer
+#define DRAW_TRIANGLE_TEXEL_TYPE uint32_t
+#define DRAW_TRIANGLE_COLOR_TO_TEXEL(V) (color_rgba(V))
+#define DRAW_TRIANGLE_TEXEL_TO_COLOR(V) (rgba_color(V))
+#define DRAW_TRIANGLE_BLEND 0
+#define DRAW_TRIANGLE_CULL 1
+#define DRAW_TRIANGLE_ZTEST 1
+#define DRAW_TRIANGLE_FRAG 1
+#define DRAW_TRIANGLE_MSAA 1
+#include "draw_triangle.cpp"
+
 #ifdef __ARCH_X86__
 #include <emmintrin.h>
 #endif
 
+// Upscales (or downscales) src into dst with bilinear filtering. Weights are
+// kept in 8-bit fixed point so four texels can be blended in 16-bit lanes.
+static void blit_bilinear(DrawingBuffer *dst, DrawingBuffer *src)
+{
+  uint32_t *src_pixels = (uint32_t *) src->pixels;
+  uint32_t *dst_pixels = (uint32_t *) dst->pixels;
+
+  uint32_t sw = src->width;
+  uint32_t sh = src->height;
+
+  int32_t xstep = (int32_t) ((sw << 16) / dst->width);
+  int32_t ystep = (int32_t) ((sh << 16) / dst->height);
+
+#ifdef __ARCH_X86__
+  __m128i zero = _mm_setzero_si128();
+#endif
+
+  int32_t v = ystep / 2 - 0x8000;
+
+  for (uint32_t y = 0; y < dst->height; y++, v += ystep) {
+    int32_t vc = MAX(v, 0);
+    uint32_t sy0 = MIN((uint32_t) (vc >> 16), sh - 1);
+    uint32_t sy1 = MIN(sy0 + 1, sh - 1);
+    uint32_t fy = (vc >> 8) & 0xFF;
+
+    uint32_t *row0 = &src_pixels[sy0 * sw];
+    uint32_t *row1 = &src_pixels[sy1 * sw];
+    uint32_t *dstp = &dst_pixels[y * dst->pitch];
+
+#ifdef __ARCH_X86__
+    __m128i wy = _mm_set1_epi16((int16_t) fy);
+    __m128i wy_inv = _mm_set1_epi16((int16_t) (256 - fy));
+#endif
+
+    int32_t u = xstep / 2 - 0x8000;
+
+    for (uint32_t x = 0; x < dst->width; x++, u += xstep) {
+      int32_t uc = MAX(u, 0);
+      uint32_t sx0 = MIN((uint32_t) (uc >> 16), sw - 1);
+      uint32_t sx1 = MIN(sx0 + 1, sw - 1);
+      uint32_t fx = (uc >> 8) & 0xFF;
+
+#ifdef __ARCH_X86__
+      // [a.rgba b.rgba] and [c.rgba d.rgba] widened to 16 bits per channel
+      __m128i top = _mm_unpacklo_epi8(_mm_unpacklo_epi32(_mm_cvtsi32_si128(row0[sx0]), _mm_cvtsi32_si128(row0[sx1])), zero);
+      __m128i bottom = _mm_unpacklo_epi8(_mm_unpacklo_epi32(_mm_cvtsi32_si128(row1[sx0]), _mm_cvtsi32_si128(row1[sx1])), zero);
+
+      __m128i vert = _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(top, wy_inv), _mm_mullo_epi16(bottom, wy)), 8);
+
+      __m128i wx = _mm_unpacklo_epi64(_mm_set1_epi16((int16_t) (256 - fx)), _mm_set1_epi16((int16_t) fx));
+      __m128i horz = _mm_mullo_epi16(vert, wx);
+      horz = _mm_srli_epi16(_mm_add_epi16(horz, _mm_srli_si128(horz, 8)), 8);
+
+      *dstp++ = (uint32_t) _mm_cvtsi128_si32(_mm_packus_epi16(horz, zero));
+#else
+      uint32_t a = row0[sx0];
+      uint32_t b = row0[sx1];
+      uint32_t c = row1[sx0];
+      uint32_t d = row1[sx1];
+      uint32_t result = 0;
+
+      for (uint32_t shift = 0; shift < 32; shift += 8) {
+        uint32_t ca = (a >> shift) & 0xFF;
+        uint32_t cb = (b >> shift) & 0xFF;
+        uint32_t cc = (c >> shift) & 0xFF;
+        uint32_t cd = (d >> shift) & 0xFF;
+
+        uint32_t left = (ca * (256 - fy) + cc * fy) >> 8;
+        uint32_t right = (cb * (256 - fy) + cd * fy) >> 8;
+        result |= ((left * (256 - fx) + right * fx) >> 8) << shift;
+      }
+
+      *dstp++ = result;
+#endif
+    }
+  }
+}
+
+static void fill_pixels(uint32_t *pixels, size_t count, uint32_t value)
+{
+  size_t i = 0;
+
+#ifdef __ARCH_X86__
+  __m128i v = _mm_set1_epi32((int32_t) value);
+  for (; i + 4 <= count; i += 4) {
+    _mm_storeu_si128((__m128i *) &pixels[i], v);
+  }
+#endif
+
+  for (; i < count; i++) {
+    pixels[i] = value;
+  }
+}
+
+// Sample buffers have to hold MSAA_SAMPLES values for every target pixel
+static void msaa_clear(RenderingContext *ctx, Vec4f color, uint32_t what = RENDER_CLEAR_COLOR | RENDER_CLEAR_DEPTH)
+{
+  size_t count = ctx->target_width * ctx->target_height * MSAA_SAMPLES;
+
+  if (what & RENDER_CLEAR_COLOR) {
+    fill_pixels(ctx->msaa_color, count, rgba_color(color));
+  }
+
+  if (what & RENDER_CLEAR_DEPTH) {
+    memset(ctx->msaa_zbuffer, ZBUFFER_MIN, count * sizeof(zval_t));
+  }
+}
+
+static inline uint32_t avg_rgba32(uint32_t a, uint32_t b)
+{
+  // Per byte (a + b + 1) >> 1, same rounding as _mm_avg_epu8
+  return (a | b) - (((a ^ b) >> 1) & 0x7F7F7F7F);
+}
+
+// Averages the samples of every pixel into the DrawingBuffer target
+static void msaa_resolve(RenderingContext *ctx)
+{
+  ASSERT(ctx->target_type == TARGET_TYPE_RGBA32);
+  DrawingBuffer *buffer = (DrawingBuffer *) ctx->target;
+  uint32_t *pixels = (uint32_t *) buffer->pixels;
+
+  for (uint32_t y = 0; y < buffer->height; y++) {
+    uint32_t *samples = &ctx->msaa_color[y * buffer->width * MSAA_SAMPLES];
+    uint32_t *dstp = &pixels[y * buffer->pitch];
+
+    for (uint32_t x = 0; x < buffer->width; x++, samples += MSAA_SAMPLES) {
+#ifdef __ARCH_X86__
+      __m128i s = _mm_loadu_si128((__m128i *) samples);
+      __m128i a = _mm_avg_epu8(s, _mm_srli_si128(s, 8));
+      a = _mm_avg_epu8(a, _mm_srli_si128(a, 4));
+      *dstp++ = (uint32_t) _mm_cvtsi128_si32(a);
+#else
+      *dstp++ = avg_rgba32(avg_rgba32(samples[0], samples[2]), avg_rgba32(samples[1], samples[3]));
+#endif
+    }
+  }
+}
+
+// Box filters src into dst, src has to be exactly twice the size of dst
+static void downsample_2x2(DrawingBuffer *dst, DrawingBuffer *src)
+{
+  ASSERT(src->width == dst->width * 2 && src->height == dst->height * 2);
+
+  uint32_t *src_pixels = (uint32_t *) src->pixels;
+  uint32_t *dst_pixels = (uint32_t *) dst->pixels;
+
+  for (uint32_t y = 0; y < dst->height; y++) {
+    uint32_t *row0 = &src_pixels[(y * 2) * src->pitch];
+    uint32_t *row1 = &src_pixels[(y * 2 + 1) * src->pitch];
+    uint32_t *dstp = &dst_pixels[y * dst->pitch];
+
+    for (uint32_t x = 0; x < dst->width; x++, row0 += 2, row1 += 2) {
+#ifdef __ARCH_X86__
+      __m128i a = _mm_avg_epu8(_mm_loadl_epi64((__m128i *) row0), _mm_loadl_epi64((__m128i *) row1));
+      a = _mm_avg_epu8(a, _mm_srli_si128(a, 4));
+      *dstp++ = (uint32_t) _mm_cvtsi128_si32(a);
+#else
+      *dstp++ = avg_rgba32(avg_rgba32(row0[0], row1[0]), avg_rgba32(row0[1], row1[1]));
+#endif
+    }
+  }
+}
+
+#define FXAA_EDGE_THRESHOLD_MIN 16 // Luma range (out of 255) below this is never an edge
+#define FXAA_EDGE_THRESHOLD_SHIFT 3 // Range also has to exceed 1/8 of the local max luma
+#define FXAA_SPAN_MAX 8.0f
+#define FXAA_REDUCE_MUL (1.0f / 8.0f)
+#define FXAA_REDUCE_MIN (255.0f / 128.0f)
+
+// Green weighted luma, doesn't depend on the channel order
+static inline uint8_t fxaa_luma(uint32_t c)
+{
+  return (uint8_t) (((c & 0xFF) + ((c >> 7) & 0x1FE) + ((c >> 16) & 0xFF)) >> 2);
+}
+
+static void fxaa_compute_luma(uint32_t *pixels, uint8_t *luma, uint32_t count)
+{
+  uint32_t i = 0;
+
+#ifdef __ARCH_X86__
+  __m128i mask = _mm_set1_epi32(0xFF);
+
+  for (; i + 16 <= count; i += 16) {
+    __m128i l[4];
+
+    for (uint32_t k = 0; k < 4; k++) {
+      __m128i c = _mm_loadu_si128((__m128i *) &pixels[i + k * 4]);
+      __m128i c0 = _mm_and_si128(c, mask);
+      __m128i c1 = _mm_and_si128(_mm_srli_epi32(c, 8), mask);
+      __m128i c2 = _mm_and_si128(_mm_srli_epi32(c, 16), mask);
+      l[k] = _mm_srli_epi32(_mm_add_epi32(_mm_add_epi32(c0, c2), _mm_add_epi32(c1, c1)), 2);
+    }
+
+    __m128i lo = _mm_packs_epi32(l[0], l[1]);
+    __m128i hi = _mm_packs_epi32(l[2], l[3]);
+    _mm_storeu_si128((__m128i *) &luma[i], _mm_packus_epi16(lo, hi));
+  }
+#endif
+
+  for (; i < count; i++) {
+    luma[i] = fxaa_luma(pixels[i]);
+  }
+}
+
+static inline float fxaa_lerp_channel(uint32_t a, uint32_t b, uint32_t c, uint32_t d, uint32_t shift, float fx, float fy)
+{
+  float top = (float) ((a >> shift) & 0xFF) * (1.0f - fx) + (float) ((b >> shift) & 0xFF) * fx;
+  float bottom = (float) ((c >> shift) & 0xFF) * (1.0f - fx) + (float) ((d >> shift) & 0xFF) * fx;
+  return top * (1.0f - fy) + bottom * fy;
+}
+
+// Bilinear fetch in pixel units, channels are returned in memory order
+static inline Vec3f fxaa_sample(uint32_t *pixels, int32_t w, int32_t h, float x, float y)
+{
+  x = CLAMP(x, 0.0f, (float) (w - 1));
+  y = CLAMP(y, 0.0f, (float) (h - 1));
+
+  int32_t x0 = (int32_t) x;
+  int32_t y0 = (int32_t) y;
+  int32_t x1 = MIN(x0 + 1, w - 1);
+  int32_t y1 = MIN(y0 + 1, h - 1);
+  float fx = x - x0;
+  float fy = y - y0;
+
+  uint32_t a = pixels[y0 * w + x0];
+  uint32_t b = pixels[y0 * w + x1];
+  uint32_t c = pixels[y1 * w + x0];
+  uint32_t d = pixels[y1 * w + x1];
+
+  return {fxaa_lerp_channel(a, b, c, d, 0, fx, fy),
+          fxaa_lerp_channel(a, b, c, d, 8, fx, fy),
+          fxaa_lerp_channel(a, b, c, d, 16, fx, fy)};
+}
+
+// Single pixel of FXAA 3 console quality, src and luma are tightly packed copies of the frame
+static inline void fxaa_pixel(uint32_t *dst, uint32_t *src, uint8_t *luma, int32_t w, int32_t h, int32_t x, int32_t y)
+{
+  uint8_t *l = &luma[y * w + x];
+
+  uint32_t lm = l[0];
+  uint32_t ln = l[-w];
+  uint32_t ls = l[w];
+  uint32_t lw = l[-1];
+  uint32_t le = l[1];
+
+  uint32_t luma_min = MIN(lm, MIN(MIN(ln, ls), MIN(lw, le)));
+  uint32_t luma_max = MAX(lm, MAX(MAX(ln, ls), MAX(lw, le)));
+
+  if (luma_max - luma_min <= MAX((uint32_t) FXAA_EDGE_THRESHOLD_MIN, luma_max >> FXAA_EDGE_THRESHOLD_SHIFT)) {
+    return;
+  }
+
+  float nw = l[-w - 1];
+  float ne = l[-w + 1];
+  float sw = l[w - 1];
+  float se = l[w + 1];
+
+  // Direction along the edge, perpendicular to the luma gradient
+  float dirx = (sw + se) - (nw + ne);
+  float diry = (nw + sw) - (ne + se);
+
+  float reduce = MAX((nw + ne + sw + se) * (0.25f * FXAA_REDUCE_MUL), FXAA_REDUCE_MIN);
+  float rcp_min = 1.0f / (MIN(fabsf(dirx), fabsf(diry)) + reduce);
+  dirx = CLAMP(dirx * rcp_min, -FXAA_SPAN_MAX, FXAA_SPAN_MAX);
+  diry = CLAMP(diry * rcp_min, -FXAA_SPAN_MAX, FXAA_SPAN_MAX);
+
+  float fx = (float) x;
+  float fy = (float) y;
+
+  Vec3f a = (fxaa_sample(src, w, h, fx + dirx * (1.0f / 3.0f - 0.5f), fy + diry * (1.0f / 3.0f - 0.5f)) +
+             fxaa_sample(src, w, h, fx + dirx * (2.0f / 3.0f - 0.5f), fy + diry * (2.0f / 3.0f - 0.5f))) * 0.5f;
+  Vec3f b = a * 0.5f + (fxaa_sample(src, w, h, fx - dirx * 0.5f, fy - diry * 0.5f) +
+                        fxaa_sample(src, w, h, fx + dirx * 0.5f, fy + diry * 0.5f)) * 0.25f;
+
+  float luma_b = (b.x + 2.0f * b.y + b.z) * 0.25f;
+  Vec3f result = (luma_b < luma_min || luma_b > luma_max) ? a : b;
+
+  *dst = 0xFF000000 | ((uint32_t) (result.z + 0.5f) << 16) | ((uint32_t) (result.y + 0.5f) << 8) | (uint32_t) (result.x + 0.5f);
+}
+
+// Post-process anti-aliasing of the whole buffer. Luma and the edge test run 16
+// pixels at a time, only pixels on detected edges go through the scalar resolve.
+static void fxaa_apply(DrawingBuffer *buffer, uint32_t *scratch, uint8_t *luma)
+{
+  int32_t w = (int32_t) buffer->width;
+  int32_t h = (int32_t) buffer->height;
+  uint32_t *pixels = (uint32_t *) buffer->pixels;
+
+  for (int32_t y = 0; y < h; y++) {
+    memcpy(&scratch[y * w], &pixels[y * buffer->pitch], w * sizeof(uint32_t));
+  }
+
+  fxaa_compute_luma(scratch, luma, w * h);
+
+#ifdef __ARCH_X86__
+  __m128i zero = _mm_setzero_si128();
+  __m128i threshold_min = _mm_set1_epi8((char) FXAA_EDGE_THRESHOLD_MIN);
+  __m128i shift_mask = _mm_set1_epi8((char) (0xFF >> FXAA_EDGE_THRESHOLD_SHIFT));
+#endif
+
+  for (int32_t y = 1; y < h - 1; y++) {
+    uint8_t *row = &luma[y * w];
+    uint32_t *dst_row = &pixels[y * buffer->pitch];
+    int32_t x = 1;
+
+#ifdef __ARCH_X86__
+    for (; x + 16 < w; x += 16) {
+      __m128i m = _mm_loadu_si128((__m128i *) &row[x]);
+      __m128i n = _mm_loadu_si128((__m128i *) &row[x - w]);
+      __m128i s = _mm_loadu_si128((__m128i *) &row[x + w]);
+      __m128i wv = _mm_loadu_si128((__m128i *) &row[x - 1]);
+      __m128i e = _mm_loadu_si128((__m128i *) &row[x + 1]);
+
+      __m128i mx = _mm_max_epu8(m, _mm_max_epu8(_mm_max_epu8(n, s), _mm_max_epu8(wv, e)));
+      __m128i mn = _mm_min_epu8(m, _mm_min_epu8(_mm_min_epu8(n, s), _mm_min_epu8(wv, e)));
+      __m128i range = _mm_subs_epu8(mx, mn);
+
+      // There's no 8-bit shift, shift 16-bit lanes and drop the bits that crossed over
+      __m128i threshold = _mm_max_epu8(_mm_and_si128(_mm_srli_epi16(mx, FXAA_EDGE_THRESHOLD_SHIFT), shift_mask), threshold_min);
+      __m128i over = _mm_subs_epu8(range, threshold);
+      uint32_t edges = ~_mm_movemask_epi8(_mm_cmpeq_epi8(over, zero)) & 0xFFFF;
+
+      for (int32_t k = 0; edges; k++, edges >>= 1) {
+        if (edges & 1) {
+          fxaa_pixel(&dst_row[x + k], scratch, luma, w, h, x + k, y);
+        }
+      }
+    }
+#endif
+
+    for (; x < w - 1; x++) {
+      fxaa_pixel(&dst_row[x], scratch, luma, w, h, x, y);
+    }
+  }
+}
+
+#define DRAW_FUNC_TABLE_SIZE (RENDER_MSAA << 1)
+
+// Every flags combination resolved once, so switching variants doesn't scan the lookups
+typedef struct DrawTriangleFuncTable {
+  DrawTriangleFunc *funcs[DRAW_FUNC_TABLE_SIZE];
+} DrawTriangleFuncTable;
+
+static DrawTriangleFuncTable draw_func_table(DrawTriangleFuncLookup *lookup, size_t count, DrawTriangleFunc *fallback)
+{
+  DrawTriangleFuncTable result;
+
+  for (uint32_t flags = 0; flags < DRAW_FUNC_TABLE_SIZE; flags++) {
+    result.funcs[flags] = fallback;
+
+    for (size_t i = 0; i < count; i++) {
+      if ((lookup[i].flags & flags) == flags) {
+        result.funcs[flags] = lookup[i].func;
+        break;
+      }
+    }
+  }
+
+  return result;
+}
+
 static void change_draw_func(RenderingContext *ctx)
 {
+  // Depth only variants come first so shadow passes without RENDER_SHADING stay cheap
+  static DrawTriangleFuncLookup texture_funcs[] = {
+    {0b1000, &draw_triangle_rgba4f_noblend_nocull_nofrag},
+    {0b1010, &draw_triangle_rgba4f_noblend_cull_nofrag},
+    {0b0100, &draw_triangle_rgba4f_noblend_nocull_frag_noz},
+    {0b0101, &draw_triangle_rgba4f_blend_nocull_frag_noz},
+    {0b1100, &draw_triangle_rgba4f_noblend_nocull_frag_z},
+    {0b1101, &draw_triangle_rgba4f_blend_nocull_frag_z},
+    {0b1110, &draw_triangle_rgba4f_noblend_cull_frag_z},
+    {0b1111, &draw_triangle_rgba4f_blend_cull_frag_z},
+  };
+
   static DrawTriangleFuncLookup funcs[] = {
     {0b0100, &draw_triangle_rgba32_noblend_nocull_frag_noz},
     {0b0101, &draw_triangle_rgba32_blend_nocull_frag_noz},
@@ -215,22 +701,28 @@ static void change_draw_func(RenderingContext *ctx)
     {0b1101, &draw_triangle_rgba32_blend_nocull_frag_z},
     {0b1110, &draw_triangle_rgba32_noblend_cull_frag_z},
     {0b1111, &draw_triangle_rgba32_blend_cull_frag_z},
+    {0b11100, &draw_triangle_rgba32_noblend_nocull_frag_z_msaa},
+    {0b11101, &draw_triangle_rgba32_blend_nocull_frag_z_msaa},
+    {0b11110, &draw_triangle_rgba32_noblend_cull_frag_z_msaa},
+    {0b11111, &draw_triangle_rgba32_blend_cull_frag_z_msaa},
   };
 
+  // Function statics are initialized once even when several threads get here first
+  static DrawTriangleFuncTable texture_table = draw_func_table(texture_funcs, sizeof(texture_funcs) / sizeof(texture_funcs[0]),
+                                                               &draw_triangle_rgba4f_blend_cull_frag_z);
+  static DrawTriangleFuncTable table = draw_func_table(funcs, sizeof(funcs) / sizeof(funcs[0]),
+                                                       &draw_triangle_rgba32_blend_cull_frag_z);
+
+  ASSERT(ctx->flags < DRAW_FUNC_TABLE_SIZE);
+  uint32_t flags = ctx->flags & (DRAW_FUNC_TABLE_SIZE - 1);
+
   switch (ctx->target_type) {
     case TARGET_TYPE_TEXTURE:
-      ctx->draw_triangle = &draw_triangle_rgba4f_noblend_nocull_nofrag;
+      ctx->draw_triangle = texture_table.funcs[flags];
       break;
 
     case TARGET_TYPE_RGBA32:
-      ctx->draw_triangle = &draw_triangle_rgba32_blend_cull_frag_z;
-
-      for (size_t i = 0; i < sizeof(funcs) / sizeof(funcs[0]); i++) {
-        if ((funcs[i].flags & ctx->flags) == ctx->flags) {
-          ctx->draw_triangle = funcs[i].func;
-          break;
-        }
-      }
+      ctx->draw_triangle = table.funcs[flags];
       break;
   }
 }
@@ -241,6 +733,7 @@ static void set_target(RenderingContext *ctx, Texture *texture)
   ctx->target_type = TARGET_TYPE_TEXTURE;
   ctx->target_width = texture->width;
   ctx->target_height = texture->height;
+  ctx->scissor = {0, 0, (int32_t) texture->width, (int32_t) texture->height};
 
   ctx->draw_line = &draw_line_rgba4f;
   ctx->blend_func = &blend_src_copy;
@@ -253,6 +746,7 @@ static void set_target(RenderingContext *ctx, DrawingBuffer *buffer)
   ctx->target_type = TARGET_TYPE_RGBA32;
   ctx->target_width = buffer->width;
   ctx->target_height = buffer->height;
+  ctx->scissor = {0, 0, (int32_t) buffer->width, (int32_t) buffer->height};
 
   ctx->flags = 0xF;
 
@@ -261,6 +755,21 @@ static void set_target(RenderingContext *ctx, DrawingBuffer *buffer)
   change_draw_func(ctx);
 }
 
+// Rect is expanded to the rasterizer block grid so blocks never cross scissor edges
+static void set_scissor(RenderingContext *ctx, RenderRect rect)
+{
+  rect.x0 = MAX(rect.x0, 0) & ~7;
+  rect.y0 = MAX(rect.y0, 0) & ~7;
+  rect.x1 = MIN((rect.x1 + 7) & ~7, (int32_t) ctx->target_width);
+  rect.y1 = MIN((rect.y1 + 7) & ~7, (int32_t) ctx->target_height);
+  ctx->scissor = rect;
+}
+
+static inline void reset_scissor(RenderingContext *ctx)
+{
+  ctx->scissor = {0, 0, (int32_t) ctx->target_width, (int32_t) ctx->target_height};
+}
+
 static inline void renderer_set_flags(RenderingContext *ctx, uint32_t flags)
 {
   uint32_t prevFlags = ctx->flags;
@@ -291,24 +800,151 @@ static inline void renderer_disable(RenderingContext *ctx, uint32_t flags)
   }
 }
 
-static void renderer_set_blend_mode(RenderingContext *ctx, BlendMode blend_mode)
+static BlendFunc *blend_mode_func(BlendMode blend_mode)
 {
   switch (blend_mode) {
     case BLEND_MODE_DECAL:
-      ctx->blend_func = &blend_decal;
-      break;
-
-    case BLEND_MODE_SRC_COPY:
-      ctx->blend_func = &blend_src_copy;
-      break;
+      return &blend_decal;
 
     case BLEND_MODE_SRC_ALPHA_ONE:
-      ctx->blend_func = &blend_src_alpha_one;
-      break;
+      return &blend_src_alpha_one;
 
+    case BLEND_MODE_SRC_COPY:
     default:
-      ctx->blend_func = &blend_src_copy;
-      break;
+      return &blend_src_copy;
+  }
+}
+
+static void renderer_set_blend_mode(RenderingContext *ctx, BlendMode blend_mode)
+{
+  ctx->blend_func = blend_mode_func(blend_mode);
+}
+
+#ifdef __ARCH_X86__
+// Target pixel to r, g, b, a floats and back, alpha is always written as opaque
+static inline __m128 sprite_unpack(uint32_t pixel)
+{
+  __m128i zero = _mm_setzero_si128();
+  __m128i c = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128((int32_t) pixel), zero), zero);
+  __m128 result = _mm_mul_ps(_mm_cvtepi32_ps(c), _mm_set1_ps(1.0f / 255.0f));
+#if COLOR_BGR
+  result = _mm_shuffle_ps(result, result, _MM_SHUFFLE(3, 0, 1, 2));
+#endif
+  return result;
+}
+
+static inline uint32_t sprite_pack(__m128 color)
+{
+#if COLOR_BGR
+  color = _mm_shuffle_ps(color, color, _MM_SHUFFLE(3, 0, 1, 2));
+#endif
+  __m128i c = _mm_cvttps_epi32(_mm_mul_ps(color, _mm_set1_ps(255.0f)));
+  c = _mm_packs_epi32(c, c);
+  c = _mm_packus_epi16(c, c);
+  return 0xFF000000 | (uint32_t) _mm_cvtsi128_si32(c);
+}
+#endif
+
+// Screen aligned rectangle that skips the triangle setup and barycentrics. p0 and p1 are
+// opposite corners in clip space, same as draw_triangle input, and map to uv.x0, uv.y0 and
+// uv.x1, uv.y1 in texels. Texture can be NULL for a solid tint. Depth of p0 is used for the
+// whole sprite when RENDER_ZTEST is enabled.
+static void draw_sprite(RenderingContext *ctx, Vec3f p0, Vec3f p1, Texture *texture, SpriteRect uv, Vec4f tint, BlendMode blend)
+{
+  ASSERT(ctx->target_type == TARGET_TYPE_RGBA32);
+  DrawingBuffer *target = (DrawingBuffer *) ctx->target;
+
+  p0 = p0 * ctx->viewport_mat;
+  p1 = p1 * ctx->viewport_mat;
+
+  float width = p1.x - p0.x;
+  float height = p1.y - p0.y;
+
+  if (width == 0.0f || height == 0.0f) {
+    return;
+  }
+
+  // Pixels are sampled at their corners like in draw_triangle
+  int32_t minx = MAX((int32_t) ceilf(MIN(p0.x, p1.x)), ctx->scissor.x0);
+  int32_t miny = MAX((int32_t) ceilf(MIN(p0.y, p1.y)), ctx->scissor.y0);
+  int32_t maxx = MIN((int32_t) ceilf(MAX(p0.x, p1.x)), ctx->scissor.x1);
+  int32_t maxy = MIN((int32_t) ceilf(MAX(p0.y, p1.y)), ctx->scissor.y1);
+
+  if (minx >= maxx || miny >= maxy) {
+    return;
+  }
+
+  float dudx = (uv.x1 - uv.x0) / width;
+  float dvdy = (uv.y1 - uv.y0) / height;
+  uint32_t clampu = texture ? texture->width - 1 : 0;
+  uint32_t clampv = texture ? texture->height - 1 : 0;
+
+  bool ztest = (ctx->flags & RENDER_ZTEST) != 0;
+  zval_t zvalue = (zval_t) ((1.0f - p0.z) * ZBUFFER_MAX);
+
+  uint32_t *pixels = (uint32_t *) target->pixels;
+
+#ifdef __ARCH_X86__
+  __m128 tintv = _mm_setr_ps(tint.x, tint.y, tint.z, tint.w);
+  __m128 zero = _mm_setzero_ps();
+  __m128 one = _mm_set1_ps(1.0f);
+#else
+  BlendFunc *blend_func = blend_mode_func(blend);
+#endif
+
+  for (int32_t y = miny; y < maxy; y++) {
+    float v = uv.y0 + ((float) y - p0.y) * dvdy;
+    float u = uv.x0 + ((float) minx - p0.x) * dudx;
+
+    Texel *texels = texture ? &texture->pixels[(((int32_t) v) & clampv) * texture->width] : NULL;
+    uint32_t *dst = &pixels[y * target->pitch + minx];
+    zval_t *zp = ztest ? &ctx->zbuffer[y * target->width + minx] : NULL;
+
+    for (int32_t x = minx; x < maxx; x++, u += dudx, dst++) {
+      if (ztest && !(zvalue > *zp++)) {
+        continue;
+      }
+
+#ifdef __ARCH_X86__
+      __m128 src = tintv;
+      if (texels) {
+        src = _mm_mul_ps(_mm_loadu_ps((float *) &texels[((int32_t) u) & clampu]), tintv);
+      }
+      src = _mm_min_ps(_mm_max_ps(src, zero), one);
+
+      float alpha = _mm_cvtss_f32(_mm_shuffle_ps(src, src, _MM_SHUFFLE(3, 3, 3, 3)));
+      if (alpha == 0.0f) {
+        continue; // Leaves the target as is in every blend mode
+      }
+
+      if (blend == BLEND_MODE_DECAL && alpha < 1.0f) {
+        __m128 a = _mm_set1_ps(alpha);
+        src = _mm_add_ps(_mm_mul_ps(src, a), _mm_mul_ps(sprite_unpack(*dst), _mm_sub_ps(one, a)));
+      } else if (blend == BLEND_MODE_SRC_ALPHA_ONE) {
+        src = _mm_min_ps(_mm_add_ps(_mm_mul_ps(src, _mm_set1_ps(alpha)), sprite_unpack(*dst)), one);
+      }
+
+      *dst = sprite_pack(src);
+#else
+      Vec4f src = tint;
+      if (texels) {
+        Vec4f texel = texels[((int32_t) u) & clampu];
+        src = Vec4f(texel.x * tint.x, texel.y * tint.y, texel.z * tint.z, texel.w * tint.w);
+      }
+      src = src.clamped();
+
+      float alpha = src.a;
+      if (alpha == 0.0f) {
+        continue;
+      }
+
+      *dst = rgba_color(blend_func(src, color_rgba(*dst)));
+#endif
+
+      if (ztest && (blend == BLEND_MODE_SRC_COPY || alpha > 0.5f)) {
+        zp[-1] = zvalue;
+      }
+    }
   }
 }
 
@@ -400,3 +1036,488 @@ Mat44 look_at_matrix(Vec3f from, Vec3f to, Vec3f up)
 
   return result;
 }
+
+/* Command buffers, recorded on one thread and executed on another */
+
+#define RENDER_COMMAND_ALIGNMENT 16
+#define RENDER_COMMAND_ALIGN(size) (((size) + RENDER_COMMAND_ALIGNMENT - 1) & ~((size_t) RENDER_COMMAND_ALIGNMENT - 1))
+
+typedef struct RenderCommandSetState {
+  RenderCommand header;
+  RenderState state;
+} RenderCommandSetState;
+
+typedef struct RenderCommandSetMatrices {
+  RenderCommand header;
+  Mat44 viewport_mat;
+  Mat44 mvp_mat; // Lines are transformed on execution
+  Vec3f light;
+} RenderCommandSetMatrices;
+
+typedef struct RenderCommandDrawTriangle {
+  RenderCommand header;
+  FragmentFunc *fragment;
+  void *shader_data; // Copy stored right after the command
+  Vec3f p0;
+  Vec3f p1;
+  Vec3f p2;
+} RenderCommandDrawTriangle;
+
+typedef struct RenderCommandDrawLine {
+  RenderCommand header;
+  Vec3f p0;
+  Vec3f p1;
+  Vec4f color;
+} RenderCommandDrawLine;
+
+typedef struct RenderCommandDrawSprite {
+  RenderCommand header;
+  Vec3f p0;
+  Vec3f p1;
+  Texture *texture;
+  SpriteRect uv;
+  Vec4f tint;
+  BlendMode blend;
+} RenderCommandDrawSprite;
+
+typedef struct RenderCommandCallback {
+  RenderCommand header;
+  RenderCallback *callback;
+  void *data; // Copy stored right after the command
+} RenderCommandCallback;
+
+static void render_commands_init(RenderCommandBuffer *buffer, void *memory, size_t size)
+{
+  *buffer = {};
+  buffer->memory = (uint8_t *) memory;
+  buffer->size = size;
+}
+
+static void render_commands_reset(RenderCommandBuffer *buffer)
+{
+  buffer->used = 0;
+  buffer->count = 0;
+  buffer->overflowed = false;
+  buffer->state_valid = false;
+}
+
+// Returns NULL when the buffer is full, everything recorded after that is dropped
+static void *render_commands__push(RenderCommandBuffer *buffer, RenderCommandType type, size_t size)
+{
+  size = RENDER_COMMAND_ALIGN(size);
+
+  if (buffer->overflowed || buffer->used + size > buffer->size) {
+    if (!buffer->overflowed) {
+      printf("Render command buffer is full (%zu bytes), dropping commands\n", buffer->size);
+      buffer->overflowed = true;
+    }
+    return NULL;
+  }
+
+  RenderCommand *result = (RenderCommand *) (buffer->memory + buffer->used);
+  result->type = type;
+  result->size = (uint32_t) size;
+
+  buffer->used += size;
+  buffer->count++;
+
+  return result;
+}
+
+static RenderState render_state_capture(RenderingContext *ctx)
+{
+  RenderState result;
+  memset(&result, 0, sizeof(result)); // Padding takes part in comparisons
+
+  result.target_type = ctx->target_type;
+  if (ctx->target_type == TARGET_TYPE_RGBA32) {
+    result.buffer = *(DrawingBuffer *) ctx->target;
+  } else {
+    result.texture = *(Texture *) ctx->target;
+  }
+
+  result.scissor = ctx->scissor;
+  result.zbuffer = ctx->zbuffer;
+  result.msaa_color = ctx->msaa_color;
+  result.msaa_zbuffer = ctx->msaa_zbuffer;
+  result.blend_func = ctx->blend_func;
+  result.flags = ctx->flags;
+
+  return result;
+}
+
+static void render_state_apply(RenderingContext *ctx, RenderState *state)
+{
+  ctx->target_type = state->target_type;
+
+  if (state->target_type == TARGET_TYPE_RGBA32) {
+    ctx->target = &state->buffer;
+    ctx->target_width = state->buffer.width;
+    ctx->target_height = state->buffer.height;
+    ctx->draw_line = &draw_line_rgba32;
+  } else {
+    ctx->target = &state->texture;
+    ctx->target_width = state->texture.width;
+    ctx->target_height = state->texture.height;
+    ctx->draw_line = &draw_line_rgba4f;
+  }
+
+  ctx->scissor = state->scissor;
+  ctx->zbuffer = state->zbuffer;
+  ctx->msaa_color = state->msaa_color;
+  ctx->msaa_zbuffer = state->msaa_zbuffer;
+  ctx->blend_func = state->blend_func;
+  ctx->flags = state->flags;
+  change_draw_func(ctx);
+}
+
+// Records state changes since the previous command, called before every recorded draw
+static void render_commands__sync(RenderingContext *ctx)
+{
+  RenderCommandBuffer *buffer = ctx->commands;
+  RenderState state = render_state_capture(ctx);
+
+  if (!buffer->state_valid || memcmp(&state, &buffer->state, sizeof(state)) != 0) {
+    RenderCommandSetState *cmd = (RenderCommandSetState *) render_commands__push(buffer, RENDER_COMMAND_SET_STATE, sizeof(RenderCommandSetState));
+    if (cmd) {
+      cmd->state = state;
+    }
+    buffer->state = state;
+  }
+
+  if (!buffer->state_valid ||
+      memcmp(&ctx->viewport_mat, &buffer->viewport_mat, sizeof(Mat44)) != 0 ||
+      memcmp(&ctx->mvp_mat, &buffer->mvp_mat, sizeof(Mat44)) != 0 ||
+      memcmp(&ctx->light, &buffer->light, sizeof(Vec3f)) != 0) {
+    RenderCommandSetMatrices *cmd = (RenderCommandSetMatrices *) render_commands__push(buffer, RENDER_COMMAND_SET_MATRICES, sizeof(RenderCommandSetMatrices));
+    if (cmd) {
+      cmd->viewport_mat = ctx->viewport_mat;
+      cmd->mvp_mat = ctx->mvp_mat;
+      cmd->light = ctx->light;
+    }
+    buffer->viewport_mat = ctx->viewport_mat;
+    buffer->mvp_mat = ctx->mvp_mat;
+    buffer->light = ctx->light;
+  }
+
+  buffer->state_valid = true;
+}
+
+// Copies data that recorded commands point to, e.g. shader settings, so it stays the same until they execute
+static void *render_commands_push_data(RenderingContext *ctx, void *data, size_t size)
+{
+  if (!ctx->commands) {
+    return data;
+  }
+
+  size_t offset = RENDER_COMMAND_ALIGN(sizeof(RenderCommand));
+  uint8_t *cmd = (uint8_t *) render_commands__push(ctx->commands, RENDER_COMMAND_DATA, offset + size);
+  if (!cmd) {
+    return data;
+  }
+
+  memcpy(cmd + offset, data, size);
+  return cmd + offset;
+}
+
+// Draws right away or records into ctx->commands, shader data is copied when recording
+static void render_triangle(RenderingContext *ctx, FragmentFunc *fragment, void *shader_data, size_t shader_data_size,
+                            Vec3f p0, Vec3f p1, Vec3f p2)
+{
+  if (!ctx->commands) {
+    ctx->draw_triangle(ctx, fragment, shader_data, p0, p1, p2);
+    return;
+  }
+
+  render_commands__sync(ctx);
+
+  size_t offset = RENDER_COMMAND_ALIGN(sizeof(RenderCommandDrawTriangle));
+  RenderCommandDrawTriangle *cmd = (RenderCommandDrawTriangle *) render_commands__push(ctx->commands, RENDER_COMMAND_DRAW_TRIANGLE, offset + shader_data_size);
+  if (!cmd) {
+    return;
+  }
+
+  cmd->fragment = fragment;
+  cmd->shader_data = (uint8_t *) cmd + offset;
+  cmd->p0 = p0;
+  cmd->p1 = p1;
+  cmd->p2 = p2;
+  memcpy(cmd->shader_data, shader_data, shader_data_size);
+}
+
+static void render_line(RenderingContext *ctx, Vec3f p0, Vec3f p1, Vec4f color)
+{
+  if (!ctx->commands) {
+    ctx->draw_line(ctx, p0, p1, color);
+    return;
+  }
+
+  render_commands__sync(ctx);
+
+  RenderCommandDrawLine *cmd = (RenderCommandDrawLine *) render_commands__push(ctx->commands, RENDER_COMMAND_DRAW_LINE, sizeof(RenderCommandDrawLine));
+  if (cmd) {
+    cmd->p0 = p0;
+    cmd->p1 = p1;
+    cmd->color = color;
+  }
+}
+
+static void render_sprite(RenderingContext *ctx, Vec3f p0, Vec3f p1, Texture *texture, SpriteRect uv, Vec4f tint, BlendMode blend)
+{
+  if (!ctx->commands) {
+    draw_sprite(ctx, p0, p1, texture, uv, tint, blend);
+    return;
+  }
+
+  render_commands__sync(ctx);
+
+  RenderCommandDrawSprite *cmd = (RenderCommandDrawSprite *) render_commands__push(ctx->commands, RENDER_COMMAND_DRAW_SPRITE, sizeof(RenderCommandDrawSprite));
+  if (cmd) {
+    cmd->p0 = p0;
+    cmd->p1 = p1;
+    cmd->texture = texture;
+    cmd->uv = uv;
+    cmd->tint = tint;
+    cmd->blend = blend;
+  }
+}
+
+// Arbitrary work on the target in command order, e.g. resolves and post-processing
+static void render_callback(RenderingContext *ctx, RenderCallback *callback, void *data, size_t size)
+{
+  if (!ctx->commands) {
+    callback(ctx, data);
+    return;
+  }
+
+  render_commands__sync(ctx);
+
+  size_t offset = RENDER_COMMAND_ALIGN(sizeof(RenderCommandCallback));
+  RenderCommandCallback *cmd = (RenderCommandCallback *) render_commands__push(ctx->commands, RENDER_COMMAND_CALLBACK, offset + size);
+  if (cmd) {
+    cmd->callback = callback;
+    cmd->data = NULL;
+    if (size) {
+      cmd->data = (uint8_t *) cmd + offset;
+      memcpy(cmd->data, data, size);
+    }
+  }
+}
+
+typedef struct RenderClearData {
+  Vec4f color;
+  uint32_t what;
+} RenderClearData;
+
+static RENDER_CALLBACK(render_clear_callback)
+{
+  RenderClearData *d = (RenderClearData *) data;
+
+  if (ctx->flags & RENDER_MSAA) {
+    msaa_clear(ctx, d->color, d->what);
+    return;
+  }
+
+  if (d->what & RENDER_CLEAR_COLOR) {
+    if (ctx->target_type == TARGET_TYPE_RGBA32) {
+      DrawingBuffer *buffer = (DrawingBuffer *) ctx->target;
+      uint32_t value = rgba_color(d->color);
+
+      for (uint32_t y = 0; y < buffer->height; y++) {
+        fill_pixels(&((uint32_t *) buffer->pixels)[y * buffer->pitch], buffer->width, value);
+      }
+    } else {
+      Texture *texture = (Texture *) ctx->target;
+      for (uint32_t i = 0; i < texture->width * texture->height; i++) {
+        texture->pixels[i] = d->color;
+      }
+    }
+  }
+
+  if (d->what & RENDER_CLEAR_DEPTH) {
+    clear_zbuffer(ctx);
+  }
+}
+
+// Clears sample buffers instead of the target when RENDER_MSAA is enabled
+static void render_clear(RenderingContext *ctx, Vec4f color, uint32_t what)
+{
+  RenderClearData data = {color, what};
+  render_callback(ctx, &render_clear_callback, &data, sizeof(data));
+}
+
+static RENDER_CALLBACK(msaa_resolve_callback)
+{
+  msaa_resolve(ctx);
+}
+
+static void render_commands_execute_range(RenderingContext *ctx, RenderCommandBuffer *buffer, size_t begin, size_t end_offset)
+{
+  ASSERT(ctx->commands == NULL);
+
+  uint8_t *at = buffer->memory + begin;
+  uint8_t *end = buffer->memory + end_offset;
+
+  while (at < end) {
+    RenderCommand *header = (RenderCommand *) at;
+
+    switch (header->type) {
+      case RENDER_COMMAND_SET_STATE:
+        render_state_apply(ctx, &((RenderCommandSetState *) header)->state);
+        break;
+
+      case RENDER_COMMAND_SET_MATRICES: {
+        RenderCommandSetMatrices *cmd = (RenderCommandSetMatrices *) header;
+        ctx->viewport_mat = cmd->viewport_mat;
+        ctx->mvp_mat = cmd->mvp_mat;
+        ctx->light = cmd->light;
+      }; break;
+
+      case RENDER_COMMAND_DRAW_TRIANGLE: {
+        RenderCommandDrawTriangle *cmd = (RenderCommandDrawTriangle *) header;
+        ctx->draw_triangle(ctx, cmd->fragment, cmd->shader_data, cmd->p0, cmd->p1, cmd->p2);
+      }; break;
+
+      case RENDER_COMMAND_DRAW_LINE: {
+        RenderCommandDrawLine *cmd = (RenderCommandDrawLine *) header;
+        ctx->draw_line(ctx, cmd->p0, cmd->p1, cmd->color);
+      }; break;
+
+      case RENDER_COMMAND_DRAW_SPRITE: {
+        RenderCommandDrawSprite *cmd = (RenderCommandDrawSprite *) header;
+        draw_sprite(ctx, cmd->p0, cmd->p1, cmd->texture, cmd->uv, cmd->tint, cmd->blend);
+      }; break;
+
+      case RENDER_COMMAND_CALLBACK: {
+        RenderCommandCallback *cmd = (RenderCommandCallback *) header;
+        cmd->callback(ctx, cmd->data);
+      }; break;
+
+      case RENDER_COMMAND_DATA:
+        break;
+    }
+
+    at += header->size;
+  }
+}
+
+static void render_commands_execute(RenderingContext *ctx, RenderCommandBuffer *buffer)
+{
+  render_commands_execute_range(ctx, buffer, 0, buffer->used);
+}
+
+static void render_graph_begin(RenderGraph *graph, RenderCommandBuffer *commands)
+{
+  graph->commands = commands;
+  graph->passes_count = 0;
+  graph->recording = false;
+  graph->wall_ms = 0.0f;
+}
+
+// Everything recorded until render_graph_pass_end belongs to the pass
+static void render_graph_pass_begin(RenderGraph *graph, const char *name, uint32_t reads, uint32_t writes)
+{
+  ASSERT(!graph->recording);
+  ASSERT(graph->passes_count < RENDER_GRAPH_MAX_PASSES);
+  if (graph->passes_count >= RENDER_GRAPH_MAX_PASSES) {
+    return;
+  }
+
+  RenderGraphPass *pass = &graph->passes[graph->passes_count];
+  snprintf(pass->name, sizeof(pass->name), "%s", name);
+  pass->reads = reads;
+  pass->writes = writes;
+  pass->begin = graph->commands->used;
+  pass->end = pass->begin;
+  pass->dependencies = 0;
+  pass->ms = 0.0f;
+
+  // Passes run on their own contexts, so each starts with the complete state
+  graph->commands->state_valid = false;
+  graph->recording = true;
+}
+
+static void render_graph_pass_end(RenderGraph *graph)
+{
+  if (!graph->recording) {
+    return;
+  }
+
+  uint32_t index = graph->passes_count++;
+  RenderGraphPass *pass = &graph->passes[index];
+  pass->end = graph->commands->used;
+
+  // Read after write, write after read and write after write hazards order passes
+  for (uint32_t i = 0; i < index; i++) {
+    RenderGraphPass *prev = &graph->passes[i];
+    if ((pass->reads & prev->writes) || (pass->writes & (prev->reads | prev->writes))) {
+      pass->dependencies |= 1 << i;
+    }
+  }
+
+  graph->recording = false;
+}
+
+typedef struct RenderGraphTask {
+  RenderGraph *graph;
+  RenderGraphPass *pass;
+  RenderingContext *ctx;
+  GetTimeFunc get_time;
+} RenderGraphTask;
+
+static WORK_QUEUE_CALLBACK(render_graph_execute_pass)
+{
+  RenderGraphTask *task = (RenderGraphTask *) data;
+  RenderGraphPass *pass = task->pass;
+
+  double start = task->get_time();
+  render_commands_execute_range(task->ctx, task->graph->commands, pass->begin, pass->end);
+  pass->ms = (float) ((task->get_time() - start) * 1000.0);
+}
+
+// Runs every pass whose dependencies are done at once, contexts has to hold a context per pass
+static void render_graph_execute(RenderGraph *graph, PlatformAPI *api, PlatformWorkQueue *queue, RenderingContext *contexts)
+{
+  ASSERT(!graph->recording);
+
+  RenderGraphTask tasks[RENDER_GRAPH_MAX_PASSES];
+  uint32_t done = 0;
+  WorkQueueBatch batch = {}; // The pool is shared, other callers' work isn't waited for
+  uint32_t all = graph->passes_count < 32 ? (1u << graph->passes_count) - 1 : 0xFFFFFFFF;
+  double start = api->get_time();
+
+  while (done != all) {
+    uint32_t ready = 0;
+    uint32_t ready_count = 0;
+
+    for (uint32_t i = 0; i < graph->passes_count; i++) {
+      if (!(done & (1 << i)) && (graph->passes[i].dependencies & ~done) == 0) {
+        tasks[i] = {graph, &graph->passes[i], &contexts[i], api->get_time};
+        ready |= 1 << i;
+        ready_count++;
+      }
+    }
+
+    ASSERT(ready_count > 0);
+
+    for (uint32_t i = 0; i < graph->passes_count; i++) {
+      if (!(ready & (1 << i))) {
+        continue;
+      }
+
+      if (ready_count == 1 || queue == NULL) {
+        render_graph_execute_pass(&tasks[i]); // Nothing to overlap with
+      } else {
+        api->work_queue_add(queue, &batch, &render_graph_execute_pass, &tasks[i]);
+      }
+    }
+
+    if (ready_count > 1 && queue != NULL) {
+      api->work_queue_complete(queue, &batch);
+    }
+
+    done |= ready;
+  }
+
+  graph->wall_ms = (float) ((api->get_time() - start) * 1000.0);
+}
@@ -54,10 +54,98 @@ typedef struct ShaderContext {
   Vec3f positions[3];
 } ShaderContext;
 
+typedef struct RenderRect {
+  int32_t x0;
+  int32_t y0;
+  int32_t x1; // Exclusive
+  int32_t y1; // Exclusive
+} RenderRect;
+
+typedef struct SpriteRect {
+  float x0;
+  float y0;
+  float x1;
+  float y1;
+} SpriteRect;
+
 #define RENDER_BLENDING (1 << 0)
 #define RENDER_CULLING (1 << 1)
 #define RENDER_SHADING (1 << 2)
 #define RENDER_ZTEST (1 << 3)
+#define RENDER_MSAA (1 << 4) // Rasterize into msaa_color/msaa_zbuffer, see msaa_resolve
+
+#define MSAA_SAMPLES 4
+
+#define RENDER_CLEAR_COLOR (1 << 0)
+#define RENDER_CLEAR_DEPTH (1 << 1)
+
+#define RENDER_CALLBACK(name) void name(RenderingContext *ctx, void *data)
+typedef RENDER_CALLBACK(RenderCallback);
+
+typedef enum RenderCommandType {
+  RENDER_COMMAND_SET_STATE,
+  RENDER_COMMAND_SET_MATRICES,
+  RENDER_COMMAND_DRAW_TRIANGLE,
+  RENDER_COMMAND_DRAW_LINE,
+  RENDER_COMMAND_DRAW_SPRITE,
+  RENDER_COMMAND_CALLBACK,
+  RENDER_COMMAND_DATA // Payload referenced by other commands, skipped on execution
+} RenderCommandType;
+
+// Context state the rasterizer depends on. Targets are copied so they can change while recorded commands wait.
+typedef struct RenderState {
+  TargetType target_type;
+  DrawingBuffer buffer;
+  Texture texture;
+  RenderRect scissor;
+  zval_t *zbuffer;
+  uint32_t *msaa_color;
+  zval_t *msaa_zbuffer;
+  BlendFunc *blend_func;
+  uint32_t flags;
+} RenderState;
+
+typedef struct RenderCommand {
+  RenderCommandType type;
+  uint32_t size; // Including the header
+} RenderCommand;
+
+typedef struct RenderCommandBuffer {
+  uint8_t *memory;
+  size_t size;
+  size_t used;
+  uint32_t count;
+  bool overflowed;
+
+  // Last recorded state, new state commands are only emitted when it changes
+  bool state_valid;
+  RenderState state;
+  Mat44 viewport_mat;
+  Mat44 mvp_mat;
+  Vec3f light;
+} RenderCommandBuffer;
+
+#define RENDER_GRAPH_MAX_PASSES 16
+
+// Recorded commands of one pass, resources are bits defined by the application
+typedef struct RenderGraphPass {
+  char name[16]; // Copied, timings outlive the module on reloads
+  uint32_t reads;
+  uint32_t writes;
+  size_t begin; // Byte range in the graph's command buffer
+  size_t end;
+  uint32_t dependencies; // Bits of earlier passes that have to complete first
+  float ms;
+} RenderGraphPass;
+
+// Passes are recorded one after another and executed concurrently when they don't touch the same resources
+typedef struct RenderGraph {
+  RenderCommandBuffer *commands;
+  RenderGraphPass passes[RENDER_GRAPH_MAX_PASSES];
+  uint32_t passes_count;
+  bool recording; // Inside render_graph_pass_begin/end
+  float wall_ms; // Whole graph, compare with the sum of pass times to see the overlap
+} RenderGraph;
 
 typedef struct RenderingContext {
   void *target;
@@ -65,8 +153,16 @@ typedef struct RenderingContext {
   uint32_t target_width;
   uint32_t target_height;
 
+  RenderRect scissor; // Triangles are only rasterized inside, see set_scissor
+
   zval_t *zbuffer;
 
+  // MSAA_SAMPLES values per target pixel, only needed with RENDER_MSAA
+  uint32_t *msaa_color;
+  zval_t *msaa_zbuffer;
+
+  RenderCommandBuffer *commands; // Draws are recorded here instead of executed when set
+
   DrawTriangleFunc *draw_triangle;
   DrawLineFunc *draw_line;
   BlendFunc *blend_func;
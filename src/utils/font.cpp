@@ -119,12 +119,6 @@ static void font_render_text(Font *font, RenderingContext *ctx, float x, float y
     return;
   }
 
-  FontShaderData data = {};
-  data.texture = font->texture;
-  data.clampu = data.texture->width - 1;
-  data.clampv = data.texture->height - 1;
-  data.tint = tint;
-
   float x0 = x;
 
   uint32_t codepoint;
@@ -141,27 +135,11 @@ static void font_render_text(Font *font, RenderingContext *ctx, float x, float y
       continue;
     }
 
-    Vec3f tex[4] = {};
-    tex[0] = {q.s0, q.t0, 0.0f};
-    tex[1] = {q.s1, q.t0, 0.0f};
-    tex[2] = {q.s1, q.t1, 0.0f};
-    tex[3] = {q.s0, q.t1, 0.0f};
-
-    Vec3f pos[4] = {};
-    pos[0] = Vec3f{q.x0 + x, q.y0 + y, 0.0f} * ctx->mvp_mat;
-    pos[1] = Vec3f{q.x1 + x, q.y0 + y, 0.0f} * ctx->mvp_mat;
-    pos[2] = Vec3f{q.x1 + x, q.y1 + y, 0.0f} * ctx->mvp_mat;
-    pos[3] = Vec3f{q.x0 + x, q.y1 + y, 0.0f} * ctx->mvp_mat;
+    Vec3f p0 = Vec3f{q.x0 + x, q.y0 + y, 0.0f} * ctx->mvp_mat;
+    Vec3f p1 = Vec3f{q.x1 + x, q.y1 + y, 0.0f} * ctx->mvp_mat;
 
     x += kerning;
 
-    data.uv0 = tex[0];
-    data.duv[0] = tex[1] - data.uv0;
-    data.duv[1] = tex[2] - data.uv0;
-    ctx->draw_triangle(ctx, &fragment_text, (void *) &data, pos[0], pos[1], pos[2]);
-
-    data.duv[0] = tex[2] - data.uv0;
-    data.duv[1] = tex[3] - data.uv0;
-    ctx->draw_triangle(ctx, &fragment_text, (void *) &data, pos[0], pos[2], pos[3]);
+    render_sprite(ctx, p0, p1, font->texture, {q.s0, q.t0, q.s1, q.t1}, tint, BLEND_MODE_DECAL);
   }
 }
@@ -375,6 +375,77 @@ Mat44 Mat44::from_quaternion(Quaternion q)
   return result;
 }
 
+//
+// Mat34
+//
+
+Mat34 Mat34::identity()
+{
+  Mat34 result = {};
+
+  result.a = 1.0f;
+  result.f = 1.0f;
+  result.k = 1.0f;
+
+  return result;
+}
+
+Mat34 Mat34::from_quaternion(Quaternion q)
+{
+  Mat44 rot = Mat44::from_quaternion(q);
+  Mat34 result = {};
+
+  for (int row = 0; row < 3; row++) {
+    for (int col = 0; col < 3; col++) {
+      result.el[row][col] = rot.el[row][col];
+    }
+  }
+
+  return result;
+}
+
+Mat44 Mat34::mat44()
+{
+  Mat44 result = {};
+
+  for (int row = 0; row < 4; row++) {
+    for (int col = 0; col < 3; col++) {
+      result.el[row][col] = el[row][col];
+    }
+  }
+
+  result.p = 1.0f;
+
+  return result;
+}
+
+inline Mat34 operator*(Mat34 m1, Mat34 m2)
+{
+  Mat34 result;
+
+  for (int i = 0; i < 3; i++) {
+    for (int j = 0; j < 3; j++) {
+      result.el[i][j] = m1.el[i][0] * m2.el[0][j] + m1.el[i][1] * m2.el[1][j] + m1.el[i][2] * m2.el[2][j];
+    }
+  }
+
+  for (int j = 0; j < 3; j++) {
+    result.el[3][j] = m1.el[3][0] * m2.el[0][j] + m1.el[3][1] * m2.el[1][j] + m1.el[3][2] * m2.el[2][j] + m2.el[3][j];
+  }
+
+  return result;
+}
+
+inline Vec3f operator*(Vec3f v, Mat34 mat)
+{
+  Vec3f result;
+
+  result.x = v.x * mat.a + v.y * mat.e + v.z * mat.i + mat.m;
+  result.y = v.x * mat.b + v.y * mat.f + v.z * mat.j + mat.n;
+  result.z = v.x * mat.c + v.y * mat.g + v.z * mat.k + mat.o;
+
+  return result;
+}
 
 //
 // Fixed point
@@ -57,6 +57,24 @@ typedef struct Mat44 {
   Mat44 transposed();
 } Mat44;
 
+// Affine transform, the last column is implicitly (0, 0, 0, 1)
+typedef struct Mat34 {
+  union {
+    float el[4][3];
+    struct {
+      float a, b, c;
+      float e, f, g;
+      float i, j, k;
+      float m, n, o;
+    };
+  };
+
+  static inline Mat34 identity();
+  static inline Mat34 from_quaternion(Quaternion q);
+
+  Mat44 mat44();
+} Mat34;
+
 typedef union Vec3f {
   struct {
     float x;
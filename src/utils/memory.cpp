@@ -59,7 +59,7 @@ void *memory_allocate(MemoryAllocator *allocator, uint32_t size)
 
 void memory_free(MemoryAllocator *allocator, void *memory)
 {
-  uint32_t size = *((uint32_t *) memory - 1);
-  allocator->total_allocated -= size;
-  allocator->papi->free_memory(memory);
+  uint32_t *header = (uint32_t *) memory - 1;
+  allocator->total_allocated -= header[0];
+  allocator->papi->free_memory(header);
 }
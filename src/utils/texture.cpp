@@ -45,16 +45,14 @@ static inline void texture_clear(Texture *texture, Vec4f color)
 {
   ASSERT(texture != NULL);
 
-  uint32_t iterCount = (texture->width * texture->height) / 4;
+  uint32_t count = texture->width * texture->height;
 
-  __m128 value = _mm_set_ps(color.x, color.y, color.z, color.a);
-  __m128 *p = (__m128 *) texture->pixels;
+  // One texel per register, lanes in memory order
+  __m128 value = _mm_setr_ps(color.x, color.y, color.z, color.w);
+  float *p = (float *) texture->pixels;
 
-  while (iterCount--) {
-    p[0] = value;
-    p[1] = value;
-    p[2] = value;
-    p[3] = value;
+  for (uint32_t i = 0; i < count; i++) {
+    _mm_storeu_ps(p, value);
     p += 4;
   }
 }
@@ -2,18 +2,6 @@
 
 #include "ui.h"
 
-typedef struct UIShaderData {
-  Vec3f pos[3];
-  Vec4f color;
-} UIShaderData;
-
-FRAGMENT_FUNC(fragment_ui)
-{
-  UIShaderData *d = (UIShaderData *) shader_data;
-  *color = d->color;
-  return true;
-}
-
 static void ui_init(UIContext *ctx, RenderingContext *renderingContext, Font *font,
                     KeyboardState *keyboardState, MouseState *mouseState)
 {
@@ -44,26 +32,6 @@ static inline bool ui_is_hovering_rect(UIContext *ctx, UIRect r)
   return result;
 }
 
-static void ui_rect(UIContext *ctx, UIRect rect, Vec4f color)
-{
-
-  UIShaderData data = {};
-  data.color = color;
-
-  Mat44 mvp = ctx->renderingContext->mvp_mat;
-
-  Vec3f pos[4] = {
-    Vec3f{rect.x0, rect.y0, 0.0f} * mvp,
-    Vec3f{rect.x1, rect.y0, 0.0f} * mvp,
-    Vec3f{rect.x1, rect.y1, 0.0f} * mvp,
-    Vec3f{rect.x0, rect.y1, 0.0f} * mvp
-  };
-
-  RenderingContext *rctx = ctx->renderingContext;
-  rctx->draw_triangle(ctx->renderingContext, &fragment_ui, (void *) &data, pos[0], pos[1], pos[2]);
-  rctx->draw_triangle(ctx->renderingContext, &fragment_ui, (void *) &data, pos[0], pos[2], pos[3]);
-}
-
 #define FNV_PRIME 16777619
 #define FNV_START 0x811c9dc5
 
@@ -96,6 +64,70 @@ static inline uint32_t fnv_hash_add_string(uint32_t current, char *string)
   return result;
 }
 
+static void ui__draw_rect(UIContext *ctx, UIRect rect, Vec4f color)
+{
+  RenderingContext *rctx = ctx->renderingContext;
+  Mat44 mvp = rctx->mvp_mat;
+
+  render_sprite(rctx, Vec3f{rect.x0, rect.y0, 0.0f} * mvp, Vec3f{rect.x1, rect.y1, 0.0f} * mvp,
+              NULL, {}, color, BLEND_MODE_DECAL);
+}
+
+static void ui__push_command(UIContext *ctx, UIDrawCommandType type, UIRect bounds, Vec4f color,
+                             float x = 0.0f, float y = 0.0f, uint8_t *text = NULL)
+{
+  ASSERT(ctx->commands_count < UI_MAX_DRAW_COMMANDS);
+  if (ctx->commands_count >= UI_MAX_DRAW_COMMANDS) {
+    return;
+  }
+
+  UIDrawCommand cmd = {};
+  cmd.type = type;
+  cmd.bounds = bounds;
+  cmd.color = color;
+  cmd.x = x;
+  cmd.y = y;
+
+  uint32_t hash = fnv_hash_add_data(FNV_START, (void *) &type, sizeof(type));
+  hash = fnv_hash_add_data(hash, (void *) &bounds, sizeof(bounds));
+  hash = fnv_hash_add_data(hash, (void *) &color.r, sizeof(float) * 4);
+  hash = fnv_hash_add_data(hash, (void *) &x, sizeof(x));
+  hash = fnv_hash_add_data(hash, (void *) &y, sizeof(y));
+
+  if (text != NULL) {
+    size_t length = strlen((char *) text) + 1;
+    if (ctx->text_pool_used + length > UI_TEXT_POOL_SIZE) {
+      return;
+    }
+
+    cmd.text_offset = ctx->text_pool_used;
+    memcpy(&ctx->text_pool[ctx->text_pool_used], text, length);
+    ctx->text_pool_used += length;
+    hash = fnv_hash_add_string(hash, (char *) text);
+  }
+
+  ctx->commands[ctx->commands_count] = cmd;
+  ctx->command_hashes[ctx->commands_count] = hash;
+  ctx->commands_count++;
+}
+
+static void ui_rect(UIContext *ctx, UIRect rect, Vec4f color)
+{
+  ui__push_command(ctx, UI_DRAW_RECT, rect, color);
+}
+
+static void ui_text(UIContext *ctx, float x, float y, uint8_t *text, Vec4f tint)
+{
+  if (text == NULL) {
+    return;
+  }
+
+  // Glyphs may extend past the advance width and below the baseline
+  float width = font_get_text_width(ctx->font, text);
+  UIRect bounds = {x - 2.0f, y - ctx->font->lineHeight, x + width + 2.0f, y + 0.5f * ctx->font->lineHeight};
+  ui__push_command(ctx, UI_DRAW_TEXT, bounds, tint, x, y, text);
+}
+
 #define UI_BUTTON_TYPE 1
 
 #define UI_BUTTON_COLOR_NORMAL (Vec4f{0.55f, 0.55f, 0.55f, 1.0f})
@@ -160,6 +192,7 @@ ui_button_result ui_button(UIContext *ctx, float width, float height, uint8_t *t
   if (!mouseIsDown && active) {
     ui_set_active(ctx, 0);
     clicked = hover;
+    ctx->interacted |= clicked;
   }
 
   Vec4f color = ctx->disabled ? UI_BUTTON_COLOR_DISABLED : UI_BUTTON_COLOR_NORMAL;
@@ -186,7 +219,7 @@ ui_button_result ui_button(UIContext *ctx, float width, float height, uint8_t *t
   float yOffset = 0.5 * (rect.y1 - rect.y0) + 0.5 * ctx->font->capHeight;
 
   Vec4f tint = ctx->disabled ? UI_FONT_TINT_DISABLED : UI_FONT_TINT_NONE;
-  font_render_text(ctx->font, ctx->renderingContext, rect.x0 + xOffset, rect.y0 + yOffset, text, tint);
+  ui_text(ctx, rect.x0 + xOffset, rect.y0 + yOffset, text, tint);
 
   return result;
 }
@@ -212,7 +245,7 @@ void ui_label(UIContext *ctx, float width, float height, uint8_t *text, UIAlign
   float yOffset = 0.5 * (rect.y1 - rect.y0) + 0.5 * ctx->font->capHeight;
 
   Vec4f tint = ctx->disabled ? UI_FONT_TINT_DISABLED : UI_FONT_TINT_NONE;
-  font_render_text(ctx->font, ctx->renderingContext, rect.x0 + xOffset, rect.y0 + yOffset, text, tint);
+  ui_text(ctx, rect.x0 + xOffset, rect.y0 + yOffset, text, tint);
 }
 
 void ui_begin(UIContext *ctx, float x, float y)
@@ -221,6 +254,76 @@ void ui_begin(UIContext *ctx, float x, float y)
   ctx->x = x;
   ctx->y = y;
   ctx->disabled = false;
+  ctx->interacted = false;
+
+  for (uint32_t i = 0; i < ctx->commands_count; i++) {
+    ctx->prev_bounds[i] = ctx->commands[i].bounds;
+    ctx->prev_hashes[i] = ctx->command_hashes[i];
+  }
+
+  ctx->prev_count = ctx->commands_count;
+  ctx->commands_count = 0;
+  ctx->text_pool_used = 0;
+}
+
+// Replays recorded commands, the rendering context scissor limits what gets touched
+void ui_draw(UIContext *ctx)
+{
+  for (uint32_t i = 0; i < ctx->commands_count; i++) {
+    UIDrawCommand *cmd = &ctx->commands[i];
+
+    switch (cmd->type) {
+      case UI_DRAW_RECT:
+        ui__draw_rect(ctx, cmd->bounds, cmd->color);
+        break;
+
+      case UI_DRAW_TEXT:
+        font_render_text(ctx->font, ctx->renderingContext, cmd->x, cmd->y, (uint8_t *) &ctx->text_pool[cmd->text_offset], cmd->color);
+        break;
+    }
+  }
+}
+
+static void ui__add_dirty_rect(UIRect *rects, uint32_t *count, uint32_t max, UIRect r)
+{
+  for (uint32_t i = 0; i < *count; i++) {
+    UIRect *d = &rects[i];
+    bool overlaps = r.x0 <= d->x1 && r.x1 >= d->x0 && r.y0 <= d->y1 && r.y1 >= d->y0;
+
+    // Out of slots, grow the last rect instead
+    if (overlaps || (*count == max && i == *count - 1)) {
+      *d = {MIN(d->x0, r.x0), MIN(d->y0, r.y0), MAX(d->x1, r.x1), MAX(d->y1, r.y1)};
+      return;
+    }
+  }
+
+  rects[(*count)++] = r;
+}
+
+// Areas where this frame's commands differ from the previous frame's, both old and new bounds are included
+uint32_t ui_dirty_rects(UIContext *ctx, UIRect *rects, uint32_t max)
+{
+  ASSERT(max > 0);
+  uint32_t result = 0;
+
+  for (uint32_t i = 0; i < MAX(ctx->commands_count, ctx->prev_count); i++) {
+    bool current = i < ctx->commands_count;
+    bool previous = i < ctx->prev_count;
+
+    if (current && previous && ctx->command_hashes[i] == ctx->prev_hashes[i]) {
+      continue;
+    }
+
+    if (previous) {
+      ui__add_dirty_rect(rects, &result, max, ctx->prev_bounds[i]);
+    }
+
+    if (current) {
+      ui__add_dirty_rect(rects, &result, max, ctx->commands[i].bounds);
+    }
+  }
+
+  return result;
 }
 
 void ui_end(UIContext *ctx)
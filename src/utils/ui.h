@@ -21,6 +21,24 @@ typedef struct UILayout {
   float yspacing;
 } UILayout;
 
+typedef enum UIDrawCommandType {
+  UI_DRAW_RECT,
+  UI_DRAW_TEXT
+} UIDrawCommandType;
+
+// Widgets record what they draw, ui_draw replays it so only changed areas can be redrawn
+typedef struct UIDrawCommand {
+  UIDrawCommandType type;
+  UIRect bounds;
+  Vec4f color;
+  float x;
+  float y;
+  uint32_t text_offset;
+} UIDrawCommand;
+
+#define UI_MAX_DRAW_COMMANDS 512
+#define UI_TEXT_POOL_SIZE KB(16)
+
 typedef struct UIContext {
   KeyboardState *keyboardState;
   MouseState *mouseState;
@@ -33,6 +51,18 @@ typedef struct UIContext {
   uint32_t active_hash;
   uint32_t group_hash;
   bool disabled;
+  bool interacted; // A button was clicked during the frame
+
+  UIDrawCommand commands[UI_MAX_DRAW_COMMANDS];
+  uint32_t command_hashes[UI_MAX_DRAW_COMMANDS];
+  uint32_t commands_count;
+  char text_pool[UI_TEXT_POOL_SIZE];
+  uint32_t text_pool_used;
+
+  // Previous frame's commands for change detection
+  UIRect prev_bounds[UI_MAX_DRAW_COMMANDS];
+  uint32_t prev_hashes[UI_MAX_DRAW_COMMANDS];
+  uint32_t prev_count;
 } UIContext;
 
 #define UI_COLOR_NONE (Vec4f(0.0f, 0.0f, 0.0f, 0.0f))
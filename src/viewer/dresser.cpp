@@ -564,8 +564,27 @@ static char *_dresser_get_creature_texture_name(Dresser *dresser, char *creature
   return buf;
 }
 
-static M2Model *_dresser_load_item(Dresser *dresser, DresserEquipmentItemSlot slot,
-                                   char *name, char *tex0, char *tex1, uint32_t race, uint32_t sex)
+static void *_dresser_allocate(MemoryArena *arena, size_t size)
+{
+  void *result = arena->allocate(size);
+  memset(result, 0, size);
+  return result;
+}
+
+// Reuses the instance the character already wears when the item model is the same
+static ModelInstance *_dresser_item_instance(MemoryArena *arena, DresserCreatureBase *base, M2Model *model)
+{
+  for (uint32_t i = 0; i < base->items_count; i++) {
+    if (base->items[i] != NULL && base->items[i]->model == model) {
+      return base->items[i];
+    }
+  }
+
+  return m2_instance_create(arena, model);
+}
+
+static ModelInstance *_dresser_load_item(Dresser *dresser, MemoryArena *arena, DresserCreatureBase *base, DresserEquipmentItemSlot slot,
+                                         char *name, char *tex0, char *tex1, uint32_t race, uint32_t sex)
 {
   char *model_name = _dresser_get_component_model_name(dresser, slot, name, race, sex);
   printf("Item model: %s\n", model_name);
@@ -575,6 +594,7 @@ static M2Model *_dresser_load_item(Dresser *dresser, DresserEquipmentItemSlot sl
   }
 
   M2Model *model = asset->model;
+  ModelInstance *instance = _dresser_item_instance(arena, base, model);
 
   asset = asset_loader_get_texture(dresser->loader, (char *) "World/Scale/1_Null.blp");
   Texture *placeholder = asset->texture; // TODO: Generate procedurally
@@ -603,13 +623,13 @@ static M2Model *_dresser_load_item(Dresser *dresser, DresserEquipmentItemSlot sl
     }
 
     if (texture != NULL) {
-      model->textures[i].texture = texture;
+      instance->textures[i] = texture;
     } else {
-      model->textures[i].texture = placeholder;
+      instance->textures[i] = placeholder;
     }
   }
 
-  return model;
+  return instance;
 }
 
 static void _dresser_blit_equipment_textures(Dresser *dresser, Texture *skin, Texture **textures)
@@ -668,7 +688,8 @@ static void dresser_set_character_appearance(Dresser *dresser, DresserCharacter
 {
   character->appearance = *appearance;
 
-  M2Model *model = character->base.model;
+  ModelInstance *instance = character->base.instance;
+  M2Model *model = instance->model;
   character->textures = _dresser_load_character_textures(dresser, character->race, character->sex, *appearance);
 
   for (size_t i = 0; i < model->texturesCount; i++) {
@@ -693,16 +714,17 @@ static void dresser_set_character_appearance(Dresser *dresser, DresserCharacter
     }
 
     if (texture != NULL) {
-      model->textures[i].texture = texture;
+      instance->textures[i] = texture;
     } else {
-      model->textures[i].texture = _dresser_load_texture(dresser, (char *) "World/Scale/1_Null.blp");
+      instance->textures[i] = _dresser_load_texture(dresser, (char *) "World/Scale/1_Null.blp");
     }
   }
 }
 
 static void dresser_set_creature_appearance(Dresser *dresser, DresserCreature *creature)
 {
-  M2Model *model = creature->base.model;
+  ModelInstance *instance = creature->base.instance;
+  M2Model *model = instance->model;
 
   for (size_t i = 0; i < model->texturesCount; i++) {
     printf("Creature model texture #%zu: type %u name %s\n", i, model->textures[i].type, model->textures[i].name);
@@ -725,9 +747,9 @@ static void dresser_set_creature_appearance(Dresser *dresser, DresserCreature *c
     }
 
     if (texture != NULL) {
-      model->textures[i].texture = texture;
+      instance->textures[i] = texture;
     } else {
-      model->textures[i].texture = _dresser_load_texture(dresser, (char *) "World/Scale/1_Null.blp");
+      instance->textures[i] = _dresser_load_texture(dresser, (char *) "World/Scale/1_Null.blp");
     }
   }
 }
@@ -735,7 +757,8 @@ static void dresser_set_creature_appearance(Dresser *dresser, DresserCreature *c
 static void _dresser_apply_character_geosets(Dresser *dresser, DresserCharacter *character,
                                              uint32_t *helm_vis_ids, uint32_t *geosets)
 {
-  M2Model *model = character->base.model;
+  ModelInstance *instance = character->base.instance;
+  M2Model *model = instance->model;
 
   DresserCharacterAppearance *appearance = &character->appearance;
 
@@ -808,16 +831,16 @@ static void _dresser_apply_character_geosets(Dresser *dresser, DresserCharacter
 
   for (int si = 0; si < model->submeshesCount; si++) {
     if (model->submeshes[si].id == 0) {
-      model->submeshes[si].enabled = true;
+      instance->submeshesEnabled[si] = true;
       continue;
     }
 
     uint32_t group = model->submeshes[si].id / 100;
-    model->submeshes[si].enabled = (model->submeshes[si].id == geosets[group]);
+    instance->submeshesEnabled[si] = (model->submeshes[si].id == geosets[group]);
   }
 }
 
-static void dresser_set_character_equipment(Dresser *dresser, DresserCharacter *character,
+static void dresser_set_character_equipment(Dresser *dresser, MemoryArena *arena, DresserCharacter *character,
                                             DresserCharacterEquipment *equipment)
 {
   Asset *asset = asset_loader_get_dbc(dresser->loader, (char *) "DBFilesClient/ItemDisplayInfo.dbc");
@@ -837,13 +860,14 @@ static void dresser_set_character_equipment(Dresser *dresser, DresserCharacter *
     0b00000000, // DEIS_BACK
   };
 
-  M2Model *model = character->base.model;
+  ModelInstance *instance = character->base.instance;
+  M2Model *model = instance->model;
 
   Texture *textures[DETS_SLOTS_COUNT] = {};
   uint32_t geosets[DRESSER_GEOSETS_COUNT];
 
   uint32_t items_count = 0;
-  M2Model *items[5] = {};
+  ModelInstance *items[5] = {};
   M2Attachment *attachments[5] = {};
 
   uint32_t helm_vis_ids[2] = {};
@@ -873,23 +897,23 @@ static void dresser_set_character_equipment(Dresser *dresser, DresserCharacter *
     printf("Icon: %s\n", DBC_STRING(dbc, rec->icon));
     printf("Ground model: %s\n", DBC_STRING(dbc, rec->ground_model));
 
-    M2Model *item = NULL;
+    ModelInstance *item = NULL;
 
     switch (slot) {
     case DEIS_HEAD: {
       char *model_name = DBC_STRING(dbc, rec->models[0]);
       char *texture0 = DBC_STRING(dbc, rec->model_textures[0]);
       char *texture1 = DBC_STRING(dbc, rec->model_textures[1]);
-      item = _dresser_load_item(dresser, slot, model_name, texture0, texture1, character->race, character->sex);
+      item = _dresser_load_item(dresser, arena, &character->base, slot, model_name, texture0, texture1, character->race, character->sex);
       if (item != NULL) {
         helm_vis_ids[0] = rec->helm_vis_ids[0];
         helm_vis_ids[1] = rec->helm_vis_ids[1];
 
         uint32_t idx = items_count++;
         items[idx] = item;
-        int16_t att_idx = character->base.model->attachmentLookups[M2_AT_HELM];
+        int16_t att_idx = model->attachmentLookups[M2_AT_HELM];
         if (att_idx > -1) {
-          attachments[idx] = &character->base.model->attachments[att_idx];
+          attachments[idx] = &model->attachments[att_idx];
         }
       }
     } break;
@@ -899,24 +923,24 @@ static void dresser_set_character_equipment(Dresser *dresser, DresserCharacter *
       char *texture0 = DBC_STRING(dbc, rec->model_textures[0]);
       char *texture1 = DBC_STRING(dbc, rec->model_textures[1]);
 
-      item = _dresser_load_item(dresser, slot, model_name, texture0, texture1, character->race, character->sex);
+      item = _dresser_load_item(dresser, arena, &character->base, slot, model_name, texture0, texture1, character->race, character->sex);
       if (item != NULL) {
         uint32_t idx = items_count++;
         items[idx] = item;
-        int16_t att_idx = character->base.model->attachmentLookups[M2_AT_LSHOULDER];
+        int16_t att_idx = model->attachmentLookups[M2_AT_LSHOULDER];
         if (att_idx > -1) {
-          attachments[idx] = &character->base.model->attachments[att_idx];
+          attachments[idx] = &model->attachments[att_idx];
         }
       }
 
       model_name = DBC_STRING(dbc, rec->models[1]);
-      item = _dresser_load_item(dresser, slot, model_name, texture0, texture1, character->race, character->sex);
+      item = _dresser_load_item(dresser, arena, &character->base, slot, model_name, texture0, texture1, character->race, character->sex);
       if (item != NULL) {
         uint32_t idx = items_count++;
         items[idx] = item;
-        int16_t att_idx = character->base.model->attachmentLookups[M2_AT_RSHOULDER];
+        int16_t att_idx = model->attachmentLookups[M2_AT_RSHOULDER];
         if (att_idx > -1) {
-          attachments[idx] = &character->base.model->attachments[att_idx];
+          attachments[idx] = &model->attachments[att_idx];
         }
       }
     } break;
@@ -957,7 +981,7 @@ static void dresser_set_character_equipment(Dresser *dresser, DresserCharacter *
         if (model->textures[ti].type == MTT_OBJECT_SKIN) {
           char *texture0 = DBC_STRING(dbc, rec->model_textures[0]);
           char *texture_name = _dresser_get_component_texture_name(dresser, slot, texture0, character->race, character->sex);
-          model->textures[ti].texture = _dresser_load_texture(dresser, texture_name);
+          instance->textures[ti] = _dresser_load_texture(dresser, texture_name);
         }
       }
 
@@ -1006,6 +1030,22 @@ static void dresser_set_character_equipment(Dresser *dresser, DresserCharacter *
   _dresser_blit_equipment_textures(dresser, character->textures.skin, textures);
 }
 
+// Shares models, textures and items with the creature, only the pose state of the body is new
+static DresserCreatureBase *dresser_clone_creature(MemoryArena *arena, DresserCreatureBase *creature)
+{
+  size_t size = creature->type == DCT_CHARACTER ? sizeof(DresserCharacter) : sizeof(DresserCreature);
+  DresserCreatureBase *result = (DresserCreatureBase *) _dresser_allocate(arena, size);
+  memcpy(result, creature, size);
+
+  ModelInstance *source = creature->instance;
+  M2Model *model = source->model;
+  result->instance = m2_instance_create(arena, model);
+  memcpy(result->instance->textures, source->textures, sizeof(Texture *) * model->texturesCount);
+  memcpy(result->instance->submeshesEnabled, source->submeshesEnabled, sizeof(bool) * model->submeshesCount);
+
+  return result;
+}
+
 static char *_dresser_get_creature_model_name(Dresser *dresser, uint32_t model)
 {
   Asset *asset = asset_loader_get_dbc(dresser->loader, (char *) "DBFilesClient/CreatureModelData.dbc");
@@ -1051,7 +1091,7 @@ static DresserCharacterEquipment _dresser_load_character_equipment(Dresser *dres
   return result;
 }
 
-static DresserCharacter *dresser_load_character(Dresser *dresser, uint32_t race, uint32_t sex)
+static DresserCharacter *dresser_load_character(Dresser *dresser, MemoryArena *arena, uint32_t race, uint32_t sex)
 {
   DresserCharacter *result = NULL;
 
@@ -1085,9 +1125,9 @@ static DresserCharacter *dresser_load_character(Dresser *dresser, uint32_t race,
     return NULL;
   }
 
-  result = ALLOCATE_ONE(&dresser->loader->allocator, DresserCharacter);
+  result = (DresserCharacter *) _dresser_allocate(arena, sizeof(DresserCharacter));
   result->base.type = DCT_CHARACTER;
-  result->base.model = asset->model;
+  result->base.instance = m2_instance_create(arena, asset->model);
 
   result->race = race;
   result->sex = sex;
@@ -1095,7 +1135,7 @@ static DresserCharacter *dresser_load_character(Dresser *dresser, uint32_t race,
   return result;
 }
 
-static DresserCreatureBase *dresser_load_creature(Dresser *dresser, uint32_t id)
+static DresserCreatureBase *dresser_load_creature(Dresser *dresser, MemoryArena *arena, uint32_t id)
 {
   DresserCreatureBase *result = NULL;
 
@@ -1120,7 +1160,7 @@ static DresserCreatureBase *dresser_load_creature(Dresser *dresser, uint32_t id)
 
   DBCCreatureDisplayInfoExtraRecord *extra_rec = (DBCCreatureDisplayInfoExtraRecord *) dbc_get_record(asset->dbc, display_rec->extra_id);
   if (extra_rec != NULL) {
-    DresserCharacter *character = dresser_load_character(dresser, extra_rec->race - 1, extra_rec->sex);
+    DresserCharacter *character = dresser_load_character(dresser, arena, extra_rec->race - 1, extra_rec->sex);
     result = (DresserCreatureBase *) character;
 
     character->appearance.skin_color = extra_rec->skin_color;
@@ -1131,7 +1171,7 @@ static DresserCreatureBase *dresser_load_creature(Dresser *dresser, uint32_t id)
     dresser_set_character_appearance(dresser, character, &character->appearance);
 
     DresserCharacterEquipment equip = _dresser_load_character_equipment(dresser, extra_rec->items);
-    dresser_set_character_equipment(dresser, character, &equip);
+    dresser_set_character_equipment(dresser, arena, character, &equip);
 
   } else {
     char *model_name = _dresser_get_creature_model_name(dresser, display_rec->model);
@@ -1146,11 +1186,11 @@ static DresserCreatureBase *dresser_load_creature(Dresser *dresser, uint32_t id)
       return NULL;
     }
 
-    DresserCreature *creature = ALLOCATE_ONE(&dresser->loader->allocator, DresserCreature);
+    DresserCreature *creature = (DresserCreature *) _dresser_allocate(arena, sizeof(DresserCreature));
     result = (DresserCreatureBase *) creature;
 
     creature->base.type = DCT_CREATURE;
-    creature->base.model = asset->model;
+    creature->base.instance = m2_instance_create(arena, asset->model);
 
     uint32_t dirlen = 0;
     char *p = model_name;
@@ -107,12 +107,14 @@ typedef enum DresserCreatureType {
   DCT_CHARACTER
 } DresserCreatureType;
 
+// Instances and the creature itself live in the arena passed to the dresser, models are shared through the loader
 typedef struct DresserCreatureBase {
   DresserCreatureType type;
-  M2Model *model;
+  ModelInstance *instance;
   uint32_t items_count;
-  M2Model *items[10];
+  ModelInstance *items[10];
   M2Attachment *attachments[10];
+  uint32_t item_views[10]; // Item instances are shared by crowd clones, so the drawn view belongs to the slot
 } DresserCreatureBase;
 
 typedef struct DresserCreature {
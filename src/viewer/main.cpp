@@ -4,6 +4,9 @@
 #include "utils/texture.cpp"
 #include "utils/memory.cpp"
 #include "utils/assets.cpp"
+
+#include "renderer/renderer.cpp"
+
 #include "utils/font.cpp"
 #include "utils/ui.cpp"
 
@@ -12,8 +15,6 @@
 #include "formats/dbc.cpp"
 #include "formats/m2.cpp"
 
-#include "renderer/renderer.cpp"
-
 #include "dresser.cpp"
 #include "model.cpp"
 
@@ -24,8 +25,237 @@ typedef struct RenderFlags {
   bool shadow_mapping;
   bool bilinear_filtering;
   bool lighting;
+  bool vertex_lighting; // Intensity computed per vertex and interpolated
+  bool transparent_passes;
 } RenderFlags;
 
+#define FRAME_TARGET_MS 16.0f
+
+#define DYNRES_MIN_SCALE 0.5f
+#define DYNRES_MAX_SCALE 1.0f
+
+// 3D scene is rendered into an internal buffer whose size follows frame time
+typedef struct DynamicResolution {
+  bool enabled;
+  float scale;
+  DrawingBuffer buffer;
+} DynamicResolution;
+
+typedef enum {
+  RENDER_PASS_SHADOW,
+  RENDER_PASS_FLOOR,
+  RENDER_PASS_OPAQUE,
+  RENDER_PASS_TRANSPARENT,
+  RENDER_PASS_UI,
+  RENDER_PASS_COUNT
+} RenderPass;
+
+static const char *render_pass_names[RENDER_PASS_COUNT] = {
+  "shadow", "floor", "opaque", "transp", "ui"
+};
+
+typedef struct QualityTier {
+  const char *name;
+  bool vertex_lighting;
+  bool bilinear_filtering;
+  uint32_t shadowmap_size;
+  uint32_t shadowmap_interval; // Frames between shadow map updates, 0 - only on model change
+  bool transparent_passes;
+} QualityTier;
+
+static QualityTier quality_tiers[] = {
+  {"high",   false, true,  512, 1, true},
+  {"medium", false, false, 256, 4, true},
+  {"low",    true,  false, 128, 0, false},
+};
+
+#define QUALITY_TIERS_COUNT (sizeof(quality_tiers) / sizeof(quality_tiers[0]))
+#define QUALITY_SHADOWMAP_MAX_SIZE 512
+#define QUALITY_SWITCH_FRAMES 30 // Budget has to be missed or met this long to switch tiers
+
+// Each knob trades the cost of its own passes, its level indexes quality_tiers
+typedef enum {
+  QUALITY_KNOB_SHADING, // Floor and opaque passes
+  QUALITY_KNOB_SHADOW,
+  QUALITY_KNOB_TRANSPARENT,
+  QUALITY_KNOB_COUNT
+} QualityKnob;
+
+static const char *quality_knob_names[QUALITY_KNOB_COUNT] = {
+  "shading", "shadow", "transp"
+};
+
+#define QUALITY_MAX_STEPS (QUALITY_KNOB_COUNT * (QUALITY_TIERS_COUNT - 1))
+
+typedef struct QualityGovernor {
+  bool enabled;
+  uint32_t levels[QUALITY_KNOB_COUNT];
+  uint32_t steps[QUALITY_MAX_STEPS]; // Knobs stepped down, most recent last
+  uint32_t steps_count;
+  float target_ms;
+  float pass_ms[RENDER_PASS_COUNT]; // Smoothed per-pass cost
+  uint32_t frames_over;
+  uint32_t frames_under;
+  uint32_t frames_since_switch;
+  uint32_t step_up_frames; // Grows when stepping up had to be undone, prevents oscillation
+  uint32_t frame_index;
+} QualityGovernor;
+
+#define IMPOSTOR_SIZE 128
+#define IMPOSTOR_MAX_SCREEN_SIZE 96.0f // Creatures smaller than this on screen (pixels) become impostors
+#define IMPOSTOR_ANGLE_BUCKETS 32
+#define IMPOSTOR_FRAME_STEP 66.0f // Animation time between impostor refreshes
+
+// Creature pose rendered from a quantized view angle, drawn as a camera facing quad
+typedef struct Impostor {
+  bool enabled;
+  bool active; // Used for the last rendered frame
+  uint32_t key;
+  Vec3f view_center; // Bounds of the creature the quad is placed at
+  float radius;
+  Texture *texture;
+  zval_t *zbuffer;
+  uint32_t refreshes;
+} Impostor;
+
+#define CROWD_MAX 64
+#define CROWD_COLUMNS 8
+#define CROWD_SPACING 0.6f
+#define CROWD_PHASE_STEP 337 // Animation frames between creature types, so they don't move in lockstep
+
+#define POSE_CACHE_ENTRIES 32
+#define POSE_CACHE_MAX_BONES 256
+#define POSE_CACHE_MAX_VERTICES 8192
+
+typedef enum PoseCacheMode {
+  POSE_CACHE_OFF,
+  POSE_CACHE_BONES,
+  POSE_CACHE_VERTICES, // Skinned attributes too
+  POSE_CACHE_MODES_COUNT
+} PoseCacheMode;
+
+static const char *pose_cache_mode_names[] = {"off", "bones", "bones and vertices"};
+
+static const uint32_t crowd_sizes[] = {0, 8, 16, 32, 64};
+
+// Screen radii in pixels below which crowd members pose every 2nd, 4th and 8th frame
+static const float animation_lod_radii[] = {96.0f, 48.0f, 24.0f};
+
+// Extra instances lined up behind the creature, shows how posing and drawing scale with the instance count.
+// Repeated creatures share models, textures and items with the first one and only get their own pose.
+typedef struct Crowd {
+  MemoryArena *arena;
+  uint32_t size_index;
+  uint32_t count;
+  DresserCreatureBase *members[CROWD_MAX];
+  float scales[CROWD_MAX];
+  uint32_t phases[CROWD_MAX]; // Clones of a creature share the phase, so they can share poses
+  float radii[CROWD_MAX]; // Screen radius when last drawn, zero when off screen
+  M2Pose poses[CROWD_MAX];
+  float pose_ms; // Smoothed
+
+  bool animation_lod; // Small members pose at a reduced rate, off screen ones not at all
+  uint32_t tick; // Staggers reduced rate updates
+  uint32_t posed; // Members posed by the last update
+
+  PoseCacheMode cache_mode;
+  M2PoseCache pose_cache;
+} Crowd;
+
+typedef enum AntialiasingMode {
+  AA_MODE_NONE,
+  AA_MODE_FXAA,
+  AA_MODE_MSAA,
+  AA_MODE_SSAA, // 2x2 supersampling, reference for the other modes
+  AA_MODE_COUNT
+} AntialiasingMode;
+
+static const char *aa_mode_names[AA_MODE_COUNT] = {"off", "FXAA", "MSAA 4x", "SSAA 2x2"};
+
+#define AA_BENCHMARK_FRAMES 20
+
+// Buffers are sized for the native resolution and allocated on first use
+typedef struct Antialiasing {
+  AntialiasingMode mode;
+  bool benchmark_requested;
+  uint32_t *samples; // MSAA color samples or the SSAA color buffer
+  zval_t *zsamples;
+  uint32_t *scratch; // FXAA source copy
+  uint8_t *luma;
+  DrawingBuffer ssaa_buffer;
+  bool benchmarked;
+  float benchmark_ms[AA_MODE_COUNT];
+  float benchmark_error[AA_MODE_COUNT]; // Share of the no-AA difference from SSAA that is left, in percent
+} Antialiasing;
+
+#define RENDER_JOB_COMMANDS_SIZE MB(32)
+
+// Render graph resources, passes touching different ones run concurrently
+enum {
+  RESOURCE_SHADOWMAP = 1 << 0, // Shadow map texture and its own depth buffer
+  RESOURCE_IMPOSTOR = 1 << 1,
+  RESOURCE_SCENE = 1 << 2, // Scene buffer with its depth and anti-aliasing buffers
+  RESOURCE_OUTPUT = 1 << 3,
+  RESOURCE_SCENE_CACHE = 1 << 4
+};
+
+// Frame recorded on the main thread and rasterized on the render thread
+typedef struct RenderJob {
+  PlatformAPI *platform_api;
+  PlatformWorkQueue *pool; // Workers for passes that can overlap
+  RenderCommandBuffer commands;
+  RenderGraph graph;
+  DrawingBuffer buffer; // Presented once the job completes
+  RenderingContext contexts[RENDER_GRAPH_MAX_PASSES]; // Execution state, the recording context is never touched by the render thread
+  double pass_start[RENDER_PASS_COUNT];
+  float pass_ms[RENDER_PASS_COUNT]; // Negative for passes that didn't run
+} RenderJob;
+
+// Frame N is rasterized while frame N + 1 is recorded, which adds a frame of latency
+typedef struct RenderPipeline {
+  bool enabled;
+  PlatformWorkQueue *queue;
+  WorkQueueBatch batch; // Job in flight on the render thread
+  PlatformWorkQueue *pool;
+  RenderJob jobs[2];
+  uint32_t frame; // Job being recorded
+  uint32_t submitted; // Last job handed to the render thread
+  bool has_submitted;
+  bool in_flight;
+  void *native_pixels;
+} RenderPipeline;
+
+#define RENDER_QUEUE_MAX_ITEMS 4096 // Enough for a full crowd
+#define RENDER_QUEUE_MAX_TRANSFORMS 512
+
+// Single M2 render pass, submitted in key order
+typedef struct RenderQueueItem {
+  uint64_t key;
+  ModelInstance *instance;
+  ModelView *view; // The pass belongs to it
+  M2RenderPass *pass;
+  uint32_t transform;
+  uint32_t flags; // RENDER_CULLING and RENDER_BLENDING bits
+  BlendMode blend;
+} RenderQueueItem;
+
+typedef struct RenderQueueStats {
+  uint32_t draws;
+  uint32_t faces;
+  uint32_t lod_faces; // Drawn from views below full detail
+  uint32_t state_changes; // Rasterizer variant or blend function switches
+  uint32_t texture_changes;
+  uint32_t unsorted_state_changes; // Same draws in submission order
+} RenderQueueStats;
+
+typedef struct RenderQueue {
+  RenderQueueItem items[RENDER_QUEUE_MAX_ITEMS];
+  uint32_t count;
+  Mat44 transforms[RENDER_QUEUE_MAX_TRANSFORMS];
+  uint32_t transforms_count;
+  RenderQueueStats stats; // Accumulated over a frame
+} RenderQueue;
+
 typedef struct Animation {
   char *name;
   int32_t id;
@@ -76,6 +306,7 @@ typedef struct State {
 
   Texture *normalmap;
   Texture *shadowmap;
+  zval_t *shadow_zbuffer; // Separate from the main one, so the shadow pass can overlap with others
 
   Model *model;
   Texture *debugTexture;
@@ -91,6 +322,9 @@ typedef struct State {
   Dresser *dresser;
   uint32_t creature_index;
   DresserCreatureBase *creature;
+  MemoryArena *creature_arenas[2]; // New creatures are loaded into the spare one, the current stays intact until replaced
+  uint32_t creature_arena;
+  Crowd crowd;
   DresserCustomizationLimits appearance_limits;
 
   uint32_t screenWidth;
@@ -112,6 +346,31 @@ typedef struct State {
   float model_scale;
 
   DrawingBuffer *buffer;
+  DynamicResolution dynres;
+  QualityGovernor quality;
+  Impostor impostor;
+  Antialiasing aa;
+  RenderPipeline pipeline;
+  RenderQueue render_queue;
+  PlatformWorkQueue *animation_pool; // Skeletons and skinning chunks
+  bool parallel_animation;
+  bool view_lod; // Instances pick lower detail M2 views as they shrink on screen
+  bool baked_animation; // Single layer animations play back from baked vertex streams
+  MemoryArena *bake_arena;
+  M2BakedAnimation *baked;
+  float frame_ms; // Smoothed time spent in draw_frame
+
+  // Stats are only refreshed with the scene, otherwise they'd keep the UI dirty
+  float stats_frame_ms;
+  float stats_pass_ms[RENDER_PASS_COUNT];
+  RenderGraph graph_timings; // Last executed graph
+  RenderGraph stats_graph;
+  RenderQueueStats stats_queue;
+
+  // Copy of the last rendered frame without UI, used to redraw changed UI areas
+  DrawingBuffer scene_cache;
+  uint32_t scene_hash;
+  bool scene_cache_valid;
 
   ModelBoneSet core_boneset;
   ModelBoneSet upper_boneset;
@@ -166,9 +425,173 @@ static Vec3f hsv_to_rgb(Vec3f hsv)
   return {r, g, b};
 }
 
+static void render_pipeline_init(State *state, DrawingBuffer *native)
+{
+  RenderPipeline *p = &state->pipeline;
+  PlatformAPI *api = state->platform_api;
+
+  p->queue = api->work_queue_create(1);
+  p->pool = api->work_queue_create(WORK_QUEUE_THREADS_AUTO);
+  p->enabled = p->queue != NULL; // Without a render thread frames execute inline
+  p->native_pixels = native->pixels;
+
+  for (uint32_t i = 0; i < 2; i++) {
+    RenderJob *job = &p->jobs[i];
+    job->platform_api = api;
+    job->pool = p->pool;
+    render_commands_init(&job->commands, api->allocate_memory(RENDER_JOB_COMMANDS_SIZE), RENDER_JOB_COMMANDS_SIZE);
+
+    job->buffer = *native;
+    job->buffer.pixels = api->allocate_memory(native->pitch * native->height * native->bytes_per_pixel);
+
+    for (uint32_t pass = 0; pass < RENDER_PASS_COUNT; pass++) {
+      job->pass_ms[pass] = -1.0f;
+    }
+  }
+}
+
+static WORK_QUEUE_CALLBACK(render_job_execute)
+{
+  RenderJob *job = (RenderJob *) data;
+  render_graph_execute(&job->graph, job->platform_api, job->pool, job->contexts);
+}
+
+// Pass timings are taken wherever the commands execute and smoothed on the main thread
+static void render_job_collect_timings(State *state, RenderJob *job)
+{
+  for (uint32_t pass = 0; pass < RENDER_PASS_COUNT; pass++) {
+    if (job->pass_ms[pass] >= 0.0f) {
+      float *ms = &state->quality.pass_ms[pass];
+      *ms += (job->pass_ms[pass] - *ms) * 0.1f;
+      job->pass_ms[pass] = -1.0f;
+    }
+  }
+
+  state->graph_timings = job->graph;
+}
+
+// Waits for the render thread, has to be called before changing anything recorded commands point to
+static void render_pipeline_finish(State *state)
+{
+  RenderPipeline *p = &state->pipeline;
+  if (!p->in_flight) {
+    return;
+  }
+
+  state->platform_api->work_queue_complete(p->queue, &p->batch);
+  p->in_flight = false;
+  render_job_collect_timings(state, &p->jobs[p->submitted]);
+}
+
+// Frames are always recorded as a graph, pipelining only decides which thread executes them
+static void render_pipeline_begin(State *state, DrawingBuffer *drawing_buffer)
+{
+  RenderPipeline *p = &state->pipeline;
+  RenderingContext *ctx = &state->rendering_context;
+  RenderJob *job = &p->jobs[p->frame];
+
+  render_commands_reset(&job->commands);
+  render_graph_begin(&job->graph, &job->commands);
+  ctx->commands = &job->commands;
+
+  if (!p->enabled) {
+    if (p->has_submitted) {
+      render_pipeline_finish(state);
+      drawing_buffer->pixels = p->native_pixels;
+      p->has_submitted = false;
+      state->scene_cache_valid = false; // Native buffer is stale
+    }
+
+    state->buffer = drawing_buffer;
+    return;
+  }
+
+  if (!p->has_submitted) {
+    state->scene_cache_valid = false; // No previous frame to redraw the UI over
+  }
+
+  state->buffer = &job->buffer;
+}
+
+// Presents the previous frame and hands this one over to the render thread
+static void render_pipeline_end(State *state, DrawingBuffer *drawing_buffer, bool submit)
+{
+  RenderPipeline *p = &state->pipeline;
+  RenderJob *job = &p->jobs[p->frame];
+  state->rendering_context.commands = NULL;
+
+  if (!p->enabled) {
+    if (submit) {
+      render_job_execute(job);
+      render_job_collect_timings(state, job);
+    }
+    return;
+  }
+
+  render_pipeline_finish(state);
+
+  if (p->has_submitted) {
+    drawing_buffer->pixels = p->jobs[p->submitted].buffer.pixels;
+  }
+
+  if (submit) {
+    state->platform_api->work_queue_add(p->queue, &p->batch, &render_job_execute, job);
+    p->in_flight = true;
+    p->has_submitted = true;
+    p->submitted = p->frame;
+    p->frame ^= 1;
+  }
+}
+
+static void render_pass_begin(State *state, const char *name, uint32_t reads, uint32_t writes)
+{
+  if (state->rendering_context.commands) {
+    render_graph_pass_begin(&state->pipeline.jobs[state->pipeline.frame].graph, name, reads, writes);
+  }
+}
+
+static void render_pass_end(State *state)
+{
+  if (state->rendering_context.commands) {
+    render_graph_pass_end(&state->pipeline.jobs[state->pipeline.frame].graph);
+  }
+}
+
+typedef struct PassTimerData {
+  RenderJob *job;
+  RenderPass pass;
+} PassTimerData;
+
+static RENDER_CALLBACK(pass_timer_begin)
+{
+  PassTimerData *d = (PassTimerData *) data;
+  d->job->pass_start[d->pass] = d->job->platform_api->get_time();
+}
+
+static RENDER_CALLBACK(pass_timer_end)
+{
+  PassTimerData *d = (PassTimerData *) data;
+  d->job->pass_ms[d->pass] = (float) ((d->job->platform_api->get_time() - d->job->pass_start[d->pass]) * 1000.0);
+}
+
+static void pass_time_begin(State *state, RenderingContext *ctx, RenderPass pass)
+{
+  PassTimerData data = {&state->pipeline.jobs[state->pipeline.frame], pass};
+  render_callback(ctx, &pass_timer_begin, &data, sizeof(data));
+}
+
+static void pass_time_end(State *state, RenderingContext *ctx, RenderPass pass)
+{
+  PassTimerData data = {&state->pipeline.jobs[state->pipeline.frame], pass};
+  render_callback(ctx, &pass_timer_end, &data, sizeof(data));
+}
+
 typedef struct ModelShaderData {
   Vec3f pos[3];
   Vec3f normals[3];
+  float intensities[3];
+  Vec3f tangents[3];
+  Vec3f bitangents[3];
   Vec3f uvs[3];
   Vec3f color;
   Texture *normalmap;
@@ -185,7 +608,9 @@ FRAGMENT_FUNC(fragment_model)
   float intensity = 0.0;
 
   Vec3f normal;
-  if (f->gouraud_shading) {
+  if (f->vertex_lighting) {
+    // Normal is not needed, lighting was done in the vertex stage
+  } else if (f->gouraud_shading) {
     normal = d->normals[0] * t0 + d->normals[1] * t1 + d->normals[2] * t2;
   } else {
     normal = (d->pos[2] - d->pos[1]).cross(d->pos[2] - d->pos[0]).normalized();
@@ -232,33 +657,21 @@ FRAGMENT_FUNC(fragment_model)
     texel = d->color;
   }
 
-#if 0
   if (f->normal_mapping && d->normalmap) {
     int nx = (int)(uv.x * d->normalmap->width) & (d->normalmap->width - 1);
     int ny = (int)(uv.y * d->normalmap->height) & (d->normalmap->height - 1);
     Vec3f ncolor = TEXEL3F(d->normalmap, nx, ny);
     Vec3f tnormal = {2 * ncolor.r - 1, 2 * ncolor.g - 1, 2 * ncolor.b};
 
-    Vec3f dp1 = d->pos[1] - d->pos[0];
-    Vec3f dp2 = d->pos[2] - d->pos[1];
-    Vec3f duv1 = d->uvs[1] - d->uvs[0];
-    Vec3f duv2 = d->uvs[2] - d->uvs[1];
-    float r = 1.0f / (duv1.x * duv2.y - duv1.y * duv2.x);
-    Vec3f tangent = -(dp1 * duv2.y - dp2 * duv1.y) * r;
-    tangent = (tangent - normal * normal.dot(tangent)).normalized();
-    Vec3f bitangent = -((dp2 * duv1.x - dp1 * duv2.x) * r).normalized();
-
-    Mat44 invTBN = {
-      tangent.x, tangent.y, tangent.z, 0,
-      bitangent.x, bitangent.y, bitangent.z, 0,
-      normal.x, normal.y, normal.z, 0,
-      0, 0, 0, 1
-    };
-    normal = (tnormal * invTBN).normalized();
+    // Tangent basis is precalculated per vertex and interpolated
+    Vec3f tangent = d->tangents[0] * t0 + d->tangents[1] * t1 + d->tangents[2] * t2;
+    Vec3f bitangent = d->bitangents[0] * t0 + d->bitangents[1] * t1 + d->bitangents[2] * t2;
+    normal = (tangent * tnormal.x + bitangent * tnormal.y + normal * tnormal.z).normalized();
   }
-#endif
 
-  if (f->lighting) {
+  if (f->lighting && f->vertex_lighting) {
+    intensity = d->intensities[0] * t0 + d->intensities[1] * t1 + d->intensities[2] * t2;
+  } else if (f->lighting) {
     intensity = normal.dot(-ctx->light);
   } else {
     intensity = 1.0f;
@@ -374,6 +787,8 @@ static Model *load_model(State *state, char *filename)
 
   model->vertices = (Vec3f *) state->main_arena->allocate(sizeof(Vec3f) * model->vcount);
   model->normals = (Vec3f *) state->main_arena->allocate(sizeof(Vec3f) * model->ncount);
+  model->tangents = (Vec3f *) state->main_arena->allocate(sizeof(Vec3f) * model->ncount);
+  model->bitangents = (Vec3f *) state->main_arena->allocate(sizeof(Vec3f) * model->ncount);
   model->texture_coords = (Vec3f *) state->main_arena->allocate(sizeof(Vec3f) * model->tcount);
   model->faces = (ModelFace *) state->main_arena->allocate(sizeof(ModelFace) * model->fcount);
 
@@ -382,7 +797,7 @@ static Model *load_model(State *state, char *filename)
   return model;
 }
 
-static Texture *load_tga_texture(State *state, char *filename)
+static Texture *load_tga_texture(State *state, MemoryArena *arena, char *filename)
 {
   LoadedFile file = load_file(state->platform_api, state->temp_arena, filename);
   if (!file.size) {
@@ -400,7 +815,13 @@ static Texture *load_tga_texture(State *state, char *filename)
   printf("X offset: %d; Y offset: %d; FlipX: %d; FlipY: %d\n",
          header->xOffset, header->yOffset, image.flipX, image.flipY);
 
-  Texture *texture = texture_create(state->main_arena, header->width, header->height);
+  // Large textures get their own memory instead of crowding the main arena
+  if (arena == NULL) {
+    size_t size = sizeof(Texel) * header->width * header->height + KB(4);
+    arena = MemoryArena::initialize(state->platform_api->allocate_memory(size), size);
+  }
+
+  Texture *texture = texture_create(arena, header->width, header->height);
   image.read_into_texture(file.contents, file.size, texture);
   return texture;
 }
@@ -419,7 +840,7 @@ static Font *load_font(State *state, char *textureFilename)
   }
 
   Font *font = (Font *) state->main_arena->allocate(sizeof(Font));
-  font->texture = load_tga_texture(state, textureFilename);
+  font->texture = load_tga_texture(state, state->main_arena, textureFilename);
   font_init(font, file.contents, file.size);
 
   return font;
@@ -450,7 +871,7 @@ static void render_floor(State *state, RenderingContext *ctx)
   FloorShaderData shader_data = {};
   shader_data.matShadow = ctx->mvp_mat.inverse() * state->matShadowMVP;
   shader_data.shadowmap = state->shadowmap;
-  shader_data.flags = &state->render_flags;
+  shader_data.flags = (RenderFlags *) render_commands_push_data(ctx, &state->render_flags, sizeof(RenderFlags));
   shader_data.normal = {0, 1, 0};
 
   Vec3f positions[3];
@@ -469,7 +890,7 @@ static void render_floor(State *state, RenderingContext *ctx)
       shader_data.colors[i] = colors[tri][i] * iz;
     }
 
-    ctx->draw_triangle(ctx, &fragment_floor, (void *) &shader_data, positions[0], positions[1], positions[2]);
+    render_triangle(ctx, &fragment_floor, (void *) &shader_data, sizeof(shader_data), positions[0], positions[1], positions[2]);
   }
 }
 
@@ -480,7 +901,8 @@ static void render_model(State *state, RenderingContext *ctx, Model *model)
 
   ModelShaderData shader_data = {};
   shader_data.color = hsv_to_rgb(state->hsv);
-  shader_data.flags = &state->render_flags;
+  shader_data.flags = (RenderFlags *) render_commands_push_data(ctx, &state->render_flags, sizeof(RenderFlags));
+  shader_data.normalmap = (state->render_flags.normal_mapping && !state->render_flags.vertex_lighting) ? state->normalmap : NULL;
   Vec3f positions[3];
 
   for (int fi = 0; fi < model->fcount; fi++) {
@@ -495,43 +917,64 @@ static void render_model(State *state, RenderingContext *ctx, Model *model)
       shader_data.uvs[vi] = {texture.x, texture.y, 0};
       shader_data.normals[vi] = (normal * ctx->normal_mat).normalized();
 
+      if (state->render_flags.vertex_lighting) {
+        shader_data.intensities[vi] = MAX(shader_data.normals[vi].dot(-ctx->light), 0.0f);
+      }
+
+      if (shader_data.normalmap) {
+        shader_data.tangents[vi] = (model->tangents[face.ni[vi]] * ctx->normal_mat).normalized();
+        shader_data.bitangents[vi] = (model->bitangents[face.ni[vi]] * ctx->normal_mat).normalized();
+      }
+
       positions[vi] = position * ctx->mvp_mat;
     }
 
-    ctx->draw_triangle(ctx, &fragment_model, (void *) &shader_data, positions[0], positions[1], positions[2]);
+    render_triangle(ctx, &fragment_model, (void *) &shader_data, sizeof(shader_data), positions[0], positions[1], positions[2]);
   }
 }
 
-static inline void render_m2_pass(State *state, RenderingContext *ctx, M2Model *model, M2RenderPass *pass, ModelSubmesh *submesh)
+static inline void render_m2_pass(State *state, RenderingContext *ctx, ModelInstance *instance, ModelView *view, M2RenderPass *pass)
 {
+  M2Model *model = instance->model;
+  ModelSubmesh *submesh = &view->submeshes[pass->submesh];
   ModelShaderData shader_data = {};
   shader_data.color = hsv_to_rgb(state->hsv);
-  shader_data.flags = &state->render_flags;
+  shader_data.flags = (RenderFlags *) render_commands_push_data(ctx, &state->render_flags, sizeof(RenderFlags));
+  shader_data.normalmap = (state->render_flags.normal_mapping && !state->render_flags.vertex_lighting) ? state->normalmap : NULL;
   Vec3f positions[3];
 
   uint32_t texture_index = model->textureLookups[pass->textureId];
-  shader_data.texture = model->textures[texture_index].texture;
+  shader_data.texture = instance->textures[texture_index];
   ASSERT(shader_data.texture != NULL);
 
   uint32_t faceStart = submesh->facesStart;
   uint32_t faceEnd = faceStart + submesh->facesCount;
 
   for (int fi = faceStart; fi < faceEnd; fi++) {
-    M2Face face = model->faces[fi];
+    M2Face face = view->faces[fi];
 
     for (int vi = 0; vi < 3; vi++) {
-      Vec3f position = model->animatedPositions[face.indices[vi]];
-      Vec3f normal = model->animatedNormals[face.indices[vi]];
-      Vec3f texture = model->textureCoords[face.indices[vi]];
+      Vec3f position = instance->animatedPositions[face.indices[vi]];
+      Vec3f normal = instance->animatedNormals[face.indices[vi]];
+      Vec3f texture = m2_texture_coords(model, face.indices[vi]);
 
       shader_data.pos[vi] = position * ctx->model_mat;
       shader_data.uvs[vi] = {texture.x, texture.y, 0};
       shader_data.normals[vi] = (normal * ctx->normal_mat).normalized();
 
+      if (state->render_flags.vertex_lighting) {
+        shader_data.intensities[vi] = MAX(shader_data.normals[vi].dot(-ctx->light), 0.0f);
+      }
+
+      if (shader_data.normalmap) {
+        shader_data.tangents[vi] = (instance->animatedTangents[face.indices[vi]] * ctx->normal_mat).normalized();
+        shader_data.bitangents[vi] = (instance->animatedBitangents[face.indices[vi]] * ctx->normal_mat).normalized();
+      }
+
       positions[vi] = position * ctx->mvp_mat;
     }
 
-    ctx->draw_triangle(ctx, &fragment_model, (void *) &shader_data, positions[0], positions[1], positions[2]);
+    render_triangle(ctx, &fragment_model, (void *) &shader_data, sizeof(shader_data), positions[0], positions[1], positions[2]);
   }
 }
 
@@ -556,16 +999,17 @@ static BlendMode map_blending_mode(uint16_t blendingMode)
   }
 }
 
-static void render_m2_model(State *state, RenderingContext *ctx, M2Model *model, RenderMode mode = RENDER_MODE_ANY)
+static void render_m2_model(State *state, RenderingContext *ctx, ModelInstance *instance, RenderMode mode = RENDER_MODE_ANY)
 {
-  if (model == NULL) {
+  if (instance == NULL) {
     return;
   }
 
-  for (int rpi = 0; rpi < model->renderPassesCount; rpi++) {
-    M2RenderPass *pass = &model->renderPasses[rpi];
-    ModelSubmesh *submesh = &model->submeshes[pass->submesh];
-    if (!submesh->enabled) {
+  M2Model *model = instance->model;
+  ModelView *view = &model->views[instance->view];
+  for (int rpi = 0; rpi < view->renderPassesCount; rpi++) {
+    M2RenderPass *pass = &view->renderPasses[rpi];
+    if (!m2_view_submesh_enabled(instance, view, pass->submesh)) {
       continue;
     }
 
@@ -597,12 +1041,14 @@ static void render_m2_model(State *state, RenderingContext *ctx, M2Model *model,
       default:; // No filtering
     }
 
-    render_m2_pass(state, ctx, model, pass, submesh);
+    render_m2_pass(state, ctx, instance, view, pass);
   }
 }
 
-static void render_m2_model_bones(State *state, RenderingContext *ctx, M2Model *model)
+static void render_m2_model_bones(State *state, RenderingContext *ctx, ModelInstance *instance)
 {
+  M2Model *model = instance->model;
+
   ctx->model_mat = Mat44::rotate_y(-RAD(90)) * Mat44::scale(state->scale, state->scale, state->scale);
   precalculate_matrices(ctx);
 
@@ -610,7 +1056,7 @@ static void render_m2_model_bones(State *state, RenderingContext *ctx, M2Model *
 
   for (int i = 0; i < model->bonesCount; i++) {
     ModelBone bone = model->bones[i];
-    if (!bone.calculated) {
+    if (instance->boneLayers[i] >= M2_POSE_MAX_LAYERS) {
       continue;
     }
 
@@ -618,11 +1064,11 @@ static void render_m2_model_bones(State *state, RenderingContext *ctx, M2Model *
 
     if (bone.parent >= 0) {
       ModelBone parentBone = model->bones[bone.parent];
-      Vec3f p1 = bone.pivot * bone.matrix;
-      Vec3f p2 = parentBone.pivot * parentBone.matrix;
-      ctx->draw_line(ctx, p1, p2, color);
+      Vec3f p1 = bone.pivot * instance->boneMatrices[i];
+      Vec3f p2 = parentBone.pivot * instance->boneMatrices[bone.parent];
+      render_line(ctx, p1, p2, color);
     } else {
-      Vec3f pos = bone.pivot * bone.matrix * mat;
+      Vec3f pos = bone.pivot * instance->boneMatrices[i] * mat;
       // set_pixel_safe(ctx->target, (uint32_t) pos.x, (uint32_t) pos.y, color);
     }
   }
@@ -639,40 +1085,15 @@ static void enable_ortho(State *state, RenderingContext *ctx)
 
 static void render_debug_texture(State *state, RenderingContext *ctx, Texture *texture, float x, float y, float width)
 {
-  const Vec3f texture_coords[4] = {
-    {0, (float) texture->height, 0.0f},
-    {(float) texture->width, (float) texture->height, 0.0f},
-    {(float) texture->width, 0.0f, 0.0f},
-    {0.0f, 0.0f, 0.0f}
-  };
+  ASSERT(texture != NULL);
 
   float height = width * ((float) texture->height / (float) texture->width);
 
-  Vec3f positions[4] = {
-    {x, y + height, 0.0},
-    {x + width, y + height, 0.0},
-    {x + width, y, 0.0},
-    {x, y, 0.0}
-  };
-
-  for (uint32_t i = 0; i < 4; i++) {
-    positions[i] = positions[i] * ctx->mvp_mat;
-  }
-
-  DebugShaderData shader_data = {};
-  shader_data.clampu = texture->width - 1;
-  shader_data.clampv = texture->height - 1;
-  shader_data.texture = texture;
-  ASSERT(shader_data.texture != NULL);
-
-  shader_data.uv0 = texture_coords[0];
-  shader_data.duv[0] = texture_coords[1] - shader_data.uv0;
-  shader_data.duv[1] = texture_coords[2] - shader_data.uv0;
-  ctx->draw_triangle(ctx, &fragment_debug, (void *) &shader_data, positions[0], positions[1], positions[2]);
+  Vec3f p0 = Vec3f{x, y + height, 0.0f} * ctx->mvp_mat;
+  Vec3f p1 = Vec3f{x + width, y, 0.0f} * ctx->mvp_mat;
 
-  shader_data.duv[0] = texture_coords[2] - shader_data.uv0;
-  shader_data.duv[1] = texture_coords[3] - shader_data.uv0;
-  ctx->draw_triangle(ctx, &fragment_debug, (void *) &shader_data, positions[0], positions[2], positions[3]);
+  render_sprite(ctx, p0, p1, texture, {0.0f, (float) texture->height, (float) texture->width, 0.0f},
+                Vec4f(1.0f, 1.0f, 1.0f, 1.0f), BLEND_MODE_DECAL);
 }
 
 static void render_unit_axes(RenderingContext *ctx)
@@ -681,38 +1102,76 @@ static void render_unit_axes(RenderingContext *ctx)
   precalculate_matrices(ctx);
 
   Vec3f origin = {0, 0, 0};
-  ctx->draw_line(ctx, origin, {1, 0, 0}, {1.0f, 0.0f, 0.0f, 1.0f});
-  ctx->draw_line(ctx, origin, {0, 1, 0}, {0.0f, 1.0f, 0.0f, 1.0f});
-  ctx->draw_line(ctx, origin, {0, 0, 1}, {0.0f, 0.0f, 1.0f, 1.0f});
+  render_line(ctx, origin, {1, 0, 0}, {1.0f, 0.0f, 0.0f, 1.0f});
+  render_line(ctx, origin, {0, 1, 0}, {0.0f, 1.0f, 0.0f, 1.0f});
+  render_line(ctx, origin, {0, 0, 1}, {0.0f, 0.0f, 1.0f, 1.0f});
 }
 
-static void animate_model(State *state)
+#define BAKE_ARENA_SIZE MB(64)
+
+// Decodes the baked frame, baking the animation first when the creature or animation changed
+static bool pose_model_baked(State *state, M2Pose *pose)
 {
-  if (state->creature == NULL) {
-    return;
+  ModelInstance *instance = pose->instance;
+  ModelAnimationLayer *layer = &pose->layers[0];
+  M2BakedAnimation *baked = state->baked;
+
+  if (baked == NULL || baked->model != instance->model || baked->animId != layer->animId) {
+    state->bake_arena->discard(); // Recorded frames hold copies of the vertices
+    double start = state->platform_api->get_time();
+    baked = state->baked = m2_bake_animation(state->bake_arena, instance, layer->animId, M2_BAKE_FRAME_STEP);
+    double ms = (state->platform_api->get_time() - start) * 1000.0;
+
+    if (baked == NULL) {
+      printf("Animation %u can't be baked, playing it live\n", layer->animId);
+      state->baked_animation = false;
+      return false;
+    }
+
+    printf("Baked animation %u: %u frames, %zu KB, max error %.5f, %.1f ms\n", baked->animId, baked->framesCount,
+           baked->size / 1024, baked->maxError, ms);
   }
 
-  M2Model *model = state->creature->model;
-  if (model == NULL) {
+  m2_baked_pose(baked, instance, layer->frame);
+  return true;
+}
+
+// Recalculates bones and vertices for the current animation frames
+static void pose_model(State *state)
+{
+  if (state->creature == NULL) {
     return;
   }
 
-  m2_reset_bones(model);
+  ModelInstance *instance = state->creature->instance;
 
-  if (state->creature->type == DCT_CHARACTER) {
-    if (state->lower_anim_enabled && (state->upperAnim.id != state->lowerAnim.id)) {
-      m2_calc_bones(model, &state->core_boneset, state->lowerAnim.id, state->lowerAnim.currentFrame, state->currentGlobalFrame);
-      m2_calc_bones(model, &state->upper_boneset, state->upperAnim.id, state->upperAnim.currentFrame, state->currentGlobalFrame);
-      m2_calc_bones(model, NULL, state->lowerAnim.id, state->lowerAnim.currentFrame, state->currentGlobalFrame);
-    } else {
-      m2_calc_bones(model, NULL, state->upperAnim.id, state->upperAnim.currentFrame, state->currentGlobalFrame);
-    }
+  M2Pose pose = {};
+  pose.instance = instance;
+  pose.globalFrame = state->currentGlobalFrame;
+
+  if (state->creature->type == DCT_CHARACTER && state->lower_anim_enabled && (state->upperAnim.id != state->lowerAnim.id)) {
+    pose.layers[pose.layersCount++] = {&state->core_boneset, (uint32_t) state->lowerAnim.id, (uint32_t) state->lowerAnim.currentFrame};
+    pose.layers[pose.layersCount++] = {&state->upper_boneset, (uint32_t) state->upperAnim.id, (uint32_t) state->upperAnim.currentFrame};
+    pose.layers[pose.layersCount++] = {NULL, (uint32_t) state->lowerAnim.id, (uint32_t) state->lowerAnim.currentFrame};
   } else {
-    m2_calc_bones(model, NULL, state->upperAnim.id, state->upperAnim.currentFrame, state->currentGlobalFrame);
+    pose.layers[pose.layersCount++] = {NULL, (uint32_t) state->upperAnim.id, (uint32_t) state->upperAnim.currentFrame};
+  }
+
+  if (state->baked_animation && pose.layersCount == 1 && pose_model_baked(state, &pose)) {
+    return;
   }
 
-  m2_animate_vertices(model);
+  if (state->parallel_animation) {
+    m2_pose_models(state->platform_api, state->animation_pool, &pose, 1);
+  } else {
+    m2_calc_bones(instance, pose.layers, pose.layersCount, pose.globalFrame);
+    m2_animate_vertices(instance);
+  }
+}
 
+static void animate_model(State *state)
+{
+  pose_model(state);
   state->modelChanged = true;
 }
 
@@ -722,7 +1181,7 @@ static void set_animation(State *state, Animation *anim, uint32_t newId)
     return;
   }
 
-  M2Model *model = state->creature->model;
+  M2Model *model = state->creature->instance->model;
 
   anim->id = newId;
   anim->startFrame = model->animations[newId].startFrame;
@@ -745,37 +1204,225 @@ static void set_animation(State *state, Animation *anim, uint32_t newId)
   animate_model(state);
 }
 
+// FNV-1a over the skinned attributes, compares serial and parallel posing
+static uint32_t animated_vertices_hash(ModelInstance *instance)
+{
+  M2Model *model = instance->model;
+  Vec3f *arrays[] = {instance->animatedPositions, instance->animatedNormals, instance->animatedTangents, instance->animatedBitangents};
+  uint32_t hash = 2166136261u;
+
+  for (size_t ai = 0; ai < 4; ai++) {
+    uint8_t *bytes = (uint8_t *) arrays[ai];
+    for (size_t i = 0; i < model->verticesCount * sizeof(Vec3f); i++) {
+      hash = (hash ^ bytes[i]) * 16777619u;
+    }
+  }
+
+  return hash;
+}
+
+#define ANIMATION_BENCHMARK_STEP 16 // Frames between samples, roughly 60 fps playback
+#define ANIMATION_BENCHMARK_SKINNING_FRAMES 100
+
+static const char *keyframe_search_names[M2_KEYFRAME_SEARCH_COUNT] = {"linear", "binary", "cursor"};
+
+// Poses the whole skeleton through every animation of the current model with each keyframe search,
+// then times posing the current frame serially and on the animation pool
+static void animation_benchmark(State *state)
+{
+  if (state->creature == NULL) {
+    return;
+  }
+
+  render_pipeline_finish(state);
+
+  ModelInstance *instance = state->creature->instance;
+  M2Model *model = instance->model;
+  M2KeyframeSearch search = model->keyframeSearch;
+
+  printf("Animation benchmark, %u bones, %u animations, every %d frames\n", model->bonesCount, model->animationsCount, ANIMATION_BENCHMARK_STEP);
+
+  for (uint32_t i = 0; i < M2_KEYFRAME_SEARCH_COUNT; i++) {
+    model->keyframeSearch = (M2KeyframeSearch) i;
+    uint32_t poses = 0;
+
+    double start = state->platform_api->get_time();
+    for (uint32_t ai = 0; ai < model->animationsCount; ai++) {
+      ModelAnimation *anim = &model->animations[ai];
+
+      for (uint32_t frame = anim->startFrame; frame <= anim->endFrame; frame += ANIMATION_BENCHMARK_STEP) {
+        ModelAnimationLayer layer = {NULL, ai, frame};
+        m2_calc_bones(instance, &layer, 1, frame);
+        poses++;
+      }
+    }
+    double ms = (state->platform_api->get_time() - start) * 1000.0;
+
+    printf("  %-8s %8.2f ms, %6.2f us/pose\n", keyframe_search_names[i], ms, poses ? ms * 1000.0 / poses : 0.0);
+  }
+
+  model->keyframeSearch = search;
+  bool parallel_animation = state->parallel_animation;
+
+#ifdef MODEL_SKIN_AVX2
+  const char *kernel = "AVX2";
+#else
+  const char *kernel = "scalar";
+#endif
+
+  uint32_t hashes[2];
+  for (uint32_t parallel = 0; parallel < 2; parallel++) {
+    state->parallel_animation = parallel == 1;
+
+    double start = state->platform_api->get_time();
+    for (uint32_t i = 0; i < ANIMATION_BENCHMARK_SKINNING_FRAMES; i++) {
+      pose_model(state);
+    }
+    double ms = (state->platform_api->get_time() - start) * 1000.0 / ANIMATION_BENCHMARK_SKINNING_FRAMES;
+
+    hashes[parallel] = animated_vertices_hash(instance);
+    printf("  pose and skin %u vertices, %s, %s: %6.3f ms/frame\n", model->verticesCount, kernel,
+           parallel ? "parallel" : "serial", ms);
+  }
+
+  printf("  parallel result %s\n", hashes[0] == hashes[1] ? "identical" : "DIFFERS");
+  state->parallel_animation = parallel_animation;
+
+  animate_model(state);
+}
+
+#define BAKE_BENCHMARK_STEP 16 // Frames between played back samples, roughly 60 fps
+
+// Bakes the first animation of every creature in the table and compares playing it back with live posing.
+// Live memory is the per instance pose state, baked memory is shared by every instance playing the animation.
+static void bake_benchmark(State *state)
+{
+  render_pipeline_finish(state);
+  state->baked = NULL;
+
+  MemoryArena *arena = state->bake_arena;
+  const uint32_t creatures_count = sizeof(creatures) / sizeof(creatures[0]);
+  size_t live_total = 0, baked_total = 0;
+  double live_us_total = 0.0, baked_us_total = 0.0;
+  uint32_t baked_count = 0;
+
+  printf("Bake benchmark, first animation, sampled every %d frames, played every %d\n", M2_BAKE_FRAME_STEP, BAKE_BENCHMARK_STEP);
+  printf("  %-28s %6s %6s %9s %9s %9s %9s %8s\n", "creature", "verts", "frames", "live KB", "baked KB", "live us", "baked us", "error");
+
+  for (uint32_t ci = 0; ci < creatures_count; ci++) {
+    arena->discard();
+    DresserCreatureBase *creature = dresser_load_creature(state->dresser, arena, creatures[ci].display_id);
+    if (creature == NULL) {
+      continue;
+    }
+
+    ModelInstance *instance = creature->instance;
+    M2Model *model = instance->model;
+    M2BakedAnimation *baked = m2_bake_animation(arena, instance, 0, M2_BAKE_FRAME_STEP);
+    if (baked == NULL) {
+      printf("  %-28s not baked\n", creatures[ci].name);
+      continue;
+    }
+
+    uint32_t frames = 0;
+    double start = state->platform_api->get_time();
+    for (uint32_t frame = baked->startFrame; frame <= baked->endFrame; frame += BAKE_BENCHMARK_STEP) {
+      ModelAnimationLayer layer = {NULL, 0, frame};
+      m2_calc_bones(instance, &layer, 1, frame);
+      m2_animate_vertices(instance);
+      frames++;
+    }
+    double live_us = (state->platform_api->get_time() - start) * 1000000.0 / frames;
+
+    start = state->platform_api->get_time();
+    for (uint32_t frame = baked->startFrame; frame <= baked->endFrame; frame += BAKE_BENCHMARK_STEP) {
+      m2_baked_pose(baked, instance, frame);
+    }
+    double baked_us = (state->platform_api->get_time() - start) * 1000000.0 / frames;
+
+    size_t live_size = sizeof(Vec3f) * 4 * model->verticesCount + sizeof(Mat34) * 2 * model->bonesCount;
+    printf("  %-28s %6u %6u %9zu %9zu %9.1f %9.1f %8.5f\n", creatures[ci].name, model->verticesCount, baked->framesCount,
+           live_size / 1024, baked->size / 1024, live_us, baked_us, baked->maxError);
+
+    live_total += live_size;
+    baked_total += baked->size;
+    live_us_total += live_us;
+    baked_us_total += baked_us;
+    baked_count++;
+  }
+
+  if (baked_count > 0) {
+    printf("  %u animations, live %zu KB per instance set, baked %zu KB, live %.1f us, baked %.1f us per frame on average\n",
+           baked_count, live_total / 1024, baked_total / 1024, live_us_total / baked_count, baked_us_total / baked_count);
+  }
+
+  arena->discard();
+  animate_model(state);
+}
+
 static void switch_animation(State *state, Animation *anim, int32_t inc)
 {
-  M2Model *model = state->creature->model;
+  M2Model *model = state->creature->instance->model;
   uint32_t newId = CLAMP_CYCLE((int32_t) anim->id + inc, (int32_t) 0, (int32_t) model->animationsCount - 1);
   set_animation(state, anim, newId);
 }
 
+// Brings large creatures down to roughly the size of the others
+static float creature_model_scale(M2Model *model)
+{
+  return model->bounding_radius > 3.0f ? 2.8f / model->bounding_radius : 1.0f;
+}
+
+// Arena for loading the next creature, whatever it held before the current creature is no longer used
+static MemoryArena *creature_spare_arena(State *state)
+{
+  MemoryArena *arena = state->creature_arenas[state->creature_arena ^ 1];
+  arena->discard();
+  return arena;
+}
+
+// One line per creature instead of one per loaded model
+static void creature_report_face_order(DresserCreatureBase *creature)
+{
+  uint32_t faces = 0, before = 0, after = 0;
+  for (uint32_t i = 0; i <= creature->items_count; i++) {
+    ModelInstance *instance = i == 0 ? creature->instance : creature->items[i - 1];
+    if (instance != NULL) {
+      faces += instance->model->orderedFacesCount;
+      before += instance->model->cacheMissesBefore;
+      after += instance->model->cacheMissesAfter;
+    }
+  }
+
+  if (faces > 0) {
+    printf("Face order: ACMR %.3f -> %.3f over %u faces\n", (float) before / faces, (float) after / faces, faces);
+  }
+}
+
 static void set_creature(State *state, DresserCreatureBase *creature)
 {
   if (creature == NULL) {
     return;
   }
 
+  render_pipeline_finish(state);
   state->creature = creature;
+  state->creature_arena ^= 1; // Creature came from the spare arena
+  state->baked = NULL; // A new model may land where the baked one was
 
-  M2Model *model = creature->model;
-  if (model->bounding_radius > 3.0f) {
-    state->model_scale = 2.8f / model->bounding_radius;
-  } else {
-    state->model_scale = 1.0f;
-  }
+  M2Model *model = creature->instance->model;
+  state->model_scale = creature_model_scale(model);
+  creature_report_face_order(creature);
 
-  state->debugTexture = model->textures[0].texture;
+  state->debugTexture = creature->instance->textures[0];
 
   if (creature->type == DCT_CHARACTER) {
     DresserCharacter *character = (DresserCharacter *) creature;
 
     state->appearance_limits = dresser_get_customization_limits(state->dresser, character->race, character->sex);
 
-    state->core_boneset = m2_character_core_boneset(creature->model);
-    state->upper_boneset = m2_character_upper_body_boneset(creature->model);
+    state->core_boneset = m2_character_core_boneset(model);
+    state->upper_boneset = m2_character_upper_body_boneset(model);
 
     if (model->animationLookups[state->upperAnim.dbc_id] > -1) {
       set_animation(state, &state->upperAnim, model->animationLookups[state->upperAnim.dbc_id]);
@@ -799,45 +1446,406 @@ static void set_creature(State *state, DresserCreatureBase *creature)
   animate_model(state);
 }
 
-static void initialize(State *state, DrawingBuffer *buffer)
+// Entries may point at models of unloaded members, so start over whenever they change
+static void crowd_pose_cache_reset(Crowd *crowd)
 {
-  RenderingContext *ctx = &state->rendering_context;
-  set_target(ctx, buffer);
-  ctx->clear_color = BLACK;
+  M2PoseCache *cache = &crowd->pose_cache;
+  m2_pose_cache_clear(cache);
+  cache->cacheVertices = crowd->cache_mode == POSE_CACHE_VERTICES;
+  cache->hits = cache->misses = cache->evictions = cache->bypasses = 0;
+}
 
-  ctx->model_mat = Mat44::identity();
-  ctx->viewport_mat = viewport_matrix((float) buffer->width, (float) buffer->height, true);
-  ctx->projection_mat = perspective_matrix(0.1f, 10.0f, 60.0f);
+// Frames between pose updates of a member, zero when it's off screen
+static uint32_t crowd_update_interval(Crowd *crowd, uint32_t member)
+{
+  float radius = crowd->radii[member];
+  if (!crowd->animation_lod) {
+    return 1;
+  } else if (radius == 0.0f) {
+    return 0;
+  }
 
-  ctx->light = Vec3f(0.5f, 1.0f, 0.5f).normalized();
+  uint32_t interval = 1;
+  for (size_t i = 0; i < sizeof(animation_lod_radii) / sizeof(animation_lod_radii[0]); i++) {
+    interval = radius < animation_lod_radii[i] ? interval * 2 : interval;
+  }
 
-  ctx->zbuffer = (zval_t *) state->main_arena->allocate(buffer->width * buffer->height * sizeof(zval_t));
+  return interval;
+}
 
-  char *basename = (char *) "misc/man";
-  char model_filename[255];
-  char diffuse_filename[255];
-  char normal_filename[255];
-  snprintf(model_filename, 255, (char *) "data/%s.obj", basename);
-  snprintf(diffuse_filename, 255, (char *) "data/%s_D.tga", basename);
-  snprintf(normal_filename, 255, (char *) "data/%s_N.tga", basename);
+static M2Pose crowd_member_pose(Crowd *crowd, uint32_t member, uint32_t globalFrame)
+{
+  M2Pose pose = crowd->poses[member];
+  M2Model *model = pose.instance->model;
 
-  state->buffer = buffer;
-  state->screenWidth = buffer->width;
-  state->screenHeight = buffer->height;
+  uint32_t frame = 0;
+  if (model->animationsCount > 0) {
+    ModelAnimation *anim = &model->animations[0];
+    uint32_t length = MAX(anim->endFrame - anim->startFrame, 1u);
+    frame = anim->startFrame + (globalFrame + crowd->phases[member]) % length;
+  }
 
-  // LoadedAsset asset = state->platform_api->load_asset((char *) "Spells/Intellect_128.blp");
-  // if (asset.data != NULL) {
-  //   printf("Loaded asset of size: %zu\n", asset.size);
+  pose.layers[0] = {NULL, 0, frame};
+  pose.layersCount = 1;
+  pose.globalFrame = globalFrame + crowd->phases[member];
+  return pose;
+}
 
-  //   BlpImage image;
-  //   image.read_header(asset.data, asset.size);
+// Every member plays its first animation, offset in time from other creature types. Members skipping an update
+// keep their last pose, their clock is the global frame so they resume in time. Reduced rate members update
+// on frames offset by their index, spreading them evenly over the interval. Only full rate members go through
+// the pose cache, an entry a reduced rate member showed could be refilled by other poses while it skips updates,
+// so those pose into their own buffers.
+static void crowd_pose(State *state)
+{
+  Crowd *crowd = &state->crowd;
+  if (crowd->count == 0) {
+    return;
+  }
 
-  //   BlpHeader *header = &image.header;
-  //   printf("BLP Image width: %d; height: %d; compression: %d\nAlpha depth: %d, alpha type: %d\n",
-  //          header->width, header->height, header->compression, header->alphaDepth, header->alphaType);
+  double start = state->platform_api->get_time();
+  uint32_t globalFrame = (uint32_t) state->currentGlobalFrame;
+  M2Pose poses[CROWD_MAX];
+  uint32_t posesCount = 0;
+  uint32_t cachedCount = 0;
+  crowd->tick++;
+
+  for (uint32_t reduced = 0; reduced < 2; reduced++) {
+    for (uint32_t i = 0; i < crowd->count; i++) {
+      // Members still showing a cache entry are posed once more to get back their own buffers
+      ModelInstance *instance = crowd->poses[i].instance;
+      bool shared = instance->boneMatrices != instance->own.boneMatrices || instance->animatedPositions != instance->own.positions;
+      uint32_t interval = crowd_update_interval(crowd, i);
+      if ((interval != 1) != (reduced == 1)) {
+        continue;
+      } else if (!shared && (interval == 0 || (crowd->tick + i) % interval != 0)) {
+        continue;
+      }
 
-  //   Texture *texture = texture_create(state->main_arena, header->width, header->height);
-  //   image.read_into_texture(asset.data, asset.size, texture);
+      poses[posesCount++] = crowd_member_pose(crowd, i, globalFrame);
+    }
+
+    cachedCount = reduced == 0 ? posesCount : cachedCount;
+  }
+
+  M2PoseCache *cache = crowd->cache_mode == POSE_CACHE_OFF ? NULL : &crowd->pose_cache;
+  m2_pose_cache_apply(cache, poses, cachedCount);
+  m2_pose_cache_apply(NULL, poses + cachedCount, posesCount - cachedCount);
+  m2_pose_models(state->platform_api, state->parallel_animation ? state->animation_pool : NULL, poses, posesCount);
+  crowd->posed = posesCount;
+
+  float ms = (float) ((state->platform_api->get_time() - start) * 1000.0);
+  crowd->pose_ms += (ms - crowd->pose_ms) * 0.1f;
+}
+
+// Creatures of the table are loaded once each, further members are clones with their own pose state
+static void crowd_build(State *state, uint32_t count)
+{
+  Crowd *crowd = &state->crowd;
+  const uint32_t creatures_count = sizeof(creatures) / sizeof(creatures[0]);
+  DresserCreatureBase *loaded[creatures_count] = {};
+
+  render_pipeline_finish(state); // Recorded frames may still draw the old members
+  crowd->arena->discard();
+  crowd->count = 0;
+  crowd->pose_ms = 0.0f;
+
+  for (uint32_t i = 0; i < count && i < CROWD_MAX; i++) {
+    uint32_t ci = i % creatures_count;
+    if (i < creatures_count) {
+      loaded[ci] = dresser_load_creature(state->dresser, crowd->arena, creatures[ci].display_id);
+    }
+
+    if (loaded[ci] == NULL) {
+      continue;
+    }
+
+    DresserCreatureBase *member = i < creatures_count ? loaded[ci] : dresser_clone_creature(crowd->arena, loaded[ci]);
+    uint32_t mi = crowd->count++;
+    crowd->members[mi] = member;
+    crowd->scales[mi] = creature_model_scale(member->instance->model);
+    crowd->phases[mi] = ci * CROWD_PHASE_STEP;
+    crowd->radii[mi] = FLT_MAX; // Posed until drawn once
+    crowd->poses[mi] = {};
+    crowd->poses[mi].instance = member->instance;
+  }
+
+  printf("Crowd: %u instances, %zu KB of instance data\n", crowd->count, crowd->arena->taken / 1024);
+  crowd_pose_cache_reset(crowd);
+  crowd_pose(state);
+  state->modelChanged = true;
+}
+
+#define CROWD_BENCHMARK_FRAMES 64
+
+// Poses every crowd size with the pose cache off and on, with animation LOD off and on. Members aren't drawn,
+// so instead of their screen radii they're spread evenly over full rate and every reduced rate.
+static void crowd_animation_benchmark(State *state)
+{
+  Crowd *crowd = &state->crowd;
+  uint32_t size_index = crowd->size_index;
+  PoseCacheMode cache_mode = crowd->cache_mode;
+  bool animation_lod = crowd->animation_lod;
+  double global_frame = state->currentGlobalFrame;
+  const uint32_t rates = sizeof(animation_lod_radii) / sizeof(animation_lod_radii[0]) + 1;
+
+  printf("Crowd animation benchmark, %d frames, members spread over %u update rates\n", CROWD_BENCHMARK_FRAMES, rates);
+
+  for (size_t si = 1; si < sizeof(crowd_sizes) / sizeof(crowd_sizes[0]); si++) {
+    crowd_build(state, crowd_sizes[si]);
+
+    for (uint32_t ci = 0; ci < 2; ci++) {
+      crowd->cache_mode = ci == 0 ? POSE_CACHE_OFF : POSE_CACHE_VERTICES;
+
+      for (uint32_t li = 0; li < 2; li++) {
+        crowd->animation_lod = li == 1;
+        crowd_pose_cache_reset(crowd);
+
+        for (uint32_t i = 0; i < crowd->count; i++) {
+          uint32_t rate = i % rates;
+          crowd->radii[i] = rate == 0 ? FLT_MAX : animation_lod_radii[rate - 1] * 0.75f;
+        }
+
+        uint32_t posed = 0;
+        double start = state->platform_api->get_time();
+        for (uint32_t f = 0; f < CROWD_BENCHMARK_FRAMES; f++) {
+          state->currentGlobalFrame += BAKE_BENCHMARK_STEP;
+          crowd_pose(state);
+          posed += crowd->posed;
+        }
+        double ms = (state->platform_api->get_time() - start) * 1000.0 / CROWD_BENCHMARK_FRAMES;
+
+        printf("  %2u members, cache %-18s, animation lod %-3s: %5.1f posed, %6.3f ms/frame\n", crowd->count,
+               pose_cache_mode_names[crowd->cache_mode], crowd->animation_lod ? "on" : "off",
+               (float) posed / CROWD_BENCHMARK_FRAMES, ms);
+      }
+    }
+  }
+
+  crowd->cache_mode = cache_mode;
+  crowd->animation_lod = animation_lod;
+  state->currentGlobalFrame = global_frame;
+  crowd->size_index = size_index;
+  crowd_build(state, crowd_sizes[size_index]);
+}
+
+static void dynamic_resolution_init(DynamicResolution *dr, MemoryArena *arena, DrawingBuffer *native)
+{
+  dr->enabled = false;
+  dr->scale = DYNRES_MAX_SCALE;
+
+  // Scene buffer is never larger than the native one, so allocate it once
+  dr->buffer = *native;
+  dr->buffer.pixels = arena->allocate(native->width * native->height * native->bytes_per_pixel);
+}
+
+static DrawingBuffer *dynamic_resolution_update(DynamicResolution *dr, DrawingBuffer *native, float frame_ms)
+{
+  if (!dr->enabled) {
+    dr->scale = DYNRES_MAX_SCALE;
+    return native;
+  }
+
+  // Fragment cost is roughly proportional to the pixel count, hence sqrt
+  float desired = dr->scale * sqrtf(FRAME_TARGET_MS / MAX(frame_ms, 0.1f));
+  dr->scale += (desired - dr->scale) * 0.1f;
+  dr->scale = CLAMP(dr->scale, DYNRES_MIN_SCALE, DYNRES_MAX_SCALE);
+
+  // Rasterizer works in 8x8 blocks, keep dimensions aligned to them
+  uint32_t width = ((uint32_t) (native->width * dr->scale)) & ~7u;
+  uint32_t height = ((uint32_t) (native->height * dr->scale)) & ~7u;
+
+  dr->buffer.width = MAX(width, 8u);
+  dr->buffer.height = MAX(height, 8u);
+  dr->buffer.pitch = dr->buffer.width;
+
+  return &dr->buffer;
+}
+
+static void quality_apply(State *state)
+{
+  QualityGovernor *q = &state->quality;
+  q->frames_over = 0;
+  q->frames_under = 0;
+  q->frames_since_switch = 0;
+
+  QualityTier *shading = &quality_tiers[q->levels[QUALITY_KNOB_SHADING]];
+  state->render_flags.vertex_lighting = shading->vertex_lighting;
+  state->render_flags.bilinear_filtering = shading->bilinear_filtering;
+  state->render_flags.transparent_passes = quality_tiers[q->levels[QUALITY_KNOB_TRANSPARENT]].transparent_passes;
+
+  // Shadow map pixels are allocated for the largest size, lower levels use a part of them
+  QualityTier *shadow = &quality_tiers[q->levels[QUALITY_KNOB_SHADOW]];
+  if (state->shadowmap && state->shadowmap->width != shadow->shadowmap_size) {
+    render_pipeline_finish(state);
+    state->shadowmap->width = shadow->shadowmap_size;
+    state->shadowmap->height = shadow->shadowmap_size;
+    state->modelChanged = true;
+  }
+}
+
+// Per-frame cost of the passes a knob controls, shadow refreshes are spread over their interval
+static float quality_knob_cost(State *state, uint32_t knob)
+{
+  QualityGovernor *q = &state->quality;
+
+  switch (knob) {
+    case QUALITY_KNOB_SHADING:
+      return q->pass_ms[RENDER_PASS_FLOOR] + q->pass_ms[RENDER_PASS_OPAQUE];
+
+    case QUALITY_KNOB_SHADOW: {
+      uint32_t interval = quality_tiers[q->levels[QUALITY_KNOB_SHADOW]].shadowmap_interval;
+      return (state->playing && interval > 0) ? q->pass_ms[RENDER_PASS_SHADOW] / interval : 0.0f;
+    }
+
+    case QUALITY_KNOB_TRANSPARENT:
+      return q->pass_ms[RENDER_PASS_TRANSPARENT];
+  }
+
+  return 0.0f;
+}
+
+// Steps down the knob behind the most expensive passes, the first one left if nothing was measured
+static bool quality_step_down(State *state)
+{
+  QualityGovernor *q = &state->quality;
+  int32_t knob = -1;
+  float knob_cost = 0.0f;
+
+  for (uint32_t i = 0; i < QUALITY_KNOB_COUNT; i++) {
+    if (q->levels[i] + 1 >= QUALITY_TIERS_COUNT) {
+      continue;
+    }
+
+    float cost = quality_knob_cost(state, i);
+    if (knob < 0 || cost > knob_cost) {
+      knob = i;
+      knob_cost = cost;
+    }
+  }
+
+  if (knob < 0) {
+    return false;
+  }
+
+  q->levels[knob]++;
+  q->steps[q->steps_count++] = knob;
+  quality_apply(state);
+  return true;
+}
+
+// Undoes the most recent step
+static bool quality_step_up(State *state)
+{
+  QualityGovernor *q = &state->quality;
+  if (q->steps_count == 0) {
+    return false;
+  }
+
+  q->levels[q->steps[--q->steps_count]]--;
+  quality_apply(state);
+  return true;
+}
+
+static void quality_update(State *state)
+{
+  QualityGovernor *q = &state->quality;
+
+  if (!q->enabled) {
+    return;
+  }
+
+  q->frames_since_switch++;
+  if (q->frames_since_switch > QUALITY_SWITCH_FRAMES * 20) {
+    q->step_up_frames = QUALITY_SWITCH_FRAMES;
+  }
+
+  // Resolution is cheaper to trade than shading, let it reach its limits first
+  DynamicResolution *dr = &state->dynres;
+  bool can_step_down = !dr->enabled || dr->scale <= DYNRES_MIN_SCALE + 0.01f;
+  bool can_step_up = !dr->enabled || dr->scale >= DYNRES_MAX_SCALE - 0.01f;
+
+  if (state->frame_ms > q->target_ms * 1.1f && can_step_down) {
+    q->frames_over++;
+    q->frames_under = 0;
+  } else if (state->frame_ms < q->target_ms * 0.7f && can_step_up) {
+    q->frames_under++;
+    q->frames_over = 0;
+  } else {
+    q->frames_over = 0;
+    q->frames_under = 0;
+  }
+
+  if (q->frames_over > QUALITY_SWITCH_FRAMES) {
+    // Higher level didn't hold the budget for long, wait longer before trying it again
+    uint32_t frames_since_switch = q->frames_since_switch;
+    if (quality_step_down(state) && frames_since_switch < q->step_up_frames * 2) {
+      q->step_up_frames = MIN(q->step_up_frames * 2, QUALITY_SWITCH_FRAMES * 16);
+    }
+  } else if (q->frames_under > q->step_up_frames) {
+    quality_step_up(state);
+  }
+}
+
+static void initialize(State *state, DrawingBuffer *buffer)
+{
+  RenderingContext *ctx = &state->rendering_context;
+  set_target(ctx, buffer);
+  ctx->clear_color = BLACK;
+
+  ctx->model_mat = Mat44::identity();
+  ctx->viewport_mat = viewport_matrix((float) buffer->width, (float) buffer->height, true);
+  ctx->projection_mat = perspective_matrix(0.1f, 10.0f, 60.0f);
+
+  ctx->light = Vec3f(0.5f, 1.0f, 0.5f).normalized();
+
+  ctx->zbuffer = (zval_t *) state->main_arena->allocate(buffer->width * buffer->height * sizeof(zval_t));
+
+  char *basename = (char *) "misc/man";
+  char model_filename[255];
+  char diffuse_filename[255];
+  char normal_filename[255];
+  snprintf(model_filename, 255, (char *) "data/%s.obj", basename);
+  snprintf(diffuse_filename, 255, (char *) "data/%s_D.tga", basename);
+  snprintf(normal_filename, 255, (char *) "data/%s_N.tga", basename);
+
+  // M2 skins carry no normal maps, the shipped one tiles over them as a detail map
+  if (state->platform_api->get_file_size(normal_filename) < 0) {
+    snprintf(normal_filename, 255, (char *) "data/rabbit/rabbit_N.tga");
+  }
+  state->normalmap = load_tga_texture(state, NULL, normal_filename);
+
+  state->buffer = buffer;
+  state->screenWidth = buffer->width;
+  state->screenHeight = buffer->height;
+
+  dynamic_resolution_init(&state->dynres, state->main_arena, buffer);
+  render_pipeline_init(state, buffer);
+  state->animation_pool = state->platform_api->work_queue_create(WORK_QUEUE_THREADS_AUTO);
+  state->parallel_animation = true;
+  state->view_lod = true;
+
+  state->scene_cache = *buffer;
+  state->scene_cache.pixels = state->main_arena->allocate(buffer->pitch * buffer->height * buffer->bytes_per_pixel);
+  state->scene_cache_valid = false;
+
+  state->impostor.enabled = true;
+  state->impostor.texture = texture_create(state->main_arena, IMPOSTOR_SIZE, IMPOSTOR_SIZE);
+  state->impostor.zbuffer = (zval_t *) state->main_arena->allocate(IMPOSTOR_SIZE * IMPOSTOR_SIZE * sizeof(zval_t));
+
+  // LoadedAsset asset = state->platform_api->load_asset((char *) "Spells/Intellect_128.blp");
+  // if (asset.data != NULL) {
+  //   printf("Loaded asset of size: %zu\n", asset.size);
+
+  //   BlpImage image;
+  //   image.read_header(asset.data, asset.size);
+
+  //   BlpHeader *header = &image.header;
+  //   printf("BLP Image width: %d; height: %d; compression: %d\nAlpha depth: %d, alpha type: %d\n",
+  //          header->width, header->height, header->compression, header->alphaDepth, header->alphaType);
+
+  //   Texture *texture = texture_create(state->main_arena, header->width, header->height);
+  //   image.read_into_texture(asset.data, asset.size, texture);
 
   //   state->debugTexture = texture;
   //   state->platform_api->release_asset(&asset);
@@ -860,8 +1868,16 @@ static void initialize(State *state, DrawingBuffer *buffer)
   state->dresser = (Dresser *) state->main_arena->allocate(sizeof(Dresser));
   dresser_init(state->dresser, &state->loader);
 
+  for (uint32_t i = 0; i < 2; i++) {
+    state->creature_arenas[i] = MemoryArena::initialize(state->platform_api->allocate_memory(MB(16)), MB(16));
+  }
+  state->crowd.arena = MemoryArena::initialize(state->platform_api->allocate_memory(MB(96)), MB(96));
+  state->bake_arena = MemoryArena::initialize(state->platform_api->allocate_memory(BAKE_ARENA_SIZE), BAKE_ARENA_SIZE);
+  m2_pose_cache_init(&state->crowd.pose_cache, &state->loader.allocator, POSE_CACHE_ENTRIES, POSE_CACHE_MAX_BONES, POSE_CACHE_MAX_VERTICES);
+  state->crowd.animation_lod = true;
+
   state->creature_index = 0;
-  set_creature(state, dresser_load_creature(state->dresser, creatures[state->creature_index].display_id));
+  set_creature(state, dresser_load_creature(state->dresser, creature_spare_arena(state), creatures[state->creature_index].display_id));
   switch_animation(state, &state->lowerAnim, 0);
   switch_animation(state, &state->upperAnim, 0);
 
@@ -882,7 +1898,7 @@ static void initialize(State *state, DrawingBuffer *buffer)
     equip.slots[DEIS_WAIST] = {35614}; // Redemption Girdle
     equip.slots[DEIS_BACK] = {35408}; // Veil of Eclipse
 
-    dresser_set_character_equipment(state->dresser, (DresserCharacter *) state->creature, &equip);
+    dresser_set_character_equipment(state->dresser, state->creature_arenas[state->creature_arena], (DresserCharacter *) state->creature, &equip);
   }
   #endif
 
@@ -933,6 +1949,12 @@ static void initialize(State *state, DrawingBuffer *buffer)
   state->camDistance = 1.0f;
 
   memset(&state->render_flags, 1, sizeof(state->render_flags)); // Set all flags
+  state->render_flags.vertex_lighting = false;
+
+  state->frame_ms = FRAME_TARGET_MS;
+  state->quality.enabled = false;
+  state->quality.target_ms = FRAME_TARGET_MS;
+  state->quality.step_up_frames = QUALITY_SWITCH_FRAMES;
   state->hsv = { 260.0f, 0.33f, 1.0f };
   state->sat_deg = RAD(109.0f);
 
@@ -951,6 +1973,20 @@ static void initialize(State *state, DrawingBuffer *buffer)
   state->temp_arena->discard();
 }
 
+// Depth rendered from the light is copied into the shadow map texture
+static RENDER_CALLBACK(shadowmap_readback)
+{
+  Texture *shadowmap = (Texture *) ctx->target;
+
+  for (int i = 0; i < shadowmap->width; i++) {
+    for (int j = 0; j < shadowmap->height; j++) {
+      zval_t zval = ctx->zbuffer[j * shadowmap->width + i];
+      float v = (float) zval / ZBUFFER_MAX;
+      shadowmap->pixels[j * shadowmap->width + i] = { v, v, v, 1.0 };
+    }
+  }
+}
+
 static void render_shadowmap(State *state, RenderingContext *ctx, Texture *shadowmap)
 {
   RenderingContext subctx = {};
@@ -961,8 +1997,8 @@ static void render_shadowmap(State *state, RenderingContext *ctx, Texture *shado
   subctx.viewport_mat = viewport_matrix((float) shadowmap->width, (float) shadowmap->height, true);
   subctx.projection_mat = orthographic_matrix(0.1f, 10.0f, -1.0f, -1.0f, 1.0f, 1.0f);
 
-  ASSERT(shadowmap->width * shadowmap->height < ctx->target_width * ctx->target_height); // Check we won't overflow zbuffer
-  subctx.zbuffer = ctx->zbuffer;
+  subctx.zbuffer = state->shadow_zbuffer;
+  subctx.commands = ctx->commands;
 
   // HACK: Multiplication by 5 so camera doesn't end up inside geometry
   subctx.view_mat = look_at_matrix(ctx->light * 5, {0, 0, 0}, {0, 1, 0});
@@ -970,23 +2006,17 @@ static void render_shadowmap(State *state, RenderingContext *ctx, Texture *shado
 
   state->matShadowMVP = subctx.modelview_mat * subctx.projection_mat * subctx.viewport_mat;
 
-  clear_zbuffer(&subctx);
+  render_clear(&subctx, Vec4f(0.0f, 0.0f, 0.0f, 0.0f), RENDER_CLEAR_DEPTH);
 
   if (state->creature != NULL) {
     float scale = state->scale * state->model_scale;
     subctx.model_mat = Mat44::rotate_y(-RAD(90)) * Mat44::scale(scale, scale, scale);
     precalculate_matrices(&subctx);
 
-    render_m2_model(state, &subctx, state->creature->model);
+    render_m2_model(state, &subctx, state->creature->instance);
   }
 
-  for (int i = 0; i < shadowmap->width; i++) {
-    for (int j = 0; j < shadowmap->height; j++) {
-      zval_t zval = subctx.zbuffer[j * shadowmap->width + i];
-      float v = (float) zval / ZBUFFER_MAX;
-      shadowmap->pixels[j * shadowmap->width + i] = { v, v, v, 1.0 };
-    }
-  }
+  render_callback(&subctx, &shadowmap_readback, NULL, 0);
 }
 
 #if 0
@@ -1050,7 +2080,9 @@ static void update_animations(State *state, float dt)
   update_animation(&state->upperAnim, dt);
   update_animation(&state->lowerAnim, dt);
 
-  animate_model(state);
+  // Playback alone doesn't count as a model change, shadow map follows its own refresh interval
+  pose_model(state);
+  crowd_pose(state);
 }
 
 static float clamp_angle(float rad)
@@ -1238,6 +2270,86 @@ static void handle_input(State *state)
     state->showUnitAxes = !state->showUnitAxes;
   }
 
+  if (KEY_WAS_PRESSED(state->keyboard, KB_R)) {
+    state->dynres.enabled = !state->dynres.enabled;
+  }
+
+  if (KEY_WAS_PRESSED(state->keyboard, KB_A)) {
+    state->quality.enabled = !state->quality.enabled;
+  }
+
+  if (KEY_WAS_PRESSED(state->keyboard, KB_I)) {
+    state->impostor.enabled = !state->impostor.enabled;
+  }
+
+  if (KEY_WAS_PRESSED(state->keyboard, KB_V)) {
+    state->render_flags.vertex_lighting = !state->render_flags.vertex_lighting;
+  }
+
+  if (KEY_WAS_PRESSED(state->keyboard, KB_J)) {
+    state->pipeline.enabled = !state->pipeline.enabled && state->pipeline.queue != NULL; // Takes effect with the next frame
+  }
+
+  if (KEY_WAS_PRESSED(state->keyboard, KB_M)) {
+    state->aa.mode = (AntialiasingMode) ((state->aa.mode + 1) % AA_MODE_COUNT);
+  }
+
+  if (KEY_WAS_PRESSED(state->keyboard, KB_K)) {
+    state->aa.benchmark_requested = true;
+  }
+
+  if (KEY_WAS_PRESSED(state->keyboard, KB_D)) {
+    animation_benchmark(state);
+  }
+
+  if (KEY_WAS_PRESSED(state->keyboard, KB_1)) {
+    state->baked_animation = !state->baked_animation;
+    printf("Baked animation: %s\n", state->baked_animation ? "on" : "off");
+    animate_model(state);
+  }
+
+  if (KEY_WAS_PRESSED(state->keyboard, KB_2)) {
+    bake_benchmark(state);
+  }
+
+  if (KEY_WAS_PRESSED(state->keyboard, KB_3)) {
+    state->view_lod = !state->view_lod;
+    printf("View LOD: %s\n", state->view_lod ? "on" : "off");
+  }
+
+  if (KEY_WAS_PRESSED(state->keyboard, KB_4)) {
+    state->crowd.animation_lod = !state->crowd.animation_lod;
+    printf("Animation LOD: %s\n", state->crowd.animation_lod ? "on" : "off");
+  }
+
+  if (KEY_WAS_PRESSED(state->keyboard, KB_5)) {
+    crowd_animation_benchmark(state);
+  }
+
+  if (KEY_WAS_PRESSED(state->keyboard, KB_E)) {
+    state->parallel_animation = !state->parallel_animation;
+    printf("Parallel animation: %s\n", state->parallel_animation ? "on" : "off");
+  }
+
+  if (KEY_WAS_PRESSED(state->keyboard, KB_O)) {
+    Crowd *crowd = &state->crowd;
+    crowd->size_index = (crowd->size_index + 1) % (sizeof(crowd_sizes) / sizeof(crowd_sizes[0]));
+    crowd_build(state, crowd_sizes[crowd->size_index]);
+  }
+
+  if (KEY_WAS_PRESSED(state->keyboard, KB_Y)) {
+    Crowd *crowd = &state->crowd;
+    M2PoseCache *cache = &crowd->pose_cache;
+    if (cache->hits + cache->misses > 0) {
+      printf("Pose cache: %u hits, %u misses, %u evictions, %u bypasses\n",
+             cache->hits, cache->misses, cache->evictions, cache->bypasses);
+    }
+
+    crowd->cache_mode = (PoseCacheMode) ((crowd->cache_mode + 1) % POSE_CACHE_MODES_COUNT);
+    crowd_pose_cache_reset(crowd);
+    printf("Pose cache: %s\n", pose_cache_mode_names[crowd->cache_mode]);
+  }
+
   bool appearanceChanged = false;
   bool shift = KEY_IS_DOWN(state->keyboard, KB_LEFT_SHIFT);
 
@@ -1300,34 +2412,6 @@ static void handle_input(State *state)
 #endif
 }
 
-#ifdef __ARCH_X86__
-
-static inline void clear_buffer(DrawingBuffer *buffer, Vec4f color)
-{
-  uint32_t iterCount = (buffer->width * buffer->height) / 4;
-
-  __m128i value = _mm_set1_epi32(rgba_color(color));
-  __m128i *p = (__m128i *) buffer->pixels;
-
-  while (iterCount--) {
-    *p++ = value;
-  }
-}
-
-#else
-
-static inline void clear_buffer(DrawingBuffer *buffer, Vec4f color)
-{
-  uint32_t iterCount = buffer->width * buffer->height;
-  Vec4f *p = (Vec4f *) buffer->pixels;
-
-  while (iterCount--) {
-    *p++ = color;
-  }
-}
-
-#endif
-
 #include <stdlib.h>
 
 #define RANDOM(a, b) (b > 0 ? (rand() % b + a) : a)
@@ -1503,18 +2587,23 @@ void render_character_ui(State *state, DresserCharacter *character)
 
   ui_end(ui);
 
+  if (race != character->race || sex != character->sex || changed) {
+    render_pipeline_finish(state); // Textures are rebuilt in place
+  }
+
   if (race != character->race || sex != character->sex) {
-    DresserCharacter *new_character = dresser_load_character(state->dresser, race, sex);
+    MemoryArena *arena = creature_spare_arena(state);
+    DresserCharacter *new_character = dresser_load_character(state->dresser, arena, race, sex);
     if (new_character != NULL) {
       DresserCharacterAppearance new_appearance = dresser_get_default_character_appearance(state->dresser, new_character);
       dresser_set_character_appearance(state->dresser, new_character, &new_appearance);
-      dresser_set_character_equipment(state->dresser, new_character, &character->equipment);
+      dresser_set_character_equipment(state->dresser, arena, new_character, &character->equipment);
 
       set_creature(state, (DresserCreatureBase *) new_character);
     }
   } else if (changed) {
     dresser_set_character_appearance(state->dresser, character, &character->appearance);
-    dresser_set_character_equipment(state->dresser, character, &character->equipment);
+    dresser_set_character_equipment(state->dresser, state->creature_arenas[state->creature_arena], character, &character->equipment);
     animate_model(state);
   }
 }
@@ -1571,6 +2660,110 @@ void render_ui(State *state)
   ui_label(ui, 0.0f, 30.0f, (uint8_t *) buf, UI_ALIGN_LEFT, UI_COLOR_NONE);
   ui_layout_row_end(ui);
 
+  DynamicResolution *dr = &state->dynres;
+  ui_layout_row_begin(ui, 600.0f, 30.0f);
+  snprintf(buf, 255, "%.2f ms, scale %.0f%% (%ux%u), AA %s%s%s", state->stats_frame_ms, dr->scale * 100.0f,
+           dr->enabled ? dr->buffer.width : state->screenWidth, dr->enabled ? dr->buffer.height : state->screenHeight,
+           aa_mode_names[state->aa.mode], state->impostor.active ? ", impostor" : "",
+           state->pipeline.enabled ? ", pipelined" : "");
+  ui_label(ui, 0.0f, 30.0f, (uint8_t *) buf, UI_ALIGN_LEFT, UI_COLOR_NONE);
+  ui_layout_pull_right(ui);
+  if (ui_button(ui, 150.0f, 30.0f, (uint8_t *) (dr->enabled ? "Dynamic res: on" : "Dynamic res: off")) == UI_BUTTON_RESULT_CLICKED) {
+    dr->enabled = !dr->enabled;
+  }
+  ui_layout_row_end(ui);
+
+  int len = 0;
+  Antialiasing *aa = &state->aa;
+  if (aa->benchmarked) {
+    ui_layout_row_begin(ui, 600.0f, 30.0f);
+    len = snprintf(buf, 255, "AA vs SSAA:");
+    for (uint32_t i = 0; i < AA_MODE_COUNT; i++) {
+      len += snprintf(buf + len, 255 - len, " %s %.1f ms %.0f%%", aa_mode_names[i], aa->benchmark_ms[i], aa->benchmark_error[i]);
+    }
+    ui_label(ui, 0.0f, 30.0f, (uint8_t *) buf, UI_ALIGN_LEFT, UI_COLOR_NONE);
+    ui_layout_row_end(ui);
+  }
+
+  QualityGovernor *q = &state->quality;
+  ui_layout_row_begin(ui, 600.0f, 30.0f);
+  len = 0;
+  for (uint32_t i = 0; i < RENDER_PASS_COUNT; i++) {
+    len += snprintf(buf + len, 255 - len, "%s %.1f ", render_pass_names[i], state->stats_pass_ms[i]);
+  }
+  ui_label(ui, 0.0f, 30.0f, (uint8_t *) buf, UI_ALIGN_LEFT, UI_COLOR_NONE);
+  ui_layout_pull_right(ui);
+  if (ui_button(ui, 150.0f, 30.0f, (uint8_t *) (q->enabled ? "Quality: auto" : "Quality: fixed")) == UI_BUTTON_RESULT_CLICKED) {
+    q->enabled = !q->enabled;
+  }
+  ui_layout_row_end(ui);
+
+  ui_layout_row_begin(ui, 600.0f, 30.0f);
+  len = snprintf(buf, 255, "quality:");
+  for (uint32_t i = 0; i < QUALITY_KNOB_COUNT; i++) {
+    len += snprintf(buf + len, 255 - len, " %s %s (%.1f ms)", quality_knob_names[i], quality_tiers[q->levels[i]].name,
+                    quality_knob_cost(state, i));
+  }
+  ui_label(ui, 0.0f, 30.0f, (uint8_t *) buf, UI_ALIGN_LEFT, UI_COLOR_NONE);
+  ui_layout_row_end(ui);
+
+  // Passes that overlapped make the graph time smaller than their sum
+  RenderGraph *graph = &state->stats_graph;
+  float passes_ms = 0.0f;
+  for (uint32_t i = 0; i < graph->passes_count; i++) {
+    passes_ms += graph->passes[i].ms;
+  }
+
+  ui_layout_row_begin(ui, 600.0f, 30.0f);
+  len = snprintf(buf, 255, "graph %.1f (sum %.1f):", graph->wall_ms, passes_ms);
+  for (uint32_t i = 0; i < graph->passes_count && len < 255; i++) {
+    len += snprintf(buf + len, 255 - len, " %s %.1f", graph->passes[i].name, graph->passes[i].ms);
+  }
+  ui_label(ui, 0.0f, 30.0f, (uint8_t *) buf, UI_ALIGN_LEFT, UI_COLOR_NONE);
+  ui_layout_row_end(ui);
+
+  RenderQueueStats *qs = &state->stats_queue;
+  ui_layout_row_begin(ui, 600.0f, 30.0f);
+  snprintf(buf, 255, "queue: %u draws, %u state changes (%u unsorted), %u texture changes",
+           qs->draws, qs->state_changes, qs->unsorted_state_changes, qs->texture_changes);
+  ui_label(ui, 0.0f, 30.0f, (uint8_t *) buf, UI_ALIGN_LEFT, UI_COLOR_NONE);
+  ui_layout_row_end(ui);
+
+  ui_layout_row_begin(ui, 600.0f, 30.0f);
+  snprintf(buf, 255, "view lod: %s, %u faces, %u from lower views", state->view_lod ? "on" : "off", qs->faces, qs->lod_faces);
+  ui_label(ui, 0.0f, 30.0f, (uint8_t *) buf, UI_ALIGN_LEFT, UI_COLOR_NONE);
+  ui_layout_pull_right(ui);
+  snprintf(buf, 255, "Normal map: %s", !state->normalmap ? "none" : state->render_flags.normal_mapping ? "on" : "off");
+  if (ui_button(ui, 150.0f, 30.0f, (uint8_t *) buf) == UI_BUTTON_RESULT_CLICKED) {
+    state->render_flags.normal_mapping = !state->render_flags.normal_mapping;
+  }
+  ui_layout_row_end(ui);
+
+  if (state->crowd.count > 0) {
+    ui_layout_row_begin(ui, 600.0f, 30.0f);
+    snprintf(buf, 255, "crowd: %u instances, pose %.2f ms, %u posed (animation lod %s)", state->crowd.count,
+             state->crowd.pose_ms, state->crowd.posed, state->crowd.animation_lod ? "on" : "off");
+    ui_label(ui, 0.0f, 30.0f, (uint8_t *) buf, UI_ALIGN_LEFT, UI_COLOR_NONE);
+    ui_layout_row_end(ui);
+
+    M2PoseCache *cache = &state->crowd.pose_cache;
+    uint32_t lookups = cache->hits + cache->misses;
+    ui_layout_row_begin(ui, 600.0f, 30.0f);
+    snprintf(buf, 255, "pose cache: %s, %.1f%% hits, %u evictions, %u bypasses",
+             pose_cache_mode_names[state->crowd.cache_mode], lookups ? 100.0f * cache->hits / lookups : 0.0f,
+             cache->evictions, cache->bypasses);
+    ui_label(ui, 0.0f, 30.0f, (uint8_t *) buf, UI_ALIGN_LEFT, UI_COLOR_NONE);
+    ui_layout_row_end(ui);
+  }
+
+  if (state->baked_animation && state->baked) {
+    M2BakedAnimation *baked = state->baked;
+    ui_layout_row_begin(ui, 600.0f, 30.0f);
+    snprintf(buf, 255, "baked: %u frames, %zu KB, max error %.5f", baked->framesCount, baked->size / 1024, baked->maxError);
+    ui_label(ui, 0.0f, 30.0f, (uint8_t *) buf, UI_ALIGN_LEFT, UI_COLOR_NONE);
+    ui_layout_row_end(ui);
+  }
+
   ui_group_begin(ui, (char *) "Creature");
   ui_layout_row_begin(ui, 600.0f, 30.0f);
 
@@ -1591,7 +2784,7 @@ void render_ui(State *state)
 
   if ((uint32_t) creature_idx != state->creature_index) {
     state->creature_index = creature_idx;
-    set_creature(state, dresser_load_creature(state->dresser, creatures[state->creature_index].display_id));
+    set_creature(state, dresser_load_creature(state->dresser, creature_spare_arena(state), creatures[state->creature_index].display_id));
   }
 
   if (state->creature == NULL) {
@@ -1607,41 +2800,792 @@ void render_ui(State *state)
   }
 }
 
-static void render_creature(State *state, DresserCreatureBase *creature, RenderingContext *ctx)
+#define RENDER_QUEUE_KEY_TRANSPARENT (1ull << 63)
+#define RENDER_QUEUE_KEY_SEQUENCE_BITS 20
+
+static void render_queue_reset(RenderQueue *queue)
 {
-  if (creature == NULL) {
+  queue->count = 0;
+  queue->transforms_count = 0;
+}
+
+static uint32_t render_queue_push_transform(RenderQueue *queue, Mat44 mat)
+{
+  ASSERT(queue->transforms_count < RENDER_QUEUE_MAX_TRANSFORMS);
+  uint32_t result = MIN(queue->transforms_count, (uint32_t) RENDER_QUEUE_MAX_TRANSFORMS - 1);
+  queue->transforms[result] = mat;
+  queue->transforms_count = result + 1;
+  return result;
+}
+
+// Bounding sphere radius in pixels, the transform's first axis stands in for its scale. Zero when the sphere
+// is off the target, tested with twice the radius since the M2 sphere is centered on the box, not the origin.
+static float model_screen_radius(RenderingContext *ctx, Mat44 model_mat, float radius)
+{
+  float w;
+  Vec3f center = Vec3f(0.0f, 0.0f, 0.0f).transform(model_mat * ctx->view_mat * ctx->projection_mat, &w);
+  radius *= Vec3f(model_mat.a, model_mat.b, model_mat.c).length();
+  if (w < -radius * 2.0f) {
+    return 0.0f; // Behind the camera
+  } else if (w < 0.0001f) {
+    return FLT_MAX;
+  }
+
+  float pixels = radius * fabsf(ctx->projection_mat.f * ctx->viewport_mat.f) / w;
+  float x = fabsf(center.x / w * ctx->viewport_mat.a);
+  float y = fabsf(center.y / w * ctx->viewport_mat.f);
+  if (x - pixels * 2.0f > ctx->target_width * 0.5f || y - pixels * 2.0f > ctx->target_height * 0.5f) {
+    return 0.0f;
+  }
+
+  return pixels;
+}
+
+// Posing picks the view from the instance's screen radius and only skins the vertices of that view
+static void repose_instance(State *state, ModelInstance *instance)
+{
+  if (state->creature != NULL && instance == state->creature->instance) {
+    animate_model(state);
     return;
   }
 
-  float scale = state->scale * state->model_scale;
-  Mat44 parent_mat = Mat44::rotate_y(-RAD(90)) * Mat44::scale(scale, scale, scale);
-  ctx->model_mat = parent_mat;
-  precalculate_matrices(ctx);
+  Crowd *crowd = &state->crowd;
+  for (uint32_t i = 0; i < crowd->count; i++) {
+    if (crowd->poses[i].instance == instance) {
+      M2Pose pose = crowd_member_pose(crowd, i, (uint32_t) state->currentGlobalFrame);
+      m2_pose_cache_apply(NULL, &pose, 1);
+      m2_pose_models(state->platform_api, state->parallel_animation ? state->animation_pool : NULL, &pose, 1);
+      return;
+    }
+  }
+}
+
+// Opaque passes are ordered by state, texture and then front to back.
+// Transparent ones keep their submission order, M2 layers rely on it.
+// Views are picked from the radius of every push, instances switching views are posed again first.
+// Shared instances pass their own slot_view instead, which is only recorded and needs no posing.
+// Returns the radius, zero for instances outside the target which aren't queued at all.
+static float render_queue_push_model(State *state, RenderQueue *queue, RenderingContext *ctx, ModelInstance *instance, uint32_t transform,
+                                     uint32_t *slot_view = NULL)
+{
+  if (instance == NULL) {
+    return 0.0f;
+  }
+
+  M2Model *model = instance->model;
+  Mat44 modelview = queue->transforms[transform] * ctx->view_mat;
+  float radius = model_screen_radius(ctx, queue->transforms[transform], model->bounding_radius);
+  float lod_radius = state->view_lod ? radius : FLT_MAX;
+  if (slot_view == NULL) {
+    instance->screenRadius = lod_radius; // Off screen instances pose their lowest detail view
+  }
+
+  if (radius == 0.0f) {
+    return 0.0f;
+  }
+
+  uint32_t view_index = instance->view;
+  if (slot_view != NULL) {
+    view_index = *slot_view = m2_view_for_radius(model, *slot_view, lod_radius);
+  } else if (m2_view_for_radius(model, instance->view, lod_radius) != instance->view) {
+    repose_instance(state, instance);
+    view_index = instance->view;
+  }
+
+  ModelView *view = &model->views[view_index];
+  for (int rpi = 0; rpi < view->renderPassesCount; rpi++) {
+    M2RenderPass *pass = &view->renderPasses[rpi];
+    ModelSubmesh *submesh = &view->submeshes[pass->submesh];
+    if (!m2_view_submesh_enabled(instance, view, pass->submesh)) {
+      continue;
+    }
+
+    M2RenderFlag *rf = &model->renderFlags[pass->renderFlagIndex];
+    bool transparent = rf->blendingMode != 0;
+    if (transparent && !state->render_flags.transparent_passes) {
+      continue;
+    }
+
+    ASSERT(queue->count < RENDER_QUEUE_MAX_ITEMS);
+    if (queue->count >= RENDER_QUEUE_MAX_ITEMS) {
+      return radius;
+    }
+
+    RenderQueueItem *item = &queue->items[queue->count];
+    item->instance = instance;
+    item->view = view;
+    item->pass = pass;
+    item->transform = transform;
+    item->flags = ((rf->flags & 0x04) != 0x04 ? RENDER_CULLING : 0) | (transparent ? RENDER_BLENDING : 0);
+    item->blend = transparent ? map_blending_mode(rf->blendingMode) : BLEND_MODE_SRC_COPY;
+
+    uint64_t sequence = queue->count;
+    queue->count++;
+
+    if (transparent) {
+      item->key = RENDER_QUEUE_KEY_TRANSPARENT | sequence;
+      continue;
+    }
+
+    Vec3f center = {0.0f, 0.0f, 0.0f};
+    for (uint32_t vi = 0; vi < submesh->verticesCount; vi++) {
+      center = center + instance->animatedPositions[submesh->verticesStart + vi];
+    }
+    center = (center * (1.0f / MAX(submesh->verticesCount, 1u))) * modelview;
+
+    uint32_t texture_index = model->textureLookups[pass->textureId];
+    uintptr_t texture = (uintptr_t) instance->textures[texture_index];
+    uint64_t texture_bits = (texture >> 4) & 0xFFFF;
+    uint64_t depth_bits = (uint64_t) (CLAMP(-center.z / 10.0f, 0.0f, 1.0f) * 0xFFFFFF);
+
+    item->key = ((uint64_t) (item->flags & RENDER_CULLING ? 1 : 0) << 62) |
+                (texture_bits << 44) |
+                (depth_bits << RENDER_QUEUE_KEY_SEQUENCE_BITS) |
+                sequence;
+  }
+
+  return radius;
+}
+
+static int render_queue_compare(const void *a, const void *b)
+{
+  uint64_t ka = ((RenderQueueItem *) a)->key;
+  uint64_t kb = ((RenderQueueItem *) b)->key;
+  return ka < kb ? -1 : (ka > kb ? 1 : 0);
+}
+
+static uint32_t render_queue_count_state_changes(RenderQueue *queue, uint32_t flags, BlendFunc *blend_func)
+{
+  uint32_t result = 0;
+
+  for (uint32_t i = 0; i < queue->count; i++) {
+    RenderQueueItem *item = &queue->items[i];
+    uint32_t item_flags = (flags & ~(RENDER_CULLING | RENDER_BLENDING)) | item->flags;
+    BlendFunc *item_blend = (item->flags & RENDER_BLENDING) ? blend_mode_func(item->blend) : blend_func;
+
+    if (item_flags != flags || item_blend != blend_func) {
+      result++;
+    }
+
+    flags = item_flags;
+    blend_func = item_blend;
+  }
+
+  return result;
+}
+
+static void render_queue_submit_range(State *state, RenderQueue *queue, RenderingContext *ctx, uint32_t begin, uint32_t end)
+{
+  uint32_t transform = RENDER_QUEUE_MAX_TRANSFORMS;
+  Texture *texture = NULL;
+
+  for (uint32_t i = begin; i < end; i++) {
+    RenderQueueItem *item = &queue->items[i];
+    uint32_t flags = (ctx->flags & ~(RENDER_CULLING | RENDER_BLENDING)) | item->flags;
+    BlendFunc *blend_func = (item->flags & RENDER_BLENDING) ? blend_mode_func(item->blend) : ctx->blend_func;
+
+    if (flags != ctx->flags || blend_func != ctx->blend_func) {
+      renderer_set_flags(ctx, flags);
+      ctx->blend_func = blend_func;
+      queue->stats.state_changes++;
+    }
+
+    if (item->transform != transform) {
+      transform = item->transform;
+      ctx->model_mat = queue->transforms[transform];
+      precalculate_matrices(ctx);
+    }
+
+    M2Model *model = item->instance->model;
+    Texture *item_texture = item->instance->textures[model->textureLookups[item->pass->textureId]];
+    if (item_texture != texture) {
+      texture = item_texture;
+      queue->stats.texture_changes++;
+    }
+
+    render_m2_pass(state, ctx, item->instance, item->view, item->pass);
+    queue->stats.draws++;
+
+    uint32_t faces = item->view->submeshes[item->pass->submesh].facesCount;
+    queue->stats.faces += faces;
+    queue->stats.lod_faces += item->view != model->views ? faces : 0;
+  }
+}
+
+// All opaque geometry goes first so transparent passes blend over the complete scene
+static void render_queue_submit(State *state, RenderQueue *queue, RenderingContext *ctx)
+{
+  uint32_t flags = ctx->flags;
+  BlendFunc *blend_func = ctx->blend_func;
+
+  queue->stats.unsorted_state_changes += render_queue_count_state_changes(queue, flags, blend_func);
+  qsort(queue->items, queue->count, sizeof(RenderQueueItem), &render_queue_compare);
+
+  uint32_t split = 0;
+  while (split < queue->count && !(queue->items[split].key & RENDER_QUEUE_KEY_TRANSPARENT)) {
+    split++;
+  }
+
+  pass_time_begin(state, ctx, RENDER_PASS_OPAQUE);
+  render_queue_submit_range(state, queue, ctx, 0, split);
+  pass_time_end(state, ctx, RENDER_PASS_OPAQUE);
 
-  render_m2_model(state, ctx, creature->model, RENDER_MODE_OPAQUE);
-  render_m2_model(state, ctx, creature->model, RENDER_MODE_TRANSPARENT);
+  if (state->render_flags.transparent_passes) {
+    pass_time_begin(state, ctx, RENDER_PASS_TRANSPARENT);
+    render_queue_submit_range(state, queue, ctx, split, queue->count);
+    pass_time_end(state, ctx, RENDER_PASS_TRANSPARENT);
+  } else {
+    state->quality.pass_ms[RENDER_PASS_TRANSPARENT] = 0.0f;
+  }
+
+  renderer_set_flags(ctx, flags);
+  ctx->blend_func = blend_func;
+}
+
+// Returns the screen radius of the creature's own model
+static float render_queue_push_creature(State *state, RenderQueue *queue, RenderingContext *ctx, DresserCreatureBase *creature, Mat44 parent_mat)
+{
+  float radius = render_queue_push_model(state, queue, ctx, creature->instance, render_queue_push_transform(queue, parent_mat));
 
   for (size_t ii = 0; ii < creature->items_count; ii++) {
-    M2Model *item = creature->items[ii];
+    ModelInstance *item = creature->items[ii];
     M2Attachment *att = creature->attachments[ii];
 
     if (item != NULL && att != NULL) {
-      ModelBone bone = creature->model->bones[att->bone];
-      Mat44 mat = Mat44::translate(att->offset.x, att->offset.y, att->offset.z) * bone.matrix;
+      // Items keep their bind pose, so any view of them can be drawn
+      Mat34 bone_mat = creature->instance->boneMatrices[att->bone];
+      Mat44 mat = Mat44::translate(att->offset.x, att->offset.y, att->offset.z) * bone_mat.mat44();
+      render_queue_push_model(state, queue, ctx, item, render_queue_push_transform(queue, mat * parent_mat), &creature->item_views[ii]);
+    }
+  }
 
-      ctx->model_mat = mat * parent_mat;
-      precalculate_matrices(ctx);
+  return radius;
+}
+
+// Crowd members go through the same queue, so their passes are sorted together with the creature's
+static void render_creature_geometry(State *state, DresserCreatureBase *creature, RenderingContext *ctx, bool with_crowd = false)
+{
+  RenderQueue *queue = &state->render_queue;
+  render_queue_reset(queue);
+
+  if (creature != NULL) {
+    float scale = state->scale * state->model_scale;
+    Mat44 parent_mat = Mat44::rotate_y(-RAD(90)) * Mat44::scale(scale, scale, scale);
+    render_queue_push_creature(state, queue, ctx, creature, parent_mat);
+  }
+
+  Crowd *crowd = &state->crowd;
+  for (uint32_t i = 0; with_crowd && i < crowd->count; i++) {
+    float scale = state->scale * crowd->scales[i] * 0.5f;
+    float x = ((float) (i % CROWD_COLUMNS) - (CROWD_COLUMNS - 1) * 0.5f) * CROWD_SPACING;
+    float z = -((float) (i / CROWD_COLUMNS) + 1.0f) * CROWD_SPACING;
+    Mat44 parent_mat = Mat44::rotate_y(-RAD(90)) * Mat44::scale(scale, scale, scale) * Mat44::translate(x, 0.0f, z);
+    crowd->radii[i] = render_queue_push_creature(state, queue, ctx, crowd->members[i], parent_mat);
+  }
+
+  render_queue_submit(state, queue, ctx);
+}
+
+// World space bounding sphere of the posed creature model, attachments are covered by a margin
+static void creature_bounds(State *state, DresserCreatureBase *creature, Vec3f *center, float *radius)
+{
+  ModelInstance *instance = creature->instance;
+  Vec3f mn = instance->animatedPositions[0];
+  Vec3f mx = mn;
+
+  for (uint32_t i = 1; i < instance->model->verticesCount; i++) {
+    Vec3f p = instance->animatedPositions[i];
+    mn = {MIN(mn.x, p.x), MIN(mn.y, p.y), MIN(mn.z, p.z)};
+    mx = {MAX(mx.x, p.x), MAX(mx.y, p.y), MAX(mx.z, p.z)};
+  }
+
+  float scale = state->scale * state->model_scale;
+  Mat44 parent_mat = Mat44::rotate_y(-RAD(90)) * Mat44::scale(scale, scale, scale);
+
+  *center = ((mn + mx) * 0.5f) * parent_mat;
+  *radius = (mx - mn).length() * 0.5f * scale * 1.2f;
+}
+
+static inline uint32_t impostor_angle_bucket(float angle)
+{
+  float step = 2.0f * PI / IMPOSTOR_ANGLE_BUCKETS;
+  int32_t bucket = (int32_t) floorf(angle / step + 0.5f) % IMPOSTOR_ANGLE_BUCKETS;
+  return (uint32_t) (bucket < 0 ? bucket + IMPOSTOR_ANGLE_BUCKETS : bucket);
+}
+
+static void render_impostor_texture(State *state, DresserCreatureBase *creature, Vec3f center, float radius,
+                                    uint32_t yaw_bucket, uint32_t pitch_bucket)
+{
+  Impostor *imp = &state->impostor;
+  RenderingContext subctx = {};
+
+  set_target(&subctx, imp->texture);
+  subctx.zbuffer = imp->zbuffer;
+  subctx.commands = state->rendering_context.commands;
+  subctx.light = state->rendering_context.light;
+  renderer_set_flags(&subctx, RENDER_ZTEST | RENDER_SHADING);
+
+  float step = 2.0f * PI / IMPOSTOR_ANGLE_BUCKETS;
+  subctx.viewport_mat = viewport_matrix((float) IMPOSTOR_SIZE, (float) IMPOSTOR_SIZE, true);
+  subctx.projection_mat = orthographic_matrix(radius * 0.5f, radius * 4.0f, -radius, -radius, radius, radius);
+  subctx.view_mat = Mat44::translate(-center.x, -center.y, -center.z) *
+                    Mat44::rotate_y(-(yaw_bucket * step)) *
+                    Mat44::rotate_x(-(pitch_bucket * step)) *
+                    Mat44::translate(0.0f, 0.0f, -radius * 2.0f);
+
+  render_clear(&subctx, Vec4f(0.0f, 0.0f, 0.0f, 0.0f), RENDER_CLEAR_COLOR | RENDER_CLEAR_DEPTH);
+
+  // The shadow map transform is built for the scene camera, not the impostor view.
+  // Flags are copied into the command data, so restoring them right after is enough.
+  bool shadow_mapping = state->render_flags.shadow_mapping;
+  state->render_flags.shadow_mapping = false;
+  render_creature_geometry(state, creature, &subctx);
+  state->render_flags.shadow_mapping = shadow_mapping;
+  imp->refreshes++;
+}
+
+// Returns false when the creature is large enough on screen to be rendered as geometry.
+// Refreshes the impostor texture in a pass of its own, before the world pass that draws the quad.
+static bool impostor_update(State *state, DresserCreatureBase *creature, RenderingContext *ctx)
+{
+  Impostor *imp = &state->impostor;
+
+  Vec3f center;
+  float radius;
+  creature_bounds(state, creature, &center, &radius);
+
+  Vec3f view_center = center * ctx->view_mat;
+  if (view_center.z > -radius) {
+    return false; // Camera is inside or too close to the bounds
+  }
+
+  Mat44 screen_mat = ctx->projection_mat * ctx->viewport_mat;
+  Vec3f top = (view_center + Vec3f{0.0f, radius, 0.0f}) * screen_mat;
+  Vec3f bottom = (view_center - Vec3f{0.0f, radius, 0.0f}) * screen_mat;
+  if (fabs(top.y - bottom.y) > IMPOSTOR_MAX_SCREEN_SIZE) {
+    return false;
+  }
+
+  uint32_t yaw_bucket = impostor_angle_bucket(state->yrot);
+  uint32_t pitch_bucket = impostor_angle_bucket(state->xrot);
+
+  uint32_t key = fnv_hash((void *) &creature, sizeof(creature));
+  key = fnv_hash_add_data(key, (void *) &yaw_bucket, sizeof(yaw_bucket));
+  key = fnv_hash_add_data(key, (void *) &pitch_bucket, sizeof(pitch_bucket));
+  key = fnv_hash_add_data(key, (void *) &state->render_flags, sizeof(state->render_flags));
+  key = fnv_hash_add_data(key, (void *) &state->hsv, sizeof(state->hsv));
+  key = fnv_hash_add_data(key, (void *) &radius, sizeof(radius));
+
+  Animation *anims[2] = {&state->upperAnim, &state->lowerAnim};
+  for (uint32_t i = 0; i < 2; i++) {
+    uint32_t frame_step = (uint32_t) (anims[i]->currentFrame / IMPOSTOR_FRAME_STEP);
+    key = fnv_hash_add_data(key, (void *) &anims[i]->id, sizeof(anims[i]->id));
+    key = fnv_hash_add_data(key, (void *) &frame_step, sizeof(frame_step));
+  }
+
+  if (!imp->active || key != imp->key) {
+    render_pass_begin(state, "impostor", 0, RESOURCE_IMPOSTOR);
+    render_impostor_texture(state, creature, center, radius, yaw_bucket, pitch_bucket);
+    render_pass_end(state);
+    imp->key = key;
+  }
+
+  imp->view_center = view_center;
+  imp->radius = radius;
+  return true;
+}
+
+static void render_impostor_quad(State *state, RenderingContext *ctx)
+{
+  Impostor *imp = &state->impostor;
+  Vec3f view_center = imp->view_center;
+  float radius = imp->radius;
+
+  // Quad is pulled towards the camera so it doesn't sink into the floor
+  Vec3f corners[4] = {
+    view_center + Vec3f{-radius, -radius, radius * 0.5f},
+    view_center + Vec3f{radius, -radius, radius * 0.5f},
+    view_center + Vec3f{radius, radius, radius * 0.5f},
+    view_center + Vec3f{-radius, radius, radius * 0.5f}
+  };
+
+  const Vec3f texture_coords[4] = {
+    {0.0f, 0.0f, 0.0f},
+    {(float) IMPOSTOR_SIZE, 0.0f, 0.0f},
+    {(float) IMPOSTOR_SIZE, (float) IMPOSTOR_SIZE, 0.0f},
+    {0.0f, (float) IMPOSTOR_SIZE, 0.0f}
+  };
+
+  Vec3f positions[4];
+  for (uint32_t i = 0; i < 4; i++) {
+    positions[i] = corners[i] * ctx->projection_mat;
+  }
+
+  uint32_t prev_flags = ctx->flags;
+  renderer_set_flags(ctx, RENDER_ZTEST | RENDER_SHADING | RENDER_BLENDING | (prev_flags & RENDER_MSAA));
+  renderer_set_blend_mode(ctx, BLEND_MODE_DECAL);
+
+  DebugShaderData shader_data = {};
+  shader_data.clampu = IMPOSTOR_SIZE - 1;
+  shader_data.clampv = IMPOSTOR_SIZE - 1;
+  shader_data.texture = imp->texture;
+
+  shader_data.uv0 = texture_coords[0];
+  shader_data.duv[0] = texture_coords[1] - shader_data.uv0;
+  shader_data.duv[1] = texture_coords[2] - shader_data.uv0;
+  render_triangle(ctx, &fragment_debug, (void *) &shader_data, sizeof(shader_data), positions[0], positions[1], positions[2]);
+
+  shader_data.duv[0] = texture_coords[2] - shader_data.uv0;
+  shader_data.duv[1] = texture_coords[3] - shader_data.uv0;
+  render_triangle(ctx, &fragment_debug, (void *) &shader_data, sizeof(shader_data), positions[0], positions[2], positions[3]);
+
+  renderer_set_flags(ctx, prev_flags);
+}
+
+static void render_creature(State *state, DresserCreatureBase *creature, RenderingContext *ctx)
+{
+  if (creature == NULL && state->crowd.count == 0) {
+    return;
+  }
+
+  if (state->impostor.active) {
+    render_impostor_quad(state, ctx);
+    creature = NULL;
+  }
+
+  if (creature != NULL || state->crowd.count > 0) {
+    render_creature_geometry(state, creature, ctx, true);
+  }
+}
 
-      render_m2_model(state, ctx, item, RENDER_MODE_OPAQUE);
-      render_m2_model(state, ctx, item, RENDER_MODE_TRANSPARENT);
+static void antialiasing_prepare(State *state)
+{
+  Antialiasing *aa = &state->aa;
+  size_t pixels = state->screenWidth * state->screenHeight;
+
+  if ((aa->mode == AA_MODE_MSAA || aa->mode == AA_MODE_SSAA) && aa->samples == NULL) {
+    aa->samples = (uint32_t *) state->platform_api->allocate_memory(pixels * MSAA_SAMPLES * sizeof(uint32_t));
+    aa->zsamples = (zval_t *) state->platform_api->allocate_memory(pixels * MSAA_SAMPLES * sizeof(zval_t));
+  }
+
+  if (aa->mode == AA_MODE_FXAA && aa->scratch == NULL) {
+    aa->scratch = (uint32_t *) state->platform_api->allocate_memory(pixels * sizeof(uint32_t));
+    aa->luma = (uint8_t *) state->platform_api->allocate_memory(pixels);
+  }
+}
+
+static void copy_buffer_rect(DrawingBuffer *dst, DrawingBuffer *src, RenderRect rect)
+{
+  if (rect.x1 <= rect.x0 || rect.y1 <= rect.y0) {
+    return;
+  }
+
+  uint32_t *dst_pixels = (uint32_t *) dst->pixels;
+  uint32_t *src_pixels = (uint32_t *) src->pixels;
+  size_t row_size = (rect.x1 - rect.x0) * sizeof(uint32_t);
+
+  for (int32_t y = rect.y0; y < rect.y1; y++) {
+    memcpy(&dst_pixels[y * dst->pitch + rect.x0], &src_pixels[y * src->pitch + rect.x0], row_size);
+  }
+}
+
+typedef enum BufferOp {
+  BUFFER_OP_COPY_RECT,
+  BUFFER_OP_BLIT,
+  BUFFER_OP_DOWNSAMPLE,
+  BUFFER_OP_FXAA
+} BufferOp;
+
+// Whole buffer operations, recorded as callbacks so they run in order with drawing
+typedef struct BufferOpData {
+  BufferOp op;
+  DrawingBuffer dst;
+  DrawingBuffer src;
+  RenderRect rect;
+  uint32_t *scratch;
+  uint8_t *luma;
+} BufferOpData;
+
+static RENDER_CALLBACK(buffer_op_execute)
+{
+  BufferOpData *d = (BufferOpData *) data;
+
+  switch (d->op) {
+    case BUFFER_OP_COPY_RECT:
+      copy_buffer_rect(&d->dst, &d->src, d->rect);
+      break;
+    case BUFFER_OP_BLIT:
+      blit_bilinear(&d->dst, &d->src);
+      break;
+    case BUFFER_OP_DOWNSAMPLE:
+      downsample_2x2(&d->dst, &d->src);
+      break;
+    case BUFFER_OP_FXAA:
+      fxaa_apply(&d->dst, d->scratch, d->luma);
+      break;
+  }
+}
+
+static void render_buffer_op(RenderingContext *ctx, BufferOp op, DrawingBuffer *dst, DrawingBuffer *src, RenderRect rect = {})
+{
+  BufferOpData data = {};
+  data.op = op;
+  data.dst = *dst;
+  data.src = src ? *src : *dst;
+  data.rect = rect;
+  render_callback(ctx, &buffer_op_execute, &data, sizeof(data));
+}
+
+static void render_copy_buffer(RenderingContext *ctx, DrawingBuffer *dst, DrawingBuffer *src)
+{
+  render_buffer_op(ctx, BUFFER_OP_COPY_RECT, dst, src, {0, 0, (int32_t) src->width, (int32_t) src->height});
+}
+
+// 3D part of the scene, anti-aliased and resolved into scene_buffer
+static void render_world(State *state, RenderingContext *ctx, DrawingBuffer *scene_buffer)
+{
+  Antialiasing *aa = &state->aa;
+  antialiasing_prepare(state);
+
+  DrawingBuffer *target = scene_buffer;
+  zval_t *zbuffer = ctx->zbuffer;
+
+  if (aa->mode == AA_MODE_SSAA) {
+    aa->ssaa_buffer = *scene_buffer;
+    aa->ssaa_buffer.width = scene_buffer->width * 2;
+    aa->ssaa_buffer.height = scene_buffer->height * 2;
+    aa->ssaa_buffer.pitch = aa->ssaa_buffer.width;
+    aa->ssaa_buffer.pixels = aa->samples;
+
+    target = &aa->ssaa_buffer;
+    ctx->zbuffer = aa->zsamples;
+  }
+
+  ctx->viewport_mat = viewport_matrix((float) target->width, (float) target->height, true);
+  ctx->projection_mat = perspective_matrix(0.1f, 10.0f, state->fov);
+
+  //ctx->view_mat = look_at_matrix((Vec3f){0, 0, 1}, (Vec3f){0, 0.35, 0}, (Vec3f){0, 1, 0});
+  ctx->view_mat = Mat44::rotate_y(-state->yrot) *
+                  Mat44::translate(0.0f, -0.5f, 0.0f) *
+                  Mat44::rotate_x(-state->xrot) *
+                  Mat44::translate(0.0f, 0.0f, -state->camDistance);
+
+  state->impostor.active = state->creature && state->impostor.enabled && impostor_update(state, state->creature, ctx);
+
+  uint32_t writes = RESOURCE_SCENE | (scene_buffer == state->buffer ? RESOURCE_OUTPUT : 0);
+  render_pass_begin(state, "world", RESOURCE_SHADOWMAP | RESOURCE_IMPOSTOR, writes);
+
+  set_target(ctx, target);
+  renderer_enable(ctx, RENDER_ZTEST);
+
+  if (aa->mode == AA_MODE_MSAA) {
+    ctx->msaa_color = aa->samples;
+    ctx->msaa_zbuffer = aa->zsamples;
+    renderer_enable(ctx, RENDER_MSAA);
+  }
+
+  render_clear(ctx, Vec4f(ctx->clear_color, 0.0f), RENDER_CLEAR_COLOR | RENDER_CLEAR_DEPTH);
+
+  pass_time_begin(state, ctx, RENDER_PASS_FLOOR);
+  render_floor(state, ctx);
+  pass_time_end(state, ctx, RENDER_PASS_FLOOR);
+
+  render_creature(state, state->creature, ctx);
+
+  if (aa->mode == AA_MODE_MSAA) {
+    render_callback(ctx, &msaa_resolve_callback, NULL, 0);
+    renderer_disable(ctx, RENDER_MSAA);
+  }
+
+  // Lines are written straight to the target, so they go after the resolve
+  if (state->showBones && state->creature) {
+    render_m2_model_bones(state, ctx, state->creature->instance);
+  }
+
+  if (state->showUnitAxes) {
+    render_unit_axes(ctx);
+  }
+
+  if (aa->mode == AA_MODE_SSAA) {
+    render_buffer_op(ctx, BUFFER_OP_DOWNSAMPLE, scene_buffer, target);
+    ctx->zbuffer = zbuffer;
+    set_target(ctx, scene_buffer);
+  } else if (aa->mode == AA_MODE_FXAA) {
+    BufferOpData data = {};
+    data.op = BUFFER_OP_FXAA;
+    data.dst = *scene_buffer;
+    data.scratch = aa->scratch;
+    data.luma = aa->luma;
+    render_callback(ctx, &buffer_op_execute, &data, sizeof(data));
+  }
+
+  render_pass_end(state);
+}
+
+// Sum of absolute channel differences against a tightly packed reference
+static uint64_t buffer_difference(DrawingBuffer *buffer, uint32_t *reference)
+{
+  uint64_t result = 0;
+  uint32_t *pixels = (uint32_t *) buffer->pixels;
+
+  for (uint32_t y = 0; y < buffer->height; y++) {
+    for (uint32_t x = 0; x < buffer->width; x++) {
+      uint32_t a = pixels[y * buffer->pitch + x];
+      uint32_t b = reference[y * buffer->width + x];
+
+      for (uint32_t shift = 0; shift < 24; shift += 8) {
+        int32_t d = (int32_t) ((a >> shift) & 0xFF) - (int32_t) ((b >> shift) & 0xFF);
+        result += d < 0 ? -d : d;
+      }
     }
   }
 
-  if (state->showBones) {
-    render_m2_model_bones(state, ctx, creature->model);
+  return result;
+}
+
+// Renders the 3D scene repeatedly in every mode, measuring the average cost and how close
+// each mode gets to the SSAA image. SSAA goes first to serve as the reference.
+static void antialiasing_benchmark(State *state, RenderingContext *ctx, DrawingBuffer *scene_buffer)
+{
+  Antialiasing *aa = &state->aa;
+  AntialiasingMode mode = aa->mode;
+
+  printf("Anti-aliasing benchmark, %ux%u, %d frames per mode\n", scene_buffer->width, scene_buffer->height, AA_BENCHMARK_FRAMES);
+
+  // Measured in place, commands recorded so far are kept for the render thread
+  render_pipeline_finish(state);
+  RenderCommandBuffer *commands = ctx->commands;
+  ctx->commands = NULL;
+
+  size_t reference_size = scene_buffer->width * scene_buffer->height * sizeof(uint32_t);
+  uint32_t *reference = (uint32_t *) state->platform_api->allocate_memory(reference_size);
+  uint64_t differences[AA_MODE_COUNT] = {0};
+
+  AntialiasingMode order[AA_MODE_COUNT] = {AA_MODE_SSAA, AA_MODE_NONE, AA_MODE_FXAA, AA_MODE_MSAA};
+  for (uint32_t i = 0; i < AA_MODE_COUNT; i++) {
+    aa->mode = order[i];
+    render_world(state, ctx, scene_buffer); // Warm up allocations and the impostor
+
+    double start = state->platform_api->get_time();
+    for (uint32_t frame = 0; frame < AA_BENCHMARK_FRAMES; frame++) {
+      render_world(state, ctx, scene_buffer);
+    }
+    aa->benchmark_ms[order[i]] = (float) ((state->platform_api->get_time() - start) * 1000.0 / AA_BENCHMARK_FRAMES);
+
+    if (order[i] == AA_MODE_SSAA) {
+      for (uint32_t y = 0; y < scene_buffer->height; y++) {
+        memcpy(&reference[y * scene_buffer->width], (uint32_t *) scene_buffer->pixels + y * scene_buffer->pitch,
+               scene_buffer->width * sizeof(uint32_t));
+      }
+    }
+
+    differences[order[i]] = buffer_difference(scene_buffer, reference);
+  }
+
+  for (uint32_t i = 0; i < AA_MODE_COUNT; i++) {
+    uint64_t aliased = differences[AA_MODE_NONE];
+    aa->benchmark_error[i] = aliased > 0 ? 100.0f * differences[i] / aliased : 0.0f;
+    printf("  %-8s %6.2f ms/frame, %5.1f%% of aliasing left\n", aa_mode_names[i], aa->benchmark_ms[i], aa->benchmark_error[i]);
   }
+
+  state->platform_api->free_memory(reference);
+
+  ctx->commands = commands;
+  aa->mode = mode;
+  aa->benchmarked = true;
+  aa->benchmark_requested = false;
+  state->scene_cache_valid = false;
 }
 
+static void render_scene(State *state, RenderingContext *ctx, DrawingBuffer *scene_buffer)
+{
+  render_world(state, ctx, scene_buffer);
+
+  render_pass_begin(state, "composite", RESOURCE_SCENE, RESOURCE_OUTPUT);
+
+  if (scene_buffer != state->buffer) {
+    render_buffer_op(ctx, BUFFER_OP_BLIT, state->buffer, scene_buffer);
+    set_target(ctx, state->buffer);
+  }
+
+  // Render 2D elements at native resolution
+  enable_ortho(state, ctx);
+
+  // if (state->render_flags.shadow_mapping) {
+  //   render_debug_texture(state, ctx, state->shadowmap, 10, 10, 400);
+  // }
+
+  if (state->debugTexture) {
+    renderer_set_flags(ctx, RENDER_BLENDING);
+    renderer_set_blend_mode(ctx, BLEND_MODE_DECAL);
+
+    render_debug_texture(state, ctx, state->debugTexture, 10, state->ui.y + 8, 400);
+  }
+
+  if (state->debugTexture2) {
+    renderer_set_flags(ctx, RENDER_BLENDING);
+    renderer_set_blend_mode(ctx, BLEND_MODE_DECAL);
+
+    render_debug_texture(state, ctx, state->debugTexture2, 1180, 410, 400);
+  }
+
+  render_pass_end(state);
+
+  render_pass_begin(state, "cache", RESOURCE_OUTPUT, RESOURCE_SCENE_CACHE);
+  render_copy_buffer(ctx, &state->scene_cache, state->buffer);
+  render_pass_end(state);
+  state->scene_cache_valid = true;
+}
+
+// Everything that affects the rendered scene, UI excluded
+static uint32_t scene_signature(State *state, DrawingBuffer *scene_buffer)
+{
+  RenderingContext *ctx = &state->rendering_context;
+
+  uint32_t result = fnv_hash((void *) &state->render_flags, sizeof(state->render_flags));
+  result = fnv_hash_add_data(result, (void *) &state->xrot, sizeof(state->xrot));
+  result = fnv_hash_add_data(result, (void *) &state->yrot, sizeof(state->yrot));
+  result = fnv_hash_add_data(result, (void *) &state->fov, sizeof(state->fov));
+  result = fnv_hash_add_data(result, (void *) &state->camDistance, sizeof(state->camDistance));
+  result = fnv_hash_add_data(result, (void *) &state->hsv, sizeof(state->hsv));
+  result = fnv_hash_add_data(result, (void *) &state->hair, sizeof(state->hair));
+  result = fnv_hash_add_data(result, (void *) &state->scale, sizeof(state->scale));
+  result = fnv_hash_add_data(result, (void *) &state->model_scale, sizeof(state->model_scale));
+  result = fnv_hash_add_data(result, (void *) &state->creature, sizeof(state->creature));
+  result = fnv_hash_add_data(result, (void *) &state->crowd.count, sizeof(state->crowd.count));
+  result = fnv_hash_add_data(result, (void *) &state->upperAnim.id, sizeof(state->upperAnim.id));
+  result = fnv_hash_add_data(result, (void *) &state->upperAnim.currentFrame, sizeof(state->upperAnim.currentFrame));
+  result = fnv_hash_add_data(result, (void *) &state->lowerAnim.id, sizeof(state->lowerAnim.id));
+  result = fnv_hash_add_data(result, (void *) &state->lowerAnim.currentFrame, sizeof(state->lowerAnim.currentFrame));
+  result = fnv_hash_add_data(result, (void *) &state->lower_anim_enabled, sizeof(state->lower_anim_enabled));
+  result = fnv_hash_add_data(result, (void *) &state->showBones, sizeof(state->showBones));
+  result = fnv_hash_add_data(result, (void *) &state->showUnitAxes, sizeof(state->showUnitAxes));
+  result = fnv_hash_add_data(result, (void *) &state->debugTexture, sizeof(state->debugTexture));
+  result = fnv_hash_add_data(result, (void *) &state->debugTexture2, sizeof(state->debugTexture2));
+  result = fnv_hash_add_data(result, (void *) &state->shadowmap->width, sizeof(state->shadowmap->width));
+  result = fnv_hash_add_data(result, (void *) &scene_buffer->width, sizeof(scene_buffer->width));
+  result = fnv_hash_add_data(result, (void *) &scene_buffer->height, sizeof(scene_buffer->height));
+  result = fnv_hash_add_data(result, (void *) &ctx->light, sizeof(ctx->light));
+  result = fnv_hash_add_data(result, (void *) &ctx->clear_color, sizeof(ctx->clear_color));
+  result = fnv_hash_add_data(result, (void *) &state->aa.mode, sizeof(state->aa.mode));
+  result = fnv_hash_add_data(result, (void *) &state->impostor.enabled, sizeof(state->impostor.enabled));
+  result = fnv_hash_add_data(result, (void *) &state->view_lod, sizeof(state->view_lod));
+
+  return result;
+}
+
+static RenderRect ui_rect_to_pixels(RenderingContext *ctx, UIRect rect)
+{
+  Mat44 mat = ctx->mvp_mat * ctx->viewport_mat;
+  Vec3f a = Vec3f{rect.x0, rect.y0, 0.0f} * mat;
+  Vec3f b = Vec3f{rect.x1, rect.y1, 0.0f} * mat;
+
+  return {(int32_t) floorf(MIN(a.x, b.x)), (int32_t) floorf(MIN(a.y, b.y)),
+          (int32_t) ceilf(MAX(a.x, b.x)) + 1, (int32_t) ceilf(MAX(a.y, b.y)) + 1};
+}
+
+#define MAX_UI_DIRTY_RECTS 8
+
 C_LINKAGE EXPORT void draw_frame(GlobalState *global_state, DrawingBuffer *drawing_buffer, float dt)
 {
   State *state = (State *) global_state->state;
@@ -1664,78 +3608,119 @@ C_LINKAGE EXPORT void draw_frame(GlobalState *global_state, DrawingBuffer *drawi
     animate_model(state);
   }
 
+  double frame_start = state->platform_api->get_time();
+
   if (state->keyboard->downedKeys[KB_ESCAPE]) {
     state->platform_api->terminate();
     return;
   }
 
   RenderingContext *ctx = &state->rendering_context;
+  render_pipeline_begin(state, drawing_buffer);
+  state->render_queue.stats = {};
 
   if (!state->shadowmap) {
-    state->shadowmap = texture_create(state->main_arena, 512, 512);
+    state->shadowmap = texture_create(state->main_arena, QUALITY_SHADOWMAP_MAX_SIZE, QUALITY_SHADOWMAP_MAX_SIZE);
+    state->shadow_zbuffer = (zval_t *) state->main_arena->allocate(QUALITY_SHADOWMAP_MAX_SIZE * QUALITY_SHADOWMAP_MAX_SIZE * sizeof(zval_t));
+    quality_apply(state);
+
+    render_pass_begin(state, "shadow", 0, RESOURCE_SHADOWMAP);
     render_shadowmap(state, ctx, state->shadowmap);
+    render_pass_end(state);
   }
 
   if (state->playing) {
     update_animations(state, dt);
   }
 
-  if (state->modelChanged) {
+  QualityGovernor *quality = &state->quality;
+  quality_update(state);
+  quality->frame_index++;
+
+  uint32_t shadow_interval = quality_tiers[quality->levels[QUALITY_KNOB_SHADOW]].shadowmap_interval;
+  bool shadow_due = state->playing && shadow_interval > 0 && (quality->frame_index % shadow_interval) == 0;
+
+  bool model_changed = state->modelChanged;
+
+  if (state->modelChanged || shadow_due) {
     if (state->render_flags.shadow_mapping) {
+      render_pass_begin(state, "shadow", 0, RESOURCE_SHADOWMAP);
+      pass_time_begin(state, ctx, RENDER_PASS_SHADOW);
       render_shadowmap(state, ctx, state->shadowmap);
+      pass_time_end(state, ctx, RENDER_PASS_SHADOW);
+      render_pass_end(state);
     }
 
     state->modelChanged = false;
   }
 
+  if (model_changed) {
+    // Textures or geometry may have changed without affecting the impostor key
+    state->impostor.active = false;
+  }
+
   update_camera(state, dt);
   handle_input(state);
 
-  ctx->viewport_mat = viewport_matrix((float) state->screenWidth, (float) state->screenHeight, true);
-  ctx->projection_mat = perspective_matrix(0.1f, 10.0f, state->fov);
+  DrawingBuffer *scene_buffer = dynamic_resolution_update(&state->dynres, state->buffer, state->frame_ms);
 
-  //ctx->view_mat = look_at_matrix((Vec3f){0, 0, 1}, (Vec3f){0, 0.35, 0}, (Vec3f){0, 1, 0});
-  ctx->view_mat = Mat44::rotate_y(-state->yrot) *
-                  Mat44::translate(0.0f, -0.5f, 0.0f) *
-                  Mat44::rotate_x(-state->xrot) *
-                  Mat44::translate(0.0f, 0.0f, -state->camDistance);
+  if (state->aa.benchmark_requested) {
+    antialiasing_benchmark(state, ctx, scene_buffer);
+  }
 
-  set_target(ctx, state->buffer);
-  renderer_enable(ctx, RENDER_ZTEST);
+  // Previous frame is reused as is when neither the scene nor the UI changed
+  uint32_t scene_hash = scene_signature(state, scene_buffer);
+  bool scene_dirty = !state->scene_cache_valid || state->playing || model_changed ||
+                     state->ui.interacted || scene_hash != state->scene_hash;
+  state->scene_hash = scene_hash;
 
-  clear_buffer(state->buffer, Vec4f(ctx->clear_color, 0.0f));
-  clear_zbuffer(ctx);
+  if (scene_dirty) {
+    render_scene(state, ctx, scene_buffer);
+  } else {
+    set_target(ctx, state->buffer);
+    enable_ortho(state, ctx);
+  }
 
-  render_floor(state, ctx);
+  render_pass_begin(state, "ui", RESOURCE_SCENE_CACHE, RESOURCE_OUTPUT);
+  pass_time_begin(state, ctx, RENDER_PASS_UI);
+  render_ui(state);
 
-  render_creature(state, state->creature, ctx);
+  uint32_t count = 0;
 
-  if (state->showUnitAxes) {
-    render_unit_axes(ctx);
-  }
-
-  // Render 2D elements
-  enable_ortho(state, ctx);
+  if (scene_dirty) {
+    ui_draw(&state->ui);
+  } else {
+    UIRect rects[MAX_UI_DIRTY_RECTS];
+    count = ui_dirty_rects(&state->ui, rects, MAX_UI_DIRTY_RECTS);
 
-  // if (state->render_flags.shadow_mapping) {
-  //   render_debug_texture(state, ctx, state->shadowmap, 10, 10, 400);
-  // }
+    // Pipelined frames alternate between two buffers, bring over the previous one first
+    RenderPipeline *pipeline = &state->pipeline;
+    if (count > 0 && pipeline->enabled) {
+      render_copy_buffer(ctx, state->buffer, &pipeline->jobs[pipeline->submitted].buffer);
+    }
 
-  if (state->debugTexture) {
-    renderer_set_flags(ctx, RENDER_BLENDING);
-    renderer_set_blend_mode(ctx, BLEND_MODE_DECAL);
+    for (uint32_t i = 0; i < count; i++) {
+      set_scissor(ctx, ui_rect_to_pixels(ctx, rects[i]));
+      render_buffer_op(ctx, BUFFER_OP_COPY_RECT, state->buffer, &state->scene_cache, ctx->scissor);
+      ui_draw(&state->ui);
+    }
 
-    render_debug_texture(state, ctx, state->debugTexture, 10, state->ui.y + 8, 400);
+    reset_scissor(ctx);
   }
 
-  if (state->debugTexture2) {
-    renderer_set_flags(ctx, RENDER_BLENDING);
-    renderer_set_blend_mode(ctx, BLEND_MODE_DECAL);
+  pass_time_end(state, ctx, RENDER_PASS_UI);
+  render_pass_end(state);
+  render_pipeline_end(state, drawing_buffer, scene_dirty || count > 0);
 
-    render_debug_texture(state, ctx, state->debugTexture2, 1180, 410, 400);
-  }
+  float frame_ms = (float) ((state->platform_api->get_time() - frame_start) * 1000.0);
+  state->frame_ms += (frame_ms - state->frame_ms) * 0.1f;
 
-  render_ui(state);
+  if (scene_dirty) {
+    state->stats_frame_ms = state->frame_ms;
+    memcpy(state->stats_pass_ms, state->quality.pass_ms, sizeof(state->stats_pass_ms));
+    state->stats_graph = state->graph_timings;
+    state->stats_queue = state->render_queue.stats;
+  }
 }
 
 // #ifdef PLATFORM_WINDOWS
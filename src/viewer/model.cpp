@@ -120,6 +120,61 @@ void Model::parse(void *bytes, size_t size, bool dry_run = false)
   tcount = ti;
 
   center = acc * (1.0f / vcount);
+
+  if (!dry_run) {
+    calculate_tangents();
+  }
+}
+
+void Model::calculate_tangents()
+{
+  if (ncount == 0 || tangents == NULL || bitangents == NULL) {
+    return;
+  }
+
+  for (int i = 0; i < ncount; i++) {
+    tangents[i] = {0, 0, 0};
+    bitangents[i] = {0, 0, 0};
+  }
+
+  for (int fi = 0; fi < fcount; fi++) {
+    ModelFace face = faces[fi];
+
+    Vec3f dp1 = vertices[face.vi[1]] - vertices[face.vi[0]];
+    Vec3f dp2 = vertices[face.vi[2]] - vertices[face.vi[1]];
+    Vec3f duv1 = texture_coords[face.ti[1]] - texture_coords[face.ti[0]];
+    Vec3f duv2 = texture_coords[face.ti[2]] - texture_coords[face.ti[1]];
+
+    float det = duv1.x * duv2.y - duv1.y * duv2.x;
+    if (fabs(det) < 0.000001f) {
+      continue;
+    }
+
+    float r = 1.0f / det;
+    Vec3f tangent = -(dp1 * duv2.y - dp2 * duv1.y) * r;
+    Vec3f bitangent = -(dp2 * duv1.x - dp1 * duv2.x) * r;
+
+    for (int i = 0; i < 3; i++) {
+      tangents[face.ni[i]] = tangents[face.ni[i]] + tangent;
+      bitangents[face.ni[i]] = bitangents[face.ni[i]] + bitangent;
+    }
+  }
+
+  for (int i = 0; i < ncount; i++) {
+    Vec3f normal = normals[i];
+    Vec3f tangent = tangents[i] - normal * normal.dot(tangents[i]);
+    if (tangent.length() < 0.000001f) {
+      tangent = normal.cross(fabs(normal.x) < 0.9f ? Vec3f(1, 0, 0) : Vec3f(0, 1, 0));
+    }
+
+    Vec3f bitangent = bitangents[i];
+    if (bitangent.length() < 0.000001f) {
+      bitangent = normal.cross(tangent);
+    }
+
+    tangents[i] = tangent.normalized();
+    bitangents[i] = bitangent.normalized();
+  }
 }
 
 void Model::normalize(bool move_to_center = false)
@@ -16,9 +16,12 @@ typedef struct Model {
   Vec3f center;
   Vec3f *vertices;
   Vec3f *normals;
+  Vec3f *tangents; // indexed the same way as normals
+  Vec3f *bitangents;
   Vec3f *texture_coords;
   ModelFace *faces;
 
   void parse(void *bytes, size_t size, bool dry_run);
+  void calculate_tangents();
   void normalize(bool move_to_center);
 } Model;
@@ -102,6 +102,38 @@ int32_t windows_file_read(WindowsFile *file, void *dst, uint32_t offset, uint32_
   return total_read;
 }
 
+void *windows_file_map(WindowsFile *file, size_t *size)
+{
+  uint64_t fileSize;
+  if (!GetFileSizeEx(file->handle, (LARGE_INTEGER *) &fileSize) || fileSize == 0) {
+    return NULL;
+  }
+
+  HANDLE mapping = CreateFileMapping(file->handle, NULL, PAGE_READONLY, 0, 0, NULL);
+  if (mapping == NULL) {
+    return NULL;
+  }
+
+  // The view keeps the mapping object alive
+  void *result = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+  CloseHandle(mapping);
+  if (result == NULL) {
+    return NULL;
+  }
+
+  *size = (size_t) fileSize;
+  return result;
+}
+
+void windows_file_close(WindowsFile *file, void *mapping, size_t size)
+{
+  if (mapping != NULL) {
+    UnmapViewOfFile(mapping);
+  }
+
+  CloseHandle(file->handle);
+}
+
 bool windows_directory_listing_begin(WindowsDirectoryListingIter *iter, char *directory)
 {
   WIN32_FIND_DATAA fd = {0};
@@ -10,6 +10,7 @@
 #include "windows/keyboard.cpp"
 #include "windows/mouse.cpp"
 #include "windows/sound.cpp"
+#include "windows/threads.cpp"
 
 #include "platform/mpq.cpp"
 
@@ -195,6 +196,7 @@ bool load_library(char *filename)
   }
 
   if (dllHandle) {
+    windows_work_queues_complete_all();
     FreeLibrary(dllHandle);
   }
 
@@ -235,6 +237,20 @@ C_LINKAGE void windows_terminate()
   gameRunning = false;
 }
 
+C_LINKAGE double windows_get_time()
+{
+  static double secondsPerCount = 0.0;
+  if (secondsPerCount == 0.0) {
+    uint64_t freq;
+    QueryPerformanceFrequency((LARGE_INTEGER *) &freq);
+    secondsPerCount = 1.0 / (double) freq;
+  }
+
+  uint64_t counter;
+  QueryPerformanceCounter((LARGE_INTEGER *) &counter);
+  return (double) counter * secondsPerCount;
+}
+
 static void update_fps(float frameMs, float fps)
 {
   char buf[255];
@@ -283,16 +299,6 @@ MPQFileId windows_get_asset_id(char *name)
 
 MPQFile windows_load_asset(char *name)
 {
-  int32_t size = windows_fs_size(name);
-  if (size >= 0) {
-    MPQFile result = {0};
-    result.id = mpq_file_id(name);
-    result.data = windows_allocate_memory(size);
-    result.size = size;
-    windows_fs_read(name, result.data, size);
-    return result;
-  }
-
   return mpq_load_file(&MPQ_REGISTRY, name);
 }
 
@@ -312,9 +318,15 @@ PlatformAPI PLATFORM_API = {
   (ReleaseAssetFunc) windows_release_asset,
   (FileOpenFunc) windows_file_open,
   (FileReadFunc) windows_file_read,
+  (FileMapFunc) windows_file_map,
+  (FileCloseFunc) windows_file_close,
   (DirectoryListingBeginFunc) windows_directory_listing_begin,
   (DirectoryListingNextEntryFunc) windows_directory_listing_next_entry,
   (DirectoryListingEndFunc) windows_directory_listing_end,
+  (GetTimeFunc) windows_get_time,
+  (WorkQueueCreateFunc) windows_work_queue_create,
+  (WorkQueueAddFunc) windows_work_queue_add,
+  (WorkQueueCompleteFunc) windows_work_queue_complete,
   (SoundBufferInitFunc) windows_sound_buffer_init,
   (SoundBufferFinalizeFunc) windows_sound_buffer_finalize,
   (SoundBufferPlayFunc) windows_sound_buffer_play,
@@ -0,0 +1,160 @@
+#define WORK_QUEUE_MAX_ENTRIES 1024
+#define WORK_QUEUE_MAX_THREADS 16
+#define MAX_WORK_QUEUES 8
+
+typedef struct WorkQueueEntry {
+  WorkQueueCallback *callback; // NULL once taken out of order by a batch's completion
+  WorkQueueBatch *batch;
+  void *data;
+} WorkQueueEntry;
+
+struct PlatformWorkQueue {
+  CRITICAL_SECTION lock;
+  CONDITION_VARIABLE work_added;
+  CONDITION_VARIABLE work_done;
+
+  WorkQueueEntry entries[WORK_QUEUE_MAX_ENTRIES];
+  uint32_t read;
+  uint32_t write;
+  uint32_t pending; // Added and not finished yet
+
+  uint32_t threads_count;
+  HANDLE threads[WORK_QUEUE_MAX_THREADS];
+};
+
+static PlatformWorkQueue *windows_work_queues[MAX_WORK_QUEUES];
+static uint32_t windows_work_queues_count = 0;
+static PlatformWorkQueue *windows_shared_work_queue = NULL; // The WORK_QUEUE_THREADS_AUTO pool
+
+// Has to be called inside the critical section, it's left while the callback runs.
+// Takes the oldest entry of the batch, or the oldest one at all for a NULL batch.
+static bool windows_work_queue_run_next(PlatformWorkQueue *queue, WorkQueueBatch *batch)
+{
+  while (queue->read != queue->write && queue->entries[queue->read % WORK_QUEUE_MAX_ENTRIES].callback == NULL) {
+    queue->read++;
+  }
+
+  WorkQueueEntry *found = NULL;
+  for (uint32_t i = queue->read; i != queue->write; i++) {
+    WorkQueueEntry *entry = &queue->entries[i % WORK_QUEUE_MAX_ENTRIES];
+    if (entry->callback != NULL && (batch == NULL || entry->batch == batch)) {
+      found = entry;
+      break;
+    }
+  }
+
+  if (found == NULL) {
+    return false;
+  }
+
+  WorkQueueEntry entry = *found;
+  found->callback = NULL;
+
+  LeaveCriticalSection(&queue->lock);
+  entry.callback(entry.data);
+  EnterCriticalSection(&queue->lock);
+
+  queue->pending--;
+  if (entry.batch != NULL) {
+    entry.batch->pending--;
+  }
+
+  // Waiters check their own batch, adders whether there's room
+  WakeAllConditionVariable(&queue->work_done);
+
+  return true;
+}
+
+static DWORD WINAPI windows_work_queue_thread(LPVOID data)
+{
+  PlatformWorkQueue *queue = (PlatformWorkQueue *) data;
+
+  EnterCriticalSection(&queue->lock);
+  for (;;) {
+    if (!windows_work_queue_run_next(queue, NULL)) {
+      SleepConditionVariableCS(&queue->work_added, &queue->lock, INFINITE);
+    }
+  }
+
+  return 0;
+}
+
+C_LINKAGE PlatformWorkQueue *windows_work_queue_create(uint32_t threads_count)
+{
+  // Pools sized for every core are shared, separate ones would oversubscribe the cores
+  bool shared = threads_count == WORK_QUEUE_THREADS_AUTO;
+  if (shared && windows_shared_work_queue != NULL) {
+    return windows_shared_work_queue;
+  }
+
+  if (windows_work_queues_count >= MAX_WORK_QUEUES) {
+    return NULL;
+  }
+
+  if (shared) {
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    threads_count = info.dwNumberOfProcessors > 1 ? info.dwNumberOfProcessors - 1 : 1;
+  }
+
+  PlatformWorkQueue *queue = (PlatformWorkQueue *) calloc(1, sizeof(PlatformWorkQueue));
+  InitializeCriticalSection(&queue->lock);
+  InitializeConditionVariable(&queue->work_added);
+  InitializeConditionVariable(&queue->work_done);
+
+  queue->threads_count = threads_count < WORK_QUEUE_MAX_THREADS ? threads_count : WORK_QUEUE_MAX_THREADS;
+  for (uint32_t i = 0; i < queue->threads_count; i++) {
+    queue->threads[i] = CreateThread(NULL, 0, &windows_work_queue_thread, queue, 0, NULL);
+  }
+
+  windows_work_queues[windows_work_queues_count++] = queue;
+  if (shared) {
+    windows_shared_work_queue = queue;
+  }
+
+  return queue;
+}
+
+C_LINKAGE void windows_work_queue_add(PlatformWorkQueue *queue, WorkQueueBatch *batch, WorkQueueCallback *callback, void *data)
+{
+  EnterCriticalSection(&queue->lock);
+
+  // Queue is full, work on the batch here until there's room
+  while (queue->write - queue->read >= WORK_QUEUE_MAX_ENTRIES) {
+    if (!windows_work_queue_run_next(queue, batch) && queue->write - queue->read >= WORK_QUEUE_MAX_ENTRIES) {
+      SleepConditionVariableCS(&queue->work_done, &queue->lock, INFINITE);
+    }
+  }
+
+  queue->entries[queue->write % WORK_QUEUE_MAX_ENTRIES] = {callback, batch, data};
+  queue->write++;
+  queue->pending++;
+  if (batch != NULL) {
+    batch->pending++;
+  }
+
+  WakeConditionVariable(&queue->work_added);
+  LeaveCriticalSection(&queue->lock);
+}
+
+C_LINKAGE void windows_work_queue_complete(PlatformWorkQueue *queue, WorkQueueBatch *batch)
+{
+  EnterCriticalSection(&queue->lock);
+
+  // Calling thread takes entries of the batch too instead of only waiting, work of others is left alone
+  while ((batch != NULL ? batch->pending : queue->pending) > 0) {
+    if (!windows_work_queue_run_next(queue, batch)) {
+      SleepConditionVariableCS(&queue->work_done, &queue->lock, INFINITE);
+    }
+  }
+
+  LeaveCriticalSection(&queue->lock);
+}
+
+// Callbacks live in the module, they have to finish before it's unloaded
+C_LINKAGE void windows_work_queues_complete_all()
+{
+  for (uint32_t i = 0; i < windows_work_queues_count; i++) {
+    windows_work_queue_complete(windows_work_queues[i], NULL);
+  }
+}